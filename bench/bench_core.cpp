@@ -0,0 +1,327 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Microbenchmarks of the core data paths, each reporting the time and the
+ * heap allocations per operation. Run with a substring of the benchmark
+ * names to only run those. */
+
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <new>
+
+#include "hotstuff/entity.h"
+#include "hotstuff/consensus.h"
+#include "hotstuff/crypto.h"
+#include "hotstuff/task.h"
+#include "hotstuff/client.h"
+
+using namespace hotstuff;
+
+static std::atomic<uint64_t> nalloc(0);
+
+void *operator new(size_t size) {
+    nalloc.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = malloc(size)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+static const char *filter = nullptr;
+
+/** Time `f`, which performs `nops` operations (setup should be done before
+ * the call). */
+template<typename Func>
+static void run(const std::string &name, size_t nops, Func &&f) {
+    if (filter && name.find(filter) == std::string::npos) return;
+    uint64_t a0 = nalloc.load();
+    auto t0 = std::chrono::steady_clock::now();
+    f();
+    auto t1 = std::chrono::steady_clock::now();
+    uint64_t a1 = nalloc.load();
+    double ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+    printf("%-36s %12.1f ns/op %10.2f allocs/op\n",
+            name.c_str(), ns / nops, (double)(a1 - a0) / nops);
+}
+
+/** The core protocol driven in-process: the outputs are counted instead of
+ * going to a network, and the timers never fire. */
+class MockCore: public HotStuffCore {
+    protected:
+    void do_decide_batch(const block_t &) override { ndecided++; }
+    void do_consensus(const block_t &) override {}
+    void do_broadcast_proposal(const Proposal &) override { nsent++; }
+    void do_broadcast_vote(const Vote &) override { nsent++; }
+    void do_broadcast_blame(const Blame &) override { nsent++; }
+    void do_broadcast_blamenotify(const BlameNotify &) override { nsent++; }
+    void do_notify(const Notify &) override { nsent++; }
+    void set_commit_timer(const block_t &, double) override {}
+    void set_blame_timer(double) override {}
+    void stop_commit_timer(uint32_t) override {}
+    void stop_commit_timer_all() override {}
+    void stop_blame_timer() override {}
+    void set_viewtrans_timer(double) override {}
+    void stop_viewtrans_timer() override {}
+
+    public:
+    size_t ndecided;
+    size_t nsent;
+    /** the keys of all replicas, so that their votes can be made up */
+    std::vector<bytearray_t> keys;
+
+    part_cert_bt create_part_cert(const PrivKey &priv_key, const uint256_t &blk_hash) override {
+        return new PartCertSecp256k1(
+                    static_cast<const PrivKeySecp256k1 &>(priv_key), blk_hash);
+    }
+
+    part_cert_bt parse_part_cert(DataStream &s) override {
+        PartCert *pc = new PartCertSecp256k1();
+        s >> *pc;
+        return pc;
+    }
+
+    quorum_cert_bt create_quorum_cert(const uint256_t &blk_hash) override {
+        return new QuorumCertSecp256k1(get_config(), blk_hash);
+    }
+
+    quorum_cert_bt parse_quorum_cert(DataStream &s) override {
+        QuorumCert *qc = new QuorumCertSecp256k1(get_config(), uint256_t());
+        s >> *qc;
+        return qc;
+    }
+
+    quorum_cert_bt parse_quorum_cert_compact(DataStream &s, const uint256_t &obj_hash) override {
+        QuorumCert *qc = new QuorumCertSecp256k1(get_config(), uint256_t());
+        qc->unserialize_compact(s, obj_hash);
+        return qc;
+    }
+
+    command_t parse_cmd(DataStream &s) override {
+        auto cmd = new CommandDummy();
+        s >> *cmd;
+        return cmd;
+    }
+
+    MockCore(size_t nreplicas, const std::vector<bytearray_t> &keys):
+            HotStuffCore(0, new PrivKeySecp256k1(keys[0])),
+            ndecided(0), nsent(0), keys(keys) {
+        for (size_t i = 0; i < nreplicas; i++)
+            add_replica(i, NetAddr("127.0.0.1", 10000 + i),
+                        new PubKeySecp256k1(PrivKeySecp256k1(keys[i])));
+        on_init((nreplicas - 1) / 2, 1);
+    }
+
+    /** A vote of replica `rid` for the block. */
+    Vote make_vote(ReplicaID rid, const uint256_t &blk_hash) {
+        return Vote(rid, blk_hash,
+                    create_part_cert(PrivKeySecp256k1(keys[rid]),
+                                    Vote::proof_obj_hash(blk_hash)), this);
+    }
+
+    /** Get the block certified by the votes of the others. */
+    void certify(const block_t &blk) {
+        for (ReplicaID i = 1; i < get_config().nmajority; i++)
+            on_receive_vote(make_vote(i, blk->get_hash()));
+    }
+};
+
+static std::vector<bytearray_t> gen_keys(size_t n) {
+    std::vector<bytearray_t> keys;
+    for (size_t i = 0; i < n; i++)
+    {
+        PrivKeySecp256k1 p;
+        p.from_rand();
+        keys.push_back(p.to_bytes());
+    }
+    return keys;
+}
+
+static std::vector<uint256_t> gen_cmds(size_t ncmds) {
+    std::vector<uint256_t> cmds;
+    for (uint32_t i = 0; i < ncmds; i++)
+        cmds.push_back(CommandDummy(0, i).get_hash());
+    return cmds;
+}
+
+static void bench_block(size_t ncmds) {
+    MockCore core(4, gen_keys(4));
+    auto b1 = core.on_propose({}, {core.get_genesis()});
+    core.certify(b1);
+    /* carries the QC for b1 */
+    auto blk = core.on_propose(gen_cmds(ncmds), {b1});
+    auto suffix = "/" + std::to_string(ncmds);
+    const size_t nops = 20000;
+    run("block_serialize" + suffix, nops, [&]() {
+        for (size_t i = 0; i < nops; i++)
+        {
+            DataStream s;
+            s << *blk;
+        }
+    });
+    DataStream full;
+    full << *blk;
+    run("block_unserialize" + suffix, nops, [&]() {
+        for (size_t i = 0; i < nops; i++)
+        {
+            DataStream s(full);
+            Block::parse(s, &core);
+        }
+    });
+    run("block_serialize_compact" + suffix, nops, [&]() {
+        for (size_t i = 0; i < nops; i++)
+        {
+            DataStream s;
+            blk->serialize_compact(s);
+        }
+    });
+    DataStream compact;
+    blk->serialize_compact(compact);
+    run("block_unserialize_compact" + suffix, nops, [&]() {
+        for (size_t i = 0; i < nops; i++)
+        {
+            DataStream s(compact);
+            block_t b = new Block();
+            b->unserialize_compact(s, &core);
+            b->finish_compact([](uint64_t, uint256_t &) { return false; });
+        }
+    });
+    run("block_get_hash" + suffix, nops, [&]() {
+        for (size_t i = 0; i < nops; i++)
+            salticidae::get_hash(*blk);
+    });
+    printf("%-36s %12lu bytes %10lu compact\n",
+            ("block_size" + suffix).c_str(), full.size(), compact.size());
+}
+
+static void bench_qc_verify(size_t n) {
+    MockCore core(n, gen_keys(n));
+    const auto &config = core.get_config();
+    auto obj_hash = Vote::proof_obj_hash(core.get_genesis()->get_hash());
+    auto qc = core.create_quorum_cert(obj_hash);
+    for (ReplicaID i = 0; i < config.nmajority; i++)
+        qc->add_part(i, *core.create_part_cert(PrivKeySecp256k1(core.keys[i]), obj_hash));
+    qc->compute();
+    const size_t nops = std::max((size_t)10, 2000 / n);
+    run("qc_verify/" + std::to_string(n), nops, [&]() {
+        for (size_t i = 0; i < nops; i++)
+            if (!qc->verify(config)) abort();
+    });
+}
+
+static void bench_veripool(size_t nworker) {
+    EventContext ec;
+    VeriPool pool(ec, nworker);
+    PrivKeySecp256k1 priv;
+    priv.from_rand();
+    PubKeySecp256k1 pub(priv);
+    uint256_t msg = CommandDummy(0, 0).get_hash();
+    SigSecp256k1 sig(msg, priv);
+    const size_t nops = 4000;
+    run("veripool/" + std::to_string(nworker), nops, [&]() {
+        size_t ndone = 0;
+        for (size_t i = 0; i < nops; i++)
+            pool.verify(new Secp256k1VeriTask(msg, pub, sig)).then(
+                    [&ndone, &ec, nops](bool) {
+                if (++ndone == nops) ec.stop();
+            });
+        ec.dispatch();
+    });
+}
+
+static void bench_receive_vote(size_t n) {
+    MockCore core(n, gen_keys(n));
+    const size_t nblks = 500;
+    std::vector<Vote> votes;
+    block_t parent = core.get_genesis();
+    for (size_t i = 0; i < nblks; i++)
+    {
+        parent = core.on_propose({}, {parent});
+        for (ReplicaID r = 1; r < n; r++)
+            votes.push_back(core.make_vote(r, parent->get_hash()));
+    }
+    run("on_receive_vote/" + std::to_string(n), votes.size(), [&]() {
+        for (const auto &v: votes)
+            core.on_receive_vote(v);
+    });
+}
+
+static void bench_cmd_parse(size_t ncmds) {
+    MockCore core(4, gen_keys(4));
+    DataStream cmds;
+    for (uint32_t i = 0; i < ncmds; i++)
+        cmds << CommandDummy(0, i);
+    auto suffix = "/" + std::to_string(ncmds);
+    const size_t nops = 200;
+    run("cmd_parse" + suffix, nops * ncmds, [&]() {
+        for (size_t i = 0; i < nops; i++)
+        {
+            DataStream s(cmds);
+            for (size_t j = 0; j < ncmds; j++)
+                core.parse_cmd(s);
+        }
+    });
+    run("cmd_parse_batch" + suffix, nops * ncmds, [&]() {
+        for (size_t i = 0; i < nops; i++)
+        {
+            DataStream s(cmds);
+            CommandDummy::parse_batch(s, ncmds);
+        }
+    });
+}
+
+static void bench_promise_all() {
+    /* the shape of the delivery of a block: itself, its QC block and its
+     * parent, joined by promise::all */
+    const size_t nops = 100000;
+    run("promise_all/3", nops, [&]() {
+        size_t ndone = 0;
+        for (size_t i = 0; i < nops; i++)
+        {
+            promise_t a([](promise_t &) {});
+            promise_t b([](promise_t &) {});
+            promise_t c([](promise_t &) {});
+            promise::all(std::vector<promise_t>{a, b, c}).then([&ndone]() {
+                ndone++;
+            });
+            a.resolve();
+            b.resolve();
+            c.resolve();
+        }
+        if (ndone != nops) abort();
+    });
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) filter = argv[1];
+    for (size_t ncmds: {0, 100, 1000})
+        bench_block(ncmds);
+    for (size_t n: {4, 16, 64})
+        bench_qc_verify(n);
+    for (size_t nworker: {1, 2, 4, 8})
+        bench_veripool(nworker);
+    for (size_t n: {4, 16, 64})
+        bench_receive_vote(n);
+    for (size_t ncmds: {8, 400})
+        bench_cmd_parse(ncmds);
+    bench_promise_all();
+    return 0;
+}
@@ -15,6 +15,8 @@
  * limitations under the License.
  */
 
+#include <atomic>
+#include <memory>
 #include <iostream>
 #include <cstring>
 #include <cassert>
@@ -22,6 +24,7 @@
 #include <random>
 #include <unistd.h>
 #include <signal.h>
+#include <arpa/inet.h>
 
 #include "salticidae/stream.h"
 #include "salticidae/util.h"
@@ -35,6 +38,7 @@
 #include "hotstuff/client.h"
 #include "hotstuff/hotstuff.h"
 #include "hotstuff/liveness.h"
+#include "hotstuff/multi.h"
 
 using salticidae::MsgNetwork;
 using salticidae::ClientNetwork;
@@ -59,15 +63,74 @@ using hotstuff::bytearray_t;
 using hotstuff::DataStream;
 using hotstuff::ReplicaID;
 using hotstuff::MsgReqCmd;
-using hotstuff::MsgRespCmd;
+using hotstuff::MsgReqCmdBatch;
+using hotstuff::MsgRespCmdBatch;
 using hotstuff::get_hash;
 using hotstuff::promise_t;
 
 using HotStuff = hotstuff::HotStuffSecp256k1;
+using resp_t = std::vector<std::pair<Finality, NetAddr>>;
+using resp_queue_t = salticidae::MPSCQueueEventDriven<resp_t>;
+
+/** One of the extra consensus instances in the parallel instances mode
+ * (the first instance is HotStuffApp itself), which hands the blocks it
+ * commits to the merge stage. */
+class HotStuffInstance: public HotStuff {
+    uint32_t inst;
+    hotstuff::InstanceMerger &merger;
+    resp_queue_t &resp_queue;
+
+    command_t parse_cmd(DataStream &s) override {
+        auto cmd = new CommandDummy();
+        s >> *cmd;
+        return cmd;
+    }
+
+    std::vector<command_t> parse_cmds(DataStream &s, size_t n) override {
+        return CommandDummy::parse_batch(s, n);
+    }
+
+    /* the commands are executed by HotStuffApp in the merged order */
+    void state_machine_execute(const Finality &) override {}
+
+    void state_machine_execute_batch(const std::vector<Finality> &fins) override {
+        if (!fins.empty()) executed = true;
+        merger.on_commit(inst, std::vector<Finality>(fins));
+    }
+
+    void state_machine_respond_batch() override {
+        if (resp_buffer.empty()) return;
+        resp_queue.enqueue(std::move(resp_buffer));
+        resp_buffer.clear();
+    }
+
+    public:
+    /** responses of the block being executed (only touched in the execution
+     * context) */
+    resp_t resp_buffer;
+    std::atomic<bool> executed;
+
+    HotStuffInstance(uint32_t inst,
+                    hotstuff::InstanceMerger &merger,
+                    resp_queue_t &resp_queue,
+                    uint32_t blk_size,
+                    ReplicaID idx,
+                    const bytearray_t &raw_privkey,
+                    NetAddr plisten_addr,
+                    hotstuff::pacemaker_bt pmaker,
+                    const EventContext &ec,
+                    const Net::Config &repnet_config,
+                    hotstuff::VeriPool &vpool):
+        HotStuff(blk_size, idx, raw_privkey, plisten_addr, std::move(pmaker),
+                ec, 0, repnet_config, &vpool),
+        inst(inst), merger(merger), resp_queue(resp_queue), executed(false) {}
+};
 
 class HotStuffApp: public HotStuff {
     double stat_period;
     double impeach_timeout;
+    /** prune blocks lower than b_exec by this many (disabled if negative) */
+    int prune_staleness;
     EventContext ec;
     EventContext req_ec;
     EventContext resp_ec;
@@ -83,35 +146,94 @@ class HotStuffApp: public HotStuff {
     std::unordered_map<const uint256_t, promise_t> unconfirmed;
 
     using conn_t = ClientNetwork<opcode_t>::conn_t;
-    using resp_queue_t = salticidae::MPSCQueueEventDriven<std::pair<Finality, NetAddr>>;
 
     /* for the dedicated thread sending responses to the clients */
     std::thread req_thread;
     std::thread resp_thread;
     resp_queue_t resp_queue;
+    /** responses of the block being executed (only touched in the execution
+     * context) */
+    resp_t resp_buffer;
     salticidae::BoxObj<salticidae::ThreadCall> resp_tcall;
     salticidae::BoxObj<salticidae::ThreadCall> req_tcall;
 
+    /** the merge stage of the parallel instances mode */
+    salticidae::BoxObj<hotstuff::InstanceMerger> merger;
+    /** the instances other than this one */
+    std::vector<salticidae::BoxObj<HotStuffInstance>> instances;
+    /** all instances (this one first) and their response buffers */
+    std::vector<hotstuff::HotStuffBase *> insts;
+    std::vector<resp_t *> resp_buffers;
+    /** Timer object to let an idle instance through the merge stage */
+    TimerEvent merge_timer;
+    double merge_linger;
+    /** the maximum number of commands of a client waiting for a decision
+     * (unlimited if zero) */
+    size_t client_max_waiting;
+    using client_count_t = std::shared_ptr<std::atomic<size_t>>;
+    /** the number of commands of each client waiting for a decision (only
+     * touched on the request thread, the counts are decremented from the
+     * execution context), dropped as the client disconnects */
+    std::unordered_map<NetAddr, client_count_t> client_waiting;
+
+    /** Count a command of the client, return nullptr if it is over the
+     * limit. */
+    client_count_t admit_client_cmd(const NetAddr &addr);
+    void reject_client_cmds(const std::vector<uint256_t> &cmd_hashes,
+                            const conn_t &conn);
+
     void client_request_cmd_handler(MsgReqCmd &&, const conn_t &);
+    void client_request_cmd_batch_handler(MsgReqCmdBatch &&, const conn_t &);
 
-    static command_t parse_cmd(DataStream &s) {
+    command_t parse_cmd(DataStream &s) override {
         auto cmd = new CommandDummy();
         s >> *cmd;
         return cmd;
     }
 
-    void reset_imp_timer() {
-        impeach_timer.del();
-        impeach_timer.add(impeach_timeout);
+    std::vector<command_t> parse_cmds(DataStream &s, size_t n) override {
+        return CommandDummy::parse_batch(s, n);
     }
 
+    /** whether a command was executed since the impeach timer fired (may be
+     * set from the execution thread) */
+    std::atomic<bool> executed;
+
     void state_machine_execute(const Finality &fin) override {
-        reset_imp_timer();
 #ifndef HOTSTUFF_ENABLE_BENCHMARK
         HOTSTUFF_LOG_INFO("replicated %s", std::string(fin).c_str());
 #endif
     }
 
+    void state_machine_execute_batch(const std::vector<Finality> &fins) override {
+        if (!fins.empty()) executed = true;
+        if (merger)
+        {
+            merger->on_commit(0, std::vector<Finality>(fins));
+            return;
+        }
+#ifndef HOTSTUFF_ENABLE_BENCHMARK
+        for (const auto &fin: fins) state_machine_execute(fin);
+#endif
+    }
+
+    void state_machine_speculate_batch(const std::vector<Finality> &fins) override {
+#ifndef HOTSTUFF_ENABLE_BENCHMARK
+        for (const auto &fin: fins)
+            HOTSTUFF_LOG_INFO("speculated %s", std::string(fin).c_str());
+#endif
+    }
+
+    void state_machine_rollback_batch(const std::vector<Finality> &fins) override {
+        HOTSTUFF_LOG_INFO("rolled back %lu commands", fins.size());
+    }
+
+    void state_machine_respond_batch() override {
+        if (resp_buffer.empty()) return;
+        resp_queue.enqueue(std::move(resp_buffer));
+        resp_buffer.clear();
+    }
+
 #ifdef SYNCHS_AUTOCLI
     void do_demand_commands(size_t blk_size) override {
         size_t ncli = client_conns.size();
@@ -143,8 +265,28 @@ class HotStuffApp: public HotStuff {
 
     void start(const std::vector<std::tuple<NetAddr, bytearray_t, bytearray_t>> &reps, double delta);
     void stop();
+    void set_prune_staleness(int staleness) { prune_staleness = staleness; }
+    /** Turn away the commands of a client beyond `max_waiting` waiting for
+     * a decision (unlimited if zero), so that a flooding client cannot use
+     * up the room of the others (see HotStuffBase::set_admission()). */
+    void set_client_max_waiting(size_t max_waiting) { client_max_waiting = max_waiting; }
+    /** Run a consensus instance with each of the given pacemakers next to
+     * this one, on the following replica ports (this replica's port plus
+     * the instance number), sharing the verification pool. The commands of
+     * the clients are partitioned among the instances by their hashes, and
+     * the committed blocks are merged round-robin. Should be called before
+     * start(). */
+    void set_instances(std::vector<hotstuff::pacemaker_bt> &&pmakers,
+                        const bytearray_t &raw_privkey,
+                        const Net::Config &repnet_config,
+                        double merge_linger);
+    const std::vector<hotstuff::HotStuffBase *> &get_instances() const { return insts; }
 };
 
+static NetAddr shift_port(const NetAddr &addr, uint16_t off) {
+    return NetAddr(addr.ip, htons(ntohs(addr.port) + off));
+}
+
 std::pair<std::string, std::string> split_ip_port_cport(const std::string &s) {
     auto ret = trim_all(split(s, ";"));
     if (ret.size() != 2)
@@ -174,6 +316,10 @@ int main(int argc, char **argv) {
     auto opt_fixed_proposer = Config::OptValInt::create(1);
     auto opt_base_timeout = Config::OptValDouble::create(1);
     auto opt_prop_delay = Config::OptValDouble::create(1);
+    auto opt_slo_rate = Config::OptValDouble::create(0);
+    auto opt_slo_latency = Config::OptValDouble::create(0);
+    auto opt_slo_window = Config::OptValDouble::create(5);
+    auto opt_leader_latency = Config::OptValStr::create("");
     auto opt_imp_timeout = Config::OptValDouble::create(11);
     auto opt_nworker = Config::OptValInt::create(1);
     auto opt_repnworker = Config::OptValInt::create(1);
@@ -182,9 +328,37 @@ int main(int argc, char **argv) {
     auto opt_cliburst = Config::OptValInt::create(1000);
     auto opt_notls = Config::OptValFlag::create(false);
     auto opt_delta = Config::OptValDouble::create(1);
+    auto opt_blk_max_bytes = Config::OptValInt::create(-1);
+    auto opt_blk_linger = Config::OptValDouble::create(0.01);
+    auto opt_adaptive_blk = Config::OptValFlag::create(false);
+    auto opt_pipeline = Config::OptValFlag::create(false);
+    auto opt_wal = Config::OptValStr::create();
+    auto opt_blk_archive = Config::OptValStr::create();
+    auto opt_staleness = Config::OptValInt::create(-1);
+    auto opt_metrics_addr = Config::OptValStr::create();
+    auto opt_metrics = Config::OptValFlag::create(false);
+    auto opt_metrics_token = Config::OptValStr::create();
+    auto opt_vote_fanout = Config::OptValInt::create(0);
+    auto opt_vote_relay_timeout = Config::OptValDouble::create(0.05);
+    auto opt_coded_proposal = Config::OptValFlag::create(false);
+    auto opt_compact_proposal = Config::OptValFlag::create(false);
+    auto opt_mempool = Config::OptValFlag::create(false);
+    auto opt_fast_view_change = Config::OptValFlag::create(false);
+    auto opt_speculative = Config::OptValFlag::create(false);
+    auto opt_responsive = Config::OptValFlag::create(false);
+    auto opt_gossip_batch = Config::OptValInt::create(64);
+    auto opt_gossip_linger = Config::OptValDouble::create(0.005);
+    auto opt_instances = Config::OptValInt::create(1);
+    auto opt_merge_linger = Config::OptValDouble::create(0.01);
+    auto opt_max_waiting = Config::OptValInt::create(0);
+    auto opt_client_max_waiting = Config::OptValInt::create(0);
+    auto opt_recent_cmds = Config::OptValInt::create(65536);
 
     config.add_opt("block-size", opt_blk_size, Config::SET_VAL);
     config.add_opt("parent-limit", opt_parent_limit, Config::SET_VAL);
+    config.add_opt("block-max-bytes", opt_blk_max_bytes, Config::SET_VAL, 'X', "cut a block at this size of commands (unlimited if negative)");
+    config.add_opt("block-linger", opt_blk_linger, Config::SET_VAL, 'L', "cut a block once a command has waited this long (disabled if negative)");
+    config.add_opt("adaptive-block", opt_adaptive_blk, Config::SWITCH_ON, 'D', "tune the block size from queue depth and commit latency");
     config.add_opt("stat-period", opt_stat_period, Config::SET_VAL);
     config.add_opt("replica", opt_replicas, Config::APPEND, 'a', "add an replica to the list");
     config.add_opt("idx", opt_idx, Config::SET_VAL, 'i', "specify the index in the replica list");
@@ -192,10 +366,14 @@ int main(int argc, char **argv) {
     config.add_opt("privkey", opt_privkey, Config::SET_VAL);
     config.add_opt("tls-privkey", opt_tls_privkey, Config::SET_VAL);
     config.add_opt("tls-cert", opt_tls_cert, Config::SET_VAL);
-    config.add_opt("pace-maker", opt_pace_maker, Config::SET_VAL, 'p', "specify pace maker (dummy, rr)");
+    config.add_opt("pace-maker", opt_pace_maker, Config::SET_VAL, 'p', "specify pace maker (dummy, rr, reputation)");
     config.add_opt("proposer", opt_fixed_proposer, Config::SET_VAL, 'l', "set the fixed proposer (for dummy)");
     config.add_opt("base-timeout", opt_base_timeout, Config::SET_VAL, 't', "set the initial timeout for the Round-Robin Pacemaker");
     config.add_opt("prop-delay", opt_prop_delay, Config::SET_VAL, 't', "set the delay that follows the timeout for the Round-Robin Pacemaker");
+    config.add_opt("slo-rate", opt_slo_rate, Config::SET_VAL, 'r', "the minimum commands committed per second a proposer must keep under load (for reputation)");
+    config.add_opt("slo-latency", opt_slo_latency, Config::SET_VAL, 'R', "the maximum commit latency of a proposer (for reputation)");
+    config.add_opt("slo-window", opt_slo_window, Config::SET_VAL, 'W', "the period over which the SLOs are checked (for reputation)");
+    config.add_opt("leader-latency", opt_leader_latency, Config::SET_VAL, 'H', "comma-separated expected block interval of each replica as the proposer (for reputation)");
     config.add_opt("imp-timeout", opt_imp_timeout, Config::SET_VAL, 'u', "set impeachment timeout (for sticky)");
     config.add_opt("nworker", opt_nworker, Config::SET_VAL, 'n', "the number of threads for verification");
     config.add_opt("repnworker", opt_repnworker, Config::SET_VAL, 'm', "the number of threads for replica network");
@@ -204,6 +382,28 @@ int main(int argc, char **argv) {
     config.add_opt("cliburst", opt_cliburst, Config::SET_VAL, 'B', "");
     config.add_opt("notls", opt_notls, Config::SWITCH_ON, 's', "disable TLS");
     config.add_opt("delta", opt_delta, Config::SET_VAL, 'd', "maximum network delay");
+    config.add_opt("pipeline", opt_pipeline, Config::SWITCH_ON, 'P', "parse messages and execute commands on separate threads");
+    config.add_opt("wal", opt_wal, Config::SET_VAL, 'w', "log the protocol state to the file and recover from it");
+    config.add_opt("blk-archive", opt_blk_archive, Config::SET_VAL, 'A', "spill pruned committed blocks to the file");
+    config.add_opt("staleness", opt_staleness, Config::SET_VAL, 'S', "periodically prune blocks lower than the last committed height minus this");
+    config.add_opt("metrics-addr", opt_metrics_addr, Config::SET_VAL, 'E', "serve the metrics over HTTP at this address (ip:port)");
+    config.add_opt("metrics", opt_metrics, Config::SWITCH_ON, 'e', "collect the metrics from the start (can be toggled by POST /enable and /disable)");
+    config.add_opt("metrics-token", opt_metrics_token, Config::SET_VAL, 'U', "bearer token required by POST /enable and /disable (toggling is off without it)");
+    config.add_opt("vote-fanout", opt_vote_fanout, Config::SET_VAL, 'k', "relay the proposals and votes through a tree of this fan-out (broadcast if 0)");
+    config.add_opt("vote-relay-timeout", opt_vote_relay_timeout, Config::SET_VAL, 'K', "how long a replica waits for the votes of its subtree");
+    config.add_opt("coded-proposal", opt_coded_proposal, Config::SWITCH_ON, 'C', "send each replica an erasure-coded chunk of a proposal to forward, instead of the whole proposal");
+    config.add_opt("compact-proposal", opt_compact_proposal, Config::SWITCH_ON, 'Z', "broadcast the proposals in the compact block encoding (with short command IDs if the mempool is on)");
+    config.add_opt("mempool", opt_mempool, Config::SWITCH_ON, 'G', "gossip the command payloads among the replicas and fetch the missing ones before voting");
+    config.add_opt("gossip-batch", opt_gossip_batch, Config::SET_VAL, 'g', "the number of commands to gossip at once");
+    config.add_opt("gossip-linger", opt_gossip_linger, Config::SET_VAL, 'Q', "the maximum time a command waits before it is gossiped");
+    config.add_opt("fast-view-change", opt_fast_view_change, Config::SWITCH_ON, 'F', "carry the hqc chain in the view change messages");
+    config.add_opt("speculative", opt_speculative, Config::SWITCH_ON, 'V', "execute the certified blocks ahead of the commit, answering the clients tentatively");
+    config.add_opt("responsive", opt_responsive, Config::SWITCH_ON, 'Y', "commit a block once 3n/4 replicas have voted for it, without waiting for 2 delta (tolerates fewer than n/4 faulty replicas)");
+    config.add_opt("instances", opt_instances, Config::SET_VAL, 'I', "run this many consensus instances in parallel, with staggered proposers (on consecutive ports)");
+    config.add_opt("merge-linger", opt_merge_linger, Config::SET_VAL, 'J', "how often an idle instance cuts an empty block to let the others through the merge");
+    config.add_opt("max-waiting", opt_max_waiting, Config::SET_VAL, 'N', "as the proposer, turn away the commands beyond this many waiting for a decision (unlimited if 0)");
+    config.add_opt("client-max-waiting", opt_client_max_waiting, Config::SET_VAL, 'O', "turn away the commands of a client beyond this many waiting for a decision (unlimited if 0)");
+    config.add_opt("recent-cmds", opt_recent_cmds, Config::SET_VAL, 'T', "drop the resubmissions of this many most recently decided commands (disabled if 0)");
     config.add_opt("help", opt_help, Config::SWITCH_ON, 'h', "show this help info");
 
     EventContext ec;
@@ -241,11 +441,38 @@ int main(int argc, char **argv) {
     NetAddr plisten_addr{split_ip_port_cport(binding_addr).first};
 
     auto parent_limit = opt_parent_limit->get();
+    auto ninst = opt_instances->get();
+    if (ninst < 1)
+        throw HotStuffError("at least one instance is needed");
+    if (ninst > 1 && opt_pace_maker->get() == "reputation")
+        throw HotStuffError("the reputation pace maker runs a single instance");
+    /* the proposers of the instances start staggered across the replicas */
+    auto create_pmaker = [&](uint32_t inst) -> hotstuff::pacemaker_bt {
+        ReplicaID offset = inst % replicas.size();
+        if (opt_pace_maker->get() == "dummy")
+            return new hotstuff::PaceMakerDummyFixed(
+                (opt_fixed_proposer->get() + offset) % replicas.size(), parent_limit);
+        return new hotstuff::PaceMakerRR(ec, parent_limit,
+                opt_base_timeout->get(), opt_prop_delay->get(), offset);
+    };
     hotstuff::pacemaker_bt pmaker;
-    if (opt_pace_maker->get() == "dummy")
-        pmaker = new hotstuff::PaceMakerDummyFixed(opt_fixed_proposer->get(), parent_limit);
+    if (opt_pace_maker->get() == "reputation")
+    {
+        auto pm = new hotstuff::PaceMakerReputation(ec, parent_limit,
+            hotstuff::PMReputationProposer::SLO{opt_slo_rate->get(),
+                                                opt_slo_latency->get(),
+                                                opt_slo_window->get()});
+        if (!opt_leader_latency->get().empty())
+        {
+            std::vector<double> hint;
+            for (const auto &t: trim_all(split(opt_leader_latency->get(), ",")))
+                hint.push_back(std::stod(t));
+            pm->set_latency_hint(hint);
+        }
+        pmaker = pm;
+    }
     else
-        pmaker = new hotstuff::PaceMakerRR(ec, parent_limit, opt_base_timeout->get(), opt_prop_delay->get());
+        pmaker = create_pmaker(0);
 
     HotStuffApp::Net::Config repnet_config;
     ClientNetwork<opcode_t>::Config clinet_config;
@@ -280,6 +507,48 @@ int main(int argc, char **argv) {
                         opt_nworker->get(),
                         repnet_config,
                         clinet_config);
+    if (ninst > 1)
+    {
+        std::vector<hotstuff::pacemaker_bt> pmakers;
+        for (int i = 1; i < ninst; i++)
+            pmakers.push_back(create_pmaker(i));
+        papp->set_instances(std::move(pmakers),
+                            hotstuff::from_hex(opt_privkey->get()),
+                            repnet_config,
+                            opt_merge_linger->get());
+    }
+    const auto &insts = papp->get_instances();
+    for (size_t i = 0; i < insts.size(); i++)
+    {
+        auto hs = insts[i];
+        /* each instance keeps its own files */
+        std::string suffix = i ? "." + std::to_string(i) : "";
+        hs->set_batching(opt_blk_max_bytes->get() < 0 ? SIZE_MAX : opt_blk_max_bytes->get(),
+                            opt_blk_linger->get(),
+                            opt_adaptive_blk->get());
+        hs->set_pipelined(opt_pipeline->get());
+        hs->set_coded_proposal(opt_coded_proposal->get());
+        hs->set_compact_proposal(opt_compact_proposal->get());
+        hs->set_fast_view_change(opt_fast_view_change->get());
+        hs->set_speculative(opt_speculative->get());
+        hs->set_responsive(opt_responsive->get());
+        hs->set_admission(std::max(opt_max_waiting->get(), 0),
+                        std::max(opt_recent_cmds->get(), 0));
+        if (opt_mempool->get())
+            hs->set_mempool(opt_gossip_batch->get(), opt_gossip_linger->get());
+        if (opt_vote_fanout->get() > 0)
+            hs->set_vote_relay(opt_vote_fanout->get(), opt_vote_relay_timeout->get());
+        if (!opt_wal->get().empty())
+            hs->set_wal(new hotstuff::WALFile(ec, opt_wal->get() + suffix));
+        if (!opt_blk_archive->get().empty())
+            hs->storage->set_archive(new hotstuff::BlockArchive(opt_blk_archive->get() + suffix));
+    }
+    papp->set_prune_staleness(opt_staleness->get());
+    papp->set_client_max_waiting(std::max(opt_client_max_waiting->get(), 0));
+    papp->get_metrics().set_enabled(opt_metrics->get());
+    if (!opt_metrics_addr->get().empty())
+        papp->start_metrics_server(NetAddr(opt_metrics_addr->get()),
+                                    opt_metrics_token->get());
     std::vector<std::tuple<NetAddr, bytearray_t, bytearray_t>> reps;
     for (auto &r: replicas)
     {
@@ -316,20 +585,33 @@ HotStuffApp::HotStuffApp(uint32_t blk_size,
             plisten_addr, std::move(pmaker), ec, nworker, repnet_config),
     stat_period(stat_period),
     impeach_timeout(impeach_timeout),
+    prune_staleness(-1),
     ec(ec),
     cn(req_ec, clinet_config),
-    clisten_addr(clisten_addr) {
+    clisten_addr(clisten_addr),
+    merge_linger(0),
+    client_max_waiting(0),
+    executed(false) {
+    insts.push_back(this);
+    resp_buffers.push_back(&resp_buffer);
     /* prepare the thread used for sending back confirmations */
     resp_tcall = new salticidae::ThreadCall(resp_ec);
     req_tcall = new salticidae::ThreadCall(req_ec);
     resp_queue.reg_handler(resp_ec, [this](resp_queue_t &q) {
-        std::pair<Finality, NetAddr> p;
-        while (q.try_dequeue(p))
+        resp_t resps;
+        while (q.try_dequeue(resps))
         {
-            try {
-                cn.send_msg(MsgRespCmd(std::move(p.first)), p.second);
-            } catch (std::exception &err) {
-                HOTSTUFF_LOG_WARN("unable to send to the client: %s", err.what());
+            /* one frame per client for each committed block */
+            std::unordered_map<NetAddr, std::vector<Finality>> fins;
+            for (auto &p: resps)
+                fins[p.second].push_back(std::move(p.first));
+            for (const auto &p: fins)
+            {
+                try {
+                    cn.send_msg(MsgRespCmdBatch(p.second), p.first);
+                } catch (std::exception &err) {
+                    HOTSTUFF_LOG_WARN("unable to send to the client: %s", err.what());
+                }
             }
         }
         return false;
@@ -337,47 +619,163 @@ HotStuffApp::HotStuffApp(uint32_t blk_size,
 
     /* register the handlers for msg from clients */
     cn.reg_handler(salticidae::generic_bind(&HotStuffApp::client_request_cmd_handler, this, _1, _2));
+    cn.reg_handler(salticidae::generic_bind(&HotStuffApp::client_request_cmd_batch_handler, this, _1, _2));
     cn.start();
     cn.listen(clisten_addr);
 }
 
+void HotStuffApp::set_instances(std::vector<hotstuff::pacemaker_bt> &&pmakers,
+                                const bytearray_t &raw_privkey,
+                                const Net::Config &repnet_config,
+                                double _merge_linger) {
+    merge_linger = _merge_linger;
+    merger = new hotstuff::InstanceMerger(pmakers.size() + 1,
+        [this](uint32_t, const std::vector<Finality> &fins) {
+#ifndef HOTSTUFF_ENABLE_BENCHMARK
+            for (const auto &fin: fins) state_machine_execute(fin);
+#endif
+        });
+    for (size_t i = 0; i < pmakers.size(); i++)
+    {
+        auto inst = new HotStuffInstance(i + 1, *merger, resp_queue,
+                                        blk_size, get_id(), raw_privkey,
+                                        shift_port(listen_addr, i + 1),
+                                        std::move(pmakers[i]), ec,
+                                        repnet_config, get_veripool());
+        instances.push_back(inst);
+        insts.push_back(inst);
+        resp_buffers.push_back(&inst->resp_buffer);
+    }
+}
+
+HotStuffApp::client_count_t HotStuffApp::admit_client_cmd(const NetAddr &addr) {
+    auto &cnt = client_waiting[addr];
+    if (!cnt) cnt = std::make_shared<std::atomic<size_t>>(0);
+    if (client_max_waiting && *cnt >= client_max_waiting) return nullptr;
+    (*cnt)++;
+    return cnt;
+}
+
+void HotStuffApp::reject_client_cmds(const std::vector<uint256_t> &cmd_hashes,
+                                    const conn_t &conn) {
+    if (cmd_hashes.empty()) return;
+    std::vector<Finality> fins;
+    for (const auto &cmd_hash: cmd_hashes)
+        fins.emplace_back(get_id(), -1, 0, 0, cmd_hash, uint256_t());
+    cn.send_msg(MsgRespCmdBatch(fins), conn);
+}
+
 void HotStuffApp::client_request_cmd_handler(MsgReqCmd &&msg, const conn_t &conn) {
     const NetAddr addr = conn->get_addr();
     auto cmd = parse_cmd(msg.serialized);
     const auto &cmd_hash = cmd->get_hash();
     HOTSTUFF_LOG_DEBUG("processing %s", std::string(*cmd).c_str());
-    exec_command(cmd_hash, [this, addr](Finality fin) {
-        resp_queue.enqueue(std::make_pair(fin, addr));
+    auto cnt = admit_client_cmd(addr);
+    if (!cnt)
+    {
+        reject_client_cmds({cmd_hash}, conn);
+        return;
+    }
+    auto i = hotstuff::InstanceMerger::partition(cmd_hash, insts.size());
+    auto &buff = *resp_buffers[i];
+    insts[i]->add_cmd(cmd);
+    insts[i]->exec_command(cmd_hash, [&buff, addr, cnt](const Finality &fin) {
+        if (!fin.tentative) (*cnt)--;
+        buff.push_back(std::make_pair(fin, addr));
     });
 }
 
+void HotStuffApp::client_request_cmd_batch_handler(MsgReqCmdBatch &&msg, const conn_t &conn) {
+    const NetAddr addr = conn->get_addr();
+    std::vector<command_t> cmds;
+    if (msg.full)
+    {
+        cmds = parse_cmds(msg.serialized, msg.ncmd);
+        for (auto &cmd: cmds)
+            msg.cmd_hashes.push_back(cmd->get_hash());
+    }
+    HOTSTUFF_LOG_DEBUG("processing %u commands", msg.ncmd);
+    std::vector<uint256_t> rejected;
+    for (size_t j = 0; j < msg.cmd_hashes.size(); j++)
+    {
+        const auto &cmd_hash = msg.cmd_hashes[j];
+        auto cnt = admit_client_cmd(addr);
+        if (!cnt)
+        {
+            rejected.push_back(cmd_hash);
+            continue;
+        }
+        auto i = hotstuff::InstanceMerger::partition(cmd_hash, insts.size());
+        auto &buff = *resp_buffers[i];
+        if (msg.full) insts[i]->add_cmd(cmds[j]);
+        insts[i]->exec_command(cmd_hash, [&buff, addr, cnt](const Finality &fin) {
+            if (!fin.tentative) (*cnt)--;
+            buff.push_back(std::make_pair(fin, addr));
+        });
+    }
+    reject_client_cmds(rejected, conn);
+}
+
 void HotStuffApp::start(const std::vector<std::tuple<NetAddr, bytearray_t, bytearray_t>> &reps,
                         double delta) {
     ev_stat_timer = TimerEvent(ec, [this](TimerEvent &) {
         HotStuff::print_stat();
         HotStuffApp::print_stat();
-        //HotStuffCore::prune(100);
+        if (prune_staleness >= 0)
+            for (auto hs: insts) hs->prune(prune_staleness);
         ev_stat_timer.add(stat_period);
     });
     ev_stat_timer.add(stat_period);
     impeach_timer = TimerEvent(ec, [this](TimerEvent &) {
-        if (get_decision_waiting().size())
+        if (!executed.exchange(false) && get_decision_waiting().size())
             get_pace_maker()->impeach();
-        reset_imp_timer();
+        for (auto &inst: instances)
+            if (!inst->executed.exchange(false) && inst->get_decision_waiting().size())
+                inst->get_pace_maker()->impeach();
+        impeach_timer.add(impeach_timeout);
     });
     impeach_timer.add(impeach_timeout);
     HOTSTUFF_LOG_INFO("** starting the system with parameters **");
     HOTSTUFF_LOG_INFO("blk_size = %lu", blk_size);
     HOTSTUFF_LOG_INFO("conns = %lu", HotStuff::size());
     HOTSTUFF_LOG_INFO("delta = %.4f", delta);
+    HOTSTUFF_LOG_INFO("instances = %lu", insts.size());
     HOTSTUFF_LOG_INFO("** starting the event loop...");
     HotStuff::start(reps, delta);
+    for (size_t i = 0; i < instances.size(); i++)
+    {
+        auto ireps = reps;
+        for (auto &r: ireps)
+            std::get<0>(r) = shift_port(std::get<0>(r), i + 1);
+        instances[i]->start(ireps, delta);
+    }
+    if (merger)
+    {
+        merge_timer = TimerEvent(ec, [this](TimerEvent &) {
+            /* an idle instance cuts empty blocks, or the merged log would
+             * wait for it */
+            for (uint32_t i = 0; i < insts.size(); i++)
+            {
+                auto pm = insts[i]->get_pace_maker();
+                if (merger->is_stalled_on(i) &&
+                    pm->get_proposer() == insts[i]->get_id() &&
+                    !pm->get_pending_size())
+                    insts[i]->flush_blk();
+            }
+            merge_timer.add(merge_linger);
+        });
+        merge_timer.add(merge_linger);
+    }
     cn.reg_conn_handler([this](const salticidae::ConnPool::conn_t &_conn, bool connected) {
         auto conn = salticidae::static_pointer_cast<conn_t::type>(_conn);
         if (connected)
             client_conns.insert(conn);
         else
+        {
             client_conns.erase(conn);
+            /* the commands still waiting keep their count alive */
+            client_waiting.erase(conn->get_addr());
+        }
         return true;
     });
     req_thread = std::thread([this]() { req_ec.dispatch(); });
@@ -387,6 +785,7 @@ void HotStuffApp::start(const std::vector<std::tuple<NetAddr, bytearray_t, bytea
 }
 
 void HotStuffApp::stop() {
+    for (auto hs: insts) hs->stop_pipeline();
     papp->req_tcall->async_call([this](salticidae::ThreadCall::Handle &) {
         req_ec.stop();
     });
@@ -0,0 +1,268 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Load generator for a running replica set. Commands are submitted either
+ * closed-loop (as fast as the window allows) or open-loop (at a fixed rate,
+ * with the latency measured from the intended submission time, so that a
+ * saturated system is not hidden by coordinated omission). The statistics
+ * are printed to stdout as one JSON object per line. */
+
+#include <cstdio>
+#include <chrono>
+#include <deque>
+#include <signal.h>
+
+#include "salticidae/type.h"
+#include "salticidae/netaddr.h"
+#include "salticidae/network.h"
+#include "salticidae/util.h"
+
+#include "hotstuff/util.h"
+#include "hotstuff/type.h"
+#include "hotstuff/client.h"
+#include "hotstuff/histogram.h"
+
+using salticidae::Config;
+
+using hotstuff::NetAddr;
+using hotstuff::EventContext;
+using hotstuff::TimerEvent;
+using hotstuff::CommandDummy;
+using hotstuff::HotStuffClient;
+using hotstuff::HotStuffError;
+using hotstuff::Finality;
+using hotstuff::Histogram;
+using hotstuff::command_t;
+
+struct Stat {
+    /** latency until confirmed by f + 1 replicas */
+    Histogram lat;
+    /** latency until the first replica committed */
+    Histogram first_lat;
+    /** time spent waiting for the window (open-loop only) */
+    Histogram queue_lat;
+
+    void merge(const Stat &other) {
+        lat.merge(other.lat);
+        first_lat.merge(other.first_lat);
+        queue_lat.merge(other.queue_lat);
+    }
+
+    void reset() {
+        lat.reset();
+        first_lat.reset();
+        queue_lat.reset();
+    }
+};
+
+EventContext ec;
+salticidae::BoxObj<HotStuffClient> client;
+uint32_t cid;
+uint32_t cnt = 0;
+bool open_loop;
+double rate;
+size_t max_backlog;
+double t_start;
+double t_last_report;
+/** intended submission times of the commands not yet submitted */
+std::deque<double> backlog;
+uint64_t ngen = 0;
+uint64_t nshed = 0;
+Stat part_stat;
+Stat stat;
+
+static double now() {
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+static inline uint64_t to_us(double sec) {
+    return sec > 0 ? (uint64_t)(sec * 1e6) : 0;
+}
+
+bool try_submit(double t_intended) {
+    double t_submit = now();
+    command_t cmd = new CommandDummy(cid, cnt);
+    auto cb = [t_intended, t_submit](const Finality &, double first_lat, double) {
+        double queued = t_submit - t_intended;
+        part_stat.lat.record(to_us(now() - t_intended));
+        part_stat.first_lat.record(to_us(queued + first_lat));
+        part_stat.queue_lat.record(to_us(queued));
+    };
+    if (!client->submit(cmd, std::move(cb))) return false;
+    cnt++;
+    return true;
+}
+
+void drain() {
+    if (open_loop)
+    {
+        while (!backlog.empty() && try_submit(backlog.front()))
+            backlog.pop_front();
+    }
+    else
+        while (try_submit(now()));
+}
+
+void generate() {
+    double t = now();
+    uint64_t due = (t - t_start) * rate;
+    for (; ngen < due; ngen++)
+    {
+        if (backlog.size() >= max_backlog)
+        {
+            nshed++;
+            continue;
+        }
+        backlog.push_back(t_start + ngen / rate);
+    }
+    drain();
+}
+
+void print_stat(const char *type, const Stat &s, double period) {
+    printf("{\"type\": \"%s\", \"time\": %.3f, \"period\": %.3f, "
+            "\"count\": %lu, \"throughput\": %.1f, "
+            "\"lat_mean_ms\": %.3f, \"lat_p50_ms\": %.3f, "
+            "\"lat_p99_ms\": %.3f, \"lat_p999_ms\": %.3f, "
+            "\"lat_max_ms\": %.3f, "
+            "\"first_ack_p50_ms\": %.3f, \"first_ack_p99_ms\": %.3f, "
+            "\"queue_p50_ms\": %.3f, \"queue_p99_ms\": %.3f, "
+            "\"outstanding\": %lu, \"backlog\": %lu, \"shed\": %lu}\n",
+            type, now() - t_start, period,
+            s.lat.get_count(),
+            period > 0 ? s.lat.get_count() / period : 0,
+            s.lat.get_mean() / 1e3,
+            s.lat.get_quantile(0.5) / 1e3,
+            s.lat.get_quantile(0.99) / 1e3,
+            s.lat.get_quantile(0.999) / 1e3,
+            s.lat.get_max() / 1e3,
+            s.first_lat.get_quantile(0.5) / 1e3,
+            s.first_lat.get_quantile(0.99) / 1e3,
+            s.queue_lat.get_quantile(0.5) / 1e3,
+            s.queue_lat.get_quantile(0.99) / 1e3,
+            client->get_nwaiting(), backlog.size(), nshed);
+    fflush(stdout);
+}
+
+std::pair<std::string, std::string> split_ip_port_cport(const std::string &s) {
+    auto ret = salticidae::trim_all(salticidae::split(s, ";"));
+    return std::make_pair(ret[0], ret[1]);
+}
+
+int main(int argc, char **argv) {
+    Config config("hotstuff.conf");
+
+    auto opt_idx = Config::OptValInt::create(0);
+    auto opt_replicas = Config::OptValStrVec::create();
+    auto opt_cid = Config::OptValInt::create(-1);
+    auto opt_rate = Config::OptValDouble::create(-1);
+    auto opt_window = Config::OptValInt::create(1000);
+    auto opt_batch_size = Config::OptValInt::create(1);
+    auto opt_batch_linger = Config::OptValDouble::create(0);
+    auto opt_proposer = Config::OptValInt::create(-1);
+    auto opt_resend_timeout = Config::OptValDouble::create(1);
+    auto opt_duration = Config::OptValDouble::create(60);
+    auto opt_report_period = Config::OptValDouble::create(1);
+    auto opt_max_backlog = Config::OptValInt::create(1000000);
+
+    auto shutdown = [&](int) { ec.stop(); };
+    salticidae::SigEvent ev_sigint(ec, shutdown);
+    salticidae::SigEvent ev_sigterm(ec, shutdown);
+    ev_sigint.add(SIGINT);
+    ev_sigterm.add(SIGTERM);
+
+    config.add_opt("idx", opt_idx, Config::SET_VAL);
+    config.add_opt("cid", opt_cid, Config::SET_VAL);
+    config.add_opt("replica", opt_replicas, Config::APPEND);
+    config.add_opt("rate", opt_rate, Config::SET_VAL, 'r', "submit this many commands per second (open-loop), or as fast as the window allows if negative (closed-loop)");
+    config.add_opt("window", opt_window, Config::SET_VAL, 'w', "the maximum number of outstanding commands");
+    config.add_opt("batch", opt_batch_size, Config::SET_VAL, 'b', "send up to this many commands in a frame");
+    config.add_opt("batch-linger", opt_batch_linger, Config::SET_VAL, 'L', "send a partial batch after this long");
+    config.add_opt("proposer", opt_proposer, Config::SET_VAL, 'p', "send full commands only to this replica (disabled if negative)");
+    config.add_opt("resend-timeout", opt_resend_timeout, Config::SET_VAL, 't', "resend the commands to all replicas if not confirmed in time");
+    config.add_opt("duration", opt_duration, Config::SET_VAL, 'd', "stop after this many seconds (run until interrupted if negative)");
+    config.add_opt("report-period", opt_report_period, Config::SET_VAL, 'R', "print the statistics this often");
+    config.add_opt("max-backlog", opt_max_backlog, Config::SET_VAL, 'B', "shed open-loop commands once this many are waiting for the window");
+    config.parse(argc, argv);
+    auto idx = opt_idx->get();
+    std::vector<std::string> raw;
+    for (const auto &s: opt_replicas->get())
+    {
+        auto res = salticidae::trim_all(salticidae::split(s, ","));
+        if (res.size() < 1)
+            throw HotStuffError("format error");
+        raw.push_back(res[0]);
+    }
+
+    if (!(0 <= idx && (size_t)idx < raw.size() && raw.size() > 0))
+        throw std::invalid_argument("out of range");
+    cid = opt_cid->get() != -1 ? opt_cid->get() : idx;
+    std::vector<NetAddr> replicas;
+    for (const auto &p: raw)
+    {
+        auto _p = split_ip_port_cport(p);
+        size_t _;
+        replicas.push_back(NetAddr(NetAddr(_p.first).ip, htons(stoi(_p.second, &_))));
+    }
+
+    rate = opt_rate->get();
+    open_loop = rate > 0;
+    max_backlog = opt_max_backlog->get();
+
+    HotStuffClient::Config cli_config;
+    cli_config.window = std::max(opt_window->get(), 1);
+    cli_config.batch_size = std::max(opt_batch_size->get(), 1);
+    cli_config.batch_linger = opt_batch_linger->get();
+    cli_config.proposer_only = opt_proposer->get() >= 0;
+    cli_config.resend_timeout = opt_resend_timeout->get();
+    client = new HotStuffClient(ec, cli_config);
+    client->reg_ready(drain);
+    client->connect(replicas, std::max(opt_proposer->get(), 0));
+
+    t_start = t_last_report = now();
+    double report_period = opt_report_period->get();
+    TimerEvent ev_report(ec, [&](TimerEvent &) {
+        double t = now();
+        print_stat("period", part_stat, t - t_last_report);
+        stat.merge(part_stat);
+        part_stat.reset();
+        t_last_report = t;
+        ev_report.add(report_period);
+    });
+    ev_report.add(report_period);
+
+    /* generate the open-loop arrivals at a fine granularity */
+    double gen_period = open_loop ? std::min(1e-3, 1 / rate) : 0;
+    TimerEvent ev_gen(ec, [&](TimerEvent &) {
+        generate();
+        ev_gen.add(gen_period);
+    });
+
+    TimerEvent ev_stop(ec, [](TimerEvent &) { ec.stop(); });
+    if (opt_duration->get() >= 0)
+        ev_stop.add(opt_duration->get());
+
+    if (open_loop)
+        ev_gen.add(0);
+    else
+        drain();
+    ec.dispatch();
+
+    stat.merge(part_stat);
+    print_stat("total", stat, now() - t_start);
+    return 0;
+}
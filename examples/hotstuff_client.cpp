@@ -34,91 +34,42 @@ using salticidae::Config;
 using hotstuff::ReplicaID;
 using hotstuff::NetAddr;
 using hotstuff::EventContext;
-using hotstuff::MsgReqCmd;
-using hotstuff::MsgRespCmd;
 using hotstuff::CommandDummy;
+using hotstuff::HotStuffClient;
 using hotstuff::HotStuffError;
-using hotstuff::uint256_t;
-using hotstuff::opcode_t;
+using hotstuff::Finality;
 using hotstuff::command_t;
 
 EventContext ec;
-ReplicaID proposer;
-size_t max_async_num;
 int max_iter_num;
 uint32_t cid;
 uint32_t cnt = 0;
-uint32_t nfaulty;
-
-struct Request {
-    command_t cmd;
-    size_t confirmed;
-    salticidae::ElapsedTime et;
-    Request(const command_t &cmd): cmd(cmd), confirmed(0) { et.start(); }
-};
-
-using Net = salticidae::MsgNetwork<opcode_t>;
-
-std::unordered_map<ReplicaID, Net::conn_t> conns;
-std::unordered_map<const uint256_t, Request> waiting;
-std::vector<NetAddr> replicas;
 std::vector<std::pair<struct timeval, double>> elapsed;
-Net mn(ec, Net::Config());
-
-void connect_all() {
-    for (size_t i = 0; i < replicas.size(); i++)
-        conns.insert(std::make_pair(i, mn.connect_sync(replicas[i])));
-}
-
-bool try_send(bool check = true) {
-    if ((!check || waiting.size() < max_async_num) && max_iter_num)
-    {
-        auto cmd = new CommandDummy(cid, cnt++);
-        MsgReqCmd msg(*cmd);
-        for (auto &p: conns) mn.send_msg(msg, p.second);
-#ifndef HOTSTUFF_ENABLE_BENCHMARK
-        HOTSTUFF_LOG_INFO("send new cmd %.10s",
-                            get_hex(cmd->get_hash()).c_str());
-#endif
-        waiting.insert(std::make_pair(
-            cmd->get_hash(), Request(cmd)));
-        if (max_iter_num > 0)
-            max_iter_num--;
-        return true;
-    }
-    return false;
-}
+salticidae::BoxObj<HotStuffClient> client;
 
-void client_resp_cmd_handler(MsgRespCmd &&msg, const Net::conn_t &) {
-    auto &fin = msg.fin;
-    HOTSTUFF_LOG_DEBUG("got %s", std::string(msg.fin).c_str());
-    const uint256_t &cmd_hash = fin.cmd_hash;
-    auto it = waiting.find(cmd_hash);
-    auto &et = it->second.et;
-    if (it == waiting.end()) return;
-    et.stop();
-    if (++it->second.confirmed <= nfaulty) return; // wait for f + 1 ack
+void on_confirm(const Finality &fin, double, double lat) {
 #ifndef HOTSTUFF_ENABLE_BENCHMARK
-    HOTSTUFF_LOG_INFO("got %s, wall: %.3f, cpu: %.3f",
-                        std::string(fin).c_str(),
-                        et.elapsed_sec, et.cpu_elapsed_sec);
+    HOTSTUFF_LOG_INFO("got %s, wall: %.3f", std::string(fin).c_str(), lat);
 #else
     struct timeval tv;
     gettimeofday(&tv, nullptr);
-    elapsed.push_back(std::make_pair(tv, et.elapsed_sec));
-#endif
-    waiting.erase(it);
-#if !defined(SYNCHS_AUTOCLI) || defined(SYNCHS_RESENDALL)
-    while (try_send());
+    elapsed.push_back(std::make_pair(tv, lat));
 #endif
 }
 
-#ifdef SYNCHS_AUTOCLI
-void client_demand_cmd_handler(hotstuff::MsgDemandCmd &&msg, const Net::conn_t &) {
-    for (size_t i = 0; i < msg.ncmd; i++)
-        try_send(false);
-}
+bool try_send() {
+    if (!max_iter_num) return false;
+    command_t cmd = new CommandDummy(cid, cnt);
+    if (!client->submit(cmd, on_confirm)) return false;
+    cnt++;
+#ifndef HOTSTUFF_ENABLE_BENCHMARK
+    HOTSTUFF_LOG_INFO("send new cmd %.10s",
+                        get_hex(cmd->get_hash()).c_str());
 #endif
+    if (max_iter_num > 0)
+        max_iter_num--;
+    return true;
+}
 
 std::pair<std::string, std::string> split_ip_port_cport(const std::string &s) {
     auto ret = salticidae::trim_all(salticidae::split(s, ";"));
@@ -133,6 +84,11 @@ int main(int argc, char **argv) {
     auto opt_max_iter_num = Config::OptValInt::create(100);
     auto opt_max_async_num = Config::OptValInt::create(10);
     auto opt_cid = Config::OptValInt::create(-1);
+    auto opt_batch_size = Config::OptValInt::create(1);
+    auto opt_batch_linger = Config::OptValDouble::create(0);
+    auto opt_proposer = Config::OptValInt::create(-1);
+    auto opt_resend_timeout = Config::OptValDouble::create(1);
+    auto opt_retry_delay = Config::OptValDouble::create(0.05);
 
     auto shutdown = [&](int) { ec.stop(); };
     salticidae::SigEvent ev_sigint(ec, shutdown);
@@ -140,21 +96,19 @@ int main(int argc, char **argv) {
     ev_sigint.add(SIGINT);
     ev_sigterm.add(SIGTERM);
 
-    mn.reg_handler(client_resp_cmd_handler);
-#ifdef SYNCHS_AUTOCLI
-    mn.reg_handler(client_demand_cmd_handler);
-#endif
-    mn.start();
-
     config.add_opt("idx", opt_idx, Config::SET_VAL);
     config.add_opt("cid", opt_cid, Config::SET_VAL);
     config.add_opt("replica", opt_replicas, Config::APPEND);
     config.add_opt("iter", opt_max_iter_num, Config::SET_VAL);
     config.add_opt("max-async", opt_max_async_num, Config::SET_VAL);
+    config.add_opt("batch", opt_batch_size, Config::SET_VAL, 'b', "send up to this many commands in a frame");
+    config.add_opt("batch-linger", opt_batch_linger, Config::SET_VAL, 'L', "send a partial batch after this long");
+    config.add_opt("proposer", opt_proposer, Config::SET_VAL, 'p', "send full commands only to this replica, and the hashes to the others (disabled if negative)");
+    config.add_opt("resend-timeout", opt_resend_timeout, Config::SET_VAL, 'r', "resend the commands to all replicas if not confirmed in time");
+    config.add_opt("retry-delay", opt_retry_delay, Config::SET_VAL, 'R', "resubmit the commands turned away by the replicas after this long (doubled each time)");
     config.parse(argc, argv);
     auto idx = opt_idx->get();
     max_iter_num = opt_max_iter_num->get();
-    max_async_num = opt_max_async_num->get();
     std::vector<std::string> raw;
     for (const auto &s: opt_replicas->get())
     {
@@ -167,6 +121,7 @@ int main(int argc, char **argv) {
     if (!(0 <= idx && (size_t)idx < raw.size() && raw.size() > 0))
         throw std::invalid_argument("out of range");
     cid = opt_cid->get() != -1 ? opt_cid->get() : idx;
+    std::vector<NetAddr> replicas;
     for (const auto &p: raw)
     {
         auto _p = split_ip_port_cport(p);
@@ -174,9 +129,27 @@ int main(int argc, char **argv) {
         replicas.push_back(NetAddr(NetAddr(_p.first).ip, htons(stoi(_p.second, &_))));
     }
 
-    nfaulty = (replicas.size() - 1) / 2;
-    HOTSTUFF_LOG_INFO("nfaulty = %zu", nfaulty);
-    connect_all();
+    HotStuffClient::Config cli_config;
+    cli_config.window = opt_max_async_num->get();
+    cli_config.batch_size = std::max(opt_batch_size->get(), 1);
+    cli_config.batch_linger = opt_batch_linger->get();
+    cli_config.proposer_only = opt_proposer->get() >= 0;
+    cli_config.resend_timeout = opt_resend_timeout->get();
+    cli_config.retry_delay = opt_retry_delay->get();
+#if defined(SYNCHS_AUTOCLI) && !defined(SYNCHS_RESENDALL)
+    cli_config.demand_driven = true;
+#endif
+    client = new HotStuffClient(ec, cli_config);
+    /* the partial batch is sent at the end of the event loop iteration */
+    client->reg_ready([]() { while (try_send()); });
+#ifndef HOTSTUFF_ENABLE_BENCHMARK
+    client->reg_tentative([](const Finality &fin, double lat) {
+        HOTSTUFF_LOG_INFO("got tentative %s, lat = %.4f",
+                            std::string(fin).c_str(), lat);
+    });
+#endif
+    client->connect(replicas, std::max(opt_proposer->get(), 0));
+    HOTSTUFF_LOG_INFO("nfaulty = %zu", (replicas.size() - 1) / 2);
     while (try_send());
     ec.dispatch();
 
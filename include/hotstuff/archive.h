@@ -0,0 +1,103 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HOTSTUFF_ARCHIVE_H
+#define _HOTSTUFF_ARCHIVE_H
+
+#include <string>
+
+#include "hotstuff/type.h"
+
+namespace hotstuff {
+
+/** Append-only, memory-mapped segment file holding the serialized form of
+ * committed blocks that are no longer kept in memory. Each record is framed
+ * as <hash, height, length, block>. The blocks are indexed by two more
+ * mapped files, so that the memory used does not grow with the archive: an
+ * open-addressing table from the hash to the record (`fname`.hash), and an
+ * array of records by height (`fname`.height). Both only hold the offsets
+ * of the records and are rebuilt from the segment when it is loaded. */
+class BlockArchive {
+    /** a file mapped in memory as a whole */
+    struct MappedFile {
+        int fd;
+        uint8_t *base;
+        size_t len;
+
+        MappedFile(): fd(-1), base(nullptr), len(0) {}
+        void open(const std::string &fname);
+        /** Resize the file and map it again (the content is kept). */
+        void remap(size_t len);
+        /** Drop the content and remap with `len` zeros. */
+        void reset(size_t len);
+        void close();
+    };
+
+    std::string fname;
+    MappedFile seg;
+    /** slots holding (offset + 1) of a record, 0 if empty */
+    MappedFile hash_idx;
+    /** (offset + 1) of the record of each height from base_height */
+    MappedFile height_idx;
+    size_t tail;            /**< end of the last intact record */
+    size_t synced;          /**< end of the records flushed to the disk */
+    size_t nblks;
+    uint32_t base_height;   /**< height of the first record */
+
+    size_t find(const uint256_t &blk_hash) const;
+    void index_hash(size_t rec);
+    void index_height(size_t rec);
+    void rebuild_hash_idx(size_t nslots);
+    void load();
+
+    public:
+    BlockArchive(const std::string &fname, size_t init_size = 1 << 26);
+    ~BlockArchive();
+
+    BlockArchive(const BlockArchive &) = delete;
+    BlockArchive &operator=(const BlockArchive &) = delete;
+
+    /** Append the serialized block to the segment (no-op if present). The
+     * blocks are expected in ascending heights, as they are committed; one
+     * that is lower than the first is not indexed by its height. */
+    void append(const uint256_t &blk_hash, uint32_t height, const DataStream &blk);
+
+    /** Flush the records appended so far to the disk, before anything
+     * else (such as the log) stops holding the blocks. */
+    void sync();
+
+    bool contains(const uint256_t &blk_hash) const {
+        return find(blk_hash) != 0;
+    }
+
+    /** Get a view of the serialized block inside the mapping. The pointer
+     * stays valid until the next append(). */
+    bool get(const uint256_t &blk_hash, const uint8_t *&data, size_t &size,
+            uint32_t *height = nullptr) const;
+    /** The same as above, for the block at the given height. */
+    bool get(uint32_t height, uint256_t &blk_hash,
+            const uint8_t *&data, size_t &size) const;
+
+    size_t size() const { return nblks; }
+    size_t get_tail() const { return tail; }
+};
+
+using blk_archive_bt = BoxObj<BlockArchive>;
+
+}
+
+#endif
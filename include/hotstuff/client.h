@@ -18,6 +18,7 @@
 #define _HOTSTUFF_CLIENT_H
 
 #include "salticidae/msg.h"
+#include "salticidae/network.h"
 #include "hotstuff/type.h"
 #include "hotstuff/entity.h"
 #include "hotstuff/consensus.h"
@@ -50,7 +51,16 @@ struct MsgRespCmd {
     }
 };
 
-#ifdef SYNCHS_AUTOCLI
+/** Acknowledges many commands from the same client in one frame. */
+struct MsgRespCmdBatch {
+    static const opcode_t opcode = 0x7;
+    DataStream serialized;
+    std::vector<Finality> fins;
+    MsgRespCmdBatch(const std::vector<Finality> &fins);
+    MsgRespCmdBatch(DataStream &&s);
+};
+
+/** Sent by the proposer to ask the clients for more commands. */
 struct MsgDemandCmd {
     static const opcode_t opcode = 0x6;
     DataStream serialized;
@@ -58,7 +68,22 @@ struct MsgDemandCmd {
     MsgDemandCmd(size_t ncmd) { serialized << ncmd; }
     MsgDemandCmd(DataStream &&s) { s >> ncmd; }
 };
-#endif
+
+/** Submits many commands in one frame. A replica other than the proposer
+ * only needs to know the hashes of the commands, so the client may send
+ * those instead of the full commands. */
+struct MsgReqCmdBatch {
+    static const opcode_t opcode = 0x8;
+    DataStream serialized;
+    /** whether the commands are carried in full */
+    bool full;
+    uint32_t ncmd;
+    /** only filled upon parsing if the commands are not carried in full,
+     * otherwise the application parses ncmd commands from `serialized` */
+    std::vector<uint256_t> cmd_hashes;
+    MsgReqCmdBatch(const std::vector<command_t> &cmds, bool full);
+    MsgReqCmdBatch(DataStream &&s);
+};
 
 class CommandDummy: public Command {
     uint32_t cid;
@@ -98,6 +123,137 @@ class CommandDummy: public Command {
     bool verify() const override {
         return true;
     }
+
+    /** Parse `n` consecutive commands, hashing them all at once. */
+    static std::vector<command_t> parse_batch(DataStream &s, size_t n);
+};
+
+/** Client-side library for submitting commands to the replicas. Commands
+ * are sent in batches of MsgReqCmdBatch and a command is confirmed once
+ * nfaulty + 1 replicas have acknowledged it. The number of outstanding
+ * commands is limited by a sliding window: a slot is freed by each
+ * confirmation, or granted by the proposer through MsgDemandCmd. A command
+ * turned away by a replica (decision -1) keeps its slot and is resubmitted
+ * to all replicas after a backoff, while the window is halved and then
+ * grows back by one with each confirmation. */
+class HotStuffClient {
+    public:
+    using Net = salticidae::MsgNetwork<opcode_t>;
+    /** called upon confirmation, with the latency until the first
+     * acknowledgement and until the confirmation (in seconds) */
+    using confirm_cb_t = std::function<void(const Finality &fin,
+                                            double first_lat, double lat)>;
+    /** called once nfaulty + 1 replicas have speculatively executed a
+     * command, with the latency so far (in seconds) */
+    using tentative_cb_t = std::function<void(const Finality &fin, double lat)>;
+
+    struct Config {
+        /** the maximum number of outstanding commands */
+        size_t window;
+        /** the maximum number of commands in a frame */
+        size_t batch_size;
+        /** send a partial batch after this long (at the end of the current
+         * event loop iteration if zero) */
+        double batch_linger;
+        /** send the full commands only to the (presumed) proposer, and the
+         * hashes to the other replicas */
+        bool proposer_only;
+        /** resend the commands to all replicas if not confirmed by then */
+        double resend_timeout;
+        /** only send commands demanded by the proposer */
+        bool demand_driven;
+        /** resubmit the commands turned away after this long, doubled with
+         * each resubmission until a confirmation */
+        double retry_delay;
+
+        Config(): window(10), batch_size(1), batch_linger(0),
+            proposer_only(false), resend_timeout(1), demand_driven(false),
+            retry_delay(0.05) {}
+    };
+
+    private:
+    struct Request {
+        command_t cmd;
+        confirm_cb_t cb;
+        uint64_t batch_id;
+        size_t confirmed;
+        size_t ntentative;
+        double first_lat;
+        /** whether it is to be resubmitted */
+        bool rejected;
+        salticidae::ElapsedTime et;
+        Request(const command_t &cmd, confirm_cb_t &&cb):
+            cmd(cmd), cb(std::move(cb)), batch_id(0),
+            confirmed(0), ntentative(0), first_lat(0),
+            rejected(false) { et.start(); }
+    };
+
+    struct Batch {
+        std::vector<command_t> cmds;
+        /** the number of unconfirmed commands */
+        size_t nwaiting;
+        TimerEvent timeout;
+    };
+
+    EventContext ec;
+    Config config;
+    Net mn;
+    std::vector<Net::conn_t> conns;
+    size_t nfaulty;
+    /** the replica presumed to be the proposer */
+    ReplicaID proposer;
+    /** the number of commands that can be submitted */
+    size_t credit;
+    /** the current window, shrunk by the rejections */
+    size_t window;
+    /** the commands turned away, to be resubmitted */
+    std::vector<command_t> rejected;
+    TimerEvent retry_timer;
+    double retry_delay;
+    std::unordered_map<const uint256_t, Request> waiting;
+    /** the batch being filled */
+    std::vector<command_t> pending;
+    TimerEvent linger_timer;
+    std::unordered_map<uint64_t, Batch> inflight;
+    uint64_t batch_cnt;
+    std::function<void()> ready_cb;
+    tentative_cb_t tentative_cb;
+
+    void send_batch(Batch &batch, bool fallback);
+    void on_confirm(const Finality &fin);
+    void on_reject(const Finality &fin);
+    void retry();
+    void add_credit(size_t ncmd);
+    void resp_cmd_handler(MsgRespCmd &&msg, const Net::conn_t &conn);
+    void resp_cmd_batch_handler(MsgRespCmdBatch &&msg, const Net::conn_t &conn);
+    void demand_cmd_handler(MsgDemandCmd &&msg, const Net::conn_t &conn);
+
+    public:
+    HotStuffClient(const EventContext &ec,
+                const Config &config,
+                const Net::Config &netconfig = Net::Config());
+
+    HotStuffClient(const HotStuffClient &) = delete;
+    HotStuffClient &operator=(const HotStuffClient &) = delete;
+
+    /** Connect to the replicas (in the order of their ids). */
+    void connect(const std::vector<NetAddr> &replicas, ReplicaID proposer = 0);
+    /** Submit a command, unless the window is full.
+     * @return true if submitted */
+    bool submit(const command_t &cmd, confirm_cb_t cb);
+    /** Send out the batch being filled. */
+    void flush();
+    /** Set the callback invoked when the window has room again. */
+    void reg_ready(std::function<void()> cb) { ready_cb = std::move(cb); }
+    /** Set the callback invoked upon the speculative execution of a command
+     * (see HotStuffBase::set_speculative()), ahead of its confirmation. */
+    void reg_tentative(tentative_cb_t cb) { tentative_cb = std::move(cb); }
+
+    size_t get_credit() const { return credit; }
+    size_t get_window() const { return window; }
+    size_t get_nwaiting() const { return waiting.size(); }
+    ReplicaID get_proposer() const { return proposer; }
+    void stop() { mn.stop(); }
 };
 
 }
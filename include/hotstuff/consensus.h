@@ -26,12 +26,14 @@
 #include "hotstuff/type.h"
 #include "hotstuff/entity.h"
 #include "hotstuff/crypto.h"
+#include "hotstuff/wal.h"
 
 namespace hotstuff {
 
 struct Proposal;
 struct Vote;
 struct Notify;
+struct AggVote;
 struct Blame;
 struct BlameNotify;
 struct Finality;
@@ -43,6 +45,7 @@ class HotStuffCore {
     /** block containing the QC for the highest block having one */
     std::pair<block_t, quorum_cert_bt> hqc;   /**< highest QC */
     block_t b_exec;                            /**< last executed block */
+    block_t b_spec;             /**< last speculatively executed block */
     uint32_t vheight;          /**< height of the block last voted for */
     uint32_t nheight;          /**< height of the block last notified for */
     uint32_t view;             /**< the current view number */
@@ -52,6 +55,8 @@ class HotStuffCore {
     bool view_trans; /**< whether the replica is in-between the views */
     std::unordered_map<uint32_t, std::unordered_set<block_t>> proposals;
     std::unordered_map<block_t, bool> finished_propose;
+    /** votes received for each block in this view, for the responsive commit */
+    std::unordered_map<block_t, size_t> view_votes;
     quorum_cert_bt blame_qc;
     std::unordered_set<ReplicaID> blamed;
 
@@ -69,10 +74,32 @@ class HotStuffCore {
     /* == feature switches == */
     /** always vote negatively, useful for some PaceMakers */
     bool vote_disabled;
+    /** execute the certified blocks ahead of the commit */
+    bool speculative;
+    /** commit the blocks voted by nresponsive replicas right away */
+    bool responsive;
+    /* === persistence === */
+    wal_bt wal;             /**< write-ahead log (disabled if null) */
+    bool recovering;        /**< whether the log is being replayed */
+    /** blocks lower than this may have been released by prune(), so the
+     * skip pointers into that range are not followed */
+    uint32_t chain_floor;
+
+    void wal_append(uint8_t type, const DataStream &s) {
+        if (wal != nullptr && !recovering) wal->append(type, s);
+    }
+    void on_recover_record(uint8_t type, DataStream &s);
+    /** Rewrite the log as a snapshot of the state from `anchor` (the lowest
+     * block kept) upwards. */
+    void compact_wal(const block_t &anchor);
 
     block_t get_delivered_blk(const uint256_t &blk_hash);
     void sanity_check_delivered(const block_t &blk);
+    const Block *get_ancestor(const Block *blk, uint32_t height) const;
     void check_commit(const block_t &_hqc);
+    void speculate(const block_t &blk);
+    void on_vote_counted(const block_t &blk, size_t nvotes);
+    void rollback_to(const block_t &blk);
     void update_hqc(const block_t &_hqc, const quorum_cert_bt &qc);
     void on_hqc_update();
     void on_qc_finish(const block_t &blk);
@@ -81,8 +108,10 @@ class HotStuffCore {
     void on_view_change();
     void on_view_trans();
     void _vote(const block_t &blk);
+    void _send_vote(const block_t &blk);
     void _blame();
     void _new_view();
+    bool _record_proposal(const block_t &blk);
 
     protected:
     ReplicaID id;                  /**< identity of the replica itself */
@@ -102,6 +131,10 @@ class HotStuffCore {
      * functions. */
     void on_init(uint32_t nfaulty, double delta);
 
+    /** Call to restore the protocol state from the write-ahead log (if any),
+     * after on_init() and before any other inputs. */
+    void on_recover();
+
     /* TODO: better name for "delivery" ? */
     /** Call to inform the state machine that a block is ready to be handled.
      * A block is only delivered if itself is fetched, the block for the
@@ -118,6 +151,9 @@ class HotStuffCore {
     /** Call upon the delivery of a vote message.
      * The block mentioned in the message should be already delivered. */
     void on_receive_vote(const Vote &vote);
+    /** Call upon the delivery of votes aggregated by the relay tree. The
+     * block should be already delivered and the parts verified. */
+    void on_receive_agg_vote(const AggVote &av);
     void on_receive_notify(const Notify &notify);
     void on_receive_blame(const Blame &blame);
     void on_receive_blamenotify(const BlameNotify &blame);
@@ -139,9 +175,16 @@ class HotStuffCore {
      * functions should be implemented by the user to specify the behavior upon
      * the events. */
     protected:
-    /** Called by HotStuffCore upon the decision being made for cmd. */
-    virtual void do_decide(Finality &&fin) = 0;
+    /** Called by HotStuffCore upon the decision being made for all commands
+     * in the committed block. */
+    virtual void do_decide_batch(const block_t &blk) = 0;
     virtual void do_consensus(const block_t &blk) = 0;
+    /** Called by HotStuffCore (if speculative) upon a block getting its QC,
+     * in the chain order, ahead of its do_decide_batch(). */
+    virtual void do_speculate(const block_t &) {}
+    /** Called by HotStuffCore to undo the last do_speculate() of a block
+     * that is not going to be committed (in reverse chain order). */
+    virtual void do_rollback(const block_t &) {}
     /** Called by HotStuffCore upon broadcasting a new proposal.
      * The user should send the proposal message to all replicas except for
      * itself. */
@@ -169,14 +212,27 @@ class HotStuffCore {
     virtual quorum_cert_bt create_quorum_cert(const uint256_t &blk_hash) = 0;
     /** Create a quorum certificate from its serialized form. */
     virtual quorum_cert_bt parse_quorum_cert(DataStream &s) = 0;
+    /** Create a quorum certificate for `obj_hash` from its compact form
+     * (see QuorumCert::serialize_compact()). */
+    virtual quorum_cert_bt parse_quorum_cert_compact(DataStream &s, const uint256_t &) {
+        return parse_quorum_cert(s);
+    }
     /** Create a command object from its serialized form. */
-    //virtual command_t parse_cmd(DataStream &s) = 0;
+    virtual command_t parse_cmd(DataStream &s) = 0;
+    /** Create `n` command objects from their consecutive serialized forms,
+     * hashing them all at once if the command type allows. */
+    virtual std::vector<command_t> parse_cmds(DataStream &s, size_t n) {
+        std::vector<command_t> cmds(n);
+        for (auto &cmd: cmds) cmd = parse_cmd(s);
+        return cmds;
+    }
 
     public:
     /** Add a replica to the current configuration. This should only be called
      * before running HotStuffCore protocol. */
     void add_replica(ReplicaID rid, const NetAddr &addr, pubkey_bt &&pub_key);
-    /** Try to prune blocks lower than last committed height - staleness. */
+    /** Try to prune blocks lower than last committed height - staleness,
+     * compacting the log (if any) down to what is kept. */
     void prune(uint32_t staleness);
 
     /* PaceMaker can use these functions to monitor the core protocol state
@@ -195,20 +251,50 @@ class HotStuffCore {
     promise_t async_wait_view_trans();
 
     /* Other useful functions */
+    /** Check if `a` is `b` itself or one of its ancestors (through the first
+     * parents). Takes O(log n) steps using the skip pointers. */
+    bool is_ancestor(const block_t &a, const block_t &b) const {
+        return get_ancestor(b.get(), a->get_height()) == a.get();
+    }
     const block_t &get_genesis() { return b0; }
     const block_t &get_hqc() { return hqc.first; }
     const ReplicaConfig &get_config() { return config; }
     ReplicaID get_id() const { return id; }
+    /** Sign `obj_hash` with the key of the replica, for the data other than
+     * votes and blames (such as the stamps of a PaceMaker) that is
+     * attributed to it. */
+    part_cert_bt sign(const uint256_t &obj_hash) {
+        return create_part_cert(*priv_key, obj_hash);
+    }
     const std::set<block_t, BlockHeightCmp> get_tails() const { return tails; }
     uint32_t get_view() const { return view; }
     operator std::string () const;
     void set_vote_disabled(bool f) { vote_disabled = f; }
+    /** Execute each block once it gets a QC instead of waiting for the
+     * commit, undoing it if the block turns out not to be committed. */
+    void set_speculative(bool f) { speculative = f; }
+    /** Commit a block as soon as floor(3n/4) + 1 replicas have voted for
+     * it and no equivocation is seen on its uncommitted branch, falling back
+     * to the 2 delta commit timer otherwise. This is only safe with fewer
+     * than n/4 faulty replicas: two such quorums then share more than n/2
+     * replicas, hence an honest one that would not vote for both of two
+     * conflicting blocks, and the honest voters of a committed block make up
+     * a majority that carries it through the view change. on_init() refuses
+     * the mode for a larger nfaulty. Votes sent through the relay tree only
+     * reach the proposer, so only the proposer commits early then. Should
+     * be called before on_init(). */
+    void set_responsive(bool f) { responsive = f; }
+    bool is_responsive() const { return responsive; }
+    /** Log the protocol state to `wal`. Votes are only sent out once the log
+     * is durable. Should be called before on_recover(). */
+    void set_wal(wal_bt &&_wal) { wal = std::move(_wal); }
 };
 
 
 enum ProofType {
     VOTE = 0x00,
-    BLAME = 0x01
+    BLAME = 0x01,
+    STAMP = 0x02
 };
 
 /** Abstraction for proposal messages. */
@@ -249,7 +335,7 @@ struct Proposal: public Serializable {
 };
 
 /** Abstraction for vote messages. */
-struct Vote: public Serializable {
+struct Vote: public Serializable, public PoolAllocated<Vote> {
     ReplicaID voter;
     /** block being voted */
     uint256_t blk_hash;
@@ -286,10 +372,24 @@ struct Vote: public Serializable {
         cert = hsc->parse_part_cert(s);
     }
 
+    /** The object signed by a vote. It is memoized (per thread), because
+     * every vote for a block checks it again. */
     static uint256_t proof_obj_hash(const uint256_t &blk_hash) {
+        struct Entry {
+            uint256_t blk_hash;
+            uint256_t obj_hash;
+            bool valid;
+        };
+        static const size_t nmemo = 16;
+        thread_local Entry memo[nmemo];
+        auto &e = memo[std::hash<uint256_t>()(blk_hash) % nmemo];
+        if (e.valid && e.blk_hash == blk_hash) return e.obj_hash;
         DataStream p;
         p << (uint8_t)ProofType::VOTE << blk_hash;
-        return p.get_hash();
+        e.blk_hash = blk_hash;
+        e.obj_hash = p.get_hash();
+        e.valid = true;
+        return e.obj_hash;
     }
 
     bool verify() const {
@@ -305,6 +405,14 @@ struct Vote: public Serializable {
         });
     }
 
+    promise_t verify(VeriPool &vpool, VeriCache &vcache) const {
+        assert(hsc != nullptr);
+        return cert->verify(hsc->get_config().get_pubkey(voter), vpool,
+                            voter, vcache).then([this](bool result) {
+            return result && cert->get_obj_hash() == proof_obj_hash(blk_hash);
+        });
+    }
+
     operator std::string () const {
         DataStream s;
         s << "<vote "
@@ -356,6 +464,13 @@ struct Notify: public Serializable {
         });
     }
 
+    promise_t verify(VeriPool &vpool, VeriCache &vcache) const {
+        assert(hsc != nullptr);
+        return qc->verify(hsc->get_config(), vpool, vcache).then([this](bool result) {
+            return result && qc->get_obj_hash() == Vote::proof_obj_hash(blk_hash);
+        });
+    }
+
     operator std::string () const {
         DataStream s;
         s << "<notify "
@@ -364,6 +479,57 @@ struct Notify: public Serializable {
     }
 };
 
+/** Votes for a block aggregated by a subtree of the vote relay tree. */
+struct AggVote: public Serializable {
+    /** root of the relay tree (the proposer) */
+    ReplicaID root;
+    uint256_t blk_hash;
+    /** partial cert holding the votes of the subtree collected so far */
+    quorum_cert_bt qc;
+
+    /** handle of the core object to allow polymorphism */
+    HotStuffCore *hsc;
+
+    AggVote(): qc(nullptr), hsc(nullptr) {}
+    AggVote(ReplicaID root,
+            const uint256_t &blk_hash,
+            quorum_cert_bt &&qc,
+            HotStuffCore *hsc):
+        root(root), blk_hash(blk_hash),
+        qc(std::move(qc)), hsc(hsc) {}
+
+    AggVote(const AggVote &other):
+        root(other.root), blk_hash(other.blk_hash),
+        qc(other.qc ? other.qc->clone() : nullptr), hsc(other.hsc) {}
+
+    AggVote(AggVote &&other) = default;
+
+    void serialize(DataStream &s) const override {
+        s << root << blk_hash << *qc;
+    }
+
+    void unserialize(DataStream &s) override {
+        s >> root >> blk_hash;
+        qc = hsc->parse_quorum_cert(s);
+    }
+
+    promise_t verify(VeriPool &vpool) const {
+        assert(hsc != nullptr);
+        if (qc->get_obj_hash() != Vote::proof_obj_hash(blk_hash))
+            return promise_t([](promise_t &pm) { pm.resolve(false); });
+        return qc->verify_parts(hsc->get_config(), vpool);
+    }
+
+    operator std::string () const {
+        DataStream s;
+        s << "<aggvote "
+          << "root=" << std::to_string(root) << " "
+          << "blk=" << get_hex10(blk_hash) << " "
+          << "nvotes=" << std::to_string(qc->get_signers().size()) << ">";
+        return std::move(s);
+    }
+};
+
 struct Blame: public Serializable {
     ReplicaID blamer;
     uint32_t view;
@@ -399,10 +565,18 @@ struct Blame: public Serializable {
         cert = hsc->parse_part_cert(s);
     }
 
+    /** The object signed by a blame, memoized for the last view. */
     static uint256_t proof_obj_hash(uint32_t view) {
+        thread_local uint32_t last_view;
+        thread_local uint256_t last_hash;
+        thread_local bool valid = false;
+        if (valid && last_view == view) return last_hash;
         DataStream p;
         p << (uint8_t)ProofType::BLAME << view;
-        return p.get_hash();
+        last_view = view;
+        last_hash = p.get_hash();
+        valid = true;
+        return last_hash;
     }
 
     bool verify() const {
@@ -418,6 +592,14 @@ struct Blame: public Serializable {
         });
     }
 
+    promise_t verify(VeriPool &vpool, VeriCache &vcache) const {
+        assert(hsc != nullptr);
+        return cert->verify(hsc->get_config().get_pubkey(blamer), vpool,
+                            blamer, vcache).then([this](bool result) {
+            return result && cert->get_obj_hash() == proof_obj_hash(view);
+        });
+    }
+
     operator std::string () const {
         DataStream s;
         s << "<blame "
@@ -476,7 +658,7 @@ struct BlameNotify: public Serializable {
         assert(hsc != nullptr);
         if (qc->get_obj_hash() != Blame::proof_obj_hash(view) ||
             hqc_qc->get_obj_hash() != Vote::proof_obj_hash(hqc_hash))
-            return promise_t([](promise_t &){ return false; });
+            return promise_t([](promise_t &pm){ pm.resolve(false); });
         return promise::all(std::vector<promise_t>{
             qc->verify(hsc->get_config(), vpool),
             hqc_qc->verify(hsc->get_config(), vpool),
@@ -486,6 +668,20 @@ struct BlameNotify: public Serializable {
         });
     }
 
+    promise_t verify(VeriPool &vpool, VeriCache &vcache) const {
+        assert(hsc != nullptr);
+        if (qc->get_obj_hash() != Blame::proof_obj_hash(view) ||
+            hqc_qc->get_obj_hash() != Vote::proof_obj_hash(hqc_hash))
+            return promise_t([](promise_t &pm){ pm.resolve(false); });
+        return promise::all(std::vector<promise_t>{
+            qc->verify(hsc->get_config(), vpool, vcache),
+            hqc_qc->verify(hsc->get_config(), vpool, vcache),
+        }).then([](const promise::values_t &values) {
+            return promise::any_cast<bool>(values[0]) &&
+                promise::any_cast<bool>(values[1]);
+        });
+    }
+
     operator std::string () const {
         DataStream s;
         s << "<blame notify "
@@ -497,14 +693,18 @@ struct BlameNotify: public Serializable {
 inline void Proposal::unserialize(DataStream &s) {
     assert(hsc != nullptr);
     s >> proposer;
-    Block _blk;
-    _blk.unserialize(s, hsc);
-    blk = hsc->storage->add_blk(std::move(_blk), hsc->get_config());
+    /* the receiver adds the block to the storage */
+    blk = Block::parse(s, hsc);
 }
 
 struct Finality: public Serializable {
     ReplicaID rid;
+    /** 1 if committed, 0 if the replica has the command already (waiting or
+     * recently decided), -1 if turned away for the lack of room */
     int8_t decision;
+    /** whether the command is only speculatively executed, the commit
+     * follows with another Finality */
+    uint8_t tentative;
     uint32_t cmd_idx;
     uint32_t cmd_height;
     uint256_t cmd_hash;
@@ -517,20 +717,21 @@ struct Finality: public Serializable {
             uint32_t cmd_idx,
             uint32_t cmd_height,
             uint256_t cmd_hash,
-            uint256_t blk_hash):
-        rid(rid), decision(decision),
+            uint256_t blk_hash,
+            bool tentative = false):
+        rid(rid), decision(decision), tentative(tentative),
         cmd_idx(cmd_idx), cmd_height(cmd_height),
         cmd_hash(cmd_hash), blk_hash(blk_hash) {}
 
     void serialize(DataStream &s) const override {
-        s << rid << decision
+        s << rid << decision << tentative
           << cmd_idx << cmd_height
           << cmd_hash;
         if (decision == 1) s << blk_hash;
     }
 
     void unserialize(DataStream &s) override {
-        s >> rid >> decision
+        s >> rid >> decision >> tentative
           >> cmd_idx >> cmd_height
           >> cmd_hash;
         if (decision == 1) s >> blk_hash;
@@ -540,6 +741,7 @@ struct Finality: public Serializable {
         DataStream s;
         s << "<fin "
           << "decision=" << std::to_string(decision) << " "
+          << "tentative=" << std::to_string(tentative) << " "
           << "cmd_idx=" << std::to_string(cmd_idx) << " "
           << "cmd_height=" << std::to_string(cmd_height) << " "
           << "cmd=" << get_hex10(cmd_hash) << " "
@@ -17,6 +17,7 @@
 #ifndef _HOTSTUFF_CRYPTO_H
 #define _HOTSTUFF_CRYPTO_H
 
+#include <queue>
 #include <openssl/rand.h>
 
 #include "secp256k1.h"
@@ -24,6 +25,10 @@
 #include "hotstuff/type.h"
 #include "hotstuff/task.h"
 
+#ifdef HOTSTUFF_ENABLE_BLS
+#include <bls/bls384_256.h>
+#endif
+
 namespace hotstuff {
 
 using salticidae::SHA256;
@@ -45,10 +50,64 @@ class PrivKey: public Serializable {
 
 using privkey_bt = BoxObj<PrivKey>;
 
+/** Cache of the partial signatures that have already been verified, keyed by
+ * (obj_hash, ReplicaID). The digest of the signature is also kept, so a
+ * different signature claimed for the same pair is still checked. Only the
+ * most recent `capacity` objects are remembered. */
+class VeriCache {
+    using sig_map_t = std::unordered_map<ReplicaID, uint256_t>;
+    std::unordered_map<const uint256_t, sig_map_t> verified;
+    std::queue<uint256_t> order;
+    size_t capacity;
+
+    public:
+    uint64_t nhit;
+    uint64_t nmiss;
+
+    VeriCache(size_t capacity = 4096):
+        capacity(capacity), nhit(0), nmiss(0) {}
+
+    bool check(const uint256_t &obj_hash, ReplicaID rid, const uint256_t &sig_hash) {
+        auto it = verified.find(obj_hash);
+        if (it != verified.end())
+        {
+            auto it2 = it->second.find(rid);
+            if (it2 != it->second.end() && it2->second == sig_hash)
+            {
+                nhit++;
+                return true;
+            }
+        }
+        nmiss++;
+        return false;
+    }
+
+    void add(const uint256_t &obj_hash, ReplicaID rid, const uint256_t &sig_hash) {
+        auto it = verified.find(obj_hash);
+        if (it == verified.end())
+        {
+            if (order.size() >= capacity)
+            {
+                verified.erase(order.front());
+                order.pop();
+            }
+            it = verified.insert(std::make_pair(obj_hash, sig_map_t())).first;
+            order.push(obj_hash);
+        }
+        it->second[rid] = sig_hash;
+    }
+};
+
 class PartCert: public Serializable, public Cloneable {
     public:
     virtual ~PartCert() = default;
     virtual promise_t verify(const PubKey &pubkey, VeriPool &vpool) = 0;
+    /** Same as verify(pubkey, vpool), but skip the check if the signature by
+     * `rid` is in `vcache`, and add it there once verified. */
+    virtual promise_t verify(const PubKey &pubkey, VeriPool &vpool,
+                            ReplicaID, VeriCache &) {
+        return verify(pubkey, vpool);
+    }
     virtual bool verify(const PubKey &pubkey) = 0;
     virtual const uint256_t &get_obj_hash() const = 0;
     virtual PartCert *clone() override = 0;
@@ -62,9 +121,27 @@ class QuorumCert: public Serializable, public Cloneable {
     virtual void add_part(ReplicaID replica, const PartCert &pc) = 0;
     virtual void compute() = 0;
     virtual promise_t verify(const ReplicaConfig &config, VeriPool &vpool) = 0;
+    /** Same as verify(config, vpool), but only check the parts not found in
+     * `vcache`, and add them there once verified. */
+    virtual promise_t verify(const ReplicaConfig &config, VeriPool &vpool,
+                            VeriCache &) {
+        return verify(config, vpool);
+    }
     virtual bool verify(const ReplicaConfig &config) = 0;
+    /** Verify the parts included so far, without requiring a quorum of
+     * them (used for the partial certs relayed by the vote tree). */
+    virtual promise_t verify_parts(const ReplicaConfig &config, VeriPool &vpool) = 0;
+    /** Merge the parts of another cert for the same object into this one,
+     * return the number of signers added (0 if it cannot be merged). */
+    virtual size_t merge(const QuorumCert &other) = 0;
+    /** Get the replicas whose parts are included. */
+    virtual std::vector<ReplicaID> get_signers() const = 0;
     virtual const uint256_t &get_obj_hash() const = 0;
     virtual QuorumCert *clone() override = 0;
+    /** Encoding used within a compact block, which already implies the
+     * object hash (defaults to the full form). */
+    virtual void serialize_compact(DataStream &s) const { serialize(s); }
+    virtual void unserialize_compact(DataStream &s, const uint256_t &) { unserialize(s); }
 };
 
 using part_cert_bt = BoxObj<PartCert>;
@@ -113,30 +190,55 @@ class PartCertDummy: public PartCert {
 
 class QuorumCertDummy: public QuorumCert {
     uint256_t obj_hash;
+    /** the signers are still tracked so that partial certs can be merged */
+    salticidae::Bits rids;
     public:
     QuorumCertDummy() {}
-    QuorumCertDummy(const ReplicaConfig &, const uint256_t &obj_hash):
-        obj_hash(obj_hash) {}
+    QuorumCertDummy(const ReplicaConfig &config, const uint256_t &obj_hash);
 
     void serialize(DataStream &s) const override {
-        s << (uint32_t)1 << obj_hash;
+        s << (uint32_t)1 << obj_hash << rids;
     }
 
     void unserialize(DataStream &s) override {
         uint32_t tmp;
-        s >> tmp >> obj_hash;
+        s >> tmp >> obj_hash >> rids;
     }
 
     QuorumCert *clone() override {
         return new QuorumCertDummy(*this);
     }
 
-    void add_part(ReplicaID, const PartCert &) override {}
+    void add_part(ReplicaID rid, const PartCert &) override {
+        if (rid < rids.size()) rids.set(rid);
+    }
     void compute() override {}
     bool verify(const ReplicaConfig &) override { return true; }
     promise_t verify(const ReplicaConfig &, VeriPool &) override {
         return promise_t([](promise_t &pm) { pm.resolve(true); });
     }
+    promise_t verify_parts(const ReplicaConfig &, VeriPool &) override {
+        return promise_t([](promise_t &pm) { pm.resolve(true); });
+    }
+
+    size_t merge(const QuorumCert &other) override {
+        const auto &o = static_cast<const QuorumCertDummy &>(other);
+        size_t added = 0;
+        for (size_t i = 0; i < o.rids.size() && i < rids.size(); i++)
+            if (o.rids.get(i) && !rids.get(i))
+            {
+                rids.set(i);
+                added++;
+            }
+        return added;
+    }
+
+    std::vector<ReplicaID> get_signers() const override {
+        std::vector<ReplicaID> res;
+        for (size_t i = 0; i < rids.size(); i++)
+            if (rids.get(i)) res.push_back(i);
+        return res;
+    }
 
     const uint256_t &get_obj_hash() const override { return obj_hash; }
 };
@@ -345,7 +447,29 @@ class Secp256k1VeriTask: public VeriTask {
     }
 };
 
-class PartCertSecp256k1: public SigSecp256k1, public PartCert {
+/** Verify all signatures for the same message (e.g. the parts of a quorum
+ * certificate) in one task. */
+class Secp256k1BatchVeriTask: public VeriTask {
+    bytearray_t msg;
+    std::vector<std::pair<PubKeySecp256k1, SigSecp256k1>> parts;
+    public:
+    Secp256k1BatchVeriTask(const uint256_t &msg): msg(msg) {}
+    virtual ~Secp256k1BatchVeriTask() = default;
+
+    void add(const PubKeySecp256k1 &pubkey, const SigSecp256k1 &sig) {
+        parts.push_back(std::make_pair(pubkey, sig));
+    }
+
+    bool verify() override {
+        for (const auto &p: parts)
+            if (!p.second.verify(msg, p.first, secp256k1_default_verify_ctx))
+                return false;
+        return true;
+    }
+};
+
+class PartCertSecp256k1: public SigSecp256k1, public PartCert,
+                        public PoolAllocated<PartCertSecp256k1> {
     uint256_t obj_hash;
 
     public:
@@ -362,11 +486,23 @@ class PartCertSecp256k1: public SigSecp256k1, public PartCert {
     }
 
     promise_t verify(const PubKey &pub_key, VeriPool &vpool) override {
-        return vpool.verify(new Secp256k1VeriTask(obj_hash,
+        return vpool.verify_batched(new Secp256k1VeriTask(obj_hash,
                 static_cast<const PubKeySecp256k1 &>(pub_key),
                 static_cast<const SigSecp256k1 &>(*this)));
     }
 
+    promise_t verify(const PubKey &pub_key, VeriPool &vpool,
+                    ReplicaID rid, VeriCache &vcache) override {
+        auto sig_hash = salticidae::get_hash(static_cast<const SigSecp256k1 &>(*this));
+        if (vcache.check(obj_hash, rid, sig_hash))
+            return promise_t([](promise_t &pm) { pm.resolve(true); });
+        return verify(pub_key, vpool).then(
+                [obj_hash=obj_hash, rid, sig_hash, &vcache](bool result) {
+            if (result) vcache.add(obj_hash, rid, sig_hash);
+            return result;
+        });
+    }
+
     const uint256_t &get_obj_hash() const override { return obj_hash; }
 
     PartCertSecp256k1 *clone() override {
@@ -384,27 +520,49 @@ class PartCertSecp256k1: public SigSecp256k1, public PartCert {
     }
 };
 
-class QuorumCertSecp256k1: public QuorumCert {
+/** Throw unless the salticidae::Bits serialized next in `s` has `nbits`
+ * bits, before it is read (and allocated). */
+void check_qc_nbits(DataStream &s, size_t nbits);
+
+class QuorumCertSecp256k1: public QuorumCert,
+                            public PoolAllocated<QuorumCertSecp256k1> {
     uint256_t obj_hash;
     salticidae::Bits rids;
-    std::unordered_map<ReplicaID, SigSecp256k1> sigs;
+    /** signatures indexed by ReplicaID, only valid where rids is set */
+    std::vector<SigSecp256k1> sigs;
+    size_t nsigs;
 
     public:
-    QuorumCertSecp256k1() = default;
+    QuorumCertSecp256k1(): nsigs(0) {}
     QuorumCertSecp256k1(const ReplicaConfig &config, const uint256_t &obj_hash);
 
     void add_part(ReplicaID rid, const PartCert &pc) override {
         if (pc.get_obj_hash() != obj_hash)
             throw std::invalid_argument("PartCert does match the block hash");
-        sigs.insert(std::make_pair(
-            rid, static_cast<const PartCertSecp256k1 &>(pc)));
+        if (rid >= sigs.size())
+            throw std::invalid_argument("ReplicaID out of range");
+        if (rids.get(rid)) return;
+        sigs[rid] = static_cast<const PartCertSecp256k1 &>(pc);
         rids.set(rid);
+        nsigs++;
     }
 
     void compute() override {}
 
     bool verify(const ReplicaConfig &config) override;
     promise_t verify(const ReplicaConfig &config, VeriPool &vpool) override;
+    promise_t verify(const ReplicaConfig &config, VeriPool &vpool,
+                    VeriCache &vcache) override;
+    promise_t verify_parts(const ReplicaConfig &config, VeriPool &vpool) override;
+
+    size_t merge(const QuorumCert &other) override;
+
+    std::vector<ReplicaID> get_signers() const override {
+        std::vector<ReplicaID> res;
+        for (size_t i = 0; i < rids.size(); i++)
+            if (rids.get(i)) res.push_back(i);
+        return res;
+    }
 
     const uint256_t &get_obj_hash() const override { return obj_hash; }
 
@@ -415,15 +573,283 @@ class QuorumCertSecp256k1: public QuorumCert {
     void serialize(DataStream &s) const override {
         s << obj_hash << rids;
         for (size_t i = 0; i < rids.size(); i++)
-            if (rids.get(i)) s << sigs.at(i);
+            if (rids.get(i)) s << sigs[i];
+    }
+
+    /** The QC must have been made for the configuration, and so is only
+     * read back if it has the same number of replicas. */
+    void unserialize(DataStream &s) override;
+
+    void serialize_compact(DataStream &s) const override;
+    void unserialize_compact(DataStream &s, const uint256_t &_obj_hash) override;
+};
+
+#ifdef HOTSTUFF_ENABLE_BLS
+/* BLS12-381 signatures through herumi/bls. Unlike secp256k1, the partial
+ * signatures of a quorum are aggregated into a single constant-size
+ * signature, so a QC is checked by one pairing no matter how many replicas
+ * signed. Aggregation is open to rogue keys (one chosen to cancel out the
+ * keys of others), so each public key comes with a proof of possession of
+ * its secret key, checked as the key is loaded from the configuration. */
+
+class BLSContext {
+    public:
+    BLSContext();
+};
+
+extern BLSContext bls_default_ctx;
+
+class PrivKeyBLS;
+
+/** A public key, serialized along with its proof of possession (the
+ * signature of the key by its secret key). */
+class PubKeyBLS: public PubKey {
+    friend class SigBLS;
+    friend class QuorumCertBLS;
+    blsPublicKey data;
+    blsSignature pop;
+
+    public:
+    PubKeyBLS(): PubKey() {}
+
+    PubKeyBLS(const bytearray_t &raw_bytes): PubKeyBLS() { from_bytes(raw_bytes); }
+
+    inline PubKeyBLS(const PrivKeyBLS &priv_key);
+
+    void serialize(DataStream &s) const override {
+        uint8_t output[128];
+        size_t olen = blsPublicKeySerialize(output, sizeof output, &data);
+        s.put_data(output, output + olen);
+        uint8_t sig[192];
+        olen = blsSignatureSerialize(sig, sizeof sig, &pop);
+        s.put_data(sig, sig + olen);
+    }
+
+    /** Throws unless the proof of possession holds. */
+    void unserialize(DataStream &s) override {
+        size_t n = blsPublicKeyDeserialize(&data, s.data(), s.size());
+        if (!n)
+            throw std::invalid_argument("ill-formed public key");
+        s.get_data_inplace(n);
+        n = blsSignatureDeserialize(&pop, s.data(), s.size());
+        if (!n)
+            throw std::invalid_argument("public key without proof of possession");
+        s.get_data_inplace(n);
+        if (blsVerifyPop(&pop, &data) != 1)
+            throw std::invalid_argument("invalid proof of possession");
+    }
+
+    PubKeyBLS *clone() override {
+        return new PubKeyBLS(*this);
+    }
+};
+
+class PrivKeyBLS: public PrivKey {
+    friend class PubKeyBLS;
+    friend class SigBLS;
+    blsSecretKey data;
+
+    public:
+    PrivKeyBLS(): PrivKey() {}
+
+    PrivKeyBLS(const bytearray_t &raw_bytes): PrivKeyBLS() { from_bytes(raw_bytes); }
+
+    void serialize(DataStream &s) const override {
+        uint8_t output[64];
+        size_t olen = blsSecretKeySerialize(output, sizeof output, &data);
+        s.put_data(output, output + olen);
+    }
+
+    void unserialize(DataStream &s) override {
+        size_t n = blsSecretKeyDeserialize(&data, s.data(), s.size());
+        if (!n)
+            throw std::invalid_argument("ill-formed private key");
+        s.get_data_inplace(n);
+    }
+
+    void from_rand() override {
+        if (blsSecretKeySetByCSPRNG(&data))
+            throw std::runtime_error("cannot get rand bytes for bls key");
+    }
+
+    inline pubkey_bt get_pubkey() const override;
+};
+
+pubkey_bt PrivKeyBLS::get_pubkey() const {
+    return new PubKeyBLS(*this);
+}
+
+PubKeyBLS::PubKeyBLS(const PrivKeyBLS &priv_key): PubKey() {
+    blsGetPublicKey(&data, &priv_key.data);
+    blsGetPop(&pop, &priv_key.data);
+}
+
+class SigBLS: public Serializable {
+    friend class QuorumCertBLS;
+    blsSignature data;
+
+    public:
+    SigBLS(): Serializable() {}
+    SigBLS(const uint256_t &digest, const PrivKeyBLS &priv_key):
+        Serializable() {
+        sign(digest, priv_key);
+    }
+
+    void serialize(DataStream &s) const override {
+        uint8_t output[192];
+        size_t olen = blsSignatureSerialize(output, sizeof output, &data);
+        s.put_data(output, output + olen);
     }
 
     void unserialize(DataStream &s) override {
-        s >> obj_hash >> rids;
+        size_t n = blsSignatureDeserialize(&data, s.data(), s.size());
+        if (!n)
+            throw std::invalid_argument("ill-formed signature");
+        s.get_data_inplace(n);
+    }
+
+    void sign(const bytearray_t &msg, const PrivKeyBLS &priv_key) {
+        blsSign(&data, &priv_key.data, &*msg.begin(), msg.size());
+    }
+
+    bool verify(const bytearray_t &msg, const PubKeyBLS &pub_key) const {
+        return blsVerify(&data, &pub_key.data, &*msg.begin(), msg.size()) == 1;
+    }
+};
+
+class BLSVeriTask: public VeriTask {
+    bytearray_t msg;
+    PubKeyBLS pubkey;
+    SigBLS sig;
+    public:
+    BLSVeriTask(const uint256_t &msg,
+                const PubKeyBLS &pubkey,
+                const SigBLS &sig):
+        msg(msg), pubkey(pubkey), sig(sig) {}
+    virtual ~BLSVeriTask() = default;
+
+    bool verify() override {
+        return sig.verify(msg, pubkey);
+    }
+};
+
+class PartCertBLS: public SigBLS, public PartCert {
+    uint256_t obj_hash;
+
+    public:
+    PartCertBLS() = default;
+    PartCertBLS(const PrivKeyBLS &priv_key, const uint256_t &obj_hash):
+        SigBLS(obj_hash, priv_key),
+        PartCert(),
+        obj_hash(obj_hash) {}
+
+    bool verify(const PubKey &pub_key) override {
+        return SigBLS::verify(obj_hash,
+                            static_cast<const PubKeyBLS &>(pub_key));
+    }
+
+    promise_t verify(const PubKey &pub_key, VeriPool &vpool) override {
+        return vpool.verify_batched(new BLSVeriTask(obj_hash,
+                static_cast<const PubKeyBLS &>(pub_key),
+                static_cast<const SigBLS &>(*this)));
+    }
+
+    const uint256_t &get_obj_hash() const override { return obj_hash; }
+
+    PartCertBLS *clone() override {
+        return new PartCertBLS(*this);
+    }
+
+    void serialize(DataStream &s) const override {
+        s << obj_hash;
+        this->SigBLS::serialize(s);
+    }
+
+    void unserialize(DataStream &s) override {
+        s >> obj_hash;
+        this->SigBLS::unserialize(s);
+    }
+};
+
+class QuorumCertBLS: public QuorumCert {
+    uint256_t obj_hash;
+    salticidae::Bits rids;
+    /** partial signatures collected before compute() */
+    std::vector<SigBLS> parts;
+    /** the aggregated signature */
+    SigBLS sig;
+    /** whether sig holds the aggregate of some of the signers */
+    bool aggregated;
+
+    /** Sum up the public keys of the signers, return the number of them. */
+    size_t get_agg_pubkey(const ReplicaConfig &config, PubKeyBLS &agg) const;
+
+    public:
+    QuorumCertBLS(): aggregated(false) {}
+    QuorumCertBLS(const ReplicaConfig &config, const uint256_t &obj_hash);
+
+    void add_part(ReplicaID rid, const PartCert &pc) override {
+        if (pc.get_obj_hash() != obj_hash)
+            throw std::invalid_argument("PartCert does match the block hash");
+        if (rids.get(rid)) return;
+        parts.push_back(static_cast<const PartCertBLS &>(pc));
+        rids.set(rid);
+    }
+
+    void compute() override;
+
+    bool verify(const ReplicaConfig &config) override;
+    promise_t verify(const ReplicaConfig &config, VeriPool &vpool) override;
+    /** Only valid once compute() has been called. */
+    promise_t verify_parts(const ReplicaConfig &config, VeriPool &vpool) override;
+
+    size_t merge(const QuorumCert &other) override;
+
+    std::vector<ReplicaID> get_signers() const override {
+        std::vector<ReplicaID> res;
         for (size_t i = 0; i < rids.size(); i++)
-            if (rids.get(i)) s >> sigs[i];
+            if (rids.get(i)) res.push_back(i);
+        return res;
+    }
+
+    const uint256_t &get_obj_hash() const override { return obj_hash; }
+
+    QuorumCertBLS *clone() override {
+        return new QuorumCertBLS(*this);
+    }
+
+    void serialize(DataStream &s) const override {
+        s << obj_hash << rids << sig;
+    }
+
+    /** The same as QuorumCertSecp256k1::unserialize(). */
+    void unserialize(DataStream &s) override {
+        s >> obj_hash;
+        check_qc_nbits(s, rids.size());
+        s >> rids >> sig;
+        parts.clear();
+        aggregated = false;
+        for (size_t i = 0; i < rids.size() && !aggregated; i++)
+            aggregated = rids.get(i);
+    }
+};
+
+class QuorumCertBLSVeriTask: public VeriTask {
+    bytearray_t msg;
+    PubKeyBLS agg_pubkey;
+    SigBLS sig;
+    public:
+    QuorumCertBLSVeriTask(const uint256_t &msg,
+                        const PubKeyBLS &agg_pubkey,
+                        const SigBLS &sig):
+        msg(msg), agg_pubkey(agg_pubkey), sig(sig) {}
+    virtual ~QuorumCertBLSVeriTask() = default;
+
+    bool verify() override {
+        return sig.verify(msg, agg_pubkey);
     }
 };
+#endif
 
 }
 
@@ -18,17 +18,21 @@
 #define _HOTSTUFF_ENT_H
 
 #include <vector>
+#include <algorithm>
 #include <unordered_map>
 #include <unordered_set>
 #include <string>
 #include <cstddef>
+#include <cstring>
 #include <ios>
+#include <functional>
 
 #include "salticidae/netaddr.h"
 #include "salticidae/ref.h"
 #include "hotstuff/type.h"
 #include "hotstuff/util.h"
 #include "hotstuff/crypto.h"
+#include "hotstuff/archive.h"
 
 namespace hotstuff {
 
@@ -62,9 +66,12 @@ class ReplicaConfig {
     public:
     size_t nreplicas;
     size_t nmajority;
+    /** votes that commit a block without waiting for 2 delta (0 if the
+     * responsive mode is disabled) */
+    size_t nresponsive;
     double delta;
 
-    ReplicaConfig(): nreplicas(0), nmajority(0), delta(0) {}
+    ReplicaConfig(): nreplicas(0), nmajority(0), nresponsive(0), delta(0) {}
 
     void add_replica(ReplicaID rid, const ReplicaInfo &info) {
         replica_map.insert(std::make_pair(rid, info));
@@ -117,13 +124,58 @@ get_hashes(const std::vector<Hashable> &plist) {
     return std::move(hashes);
 }
 
-class Block {
+/** The command hashes of a block, read in place from its serialized form
+ * (as their 32 bytes each). Only valid as long as the block is. */
+class CmdHashes {
+    const uint8_t *base;
+    size_t n;
+
+    public:
+    class const_iterator {
+        const uint8_t *p;
+        public:
+        const_iterator(const uint8_t *p): p(p) {}
+        uint256_t operator*() const { return uint256_t(p); }
+        const_iterator &operator++() { p += uint256_nbytes; return *this; }
+        bool operator==(const const_iterator &other) const { return p == other.p; }
+        bool operator!=(const const_iterator &other) const { return p != other.p; }
+    };
+
+    CmdHashes(const uint8_t *base, size_t n): base(base), n(n) {}
+
+    size_t size() const { return n; }
+    bool empty() const { return n == 0; }
+    uint256_t operator[](size_t i) const {
+        return uint256_t(base + i * uint256_nbytes);
+    }
+    const_iterator begin() const { return base; }
+    const_iterator end() const { return base + n * uint256_nbytes; }
+
+    bool operator==(const CmdHashes &other) const {
+        return n == other.n &&
+            (n == 0 || !memcmp(base, other.base, n * uint256_nbytes));
+    }
+
+    operator std::vector<uint256_t>() const {
+        std::vector<uint256_t> hashes;
+        hashes.reserve(n);
+        for (const auto &h: *this) hashes.push_back(h);
+        return std::move(hashes);
+    }
+};
+
+class Block: public PoolAllocated<Block> {
     friend HotStuffCore;
     std::vector<uint256_t> parent_hashes;
-    std::vector<uint256_t> cmds;
     quorum_cert_bt qc;
     uint256_t qc_ref_hash;
-    bytearray_t extra;
+    /** the serialized block, which the hash is taken over, and the
+     * commands and extra are read from in place */
+    bytearray_t raw;
+    uint32_t ncmds;
+    uint32_t cmds_off;
+    uint32_t extra_off;
+    uint32_t extra_len;
 
     /* the following fields can be derived from above */
     uint256_t hash;
@@ -133,22 +185,39 @@ class Block {
     uint32_t height;
     bool delivered;
     int8_t decision;
+    /** the ancestor at a skip height, set upon delivery (not owned, see
+     * HotStuffCore::get_ancestor()) */
+    const Block *skip;
+    /** commands received as short IDs in a compact block, until resolved
+     * by finish_compact() */
+    std::vector<std::pair<uint32_t, uint64_t>> short_cmds;
 
     std::unordered_set<ReplicaID> voted;
 
+    /** unserialize() without computing the hash. Only the canonical
+     * encoding (the one serialize() gives) is accepted, checked field by
+     * field as it is read, so that each block has one hash. */
+    void unserialize_unhashed(DataStream &s, HotStuffCore *hsc);
+    /** Build `raw` from the other fields, `cmds` and `extra`. */
+    void encode(const std::vector<uint256_t> &cmds, const bytearray_t &extra);
+    void hash_raw();
+
     public:
     Block():
         qc(nullptr),
+        ncmds(0), cmds_off(0), extra_off(0), extra_len(0),
         qc_ref(nullptr),
         self_qc(nullptr), height(0),
-        delivered(false), decision(0) {}
+        delivered(false), decision(0), skip(nullptr) {}
 
     Block(bool delivered, int8_t decision):
         qc(nullptr),
-        hash(salticidae::get_hash(*this)),
         qc_ref(nullptr),
         self_qc(nullptr), height(0),
-        delivered(delivered), decision(decision) {}
+        delivered(delivered), decision(decision), skip(nullptr) {
+        encode(std::vector<uint256_t>(), bytearray_t());
+        hash_raw();
+    }
 
     Block(const std::vector<block_t> &parents,
         const std::vector<uint256_t> &cmds,
@@ -159,24 +228,50 @@ class Block {
         quorum_cert_bt &&self_qc,
         int8_t decision = 0):
             parent_hashes(get_hashes(parents)),
-            cmds(cmds),
             qc(std::move(qc)),
             qc_ref_hash(qc_ref ? qc_ref->get_hash() : uint256_t()),
-            extra(std::move(extra)),
-            hash(salticidae::get_hash(*this)),
             parents(parents),
             qc_ref(qc_ref),
             self_qc(std::move(self_qc)),
             height(height),
             delivered(0),
-            decision(decision) {}
+            decision(decision),
+            skip(nullptr) {
+        encode(cmds, extra);
+        hash_raw();
+    }
 
     void serialize(DataStream &s) const;
 
     void unserialize(DataStream &s, HotStuffCore *hsc);
 
-    const std::vector<uint256_t> &get_cmds() const {
-        return cmds;
+    /** Parse a block from `s` without touching the storage, so it is safe
+     * to be called outside the consensus thread. */
+    static block_t parse(DataStream &s, HotStuffCore *hsc);
+    /** Parse `n` consecutive blocks, hashing them all at once. */
+    static std::vector<block_t> parse_batch(DataStream &s, size_t n, HotStuffCore *hsc);
+    /** Parse a block read back from the archive, which is committed and
+     * delivered at `height` but, like a pruned block, has no ancestors in
+     * memory. */
+    static block_t parse_archived(DataStream &s, const uint256_t &blk_hash,
+                                uint32_t height, HotStuffCore *hsc);
+
+    /** Compact wire encoding (version compact_blk_version): varint lengths,
+     * no qc_ref_hash when the QC is for the first parent (nor the object
+     * hash of the QC, which follows from it), and 8-byte short IDs for the
+     * commands `use_short` holds for. The block is still hashed over
+     * serialize(), which the receiver rebuilds in unserialize_compact()
+     * (and fills in with the short IDs in finish_compact()). */
+    void serialize_compact(DataStream &s,
+                        const std::function<bool(const uint256_t &)> &use_short = nullptr) const;
+    void unserialize_compact(DataStream &s, HotStuffCore *hsc);
+    /** Resolve the short IDs with `lookup` and compute the hash, return
+     * false if any of them is unknown. */
+    bool finish_compact(const std::function<bool(uint64_t, uint256_t &)> &lookup);
+    static uint64_t get_short_id(const uint256_t &cmd_hash);
+
+    CmdHashes get_cmds() const {
+        return CmdHashes(raw.data() + cmds_off, ncmds);
     }
 
     const std::vector<block_t> &get_parents() const {
@@ -191,6 +286,7 @@ class Block {
 
     bool verify(const ReplicaConfig &config) const;
     promise_t verify(const ReplicaConfig &config, VeriPool &vpool) const;
+    promise_t verify(const ReplicaConfig &config, VeriPool &vpool, VeriCache &vcache) const;
 
     int8_t get_decision() const { return decision; }
 
@@ -202,7 +298,11 @@ class Block {
 
     const block_t &get_qc_ref() const { return qc_ref; }
 
-    const bytearray_t &get_extra() const { return extra; }
+    /** A copy of the extra data (which is kept inside the encoding). */
+    bytearray_t get_extra() const {
+        return bytearray_t(raw.data() + extra_off,
+                            raw.data() + extra_off + extra_len);
+    }
 
     const uint256_t &get_qc_ref_hash() const { return qc_ref_hash; }
 
@@ -226,15 +326,39 @@ struct BlockHeightCmp {
 class EntityStorage {
     std::unordered_map<const uint256_t, block_t> blk_cache;
     std::unordered_map<const uint256_t, command_t> cmd_cache;
+    /** committed blocks spilled out of blk_cache (disabled if null) */
+    blk_archive_bt archive;
+    /** used to parse the blocks read back from the archive */
+    HotStuffCore *hsc;
+
+    block_t find_archived_blk(const uint256_t &blk_hash) const;
+
     public:
+    EntityStorage(HotStuffCore *hsc): archive(nullptr), hsc(hsc) {}
+
+    void set_archive(blk_archive_bt &&_archive) { archive = std::move(_archive); }
+    const blk_archive_bt &get_archive() const { return archive; }
+    void sync_archive() { if (archive != nullptr) archive->sync(); }
+
+    /** Whether the block is only available in serialized form from the
+     * archive. */
+    bool is_blk_archived(const uint256_t &blk_hash) {
+        return archive != nullptr && !blk_cache.count(blk_hash) &&
+                archive->contains(blk_hash);
+    }
+
+    /** Archived blocks count as delivered (and fetched), as they are
+     * committed. */
     bool is_blk_delivered(const uint256_t &blk_hash) {
         auto it = blk_cache.find(blk_hash);
-        if (it == blk_cache.end()) return false;
+        if (it == blk_cache.end())
+            return archive != nullptr && archive->contains(blk_hash);
         return it->second->is_delivered();
     }
 
     bool is_blk_fetched(const uint256_t &blk_hash) {
-        return blk_cache.count(blk_hash);
+        return blk_cache.count(blk_hash) ||
+                (archive != nullptr && archive->contains(blk_hash));
     }
 
     block_t add_blk(Block &&_blk, const ReplicaConfig &/*config*/) {
@@ -251,9 +375,15 @@ class EntityStorage {
         return blk_cache.insert(std::make_pair(blk->get_hash(), blk)).first->second;
     }
 
+    /** Parse a block from `s` and add it, without an intermediate copy.
+     * Returns the stored block if it is already there. */
+    block_t parse_blk(DataStream &s, HotStuffCore *hsc);
+
+    /** Find the block in memory, or else parse it out of the archive (a
+     * new object each time, which is not kept in blk_cache). */
     block_t find_blk(const uint256_t &blk_hash) {
         auto it = blk_cache.find(blk_hash);
-        return it == blk_cache.end() ? nullptr : it->second;
+        return it == blk_cache.end() ? find_archived_blk(blk_hash) : it->second;
     }
 
     bool is_cmd_fetched(const uint256_t &cmd_hash) {
@@ -269,12 +399,28 @@ class EntityStorage {
         return it == cmd_cache.end() ? nullptr: it->second;
     }
 
+    /** The delivered blocks of at least the given height, lower ones first
+     * (so that each comes after its parents). */
+    std::vector<block_t> get_delivered_blks(uint32_t min_height) const {
+        std::vector<block_t> blks;
+        for (const auto &p: blk_cache)
+            if (p.second->is_delivered() && p.second->get_height() >= min_height)
+                blks.push_back(p.second);
+        std::sort(blks.begin(), blks.end(), [](const block_t &a, const block_t &b) {
+            return a->get_height() < b->get_height();
+        });
+        return blks;
+    }
+
     size_t get_cmd_cache_size() {
         return cmd_cache.size();
     }
     size_t get_blk_cache_size() {
         return blk_cache.size();
     }
+    size_t get_blk_archive_size() {
+        return archive != nullptr ? archive->size() : 0;
+    }
 
     bool try_release_cmd(const command_t &cmd) {
         if (cmd.get_cnt() == 2) /* only referred by cmd and the storage */
@@ -293,8 +439,15 @@ class EntityStorage {
 #ifdef HOTSTUFF_PROTO_LOG
             HOTSTUFF_LOG_INFO("releasing blk %.10s", get_hex(blk_hash).c_str());
 #endif
-//            for (const auto &cmd: blk->get_cmds())
-//                try_release_cmd(cmd);
+            /* the payloads (if any) go together with the block */
+            for (const auto &cmd_hash: blk->get_cmds())
+                cmd_cache.erase(cmd_hash);
+            if (archive != nullptr && blk->get_decision() == 1)
+            {
+                DataStream s;
+                s << *blk;
+                archive->append(blk_hash, blk->get_height(), s);
+            }
             blk_cache.erase(blk_hash);
             return true;
         }
@@ -0,0 +1,66 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HOTSTUFF_ERASURE_H
+#define _HOTSTUFF_ERASURE_H
+
+#include <vector>
+#include <unordered_map>
+
+#include "hotstuff/type.h"
+
+namespace hotstuff {
+
+/** Systematic Reed-Solomon code over GF(2^8): the data is cut into `ndata`
+ * shards, followed by `nshard - ndata` parity shards, so that any `ndata` of
+ * the shards recover the data. The parity rows are a Cauchy matrix, which
+ * keeps every square submatrix of the generator invertible. */
+class ReedSolomon {
+    size_t ndata;
+    size_t nshard;
+    /** nshard x ndata generator matrix (the top rows are the identity) */
+    std::vector<uint8_t> gen;
+
+    public:
+    /** At most 256 shards are supported. */
+    ReedSolomon(size_t ndata, size_t nshard);
+
+    size_t get_ndata() const { return ndata; }
+    size_t get_nshard() const { return nshard; }
+    size_t get_shard_size(size_t len) const { return (len + ndata - 1) / ndata; }
+
+    /** Split `len` bytes of data into nshard shards of equal size. */
+    std::vector<bytearray_t> encode(const uint8_t *data, size_t len) const;
+
+    /** Recover the first `len` bytes of data from at least ndata shards
+     * (indexed by their position), return false if there are too few of them
+     * or they are ill-sized. */
+    bool decode(const std::unordered_map<uint32_t, bytearray_t> &shards,
+                size_t len, bytearray_t &data) const;
+};
+
+/** Merkle tree over the hashes of the shards, so that each shard can be
+ * checked on its own against the root. An odd node at the end of a level
+ * is carried up without being hashed. */
+uint256_t merkle_root(std::vector<uint256_t> level);
+std::vector<uint256_t> merkle_proof(std::vector<uint256_t> level, size_t idx);
+bool merkle_verify(const uint256_t &root, uint256_t leaf, size_t idx,
+                    size_t nleaves, const std::vector<uint256_t> &proof);
+
+}
+
+#endif
@@ -0,0 +1,41 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HOTSTUFF_HASH_H
+#define _HOTSTUFF_HASH_H
+
+#include "hotstuff/type.h"
+
+namespace hotstuff {
+
+/** SHA-256 of `n` messages at once, giving the same digests as
+ * DataStream::get_hash(). On a CPU with AVX2 but without the SHA
+ * extensions, the messages are hashed eight at a time (those of similar
+ * lengths together); otherwise each goes through SHA256, which already
+ * uses the SHA extensions when there are any. */
+void hash_batch(const uint8_t *const *msgs, const size_t *lens, size_t n,
+                uint256_t *hashes);
+
+/** hash_batch() always through the eight lanes, even with the SHA
+ * extensions around, for testing. Return false if the CPU (or the OS) does
+ * not support AVX2, leaving `hashes` untouched. */
+bool hash_batch_x8(const uint8_t *const *msgs, const size_t *lens, size_t n,
+                uint256_t *hashes);
+
+}
+
+#endif
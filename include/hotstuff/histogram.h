@@ -0,0 +1,103 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HOTSTUFF_HISTOGRAM_H
+#define _HOTSTUFF_HISTOGRAM_H
+
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+namespace hotstuff {
+
+/** Histogram of non-negative integer values (e.g. latencies in microseconds)
+ * in constant memory, in the style of HdrHistogram: values are bucketed by
+ * their magnitude (power of two), and linearly within a magnitude, so that
+ * the relative error of a reported value is below 2^-(sub_bits - 1). */
+class Histogram {
+    static const int sub_bits = 8;
+    static const uint64_t half = 1ull << (sub_bits - 1);
+
+    std::vector<uint64_t> counts;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+
+    static int msb(uint64_t v) { return 63 - __builtin_clzll(v); }
+
+    static size_t get_index(uint64_t v) {
+        if (v < 2 * half) return v;
+        int mag = msb(v) - (sub_bits - 1);
+        return mag * half + (v >> mag);
+    }
+
+    static uint64_t get_value(size_t idx) {
+        if (idx < 2 * half) return idx;
+        int mag = idx / half - 1;
+        return (idx - mag * half) << mag;
+    }
+
+    public:
+    Histogram(): counts((64 - sub_bits + 2) * half) { reset(); }
+
+    void record(uint64_t v, uint64_t n = 1) {
+        counts[get_index(v)] += n;
+        total += n;
+        sum += (double)v * n;
+        if (v < min) min = v;
+        if (v > max) max = v;
+    }
+
+    void merge(const Histogram &other) {
+        for (size_t i = 0; i < counts.size(); i++)
+            counts[i] += other.counts[i];
+        total += other.total;
+        sum += other.sum;
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+    }
+
+    void reset() {
+        std::fill(counts.begin(), counts.end(), 0);
+        total = 0;
+        sum = 0;
+        min = UINT64_MAX;
+        max = 0;
+    }
+
+    /** Get the value at quantile q in [0, 1] (the lower end of its bucket). */
+    uint64_t get_quantile(double q) const {
+        if (!total) return 0;
+        uint64_t rank = std::max((uint64_t)std::ceil(q * total), (uint64_t)1);
+        uint64_t acc = 0;
+        for (size_t i = 0; i < counts.size(); i++)
+            if ((acc += counts[i]) >= rank)
+                return std::min(std::max(get_value(i), min), max);
+        return max;
+    }
+
+    uint64_t get_count() const { return total; }
+    uint64_t get_min() const { return total ? min : 0; }
+    uint64_t get_max() const { return max; }
+    double get_mean() const { return total ? sum / total : 0; }
+};
+
+}
+
+#endif
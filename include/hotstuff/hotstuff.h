@@ -18,7 +18,10 @@
 #ifndef _HOTSTUFF_CORE_H
 #define _HOTSTUFF_CORE_H
 
+#include <functional>
 #include <queue>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
 
@@ -27,6 +30,10 @@
 #include "salticidae/msg.h"
 #include "hotstuff/util.h"
 #include "hotstuff/consensus.h"
+#include "hotstuff/timer.h"
+#include "hotstuff/metrics.h"
+#include "hotstuff/erasure.h"
+#include "hotstuff/mempool.h"
 
 namespace hotstuff {
 
@@ -37,6 +44,21 @@ using salticidae::_2;
 
 const double ent_waiting_timeout = 10;
 const double double_inf = 1e10;
+/** number of blocks in each chunk of a range sync response */
+const uint32_t range_sync_chunk_size = 128;
+/** maximum number of peers a range sync is striped across */
+const size_t range_sync_nstripe = 4;
+/** maximum number of tasks a pipeline stage runs per event loop iteration */
+const size_t stage_burst_size = 256;
+/** a vote relay context is dropped after this many relay timeouts */
+const double vote_relay_expiry = 4;
+/** maximum number of uncommitted blocks carried by a view change message */
+const uint32_t view_change_suffix_max = 4;
+/** number of own blocks in each window of the minimum commit latency */
+const uint32_t commit_lat_window = 256;
+
+/** queue connecting the stages of the replica pipeline */
+using stage_queue_t = salticidae::MPSCQueueEventDriven<std::function<void()>>;
 
 /** Network message format for HotStuff. */
 struct MsgPropose {
@@ -50,6 +72,21 @@ struct MsgPropose {
     void postponed_parse(HotStuffCore *hsc);
 };
 
+/** A proposal in the compact block encoding (see
+ * Block::serialize_compact()), with the hash of the block, so that a replica
+ * unable to resolve the short IDs fetches the block instead. */
+struct MsgProposeCompact {
+    static const opcode_t opcode = 0xd;
+    DataStream serialized;
+    Proposal proposal;
+    uint256_t blk_hash;
+    MsgProposeCompact(const Proposal &,
+                    const std::function<bool(const uint256_t &)> &use_short);
+    MsgProposeCompact(DataStream &&s): serialized(std::move(s)) {}
+    /** Parse the block, which is left to Block::finish_compact(). */
+    void postponed_parse(HotStuffCore *hsc);
+};
+
 struct MsgVote {
     static const opcode_t opcode = 0x1;
     DataStream serialized;
@@ -63,11 +100,24 @@ struct MsgNotify {
     static const opcode_t opcode = 0x4;
     DataStream serialized;
     Notify notify;
-    MsgNotify(const Notify &);
+    /** the uncommitted chain ending at the notified block (fast view
+     * change only) */
+    std::vector<block_t> blks;
+    MsgNotify(const Notify &, const std::vector<block_t> &blks = {});
     MsgNotify(DataStream &&s): serialized(std::move(s)) {}
     void postponed_parse(HotStuffCore *hsc);
 };
 
+/** Votes aggregated by a subtree of the vote relay tree. */
+struct MsgAggVote {
+    static const opcode_t opcode = 0x9;
+    DataStream serialized;
+    AggVote av;
+    MsgAggVote(const AggVote &);
+    MsgAggVote(DataStream &&s): serialized(std::move(s)) {}
+    void postponed_parse(HotStuffCore *hsc);
+};
+
 struct MsgBlame {
     static const opcode_t opcode = 0x5;
     DataStream serialized;
@@ -81,7 +131,10 @@ struct MsgBlameNotify {
     static const opcode_t opcode = 0x6;
     DataStream serialized;
     BlameNotify bn;
-    MsgBlameNotify(const BlameNotify &);
+    /** the uncommitted chain ending at the hqc block (fast view change
+     * only) */
+    std::vector<block_t> blks;
+    MsgBlameNotify(const BlameNotify &, const std::vector<block_t> &blks = {});
     MsgBlameNotify(DataStream &&s): serialized(std::move(s)) {}
     void postponed_parse(HotStuffCore *hsc);
 };
@@ -101,10 +154,97 @@ struct MsgRespBlock {
     DataStream serialized;
     std::vector<block_t> blks;
     MsgRespBlock(const std::vector<block_t> &blks);
+    /** Construct directly from the serialized blocks kept in the archive. */
+    MsgRespBlock(const BlockArchive &archive,
+                const std::vector<uint256_t> &blk_hashes);
     MsgRespBlock(DataStream &&s): serialized(std::move(s)) {}
     void postponed_parse(HotStuffCore *hsc);
 };
 
+/** Request for the blocks on the chain ending at `end_hash`, starting from
+ * `start_height`. The range is cut into chunks of `chunk_size` blocks at
+ * absolute heights (chunk i starts at `start_height + i * chunk_size`), and
+ * the peer only sends the chunks `stripe`, `stripe + nstripe`, ... so that
+ * the range can be fetched from several peers at once. A peer that does
+ * not have all blocks of a chunk does not send it. */
+struct MsgReqBlockRange {
+    static const opcode_t opcode = 0x7;
+    DataStream serialized;
+    uint256_t end_hash;
+    uint32_t start_height;
+    uint32_t chunk_size;
+    uint32_t stripe;
+    uint32_t nstripe;
+    MsgReqBlockRange(const uint256_t &end_hash, uint32_t start_height,
+                    uint32_t chunk_size, uint32_t stripe, uint32_t nstripe);
+    MsgReqBlockRange(DataStream &&s);
+};
+
+/** One chunk of the blocks requested by MsgReqBlockRange. */
+struct MsgRespBlockRange {
+    static const opcode_t opcode = 0x8;
+    DataStream serialized;
+    uint256_t end_hash;
+    uint32_t start_height;
+    uint32_t chunk_idx;
+    /** total number of chunks in the range (0 if the peer cannot serve it) */
+    uint32_t nchunk;
+    std::vector<block_t> blks;
+    MsgRespBlockRange(const uint256_t &end_hash, uint32_t start_height,
+                    uint32_t chunk_idx, uint32_t nchunk,
+                    std::vector<block_t>::const_iterator begin,
+                    std::vector<block_t>::const_iterator end);
+    MsgRespBlockRange(DataStream &&s);
+    void postponed_parse(HotStuffCore *hsc);
+};
+
+/** One erasure-coded chunk of a serialized proposal. The proposer sends
+ * chunk i to replica i only, which then forwards it to all others. */
+struct MsgProposeChunk {
+    static const opcode_t opcode = 0xa;
+    DataStream serialized;
+    ReplicaID proposer;
+    uint256_t blk_hash;
+    /** Merkle root over the hashes of all chunks */
+    uint256_t root;
+    /** length of the serialized proposal */
+    uint32_t len;
+    /** number of chunks needed to recover the proposal */
+    uint16_t ndata;
+    uint16_t nchunk;
+    uint16_t idx;
+    bytearray_t chunk;
+    /** Merkle path from the chunk to the root */
+    std::vector<uint256_t> proof;
+    MsgProposeChunk(ReplicaID proposer, const uint256_t &blk_hash,
+                    const uint256_t &root, uint32_t len,
+                    uint16_t ndata, uint16_t nchunk, uint16_t idx,
+                    const bytearray_t &chunk,
+                    const std::vector<uint256_t> &proof);
+    MsgProposeChunk(DataStream &&s);
+};
+
+/** Command payloads, either gossiped by a replica that got them from the
+ * clients, or sent in response to MsgReqCmds. */
+struct MsgRespCmds {
+    static const opcode_t opcode = 0xb;
+    DataStream serialized;
+    std::vector<command_t> cmds;
+    MsgRespCmds(const std::vector<command_t> &cmds);
+    MsgRespCmds(DataStream &&s): serialized(std::move(s)) {}
+    void postponed_parse(HotStuffCore *hsc);
+};
+
+/** Bulk request for the payloads of the commands referenced by a block. */
+struct MsgReqCmds {
+    static const opcode_t opcode = 0xc;
+    DataStream serialized;
+    std::vector<uint256_t> cmd_hashes;
+    MsgReqCmds() = default;
+    MsgReqCmds(const std::vector<uint256_t> &cmd_hashes);
+    MsgReqCmds(DataStream &&s);
+};
+
 using promise::promise_t;
 
 class HotStuffBase;
@@ -114,11 +254,13 @@ template<EntityType ent_type>
 class FetchContext: public promise_t {
     TimerEvent timeout;
     HotStuffBase *hs;
-    MsgReqBlock fetch_msg;
+    typename std::conditional<ent_type == ENT_TYPE_BLK,
+                            MsgReqBlock, MsgReqCmds>::type fetch_msg;
     const uint256_t ent_hash;
     std::unordered_set<NetAddr> replica_ids;
     inline void timeout_cb(TimerEvent &);
     public:
+    ElapsedTime elapsed;
     FetchContext(const FetchContext &) = delete;
     FetchContext &operator=(const FetchContext &) = delete;
     FetchContext(FetchContext &&other);
@@ -127,6 +269,8 @@ class FetchContext: public promise_t {
     ~FetchContext() {}
 
     inline void send(const NetAddr &replica_id);
+    /** Send the request to all known replicas now. */
+    inline void send_all();
     inline void reset_timeout();
     inline void add_replica(const NetAddr &replica_id, bool fetch_now = true);
 };
@@ -147,6 +291,147 @@ class BlockDeliveryContext: public promise_t {
     }
 };
 
+/** A block waiting in the DeliveryScheduler. */
+struct DeliveryEntry {
+    BlockDeliveryContext pm;
+    /** tells the entry apart from a later one for the same block */
+    uint64_t id;
+    /** the block, once it is fetched */
+    block_t blk;
+    /** the replica to fetch the block and its dependencies from */
+    NetAddr replica;
+    /** whether the delivery is driven by the scheduler (otherwise the
+     * range sync delivers the block) */
+    bool scheduled;
+    /** number of dependencies not satisfied yet: the qc_ref to be fetched,
+     * the parents to be delivered and the signatures to be verified */
+    uint32_t nmissing;
+    /** entries waiting for this block to be delivered */
+    std::vector<std::pair<uint256_t, uint64_t>> dependents;
+
+    DeliveryEntry(uint64_t id):
+        pm([](promise_t){}), id(id),
+        scheduled(false), nmissing(0) {}
+};
+
+/** Delivers the blocks in the order of their dependencies. Each pending
+ * block counts its missing dependencies and keeps the list of its
+ * dependents, so that a delivery releases the dependents that become
+ * ready in one batch, without chaining promises. The signatures of all the
+ * fetched blocks are verified concurrently on the VeriPool, regardless of
+ * whether their parents have arrived. */
+class DeliveryScheduler {
+    using dep_t = std::pair<uint256_t, uint64_t>;
+    HotStuffBase *hs;
+    uint64_t next_id;
+    std::unordered_map<const uint256_t, DeliveryEntry> pending;
+    /** entries waiting for a block (their qc_ref) to be fetched */
+    std::unordered_map<const uint256_t, std::vector<dep_t>> fetch_dependents;
+    /** entries with all dependencies satisfied, in topological order */
+    std::vector<uint256_t> ready;
+    bool releasing;
+
+    DeliveryEntry &get_entry(const uint256_t &blk_hash);
+    DeliveryEntry *find_entry(const dep_t &dep);
+    void resolve_deps(const uint256_t &blk_hash, const block_t &blk);
+    void satisfy(const dep_t &dep);
+    void release();
+
+    public:
+    DeliveryScheduler(HotStuffBase *hs):
+        hs(hs), next_id(0), releasing(false) {}
+
+    /** Deliver the block, fetching it and its missing ancestors from
+     * `replica` when needed. */
+    promise_t schedule(const uint256_t &blk_hash, const NetAddr &replica);
+    /** Get the entry of a block that will be delivered by someone else. */
+    promise_t reserve(const uint256_t &blk_hash);
+    bool is_pending(const uint256_t &blk_hash) const {
+        return pending.count(blk_hash);
+    }
+    void on_fetch(const block_t &blk);
+    /** Resolve (or reject) the entry of a block that has been delivered
+     * (or found invalid), together with its dependents. */
+    void on_deliver(const uint256_t &blk_hash, const block_t &blk, bool valid);
+    size_t size() const { return pending.size(); }
+};
+
+/** State of catching up the blocks on the chain ending at `end_hash`. Chunk
+ * i holds the blocks of heights start_height + i * range_sync_chunk_size
+ * and up. A chunk is only taken in once it links to the chunk above it (the
+ * top one to `end_hash`), so the chunks are checked top-down and delivered
+ * bottom-up when all of them are in. */
+struct RangeSyncContext {
+    uint256_t end_hash;
+    /** height of the lowest block in the current request */
+    uint32_t start_height;
+    /** number of chunks in the range, as told by the first response (0 if
+     * unknown yet) */
+    uint32_t nchunk;
+    /** the next chunk to be delivered */
+    uint32_t next_chunk;
+    /** the lowest chunk known to link to `end_hash` (nchunk if none) */
+    uint32_t linked;
+    /** hash of the top block expected in the chunk below `linked` */
+    uint256_t link_hash;
+    /** whether a chunk is being verified and delivered */
+    bool delivering;
+    /** peers the range is striped across, the first one is known to have
+     * the block; the others are only asked once the range turns out to
+     * have more than one chunk */
+    std::vector<NetAddr> replicas;
+    /** chunks received ahead of the delivery */
+    std::unordered_map<uint32_t, std::vector<block_t>> chunks;
+    TimerEvent timeout;
+
+    RangeSyncContext(const uint256_t &end_hash, uint32_t start_height):
+        end_hash(end_hash), start_height(start_height),
+        nchunk(0), next_chunk(0), linked(0), link_hash(end_hash),
+        delivering(false) {}
+};
+
+/** State of relaying the votes for a block up the vote relay tree. */
+struct VoteRelayContext {
+    /** root of the tree (the proposer of the block) */
+    ReplicaID root;
+    /** number of replicas in the subtree rooted at this replica */
+    size_t nsubtree;
+    /** voters of the subtree heard of so far */
+    std::unordered_set<ReplicaID> voters;
+    /** votes collected but not forwarded to the parent yet */
+    quorum_cert_bt pending;
+    /** whether the parent has stopped waiting for the subtree as a whole,
+     * so that any late votes are forwarded right away */
+    bool flushed;
+    /** whether the proposal has been relayed to the children */
+    bool prop_relayed;
+    /** the vote of this replica, sent to the root directly if the block is
+     * still not certified when the context expires */
+    BoxObj<Vote> own_vote;
+    TimerQueue::timer_id_t flush_timer;
+    TimerQueue::timer_id_t expire_timer;
+
+    VoteRelayContext(ReplicaID root, size_t nsubtree):
+        root(root), nsubtree(nsubtree),
+        flushed(false), prop_relayed(false),
+        flush_timer(TimerQueue::null_id),
+        expire_timer(TimerQueue::null_id) {}
+};
+
+/** Chunks of a coded proposal received so far. */
+struct ProposalChunkContext {
+    /** chunks grouped by the Merkle root they were checked against, which
+     * only differ if the proposer equivocates */
+    std::unordered_map<const uint256_t,
+                    std::unordered_map<uint32_t, bytearray_t>> chunks;
+    /** roots whose chunks turned out not to decode to the proposal */
+    std::unordered_set<uint256_t> bad_roots;
+    /** whether the chunk of this replica has been forwarded */
+    bool forwarded;
+    /** whether the proposal has been recovered */
+    bool decoded;
+    ProposalChunkContext(): forwarded(false), decoded(false) {}
+};
 
 /** HotStuff protocol (with network implementation). */
 class HotStuffBase: public HotStuffCore {
@@ -155,6 +440,7 @@ class HotStuffBase: public HotStuffCore {
 
     friend BlockFetchContext;
     friend CmdFetchContext;
+    friend DeliveryScheduler;
 
     public:
     using Net = PeerNetwork<opcode_t>;
@@ -163,16 +449,91 @@ class HotStuffBase: public HotStuffCore {
     protected:
     /** the binding address in replica network */
     NetAddr listen_addr;
-    /** the block size */
+    /** the maximum number of commands in a block */
     size_t blk_size;
+    /** the maximum size of the commands in a block (in bytes) */
+    size_t blk_max_bytes;
+    /** the maximum time a command waits before a block is cut (disabled if
+     * negative) */
+    double blk_linger;
+    /** whether to tune blk_target from the observed commit latency */
+    bool blk_adaptive;
+    /** the current number of commands to cut a block at */
+    size_t blk_target;
     /** libevent handle */
     EventContext ec;
     salticidae::ThreadCall tcall;
-    VeriPool vpool;
+    /* === staged pipeline (if enabled): messages are parsed on parse_ec,
+     * the protocol runs on ec and the decisions are executed on exec_ec === */
+    bool pipelined;
+    EventContext parse_ec;
+    EventContext exec_ec;
+    BoxObj<ThreadCall> parse_tcall;
+    BoxObj<ThreadCall> exec_tcall;
+    std::thread parse_thread;
+    std::thread exec_thread;
+    stage_queue_t parse_queue;
+    stage_queue_t core_queue;
+    stage_queue_t exec_queue;
+    /** the pool owned by this replica, unless it shares another one */
+    BoxObj<VeriPool> own_vpool;
+    VeriPool &vpool;
+    /** signatures already verified, shared by votes and QCs */
+    VeriCache vcache;
     std::vector<NetAddr> peers;
-    std::unordered_map<uint32_t, TimerEvent> commit_timers;
-    TimerEvent blame_timer;
-    TimerEvent viewtrans_timer;
+    /** runtime metrics (only collected if enabled) */
+    Metrics metrics;
+    BoxObj<MetricsServer> metrics_server;
+    struct PeerMetrics {
+        MetricCounter *nsent;
+        MetricCounter *nrecv;
+        MetricCounter *nsentb;
+        MetricCounter *nrecvb;
+    };
+    std::unordered_map<NetAddr, PeerMetrics> peer_metrics;
+    MetricCounter *m_fetched;
+    MetricCounter *m_delivered;
+    MetricCounter *m_decided;
+    MetricCounter *m_rejected;
+    MetricCounter *m_view_changes;
+    MetricHistogram *m_view_change_time;
+    MetricHistogram *m_view_change_commit_time;
+    MetricHistogram *m_fetch_time;
+    MetricHistogram *m_delivery_time;
+    MetricHistogram *m_commit_lat;
+    /** commit/blame/viewtrans timers, driven by a single libevent timer */
+    TimerQueue timers;
+    std::unordered_map<uint32_t, TimerQueue::timer_id_t> commit_timers;
+    TimerQueue::timer_id_t blame_timer;
+    TimerQueue::timer_id_t viewtrans_timer;
+    /** fan-out of the relay tree for votes and proposals (0 to broadcast) */
+    size_t vote_fanout;
+    /** how long a replica waits for the votes of its subtree */
+    double vote_relay_timeout;
+    std::unordered_map<const uint256_t, BoxObj<VoteRelayContext>> vote_relay;
+    /** whether to disseminate proposals as erasure-coded chunks */
+    bool coded_proposal;
+    /** whether to broadcast proposals in the compact block encoding */
+    bool compact_proposal;
+    std::unordered_map<const uint256_t, ProposalChunkContext> chunk_waiting;
+    /** whether command payloads are disseminated through the mempool */
+    bool mempool_enabled;
+    Mempool mempool;
+    /** number of client commands to gossip at once */
+    size_t gossip_batch;
+    /** the maximum time a client command waits before it is gossiped */
+    double gossip_linger;
+    std::unordered_map<NetAddr, ReplicaID> peer_rids;
+    /** the speculated blocks not committed yet, in the chain order, with
+     * what to undo */
+    std::deque<std::pair<block_t, std::vector<Finality>>> spec_log;
+    /** whether view change messages carry the hqc chain (see
+     * set_fast_view_change()) */
+    bool fast_view_change;
+    /** time since the current view transition started */
+    ElapsedTime vc_elapsed;
+    /** whether no command has been committed since the last view change */
+    bool vc_awaiting_commit;
 
     private:
     /** whether libevent handle is owned by itself */
@@ -186,11 +547,36 @@ class HotStuffBase: public HotStuffCore {
     pacemaker_bt pmaker;
     /* queues for async tasks */
     std::unordered_map<const uint256_t, BlockFetchContext> blk_fetch_waiting;
-    std::unordered_map<const uint256_t, BlockDeliveryContext> blk_delivery_waiting;
+    std::unordered_map<const uint256_t, CmdFetchContext> cmd_fetch_waiting;
+    DeliveryScheduler dsched;
+    std::unordered_map<const uint256_t, BoxObj<RangeSyncContext>> range_sync_waiting;
     std::unordered_map<const uint256_t, commit_cb_t> decision_waiting;
     using cmd_queue_t = salticidae::MPSCQueueEventDriven<std::pair<uint256_t, commit_cb_t>>;
     cmd_queue_t cmd_pending;
     std::queue<uint256_t> cmd_pending_buffer;
+    TimerEvent linger_timer;
+    using cmd_arrival_queue_t = salticidae::MPSCQueueEventDriven<command_t>;
+    /** payloads of the commands from the clients */
+    cmd_arrival_queue_t cmd_arrived;
+    /** commands to be proposed once their payloads are here */
+    std::unordered_set<uint256_t> cmd_awaiting_payload;
+    /** commands queued to be proposed by itself and not decided yet */
+    std::unordered_set<uint256_t> cmd_queued;
+    /** the maximum number of commands waiting for a decision (unlimited if
+     * zero) */
+    size_t max_waiting;
+    /** the recently decided commands */
+    RecentFilter recent_decided;
+    TimerEvent gossip_timer;
+    /** when each of the blocks proposed by itself was proposed */
+    std::unordered_map<const uint256_t, ElapsedTime> blk_proposed;
+    /** moving average of the commit latency of own blocks */
+    double commit_lat_avg;
+    /** minimum of the commit latency over this window of own blocks and the
+     * one before, so that a lasting rise becomes the new baseline */
+    double commit_lat_min;
+    double commit_lat_min_cur;      /**< over this window only */
+    uint32_t commit_lat_nsamples;   /**< in this window */
 
     /* statistics */
     uint64_t fetched;
@@ -232,34 +618,136 @@ class HotStuffBase: public HotStuffCore {
     void on_fetch_cmd(const command_t &cmd);
     void on_fetch_blk(const block_t &blk);
     void on_deliver_blk(const block_t &blk);
+    /** Request the stripes [first, last) of the range. */
+    void range_sync_send(RangeSyncContext &ctx, uint32_t first, uint32_t last);
+    void range_sync_link(RangeSyncContext &ctx);
+    void range_sync_deliver(const uint256_t &end_hash);
+    void range_sync_finish(const uint256_t &end_hash);
+    void start_pipeline();
+    /** Parse the message on the parsing stage (or in place if the pipeline
+     * is disabled), then continue with `cont` on the consensus thread. */
+    template<typename M, typename Func>
+    void parse_msg(M &&msg, Func cont) {
+        if (!pipelined)
+        {
+            msg.postponed_parse(this);
+            cont(msg);
+            return;
+        }
+        ArcObj<M> m(new M(std::move(msg)));
+        parse_queue.enqueue([this, m, cont]() {
+            m->postponed_parse(this);
+            core_queue.enqueue([m, cont]() { cont(*m); });
+        });
+    }
+    void cut_blk();
+    /** Queue the command to be proposed, return true if a block was cut. */
+    bool queue_proposal_cmd(const uint256_t &cmd_hash);
+    void on_blk_committed(const block_t &blk);
+    void on_client_cmd(const command_t &cmd);
+    void gossip_flush();
+    /** Returns a promise resolved when the payloads of all commands in the
+     * block are available, fetching the missing ones from `replica` in
+     * bulk. */
+    promise_t async_fetch_cmds(const block_t &blk, const NetAddr &replica);
 
     /** deliver consensus message: <propose> */
     inline void propose_handler(MsgPropose &&, const Net::conn_t &);
+    /** receive one chunk of a coded proposal */
+    inline void propose_chunk_handler(MsgProposeChunk &&, const Net::conn_t &);
+    inline void propose_compact_handler(MsgProposeCompact &&, const Net::conn_t &);
+    void on_proposal_parsed(Proposal &prop, const NetAddr &peer);
+    void broadcast_coded_proposal(const Proposal &prop);
+    void broadcast_compact_proposal(const Proposal &prop);
+    void try_decode_proposal(const MsgProposeChunk &msg);
+    /** Give up on the chunks of `root` and fetch the block in full. */
+    void on_decode_proposal_failed(const uint256_t &blk_hash,
+                                const uint256_t &root, const NetAddr &proposer);
+    void chunk_waiting_expire(const uint256_t &blk_hash);
     /** deliver consensus message: <vote> */
     inline void vote_handler(MsgVote &&, const Net::conn_t &);
     inline void notify_handler(MsgNotify &&, const Net::conn_t &);
     inline void blame_handler(MsgBlame &&, const Net::conn_t &);
     inline void blamenotify_handler(MsgBlameNotify &&, const Net::conn_t &);
+    /** deliver the votes aggregated by a subtree of the relay tree */
+    inline void agg_vote_handler(MsgAggVote &&, const Net::conn_t &);
 
     /** fetches full block data */
     inline void req_blk_handler(MsgReqBlock &&, const Net::conn_t &);
     /** receives a block */
     inline void resp_blk_handler(MsgRespBlock &&, const Net::conn_t &);
+    /** fetches command payloads */
+    inline void req_cmds_handler(MsgReqCmds &&, const Net::conn_t &);
+    /** receives command payloads */
+    inline void resp_cmds_handler(MsgRespCmds &&, const Net::conn_t &);
+    /** fetches a range of blocks on a chain */
+    inline void req_blk_range_handler(MsgReqBlockRange &&, const Net::conn_t &);
+    /** receives a chunk of a range of blocks */
+    inline void resp_blk_range_handler(MsgRespBlockRange &&, const Net::conn_t &);
 
     inline bool conn_handler(const salticidae::ConnPool::conn_t &, bool);
+    template<typename M>
+    void send_msg(M &&m, const NetAddr &addr) {
+        if (metrics.is_enabled())
+            count_msg(addr, m.serialized.size(), true);
+        pn.send_msg(std::forward<M>(m), addr);
+    }
+
+    template<typename M>
+    void count_recv(const M &m, const Net::conn_t &conn) {
+        if (metrics.is_enabled())
+            count_msg(conn->get_peer_addr(), m.serialized.size(), false);
+    }
+
+    void count_msg(const NetAddr &addr, size_t nbytes, bool sent);
+
+    /* === vote relay tree: replica (root + i) % n sits at position i of a
+     * complete vote_fanout-ary tree rooted at the proposer === */
+    size_t tree_pos(ReplicaID rid, ReplicaID root);
+    ReplicaID tree_rid(size_t pos, ReplicaID root);
+    size_t tree_subtree_size(size_t pos);
+    void relay_proposal(const Proposal &prop, ReplicaID root);
+    VoteRelayContext &get_vote_relay(const uint256_t &blk_hash, ReplicaID root);
+    void relay_vote(const Vote &vote);
+    void vote_relay_flush(const uint256_t &blk_hash, VoteRelayContext &ctx);
+    void vote_relay_expire(const uint256_t &blk_hash);
+    void init_metrics();
+    void reg_view_change_metric();
+    void reg_view_trans_metric();
+    /** the uncommitted blocks up to `blk`, oldest first */
+    std::vector<block_t> get_chain_suffix(const block_t &blk);
+    /** add the blocks carried by a view change message */
+    void add_inline_blks(std::vector<block_t> &blks);
+
     template<typename T, typename M>
     void _do_broadcast(const T &t) {
         //M m(t);
-        pn.multicast_msg(M(t), peers);
+        M m(t);
+        if (metrics.is_enabled())
+            for (const auto &replica: peers)
+                count_msg(replica, m.serialized.size(), true);
+        pn.multicast_msg(std::move(m), peers);
         //for (const auto &replica: peers)
         //    pn.send_msg(m, replica);
     }
 
     void do_broadcast_proposal(const Proposal &prop) override {
-        _do_broadcast<Proposal, MsgPropose>(prop);
+        if (coded_proposal)
+            broadcast_coded_proposal(prop);
+        else if (vote_fanout)
+            relay_proposal(prop, get_id());
+        else if (compact_proposal)
+            broadcast_compact_proposal(prop);
+        else
+            _do_broadcast<Proposal, MsgPropose>(prop);
     }
 
     void do_broadcast_vote(const Vote &vote) override {
+        if (vote_fanout)
+        {
+            relay_vote(vote);
+            return;
+        }
 #ifdef SYNCHS_NOVOTEBROADCAST
         pmaker->beat_resp(0)
                 .then([this, vote](ReplicaID proposer) {
@@ -269,7 +757,7 @@ class HotStuffBase: public HotStuffCore {
                 //on_receive_vote(vote);
             }
             else
-                pn.send_msg(MsgVote(vote), get_config().get_addr(proposer));
+                send_msg(MsgVote(vote), get_config().get_addr(proposer));
         });
 #else
         _do_broadcast<Vote, MsgVote>(vote);
@@ -281,9 +769,7 @@ class HotStuffBase: public HotStuffCore {
         _do_broadcast<Blame, MsgBlame>(blame);
     }
 
-    void do_broadcast_blamenotify(const BlameNotify &bn) override {
-        _do_broadcast<BlameNotify, MsgBlameNotify>(bn);
-    }
+    void do_broadcast_blamenotify(const BlameNotify &bn) override;
 
     void do_notify(const Notify &notify) override;
 
@@ -295,16 +781,41 @@ class HotStuffBase: public HotStuffCore {
     void set_viewtrans_timer(double t_sec) override;
     void stop_viewtrans_timer() override;
 
-    void do_decide(Finality &&) override;
+    void do_decide_batch(const block_t &blk) override;
+    void do_speculate(const block_t &blk) override;
+    void do_rollback(const block_t &blk) override;
+    /** run a task on the execution context, in order */
+    void run_exec(std::function<void()> &&exec);
     void do_consensus(const block_t &blk) override;
 
     protected:
 
     /** Called to replicate the execution of a command, the application should
-     * implement this to make transition for the application state. */
+     * implement this to make transition for the application state. With the
+     * pipeline enabled, this is called on the execution thread. */
     virtual void state_machine_execute(const Finality &) = 0;
+    /** Called to replicate the execution of all commands in a committed block,
+     * given in order. The default calls state_machine_execute() for each. */
+    virtual void state_machine_execute_batch(const std::vector<Finality> &fins) {
+        for (const auto &fin: fins) state_machine_execute(fin);
+    }
+    /** Called after the callbacks of exec_command() have been invoked for a
+     * committed block (or a resubmitted command), in the same context as
+     * state_machine_execute_batch(), e.g. to flush the buffered responses. */
+    virtual void state_machine_respond_batch() {}
+    /** Called (if speculative) to execute the commands of a certified block
+     * ahead of its commit, given in order. The block is either undone by
+     * state_machine_rollback_batch() or committed later, which still calls
+     * state_machine_execute_batch() for it. */
+    virtual void state_machine_speculate_batch(const std::vector<Finality> &) {}
+    /** Called to undo the last state_machine_speculate_batch() (the
+     * Finality objects are the same). */
+    virtual void state_machine_rollback_batch(const std::vector<Finality> &) {}
 
     public:
+    /** If `shared_vpool` is given, the signatures are verified by that pool
+     * (which must be driven by the same event context) instead of a pool of
+     * its own with `nworker` threads. */
     HotStuffBase(uint32_t blk_size,
             ReplicaID rid,
             privkey_bt &&priv_key,
@@ -312,21 +823,91 @@ class HotStuffBase: public HotStuffCore {
             pacemaker_bt pmaker,
             EventContext ec,
             size_t nworker,
-            const Net::Config &netconfig);
+            const Net::Config &netconfig,
+            VeriPool *shared_vpool = nullptr);
 
     ~HotStuffBase();
 
     /* the API for HotStuffBase */
 
-    /* Submit the command to be decided. */
+    /* Submit the command to be decided. If speculative (see
+     * set_speculative()), the callback is first invoked with a tentative
+     * Finality once the command is speculatively executed. */
     void exec_command(uint256_t cmd_hash, commit_cb_t callback);
+    /** Configure how the proposer batches commands into blocks: a block is
+     * cut when it reaches the target number of commands (at most blk_size),
+     * max_bytes worth of commands, or when the oldest pending command has
+     * waited for linger seconds. If adaptive is set, the target is tuned by
+     * the queue depth and the commit latency. Should be called before
+     * start(). */
+    void set_batching(size_t max_bytes, double linger, bool adaptive);
+    /** Run message parsing and command execution on their own threads, so
+     * that neither blocks the protocol. Should be called before start(). */
+    void set_pipelined(bool enabled);
+    /** Disseminate the proposals and collect the votes through a tree of
+     * the given fan-out rooted at the proposer, instead of broadcasting
+     * them. Each replica aggregates the votes of its subtree before
+     * forwarding them to its parent, waiting for at most `timeout` seconds.
+     * A fan-out of 0 disables the tree. Should be called before start(). */
+    void set_vote_relay(size_t fanout, double timeout);
+    /** Send each replica one Reed-Solomon coded chunk of a proposal, which
+     * it forwards to the others, instead of sending the whole proposal to
+     * everyone. Any n - nmajority chunks recover the proposal, so the
+     * proposer sends about twice the size of the block in total. Should be
+     * called before start(). */
+    void set_coded_proposal(bool enabled);
+    /** Broadcast the proposals in the compact block encoding. With the
+     * mempool enabled, the commands all replicas are known to have are sent
+     * as 8-byte short IDs. Proposals going through the coded or the relay
+     * dissemination are unaffected. Should be called before start(). */
+    void set_compact_proposal(bool enabled);
+    /** Attach the uncommitted chain ending at the hqc block to BlameNotify
+     * and Notify, so that no replica has to fetch the hqc blocks of the
+     * others. A replica enters the view transition as soon as the blame is
+     * verified, and learns the hqc of each blamer during the 2 delta wait,
+     * which also leaves the incoming proposer with the blocks delivered and
+     * their certificates verified before the notifications arrive. */
+    void set_fast_view_change(bool enabled);
+    /** Store the payloads of the commands given to add_cmd() and gossip them
+     * to the other replicas in batches of `batch` commands (or after
+     * `linger` seconds), fetching the missing ones of a proposal in bulk
+     * before voting for it. The proposer only proposes the commands it has
+     * the payloads of. Should be called before start(). */
+    void set_mempool(size_t batch, double linger);
+    /** As the proposer, admit at most `max_waiting` commands waiting for a
+     * decision (unlimited if zero), answering those beyond with decision -1
+     * for the client to back off and resubmit them later (the others keep
+     * them, to answer once they are decided). The resubmissions of the
+     * last `nrecent` decided commands are answered with decision
+     * 0, like those still waiting, instead of being proposed again (no
+     * filtering if zero, see RecentFilter). Should be called before
+     * start(). */
+    void set_admission(size_t max_waiting, size_t nrecent);
+    /** Add the payload of a command from a client to the mempool (no-op if
+     * the mempool is disabled). Can be called from any thread. */
+    void add_cmd(const command_t &cmd);
+    /** Stop the pipeline threads. The application should call this before
+     * tearing down the state used by state_machine_execute(). */
+    void stop_pipeline();
+    /** Serve the metrics over HTTP at `addr` (see MetricsServer), `token`
+     * being required to switch the collection on and off. */
+    void start_metrics_server(const NetAddr &addr, const std::string &token = "");
+    Metrics &get_metrics() { return metrics; }
     void start(std::vector<std::tuple<NetAddr, pubkey_bt, uint256_t>> &&replicas,
                 double delta, bool ec_loop = false);
 
     size_t size() const { return peers.size(); }
     const auto &get_decision_waiting() const { return decision_waiting; }
+    /** Queue all commands waiting for a decision to be proposed again (upon
+     * election), and take the first block of them. The rest are cut into
+     * blocks as usual, each following the QC of the previous one. */
+    std::vector<uint256_t> requeue_waiting();
     ThreadCall &get_tcall() { return tcall; }
     PaceMaker *get_pace_maker() { return pmaker.get(); }
+    VeriPool &get_veripool() { return vpool; }
+    /** Propose the pending commands now (an empty block if there is none),
+     * without waiting for the batch to fill up. No-op if not the proposer. */
+    void flush_blk() { cut_blk(); }
     void print_stat() const;
     virtual void do_elected() {}
 #ifdef SYNCHS_AUTOCLI
@@ -340,6 +921,10 @@ class HotStuffBase: public HotStuffCore {
     promise_t async_fetch_blk(const uint256_t &blk_hash, const NetAddr *replica_id, bool fetch_now = true);
     /** Returns a promise resolved (with block_t blk) when Block is delivered (i.e. prefix is fetched). */
     promise_t async_deliver_blk(const uint256_t &blk_hash,  const NetAddr &replica_id);
+    /** Returns a promise resolved (with block_t blk) when Block is delivered.
+     * Unlike async_deliver_blk(), the missing prefix is fetched in
+     * pipelined chunks of consecutive blocks, from several peers at a time. */
+    promise_t async_sync_blk(const uint256_t &blk_hash, const NetAddr &replica_id);
 };
 
 /** HotStuff protocol (templated by cryptographic implementation). */
@@ -370,11 +955,17 @@ class HotStuff: public HotStuffBase {
     }
 
     quorum_cert_bt parse_quorum_cert(DataStream &s) override {
-        QuorumCert *qc = new QuorumCertType();
+        QuorumCert *qc = new QuorumCertType(get_config(), uint256_t());
         s >> *qc;
         return qc;
     }
 
+    quorum_cert_bt parse_quorum_cert_compact(DataStream &s, const uint256_t &obj_hash) override {
+        QuorumCert *qc = new QuorumCertType(get_config(), uint256_t());
+        qc->unserialize_compact(s, obj_hash);
+        return qc;
+    }
+
     public:
     HotStuff(uint32_t blk_size,
             ReplicaID rid,
@@ -383,7 +974,8 @@ class HotStuff: public HotStuffBase {
             pacemaker_bt pmaker,
             EventContext ec = EventContext(),
             size_t nworker = 4,
-            const Net::Config &netconfig = Net::Config()):
+            const Net::Config &netconfig = Net::Config(),
+            VeriPool *shared_vpool = nullptr):
         HotStuffBase(blk_size,
                     rid,
                     new PrivKeyType(raw_privkey),
@@ -391,7 +983,8 @@ class HotStuff: public HotStuffBase {
                     std::move(pmaker),
                     ec,
                     nworker,
-                    netconfig) {}
+                    netconfig,
+                    shared_vpool) {}
 
     void start(const std::vector<std::tuple<NetAddr, bytearray_t, bytearray_t>> &replicas,
                 double delta, bool ec_loop = false) {
@@ -410,6 +1003,10 @@ class HotStuff: public HotStuffBase {
 using HotStuffNoSig = HotStuff<>;
 using HotStuffSecp256k1 = HotStuff<PrivKeySecp256k1, PubKeySecp256k1,
                                     PartCertSecp256k1, QuorumCertSecp256k1>;
+#ifdef HOTSTUFF_ENABLE_BLS
+using HotStuffBLS = HotStuff<PrivKeyBLS, PubKeyBLS,
+                            PartCertBLS, QuorumCertBLS>;
+#endif
 
 template<EntityType ent_type>
 FetchContext<ent_type>::FetchContext(FetchContext && other):
@@ -417,7 +1014,8 @@ FetchContext<ent_type>::FetchContext(FetchContext && other):
         hs(other.hs),
         fetch_msg(std::move(other.fetch_msg)),
         ent_hash(other.ent_hash),
-        replica_ids(std::move(other.replica_ids)) {
+        replica_ids(std::move(other.replica_ids)),
+        elapsed(std::move(other.elapsed)) {
     other.timeout.del();
     timeout = TimerEvent(hs->ec,
             std::bind(&FetchContext::timeout_cb, this, _1));
@@ -446,6 +1044,7 @@ FetchContext<ent_type>::FetchContext(
             promise_t([](promise_t){}),
             hs(hs), ent_hash(ent_hash) {
     fetch_msg = std::vector<uint256_t>{ent_hash};
+    elapsed.start();
 
     timeout = TimerEvent(hs->ec,
             std::bind(&FetchContext::timeout_cb, this, _1));
@@ -455,7 +1054,14 @@ FetchContext<ent_type>::FetchContext(
 template<EntityType ent_type>
 void FetchContext<ent_type>::send(const NetAddr &replica_id) {
     hs->part_fetched_replica[replica_id]++;
-    hs->pn.send_msg(fetch_msg, replica_id);
+    hs->send_msg(fetch_msg, replica_id);
+}
+
+template<EntityType ent_type>
+void FetchContext<ent_type>::send_all() {
+    for (const auto &replica_id: replica_ids)
+        send(replica_id);
+    reset_timeout();
 }
 
 template<EntityType ent_type>
@@ -18,6 +18,10 @@
 #ifndef _HOTSTUFF_LIVENESS_H
 #define _HOTSTUFF_LIVENESS_H
 
+#include <chrono>
+#include <cmath>
+#include <map>
+
 #include "salticidae/util.h"
 #include "hotstuff/hotstuff.h"
 
@@ -53,6 +57,8 @@ class PaceMaker {
     virtual void impeach() {}
     virtual void on_consensus(const block_t &) {}
     virtual size_t get_pending_size() = 0;
+    /** Get the extra data to be carried by a new block. */
+    virtual bytearray_t get_extra() { return bytearray_t(); }
 };
 
 using pacemaker_bt = BoxObj<PaceMaker>;
@@ -64,11 +70,7 @@ class PMHighTail: public virtual PaceMaker {
     const int32_t parent_limit;         /**< maximum number of parents */
 
     bool check_ancestry(const block_t &_a, const block_t &_b) {
-        block_t b;
-        for (b = _b;
-            b->get_height() > _a->get_height();
-            b = b->get_parents()[0]);
-        return b == _a;
+        return hsc->is_ancestor(_a, _b);
     }
     
     void reg_hqc_update() {
@@ -343,13 +345,10 @@ class PMRoundRobinProposer: virtual public PaceMaker {
             auto hs = static_cast<hotstuff::HotStuffBase *>(hsc);
             hs->do_elected();
             hs->get_tcall().async_call([this, hs](salticidae::ThreadCall::Handle &) {
-                auto &pending = hs->get_decision_waiting();
-                if (!pending.size()) return;
+                if (hs->get_decision_waiting().empty()) return;
                 HOTSTUFF_LOG_PROTO("reproposing pending commands");
-                std::vector<uint256_t> cmds;
-                for (auto &p: pending)
-                    cmds.push_back(p.first);
-                do_new_consensus(0, cmds);
+                /* one block's worth now, the rest follow as usual */
+                do_new_consensus(0, hs->requeue_waiting());
             });
         }
     }
@@ -369,11 +368,13 @@ class PMRoundRobinProposer: virtual public PaceMaker {
     }
 
     public:
+    /** The replicas take turns from `init_proposer` on. */
     PMRoundRobinProposer(const EventContext &ec,
-                        double base_timeout, double prop_delay):
+                        double base_timeout, double prop_delay,
+                        ReplicaID init_proposer = 0):
         base_timeout(base_timeout),
         prop_delay(prop_delay),
-        ec(ec), proposer(0), rotating(false) {}
+        ec(ec), proposer(init_proposer), rotating(false) {}
 
     size_t get_pending_size() override { return pending_beats.size(); }
 
@@ -409,9 +410,10 @@ class PMRoundRobinProposer: virtual public PaceMaker {
 
 struct PaceMakerRR: public PMHighTail, public PMRoundRobinProposer {
     PaceMakerRR(EventContext ec, int32_t parent_limit,
-                double base_timeout = 1, double prop_delay = 1):
+                double base_timeout = 1, double prop_delay = 1,
+                ReplicaID init_proposer = 0):
         PMHighTail(parent_limit),
-        PMRoundRobinProposer(ec, base_timeout, prop_delay) {}
+        PMRoundRobinProposer(ec, base_timeout, prop_delay, init_proposer) {}
 
     void init(HotStuffCore *hsc) override {
         PaceMaker::init(hsc);
@@ -420,6 +422,383 @@ struct PaceMakerRR: public PMHighTail, public PMRoundRobinProposer {
     }
 };
 
+/**
+ * Long-standing proposer that is only replaced when it falls short of the
+ * throughput and latency SLOs.
+ *
+ * The proposer stamps its blocks with its ID, the view and a local
+ * timestamp, signed together with the parent, which record on the chain the
+ * block interval (about the round trip from the proposer to a quorum) of
+ * each past proposer. A replica that
+ * finds the current proposer missing the SLOs over a window blames it, and
+ * once enough replicas do, the view changes and the next proposer is the one
+ * with the shortest expected block interval, inflated by the reputation it
+ * lost each time it was replaced.
+ *
+ * The choice only depends on the new view, the proposers of the past views
+ * and the last `nhistory` blocks of the chain up to the highest certified
+ * block taken into the view (the highest one carried by the view change), so
+ * the replicas that enter the view with the same hqc pick the same proposer.
+ * Under synchrony the honest replicas do, unless a faulty one withholds a
+ * higher QC from some of them; a wrong pick then costs one more view change.
+ * The chain kept (or archived) should reach `nhistory` blocks below the hqc,
+ * i.e., the prune staleness must not be smaller than that.
+ *
+ * The proposers of the past views are taken from the stamps on that chain,
+ * which a replica cannot sign for another one, so a replica that once picks
+ * differently agrees again as soon as the chain shows who led. Only the
+ * views that left no block on the chain fall back to the local pick. The
+ * views named along the chain must not go down, but a faulty proposer may
+ * still claim an earlier view that left no block (taking its penalty), and
+ * the timestamps themselves are the proposer's own word. */
+class PMReputationProposer: virtual public PaceMaker {
+    public:
+    struct SLO {
+        /** minimum number of commands committed per second under load (0 to
+         * disable) */
+        double min_rate;
+        /** maximum time from receiving a proposal to committing it (0 to
+         * disable) */
+        double max_latency;
+        /** the period over which the SLOs are checked */
+        double window;
+    };
+
+    /** number of blocks below the hqc used for the scores */
+    static const uint32_t nhistory = 256;
+    /** number of past views whose proposers are still penalized */
+    static const uint32_t nhistory_views = 64;
+
+    private:
+    struct LeaderStat {
+        /** moving average of the time between its blocks, in chain order */
+        double interval;
+        uint32_t nsamples;
+        /** reputation lost by being replaced, halves with each view */
+        double penalty;
+        LeaderStat(): interval(0), nsamples(0), penalty(0) {}
+    };
+
+    struct Stamp {
+        ReplicaID rid;
+        uint32_t view;
+        uint64_t ts;
+        bool valid;
+    };
+
+    EventContext ec;
+    SLO slo;
+    /** the proposer it believes */
+    ReplicaID proposer;
+    /** the proposer of each recent view, as seen on the chain (or picked
+     * locally if the view left no block there) */
+    std::map<uint32_t, ReplicaID> leaders;
+    /** the stamps already checked, by block hash */
+    std::unordered_map<uint256_t, Stamp> stamps_checked;
+    /** expected block interval of each replica before it has led */
+    std::vector<double> latency_hint;
+    TimerEvent slo_timer;
+    /* local observations of the current proposer in this window */
+    size_t win_ncmds;
+    size_t win_nblks;
+    double win_lat_sum;
+    std::unordered_map<block_t, double> recv_time;
+
+    /* extra state needed for a proposer */
+    std::queue<promise_t> pending_beats;
+    block_t last_proposed;
+    bool locked;
+    promise_t pm_qc_finish;
+    promise_t pm_wait_propose;
+
+    static double now() {
+        using namespace std::chrono;
+        return duration<double>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    static uint256_t stamp_obj_hash(ReplicaID rid, uint32_t view, uint64_t ts,
+                                    const uint256_t &parent_hash) {
+        DataStream p;
+        p << (uint8_t)ProofType::STAMP << htole((uint32_t)rid) << htole(view)
+            << htole(ts) << parent_hash;
+        return p.get_hash();
+    }
+
+    /** Parse the stamp of a block, which only counts if it is signed by
+     * the replica it names, for the parent of the block. */
+    const Stamp &parse_stamp(const block_t &blk) {
+        auto it = stamps_checked.find(blk->get_hash());
+        if (it != stamps_checked.end()) return it->second;
+        if (stamps_checked.size() >= 4 * nhistory) stamps_checked.clear();
+        Stamp &st = stamps_checked[blk->get_hash()];
+        st.valid = false;
+        const auto &extra = blk->get_extra();
+        const auto &parent_hashes = blk->get_parent_hashes();
+        if (extra.size() <= 2 * sizeof(uint32_t) + sizeof(uint64_t) ||
+            parent_hashes.empty())
+            return st;
+        DataStream s(extra);
+        uint32_t _rid;
+        s >> _rid >> st.view >> st.ts;
+        st.rid = letoh(_rid);
+        st.view = letoh(st.view);
+        st.ts = letoh(st.ts);
+        if (st.rid >= hsc->get_config().nreplicas) return st;
+        try {
+            part_cert_bt cert = hsc->parse_part_cert(s);
+            st.valid = s.size() == 0 &&
+                cert->get_obj_hash() == stamp_obj_hash(st.rid, st.view, st.ts,
+                                                        parent_hashes[0]) &&
+                cert->verify(hsc->get_config().get_pubkey(st.rid));
+        } catch (std::exception &) {}
+        return st;
+    }
+
+    void reg_receive_proposal() {
+        hsc->async_wait_receive_proposal().then([this](const Proposal &prop) {
+            if (prop.proposer == proposer)
+                recv_time.insert(std::make_pair(prop.blk, now()));
+            reg_receive_proposal();
+        });
+    }
+
+    void reg_view_change() {
+        hsc->async_wait_view_change().then([this](uint32_t view) {
+            on_new_view(view);
+            reg_view_change();
+        });
+    }
+
+    void proposer_schedule_next() {
+        if (!pending_beats.empty() && !locked)
+        {
+            auto pm = pending_beats.front();
+            pending_beats.pop();
+            pm_qc_finish.reject();
+            (pm_qc_finish = hsc->async_qc_finish(last_proposed))
+                .then([this, pm]() {
+                    pm.resolve(proposer);
+                });
+            locked = true;
+        }
+    }
+
+    void proposer_update_last_proposed() {
+        pm_wait_propose.reject();
+        (pm_wait_propose = hsc->async_wait_proposal()).then(
+                [this](const Proposal &prop) {
+            last_proposed = prop.blk;
+            locked = false;
+            proposer_schedule_next();
+            proposer_update_last_proposed();
+        });
+    }
+
+    void reset_window() {
+        win_ncmds = 0;
+        win_nblks = 0;
+        win_lat_sum = 0;
+    }
+
+    /** expected block interval of a replica if it takes over (lower is
+     * better) */
+    double get_score(ReplicaID rid, const LeaderStat &st) const {
+        double interval = st.nsamples ? st.interval :
+                        (rid < latency_hint.size() ? latency_hint[rid] : 0);
+        return interval * (1 + st.penalty) + st.penalty * slo.window;
+    }
+
+    /** Gather the stats for `view` from the chain up to `tail`, taking the
+     * proposers of the past views found there into `leaders`. */
+    std::vector<LeaderStat> get_stats(uint32_t view, block_t tail) {
+        std::vector<LeaderStat> stats(hsc->get_config().nreplicas);
+        /* walk down the main chain (past the pruned blocks via the archive) */
+        std::vector<Stamp> stamps;
+        uint32_t max_view = view - 1;
+        for (uint32_t i = 0; tail != nullptr && i < nhistory; i++)
+        {
+            const Stamp &st = parse_stamp(tail);
+            if (st.valid && st.view <= max_view)
+            {
+                stamps.push_back(st);
+                max_view = st.view;
+            }
+            if (!tail->get_parents().empty())
+                tail = tail->get_parents()[0];
+            else if (tail->get_parent_hashes().empty())
+                break;
+            else
+                tail = hsc->storage->find_blk(tail->get_parent_hashes()[0]);
+        }
+        /* the lowest stamp of a view tells its proposer */
+        for (const auto &st: stamps)
+            if (leaders.empty() || st.view >= leaders.begin()->first)
+                leaders[st.view] = st.rid;
+        /* the proposer replaced at view u loses 2^-(view - 1 - u) */
+        for (const auto &l: leaders)
+            if (l.first < view && l.second < stats.size())
+                stats[l.second].penalty +=
+                    std::ldexp(1.0, -(int)(view - 1 - l.first));
+        /* only the blocks within one term tell the interval */
+        for (size_t i = stamps.size(); i > 1; i--)
+        {
+            const auto &a = stamps[i - 1], &b = stamps[i - 2];
+            if (a.rid != b.rid || a.view != b.view || b.ts <= a.ts) continue;
+            auto &st = stats[b.rid];
+            double dt = (b.ts - a.ts) / 1e3;
+            st.interval = st.nsamples ? 0.8 * st.interval + 0.2 * dt : dt;
+            st.nsamples++;
+        }
+        return std::move(stats);
+    }
+
+    void on_new_view(uint32_t view) {
+        leaders[view - 1] = proposer;
+        auto stats = get_stats(view, hsc->get_hqc());
+        while (leaders.size() > nhistory_views)
+            leaders.erase(leaders.begin());
+        /* the ties go round-robin from the replaced proposer */
+        size_t n = stats.size();
+        ReplicaID next = proposer;
+        double best = double_inf;
+        for (size_t i = 1; i < n; i++)
+        {
+            ReplicaID rid = (proposer + i) % n;
+            double score = get_score(rid, stats[rid]);
+            if (score < best)
+            {
+                best = score;
+                next = rid;
+            }
+        }
+        HOTSTUFF_LOG_PROTO("Pacemaker: view %u, replace %d with %d",
+                            view, proposer, next);
+        proposer = next;
+        leaders[view] = proposer;
+        recv_time.clear();
+        reset_window();
+        elect();
+    }
+
+    void elect() {
+        pm_qc_finish.reject();
+        pm_wait_propose.reject();
+        locked = false;
+        last_proposed = hsc->get_genesis();
+        proposer_update_last_proposed();
+        if (proposer != hsc->get_id()) return;
+        auto hs = static_cast<hotstuff::HotStuffBase *>(hsc);
+        hs->do_elected();
+        hs->get_tcall().async_call([this, hs](salticidae::ThreadCall::Handle &) {
+            if (hs->get_decision_waiting().empty()) return;
+            HOTSTUFF_LOG_PROTO("reproposing pending commands");
+            /* one block's worth now, the rest follow as usual */
+            hsc->on_propose(hs->requeue_waiting(), get_parents(), get_extra());
+        });
+    }
+
+    void on_slo_timeout(TimerEvent &) {
+        auto hs = static_cast<hotstuff::HotStuffBase *>(hsc);
+        bool loaded = !recv_time.empty() || !hs->get_decision_waiting().empty();
+        if (proposer != hsc->get_id() && loaded)
+        {
+            double rate = win_ncmds / slo.window;
+            double lat = win_nblks ? win_lat_sum / win_nblks : 0;
+            if ((slo.min_rate > 0 && rate < slo.min_rate) ||
+                (slo.max_latency > 0 && lat > slo.max_latency))
+            {
+                HOTSTUFF_LOG_INFO("proposer %d misses the SLOs "
+                                "(%.1f cmd/s, %.3f sec), blaming",
+                                proposer, rate, lat);
+                hsc->on_blame_timeout();
+            }
+        }
+        reset_window();
+        slo_timer.add(slo.window);
+    }
+
+    protected:
+    void on_consensus(const block_t &blk) override {
+        auto it = recv_time.find(blk);
+        if (it == recv_time.end()) return;
+        win_ncmds += blk->get_cmds().size();
+        win_lat_sum += now() - it->second;
+        win_nblks++;
+        recv_time.erase(it);
+    }
+
+    public:
+    PMReputationProposer(const EventContext &ec, const SLO &slo):
+        ec(ec), slo(slo), proposer(0) {}
+
+    /** Set the expected block interval of each replica as the proposer
+     * (e.g., estimated from the round trips between the regions), used
+     * until the replica has led. */
+    void set_latency_hint(const std::vector<double> &hint) {
+        latency_hint = hint;
+    }
+
+    size_t get_pending_size() override { return pending_beats.size(); }
+
+    void init() {
+        leaders[hsc->get_view()] = proposer;
+        reset_window();
+        reg_receive_proposal();
+        reg_view_change();
+        slo_timer = TimerEvent(ec, salticidae::generic_bind(
+                        &PMReputationProposer::on_slo_timeout, this, _1));
+        slo_timer.add(slo.window);
+        elect();
+    }
+
+    ReplicaID get_proposer() override {
+        return proposer;
+    }
+
+    promise_t beat() override {
+        if (proposer == hsc->get_id())
+        {
+            promise_t pm;
+            pending_beats.push(pm);
+            proposer_schedule_next();
+            return std::move(pm);
+        }
+        else
+            return promise_t([proposer=proposer](promise_t &pm) {
+                pm.resolve(proposer);
+            });
+    }
+
+    promise_t beat_resp(ReplicaID last_proposer) override {
+        return promise_t([last_proposer](promise_t &pm) {
+            pm.resolve(last_proposer);
+        });
+    }
+
+    bytearray_t get_extra() override {
+        uint64_t ts = now() * 1e3;
+        ReplicaID rid = hsc->get_id();
+        uint32_t view = hsc->get_view();
+        uint256_t parent_hash = get_parents()[0]->get_hash();
+        DataStream s;
+        s << htole((uint32_t)rid) << htole(view) << htole(ts)
+            << *hsc->sign(stamp_obj_hash(rid, view, ts, parent_hash));
+        return std::move(s);
+    }
+};
+
+struct PaceMakerReputation: public PMHighTail, public PMReputationProposer {
+    PaceMakerReputation(EventContext ec, int32_t parent_limit, const SLO &slo):
+        PMHighTail(parent_limit),
+        PMReputationProposer(ec, slo) {}
+
+    void init(HotStuffCore *hsc) override {
+        PaceMaker::init(hsc);
+        PMHighTail::init();
+        PMReputationProposer::init();
+    }
+};
+
 }
 
 #endif
@@ -0,0 +1,109 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HOTSTUFF_MEMPOOL_H
+#define _HOTSTUFF_MEMPOOL_H
+
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "hotstuff/type.h"
+
+namespace hotstuff {
+
+/** Bookkeeping for the command payloads disseminated among the replicas
+ * ahead of (and apart from) the ordering: the payloads themselves live in
+ * the command cache of EntityStorage, while the mempool records which of
+ * the replicas are known to have each uncommitted command, and which of the
+ * commands received from the clients are still to be gossiped. */
+class Mempool {
+    size_t nreplicas;
+    /** replicas known to have each of the uncommitted commands */
+    std::unordered_map<const uint256_t, std::vector<bool>> known;
+    /** commands from the clients not gossiped yet */
+    std::vector<uint256_t> outbox;
+    /** the uncommitted commands by their short IDs (see
+     * Block::get_short_id()), null for the IDs shared by several of them */
+    std::unordered_map<uint64_t, uint256_t> short_ids;
+
+    public:
+    Mempool(): nreplicas(0) {}
+
+    void init(size_t _nreplicas) { nreplicas = _nreplicas; }
+
+    /** Record that replica `rid` has the command, return false if it was
+     * already known to. */
+    bool mark_known(const uint256_t &cmd_hash, ReplicaID rid);
+
+    bool is_known(const uint256_t &cmd_hash, ReplicaID rid) const;
+    /** Whether all replicas are known to have the command, and its short ID
+     * refers to no other one here, so that a proposal can carry the short
+     * ID instead of the hash. */
+    bool is_short_safe(const uint256_t &cmd_hash) const;
+    /** Find the command with the short ID, return false if there is no
+     * such command or more than one. */
+    bool lookup_short(uint64_t sid, uint256_t &cmd_hash) const;
+
+    /** Queue a command received from a client to be gossiped. */
+    void queue_gossip(const uint256_t &cmd_hash) { outbox.push_back(cmd_hash); }
+    size_t get_outbox_size() const { return outbox.size(); }
+
+    /** Take the commands queued to be gossiped. */
+    std::vector<uint256_t> take_outbox();
+
+    /** Of the given commands, pick those replica `rid` is not known to have
+     * and mark them as known (as they are about to be sent to it). */
+    std::vector<uint256_t> pick_unknown(ReplicaID rid,
+                                        const std::vector<uint256_t> &cmd_hashes);
+
+    /** Forget a committed command. */
+    void remove(const uint256_t &cmd_hash);
+
+    size_t size() const { return known.size(); }
+};
+
+/** The recently committed commands, to tell the resubmissions of the
+ * commands no longer waiting for a decision. It keeps the exact hashes of
+ * the last `capacity` commands inserted, evicting the oldest first, so a
+ * command never committed is never mistaken for a recent one (and left
+ * unanswered). */
+class RecentFilter {
+    size_t capacity;
+    std::unordered_set<uint256_t> cmds;
+    /** the commands in the order of insertion */
+    std::deque<uint256_t> order;
+
+    public:
+    RecentFilter(): capacity(0) {}
+
+    /** Remember up to `capacity` commands (disabled if zero), forgetting all
+     * commands. */
+    void init(size_t capacity);
+    bool is_enabled() const { return capacity > 0; }
+
+    void insert(const uint256_t &cmd_hash);
+    /** Whether the command is among the last `capacity` inserted. */
+    bool contains(const uint256_t &cmd_hash) const {
+        return cmds.count(cmd_hash) > 0;
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,194 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HOTSTUFF_METRICS_H
+#define _HOTSTUFF_METRICS_H
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+
+#include "hotstuff/type.h"
+
+namespace hotstuff {
+
+/** Monotonic counter that can be bumped from any thread without contention:
+ * each thread adds to its own (cache-line sized) stripe, and the stripes are
+ * only summed up upon reading. */
+class MetricCounter {
+    static const size_t nstripe = 16;
+    struct alignas(64) Stripe {
+        std::atomic<uint64_t> val;
+        Stripe(): val(0) {}
+    };
+    Stripe stripes[nstripe];
+
+    static size_t get_stripe();
+
+    public:
+    void inc(uint64_t n = 1) {
+        stripes[get_stripe()].val.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t get() const {
+        uint64_t sum = 0;
+        for (const auto &s: stripes)
+            sum += s.val.load(std::memory_order_relaxed);
+        return sum;
+    }
+};
+
+/** Histogram of durations (in seconds) with fixed bucket bounds, as
+ * exported by Prometheus. */
+class MetricHistogram {
+    std::vector<double> bounds;
+    std::vector<std::atomic<uint64_t>> counts;
+    std::atomic<uint64_t> sum_ns;
+    MetricCounter count;
+
+    public:
+    MetricHistogram(const std::vector<double> &bounds);
+
+    void observe(double sec);
+
+    const std::vector<double> &get_bounds() const { return bounds; }
+    /** Get the number of observations in bucket i (not cumulative). */
+    uint64_t get_bucket(size_t i) const {
+        return counts[i].load(std::memory_order_relaxed);
+    }
+    double get_sum() const {
+        return sum_ns.load(std::memory_order_relaxed) / 1e9;
+    }
+    uint64_t get_count() const { return count.get(); }
+
+    /** Exponential buckets from 100us to ~100s. */
+    static std::vector<double> default_bounds();
+};
+
+/** Registry of the runtime metrics of a replica. Collection can be switched
+ * on and off at runtime; the instrumented code checks is_enabled() before
+ * doing any work beyond an increment. */
+class Metrics {
+    public:
+    using gauge_fn_t = std::function<double()>;
+
+    private:
+    struct Series {
+        std::string labels;
+        MetricCounter *counter;
+        MetricHistogram *histogram;
+        gauge_fn_t gauge;
+    };
+
+    struct Family {
+        std::string help;
+        std::string type;
+        std::vector<Series> series;
+    };
+
+    std::atomic<bool> enabled;
+    std::map<std::string, Family> families;
+    std::deque<MetricCounter> counters;
+    std::deque<MetricHistogram> histograms;
+
+    Family &get_family(const std::string &name,
+                        const std::string &help,
+                        const std::string &type);
+
+    public:
+    Metrics(): enabled(false) {}
+
+    Metrics(const Metrics &) = delete;
+    Metrics &operator=(const Metrics &) = delete;
+
+    bool is_enabled() const { return enabled.load(std::memory_order_relaxed); }
+    void set_enabled(bool f) { enabled.store(f, std::memory_order_relaxed); }
+
+    /** Register a counter. `labels` is of the form `key="value",...`. The
+     * returned reference stays valid for the lifetime of the registry. */
+    MetricCounter &add_counter(const std::string &name,
+                            const std::string &help,
+                            const std::string &labels = "");
+    MetricHistogram &add_histogram(const std::string &name,
+                            const std::string &help,
+                            const std::vector<double> &bounds =
+                                MetricHistogram::default_bounds());
+    /** Register a gauge whose value is taken by `fn` at export time (in the
+     * thread calling to_prometheus()). */
+    void add_gauge(const std::string &name,
+                    const std::string &help,
+                    gauge_fn_t fn,
+                    const std::string &labels = "");
+
+    /** Export all metrics in the Prometheus text format. */
+    std::string to_prometheus() const;
+};
+
+/** A minimal HTTP endpoint serving the metrics on an event loop:
+ *   GET /metrics   -- the metrics in the Prometheus text format
+ *   POST /enable   -- start collecting
+ *   POST /disable  -- stop collecting
+ * The last two need an "Authorization: Bearer <token>" header with the token
+ * given to the server, and are refused if it has none. The sockets never
+ * block the loop: a response is written out as the peer reads it, and a
+ * connection is dropped once idle for `idle_timeout` seconds. At most
+ * `max_conns` connections are served at a time, further ones are closed
+ * right away. */
+class MetricsServer {
+    static const size_t max_conns = 16;
+    static const size_t max_req_size = 8192;
+    static constexpr double idle_timeout = 5;
+
+    struct Conn {
+        FdEvent ev;
+        TimerEvent timeout;
+        std::string req;
+        std::string resp;
+        size_t resp_off;
+        Conn(): resp_off(0) {}
+    };
+
+    Metrics &metrics;
+    EventContext ec;
+    std::string token;
+    int fd;
+    FdEvent ev_accept;
+    std::unordered_map<int, BoxObj<Conn>> conns;
+
+    void on_accept();
+    void on_read(int cfd);
+    void on_write(int cfd);
+    void handle(int cfd, const std::string &req);
+    void respond(int cfd, const std::string &status, const std::string &body);
+    void close_conn(int cfd);
+
+    public:
+    MetricsServer(const EventContext &ec, Metrics &metrics,
+                const NetAddr &listen_addr, const std::string &token = "");
+    ~MetricsServer();
+
+    MetricsServer(const MetricsServer &) = delete;
+    MetricsServer &operator=(const MetricsServer &) = delete;
+};
+
+}
+
+#endif
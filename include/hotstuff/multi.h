@@ -0,0 +1,74 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HOTSTUFF_MULTI_H
+#define _HOTSTUFF_MULTI_H
+
+#include <queue>
+#include <mutex>
+#include <vector>
+#include <functional>
+
+#include "hotstuff/type.h"
+#include "hotstuff/consensus.h"
+
+namespace hotstuff {
+
+/** The merge stage of the parallel instances mode: each of the k instances
+ * orders its own share of the commands, and the blocks they commit are
+ * interleaved round-robin (one block of instance 0, then one of instance 1,
+ * and so on) into a single log. Since every instance commits the same
+ * sequence of blocks at all correct replicas, so is the merged log. An
+ * instance with nothing to order holds up the log, so it is expected to cut
+ * empty blocks while is_stalled_on() is true. */
+class InstanceMerger {
+    public:
+    /** Receives the commands of each block in the merged order. */
+    using output_t = std::function<void(uint32_t inst, const std::vector<Finality> &fins)>;
+
+    private:
+    /** committed blocks of each instance not merged yet */
+    std::vector<std::queue<std::vector<Finality>>> pending;
+    /** the instance the next block of the log is taken from */
+    uint32_t next;
+    uint64_t nmerged;
+    output_t output;
+    mutable std::mutex mlock;
+
+    public:
+    InstanceMerger(size_t ninst, output_t output);
+
+    size_t get_ninst() const { return pending.size(); }
+    /** The number of blocks merged so far. */
+    uint64_t get_nmerged() const;
+
+    /** Take the commands one block of instance `inst` committed, and output
+     * what is ready in the merged order. Can be called from the execution
+     * context of any instance (the output is serialized). */
+    void on_commit(uint32_t inst, std::vector<Finality> &&fins);
+
+    /** Whether the merged log waits for a block from `inst` while the other
+     * instances have some ready. */
+    bool is_stalled_on(uint32_t inst) const;
+
+    /** The instance ordering a command. */
+    static uint32_t partition(const uint256_t &cmd_hash, size_t ninst);
+};
+
+}
+
+#endif
@@ -18,6 +18,7 @@
 #define _HOTSTUFF_WORKER_H
 
 #include <thread>
+#include <vector>
 #include <unordered_map>
 #include <unistd.h>
 
@@ -28,6 +29,7 @@ namespace hotstuff {
 
 class VeriTask {
     friend class VeriPool;
+    friend class VeriTaskBatch;
     bool result;
     public:
     virtual bool verify() = 0;
@@ -37,7 +39,32 @@ class VeriTask {
 using salticidae::ThreadCall;
 using veritask_ut = BoxObj<VeriTask>;
 using mpmc_queue_t = salticidae::MPMCQueueEventDriven<VeriTask *>;
-using mpsc_queue_t = salticidae::MPSCQueueEventDriven<VeriTask *>;
+using mpsc_queue_t = salticidae::MPSCQueueEventDriven<std::vector<VeriTask *>>;
+
+/** A group of independent tasks verified back-to-back by one worker as a
+ * single job. The result of each task is kept so that every part can still
+ * be resolved on its own. */
+class VeriTaskBatch: public VeriTask {
+    friend class VeriPool;
+    std::vector<veritask_ut> tasks;
+    std::vector<promise_t> pms;
+
+    public:
+    size_t size() const { return tasks.size(); }
+
+    promise_t add(veritask_ut &&task) {
+        tasks.push_back(std::move(task));
+        pms.push_back(promise_t([](promise_t &){}));
+        return pms.back();
+    }
+
+    bool verify() override {
+        bool ret = true;
+        for (auto &t: tasks)
+            if (!(t->result = t->verify())) ret = false;
+        return ret;
+    }
+};
 
 class VeriPool {
     mpmc_queue_t in_queue;
@@ -51,17 +78,36 @@ class VeriPool {
 
     std::vector<Worker> workers;
     std::unordered_map<VeriTask *, std::pair<veritask_ut, promise_t>> pms;
+    std::unordered_map<VeriTask *, BoxObj<VeriTaskBatch>> batches;
+    /** tasks submitted by verify_batched() that are not yet dispatched */
+    BoxObj<VeriTaskBatch> pending;
+    TimerEvent flush_timer;
+    const size_t burst_size;
+
+    void on_finish(VeriTask *task) {
+        auto bit = batches.find(task);
+        if (bit != batches.end())
+        {
+            auto &batch = bit->second;
+            for (size_t i = 0; i < batch->tasks.size(); i++)
+                batch->pms[i].resolve(batch->tasks[i]->result);
+            batches.erase(bit);
+            return;
+        }
+        auto it = pms.find(task);
+        it->second.second.resolve(task->result);
+        pms.erase(it);
+    }
 
     public:
-    VeriPool(EventContext ec, size_t nworker, size_t burst_size = 128) {
+    VeriPool(EventContext ec, size_t nworker, size_t burst_size = 128):
+            burst_size(burst_size) {
         out_queue.reg_handler(ec, [this, burst_size](mpsc_queue_t &q) {
             size_t cnt = burst_size;
-            VeriTask *task;
-            while (q.try_dequeue(task))
+            std::vector<VeriTask *> tasks;
+            while (q.try_dequeue(tasks))
             {
-                auto it = pms.find(task);
-                it->second.second.resolve(task->result);
-                pms.erase(it);
+                for (auto task: tasks) on_finish(task);
                 if (!--cnt) return true;
             }
             return false;
@@ -72,18 +118,29 @@ class VeriPool {
         {
             in_queue.reg_handler(workers[i].ec, [this, burst_size](mpmc_queue_t &q) {
                 size_t cnt = burst_size;
+                std::vector<VeriTask *> done;
                 VeriTask *task;
+                bool more = false;
+                /* verify a burst of tasks in one go and hand back all the
+                 * results at once */
                 while (q.try_dequeue(task))
                 {
                     HOTSTUFF_LOG_DEBUG("%lx working on %u",
                                         std::this_thread::get_id(), (uintptr_t)task);
                     task->result = task->verify();
-                    out_queue.enqueue(task);
-                    if (!--cnt) return true;
+                    done.push_back(task);
+                    if (!--cnt)
+                    {
+                        more = true;
+                        break;
+                    }
                 }
-                return false;
+                if (!done.empty())
+                    out_queue.enqueue(std::move(done));
+                return more;
             });
         }
+        flush_timer = TimerEvent(ec, [this](TimerEvent &) { flush(); });
         for (auto &w: workers)
         {
             w.tcall = new ThreadCall(w.ec);
@@ -108,6 +165,37 @@ class VeriPool {
         in_queue.enqueue(ptr);
         return ret.first->second.second;
     }
+
+    /** Same as verify(), but the task is coalesced with other tasks submitted
+     * in the same event loop iteration (up to `burst_size`) and handed to a
+     * worker as one job. */
+    promise_t verify_batched(veritask_ut &&task) {
+        if (!pending)
+        {
+            pending = new VeriTaskBatch();
+            flush_timer.add(0);
+        }
+        auto pm = pending->add(std::move(task));
+        if (pending->size() >= burst_size) flush();
+        return pm;
+    }
+
+    /** Dispatch the coalesced tasks immediately. */
+    void flush() {
+        flush_timer.del();
+        if (!pending) return;
+        auto ptr = pending.get();
+        auto ret = batches.insert(std::make_pair(ptr, std::move(pending)));
+        assert(ret.second);
+        in_queue.enqueue(static_cast<VeriTask *>(ptr));
+    }
+
+    /** Get the number of tasks submitted but not yet finished. */
+    size_t get_queue_depth() const {
+        size_t n = pms.size() + (pending ? pending->size() : 0);
+        for (const auto &p: batches) n += p.second->size();
+        return n;
+    }
 };
 
 }
@@ -0,0 +1,83 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HOTSTUFF_TIMER_H
+#define _HOTSTUFF_TIMER_H
+
+#include <deque>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+
+#include "hotstuff/type.h"
+
+namespace hotstuff {
+
+/** Timers multiplexed onto a single libevent timer. The protocol only uses a
+ * handful of distinct durations (e.g. 2Δ for every commit timer), so the
+ * timers are kept in one FIFO per duration: with deadlines taken from a
+ * monotonic clock, each FIFO stays sorted and adding or cancelling a timer
+ * is O(1). The libevent timer is armed for the earliest head. */
+class TimerQueue {
+    public:
+    using callback_t = std::function<void()>;
+    using timer_id_t = uint64_t;
+    static const timer_id_t null_id = 0;
+
+    private:
+    struct Entry {
+        double deadline;
+        timer_id_t id;
+    };
+
+    struct Lane {
+        double duration;
+        std::deque<Entry> fifo;
+    };
+
+    std::vector<Lane> lanes;
+    /** callbacks of the timers that are neither fired nor cancelled */
+    std::unordered_map<timer_id_t, callback_t> pending;
+    TimerEvent tick;
+    /** the deadline the tick is armed for (negative if not armed) */
+    double armed;
+    timer_id_t next_id;
+
+    static double now();
+    void rearm();
+    void on_tick();
+
+    public:
+    TimerQueue(const EventContext &ec);
+
+    TimerQueue(const TimerQueue &) = delete;
+    TimerQueue &operator=(const TimerQueue &) = delete;
+
+    /** Call `cb` after `t_sec` seconds, unless cancelled before. */
+    timer_id_t add(double t_sec, callback_t cb);
+    /** Cancel the timer (no-op if it has fired or is null_id). */
+    void cancel(timer_id_t id) { pending.erase(id); }
+    /** Cancel all timers. */
+    void clear();
+
+    bool is_pending(timer_id_t id) const { return pending.count(id); }
+    size_t size() const { return pending.size(); }
+};
+
+}
+
+#endif
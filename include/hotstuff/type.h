@@ -17,6 +17,8 @@
 #ifndef _HOTSTUFF_TYPE_H
 #define _HOTSTUFF_TYPE_H
 
+#include <stdexcept>
+
 #include "promise.hpp"
 #include "salticidae/event.h"
 #include "salticidae/ref.h"
@@ -32,6 +34,8 @@ using salticidae::ArcObj;
 using salticidae::BoxObj;
 
 using salticidae::uint256_t;
+/** bytes of a serialized uint256_t (the object itself may be larger) */
+const size_t uint256_nbytes = 32;
 using salticidae::DataStream;
 using salticidae::htole;
 using salticidae::letoh;
@@ -71,6 +75,29 @@ class Cloneable {
     virtual Cloneable *clone() = 0;
 };
 
+/** Write an unsigned LEB128 integer (7 bits per byte, the high bit set on
+ * all but the last byte). */
+inline void put_varint(DataStream &s, uint64_t x) {
+    while (x >= 0x80)
+    {
+        s << (uint8_t)(x | 0x80);
+        x >>= 7;
+    }
+    s << (uint8_t)x;
+}
+
+inline uint64_t get_varint(DataStream &s) {
+    uint64_t x = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        uint8_t b;
+        s >> b;
+        x |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return x;
+    }
+    throw std::runtime_error("varint too long");
+}
+
 using ReplicaID = uint16_t;
 using opcode_t = uint8_t;
 using tls_pkey_bt = BoxObj<salticidae::PKey>;
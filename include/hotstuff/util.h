@@ -17,6 +17,10 @@
 #ifndef _HOTSTUFF_UTIL_H
 #define _HOTSTUFF_UTIL_H
 
+#include <new>
+#include <mutex>
+#include <vector>
+
 #include "hotstuff/config.h"
 #include "salticidae/util.h"
 
@@ -77,6 +81,86 @@ extern Logger logger;
 
 #define HOTSTUFF_LOG_ERROR(...) hotstuff::logger.error(__VA_ARGS__)
 
+/** Mixin that gives class T a free-list allocator, so that the objects
+ * created and destroyed at a high rate reuse their memory instead of going
+ * through malloc. Each thread allocates from its own free list. Objects are
+ * often freed by another thread than the one that made them (parsed by the
+ * pipeline, dropped by the consensus thread), so a thread whose list fills
+ * up hands a batch of `pool_batch` objects to a shared depot, from which a
+ * thread whose list runs dry takes one back: the lock is only taken once
+ * per batch. At most `max_pooled` objects are kept in the depot, and none
+ * is ever released, so that objects freed during static destruction stay
+ * safe. Objects of classes derived from T have a different size and bypass
+ * the pool. */
+template<typename T, size_t max_pooled = 4096, size_t pool_batch = 256>
+class PoolAllocated {
+    using batch_t = std::vector<void *>;
+
+    struct Depot {
+        std::mutex mlock;
+        std::vector<batch_t> batches;
+    };
+
+    static batch_t &get_free_list() {
+        static thread_local batch_t *free_list = new batch_t();
+        return *free_list;
+    }
+
+    static Depot &get_depot() {
+        static Depot *depot = new Depot();
+        return *depot;
+    }
+
+    public:
+    static void *operator new(size_t size) {
+        if (size == sizeof(T))
+        {
+            auto &fl = get_free_list();
+            if (fl.empty())
+            {
+                auto &depot = get_depot();
+                std::lock_guard<std::mutex> _(depot.mlock);
+                if (!depot.batches.empty())
+                {
+                    fl = std::move(depot.batches.back());
+                    depot.batches.pop_back();
+                }
+            }
+            if (!fl.empty())
+            {
+                void *ptr = fl.back();
+                fl.pop_back();
+                return ptr;
+            }
+        }
+        return ::operator new(size);
+    }
+
+    static void operator delete(void *ptr, size_t size) {
+        if (size != sizeof(T))
+        {
+            ::operator delete(ptr);
+            return;
+        }
+        auto &fl = get_free_list();
+        fl.push_back(ptr);
+        if (fl.size() < pool_batch * 2) return;
+        /* keep one batch for this thread, pass the other on */
+        batch_t batch(fl.end() - pool_batch, fl.end());
+        fl.resize(fl.size() - pool_batch);
+        {
+            auto &depot = get_depot();
+            std::lock_guard<std::mutex> _(depot.mlock);
+            if (depot.batches.size() * pool_batch < max_pooled)
+            {
+                depot.batches.push_back(std::move(batch));
+                return;
+            }
+        }
+        for (auto p: batch) ::operator delete(p);
+    }
+};
+
 #ifdef HOTSTUFF_BLK_PROFILE
 class BlockProfiler {
     enum BlockState {
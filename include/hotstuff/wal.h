@@ -0,0 +1,105 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HOTSTUFF_WAL_H
+#define _HOTSTUFF_WAL_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "hotstuff/type.h"
+
+namespace hotstuff {
+
+enum WALRecordType {
+    WAL_REC_BLOCK = 0x00,   /**< a delivered block (wire format) */
+    WAL_REC_VOTE = 0x01,    /**< height and hash of the block voted for */
+    WAL_REC_QC = 0x02,      /**< hash of the new hqc block and its QC */
+    WAL_REC_VIEW = 0x03,    /**< entering a new view */
+    WAL_REC_BLAME = 0x04,   /**< blamed the proposer of a view */
+    WAL_REC_EXEC = 0x05,    /**< hash of the last executed block */
+    WAL_REC_SNAPSHOT = 0x06 /**< view, vheight and the lowest block kept,
+                                which starts a compacted log */
+};
+
+/** Abstraction for an append-only log of the protocol state. Records are
+ * buffered by append() and made durable in groups, so that one sync covers
+ * all records appended in a burst. */
+class WriteAheadLog {
+    public:
+    using durable_cb_t = std::function<void()>;
+    using replay_cb_t = std::function<void(uint8_t type, DataStream &payload)>;
+    using records_t = std::vector<std::pair<uint8_t, DataStream>>;
+
+    virtual ~WriteAheadLog() = default;
+    /** Append a record to the log (not necessarily durable yet). */
+    virtual void append(uint8_t type, const DataStream &payload) = 0;
+    /** Call `on_durable` once all records appended so far are durable. */
+    virtual void commit(durable_cb_t on_durable) = 0;
+    /** Invoke `cb` on each intact record in the log, in order. */
+    virtual void replay(const replay_cb_t &cb) = 0;
+    /** Replace the log with `records` (a snapshot of the state so far),
+     * once the records appended before are durable. The old log is kept
+     * if the new one cannot be written. */
+    virtual void compact(const records_t &records) = 0;
+};
+
+using wal_bt = BoxObj<WriteAheadLog>;
+
+/** Write-ahead log backed by a local file. Each record is framed as
+ * <length, type, crc32, payload>. A torn record at the tail is dropped on
+ * replay. Appended records are written out at the end of the current event
+ * loop iteration, with one fdatasync() covering all pending commits. A
+ * compacted log is written to a temporary file and renamed over the old one.
+ * Once a write or a sync fails, the log stops: nothing more is written and
+ * no commit is ever notified (so no more votes go out). */
+class WALFile: public WriteAheadLog {
+    int fd;
+    std::string fname;
+    bytearray_t buffer;
+    std::vector<durable_cb_t> waiting;
+    TimerEvent flush_timer;
+    bool scheduled;
+    bool failed;
+
+    void schedule_flush();
+    void fail(const char *what);
+
+    public:
+    /* statistics */
+    uint64_t nrecords;
+    uint64_t nsync;
+
+    WALFile(const EventContext &ec, const std::string &fname);
+    ~WALFile() override;
+
+    WALFile(const WALFile &) = delete;
+    WALFile &operator=(const WALFile &) = delete;
+
+    void append(uint8_t type, const DataStream &payload) override;
+    void commit(durable_cb_t on_durable) override;
+    void replay(const replay_cb_t &cb) override;
+    void compact(const records_t &records) override;
+    /** Write out the buffered records, sync and notify the waiting commits. */
+    void flush();
+    bool has_failed() const { return failed; }
+};
+
+}
+
+#endif
@@ -0,0 +1,954 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Deterministic simulation of n replicas running HotStuffCore in one
+ * process. Time is virtual: the replicas only react to the events popped
+ * from a single queue (message deliveries, timers and command arrivals), so
+ * a run only takes as long as the protocol logic itself, and a run with the
+ * same options and seed always plays out the same way. */
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <random>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "salticidae/util.h"
+#include "hotstuff/entity.h"
+#include "hotstuff/consensus.h"
+#include "hotstuff/crypto.h"
+#include "hotstuff/liveness.h"
+#include "hotstuff/metrics.h"
+#include "hotstuff/client.h"
+
+using salticidae::Config;
+using salticidae::split;
+using salticidae::trim_all;
+
+using namespace hotstuff;
+
+/** Event queue on a virtual clock. Events at the same time run in the order
+ * they are added. */
+class Simulator {
+    public:
+    using callback_t = std::function<void()>;
+    using timer_id_t = uint64_t;
+    static const timer_id_t null_id = 0;
+
+    private:
+    struct Event {
+        double time;
+        timer_id_t id;
+        bool operator>(const Event &other) const {
+            return time > other.time || (time == other.time && id > other.id);
+        }
+    };
+
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
+    /** callbacks of the events that are neither run nor cancelled */
+    std::unordered_map<timer_id_t, callback_t> pending;
+    double now;
+    timer_id_t next_id;
+
+    public:
+    Simulator(): now(0), next_id(1) {}
+
+    double get_time() const { return now; }
+
+    /** Call `cb` after `t_sec` seconds of virtual time. */
+    timer_id_t add(double t_sec, callback_t cb) {
+        timer_id_t id = next_id++;
+        events.push(Event{now + t_sec, id});
+        pending.insert(std::make_pair(id, std::move(cb)));
+        return id;
+    }
+
+    /** Cancel the event (no-op if it has run or is null_id). */
+    void cancel(timer_id_t id) { pending.erase(id); }
+
+    /** Run the events up to time `until`. */
+    void run(double until) {
+        while (!events.empty() && events.top().time <= until)
+        {
+            Event ev = events.top();
+            events.pop();
+            auto it = pending.find(ev.id);
+            if (it == pending.end()) continue;
+            callback_t cb = std::move(it->second);
+            pending.erase(it);
+            now = ev.time;
+            cb();
+        }
+        now = until;
+    }
+};
+
+/** Proposer rotating with the view of the core, so that a faulty one is
+ * replaced upon the view change. Like PMWaitQC, it beats once the last
+ * block it proposed gets its QC, and it starts over from the hqc block in a
+ * new view, dropping the beats of the last one. */
+class PaceMakerViewRR: public PMHighTail {
+    std::queue<promise_t> pending_beats;
+    block_t last_proposed;
+    bool locked;
+    promise_t pm_qc_finish;
+
+    void schedule_next() {
+        if (!pending_beats.empty() && !locked)
+        {
+            auto pm = pending_beats.front();
+            pending_beats.pop();
+            pm_qc_finish.reject();
+            (pm_qc_finish = hsc->async_qc_finish(last_proposed))
+                .then([this, pm]() {
+                    pm.resolve(get_proposer());
+                });
+            locked = true;
+        }
+    }
+
+    void reg_proposal() {
+        hsc->async_wait_proposal().then([this](const Proposal &prop) {
+            last_proposed = prop.blk;
+            locked = false;
+            schedule_next();
+            reg_proposal();
+        });
+    }
+
+    void reg_view_change() {
+        hsc->async_wait_view_change().then([this](uint32_t) {
+            pm_qc_finish.reject();
+            pending_beats = std::queue<promise_t>();
+            last_proposed = hsc->get_hqc();
+            locked = false;
+            reg_view_change();
+        });
+    }
+
+    public:
+    PaceMakerViewRR(int32_t parent_limit): PMHighTail(parent_limit) {}
+
+    void init(HotStuffCore *hsc) override {
+        PaceMaker::init(hsc);
+        PMHighTail::init();
+        last_proposed = hsc->get_genesis();
+        locked = false;
+        reg_proposal();
+        reg_view_change();
+    }
+
+    ReplicaID get_proposer() override {
+        return hsc->get_view() % hsc->get_config().nreplicas;
+    }
+
+    promise_t beat() override {
+        promise_t pm;
+        pending_beats.push(pm);
+        schedule_next();
+        return std::move(pm);
+    }
+
+    promise_t beat_resp(ReplicaID) override {
+        return promise_t([this](promise_t &pm) {
+            pm.resolve(get_proposer());
+        });
+    }
+
+    size_t get_pending_size() override { return pending_beats.size(); }
+};
+
+enum MsgType {
+    MSG_PROPOSE,
+    MSG_VOTE,
+    MSG_NOTIFY,
+    MSG_BLAME,
+    MSG_BLAMENOTIFY
+};
+
+/** A directed link with its own latency, bandwidth (no limit if zero) and
+ * message loss rate. Messages on a link are delivered in FIFO order. */
+struct Link {
+    double latency;
+    double bandwidth;
+    double drop;
+    /** when the last message finishes going onto the wire */
+    double busy_until;
+    /** when the last message arrives */
+    double last_arrival;
+};
+
+struct SimOptions {
+    size_t nreplicas;
+    size_t blk_size;
+    double blk_linger;
+    double delta;
+    double jitter;
+    double imp_timeout;
+    uint32_t staleness;
+    uint32_t nfaulty;
+    bool responsive;
+    /** the replicas below this ID are Byzantine */
+    uint32_t nbyzantine;
+};
+
+class Cluster;
+
+/** A replica whose outputs go through the simulated network and whose
+ * timers run on the virtual clock. It cuts blocks from the commands it
+ * holds the same way HotStuffBase does. */
+class SimReplica: public HotStuffCore {
+    using timer_id_t = Simulator::timer_id_t;
+
+    Cluster &cluster;
+    pacemaker_bt pmaker;
+    const SimOptions &opts;
+    bool crashed;
+
+    std::unordered_map<uint32_t, timer_id_t> commit_timers;
+    timer_id_t blame_timer;
+    timer_id_t viewtrans_timer;
+    timer_id_t linger_timer;
+    /** commands not yet committed here, by their IDs */
+    std::set<uint64_t> waiting;
+    /** commands to be cut into blocks (as the proposer) */
+    std::queue<uint256_t> cmd_pending;
+    /** whether a command was committed since the last impeach check */
+    bool progressed;
+
+    void broadcast(MsgType type, const Serializable &msg);
+    /** Send to the replicas on one side of an equivocation. */
+    void send_side(MsgType type, const Serializable &msg, bool twin);
+    /** Vote for the block regardless of the state (as a Byzantine
+     * replica). */
+    void vote_any(const block_t &blk);
+    void reg_view_change();
+    void queue_cmd(const uint256_t &cmd_hash);
+    void cut_blk();
+    void check_progress();
+    void sched_prune();
+    /** Copy the block (and its missing ancestors) over from `from`, which
+     * has it delivered. The fetch takes no simulated time. */
+    bool pull(const uint256_t &blk_hash, SimReplica &from);
+    bool deliver(block_t blk, SimReplica &from);
+
+    protected:
+    void do_decide_batch(const block_t &blk) override;
+    void do_consensus(const block_t &blk) override { pmaker->on_consensus(blk); }
+    void do_broadcast_proposal(const Proposal &prop) override;
+    void do_broadcast_vote(const Vote &vote) override;
+    void do_broadcast_blame(const Blame &blame) override {
+        /* a Byzantine replica never blames its accomplices */
+        if (!is_byzantine()) broadcast(MSG_BLAME, blame);
+    }
+    void do_broadcast_blamenotify(const BlameNotify &bn) override {
+        broadcast(MSG_BLAMENOTIFY, bn);
+    }
+    void do_notify(const Notify &notify) override;
+    void set_commit_timer(const block_t &blk, double t_sec) override;
+    void stop_commit_timer(uint32_t height) override;
+    void stop_commit_timer_all() override;
+    void set_blame_timer(double t_sec) override;
+    void stop_blame_timer() override;
+    void set_viewtrans_timer(double t_sec) override;
+    void stop_viewtrans_timer() override;
+
+    public:
+    SimReplica(ReplicaID rid, Cluster &cluster, pacemaker_bt &&pmaker,
+                const SimOptions &opts);
+
+    part_cert_bt create_part_cert(const PrivKey &, const uint256_t &blk_hash) override {
+        return new PartCertDummy(blk_hash);
+    }
+
+    part_cert_bt parse_part_cert(DataStream &s) override {
+        PartCert *pc = new PartCertDummy();
+        s >> *pc;
+        return pc;
+    }
+
+    quorum_cert_bt create_quorum_cert(const uint256_t &blk_hash) override {
+        return new QuorumCertDummy(get_config(), blk_hash);
+    }
+
+    quorum_cert_bt parse_quorum_cert(DataStream &s) override {
+        QuorumCert *qc = new QuorumCertDummy();
+        s >> *qc;
+        return qc;
+    }
+
+    command_t parse_cmd(DataStream &s) override {
+        auto cmd = new CommandDummy();
+        s >> *cmd;
+        return cmd;
+    }
+
+    void start();
+    void crash();
+    bool is_crashed() const { return crashed; }
+    /** A Byzantine replica equivocates as the proposer, and votes for
+     * every proposal it sees, each vote only to the replicas that have
+     * seen that block. */
+    bool is_byzantine() const { return get_id() < opts.nbyzantine; }
+    /** A client command arrives. */
+    void on_cmd(uint64_t cmd_id);
+    void on_msg(MsgType type, SimReplica &from, const bytearray_t &msg);
+    const pacemaker_bt &get_pace_maker() const { return pmaker; }
+};
+
+/** The replicas, the network between them and the client load. */
+class Cluster {
+    public:
+    Simulator sim;
+    std::mt19937_64 rng;
+    std::vector<std::unique_ptr<SimReplica>> replicas;
+
+    private:
+    const SimOptions &opts;
+    std::vector<Link> links;
+    uint32_t nfaulty;
+    double load;
+
+    /** arrival time of each command (by its ID) */
+    std::vector<double> cmd_arrival;
+    /** number of replicas having committed each command */
+    std::vector<uint16_t> cmd_ncommit;
+
+    void issue_cmd();
+
+    public:
+    uint64_t nmsgs;
+    uint64_t nbytes;
+    uint64_t ndropped;
+    uint64_t ncommitted;
+    /** number of commits conflicting with another honest replica */
+    uint64_t nconflicts;
+    MetricHistogram lat;
+    /** the blocks made up to equivocate */
+    std::unordered_set<uint256_t> twins;
+    /** the block committed at each height by the honest replicas */
+    std::unordered_map<uint32_t, uint256_t> decided;
+
+    Cluster(const SimOptions &opts, double load, uint64_t seed,
+            const std::function<pacemaker_bt(ReplicaID)> &create_pmaker);
+
+    Link &get_link(ReplicaID from, ReplicaID to) {
+        return links[from * opts.nreplicas + to];
+    }
+
+    void set_link(ReplicaID from, ReplicaID to, double latency,
+                double bandwidth, double drop) {
+        auto &l = get_link(from, to);
+        l.latency = latency;
+        l.bandwidth = bandwidth;
+        l.drop = drop;
+    }
+
+    /** Start the replicas and the client load. */
+    void start();
+    void send(ReplicaID from, ReplicaID to, MsgType type,
+            const std::shared_ptr<bytearray_t> &msg);
+    uint256_t get_cmd_hash(uint64_t cmd_id) const;
+    /** A command is done once nfaulty + 1 replicas have committed it, as a
+     * client would then have enough matching replies. */
+    void on_commit(uint64_t cmd_id);
+    void on_decide(const SimReplica &r, const block_t &blk);
+    /** Whether the replica gets to see the twin (or the original) of an
+     * equivocating proposal: the Byzantine replicas see both, the honest
+     * ones are split in two halves. */
+    bool on_side(ReplicaID rid, bool twin) const {
+        return rid < opts.nbyzantine ||
+                ((rid - opts.nbyzantine) % 2 == 1) == twin;
+    }
+    uint64_t get_nissued() const { return cmd_arrival.size(); }
+};
+
+SimReplica::SimReplica(ReplicaID rid, Cluster &cluster,
+                        pacemaker_bt &&pmaker, const SimOptions &opts):
+        HotStuffCore(rid, new PrivKeyDummy()),
+        cluster(cluster), pmaker(std::move(pmaker)), opts(opts),
+        crashed(false),
+        blame_timer(Simulator::null_id),
+        viewtrans_timer(Simulator::null_id),
+        linger_timer(Simulator::null_id),
+        progressed(false) {
+    for (size_t i = 0; i < opts.nreplicas; i++)
+        add_replica(i, NetAddr("127.0.0.1", 10000 + i), new PubKeyDummy());
+}
+
+void SimReplica::start() {
+    set_responsive(opts.responsive);
+    /* it only casts the votes of its own making */
+    if (is_byzantine()) set_vote_disabled(true);
+    on_init(opts.nfaulty, opts.delta);
+    pmaker->init(this);
+    reg_view_change();
+    if (opts.imp_timeout > 0)
+        cluster.sim.add(opts.imp_timeout, [this]() { check_progress(); });
+    sched_prune();
+}
+
+void SimReplica::sched_prune() {
+    cluster.sim.add(1, [this]() {
+        if (crashed) return;
+        prune(opts.staleness);
+        sched_prune();
+    });
+}
+
+void SimReplica::crash() {
+    crashed = true;
+    stop_commit_timer_all();
+    stop_blame_timer();
+    stop_viewtrans_timer();
+    cluster.sim.cancel(linger_timer);
+    HOTSTUFF_LOG_INFO("replica %d crashed at %.3f", get_id(),
+                    cluster.sim.get_time());
+}
+
+void SimReplica::reg_view_change() {
+    async_wait_view_change().then([this](uint32_t) {
+        /* the new proposer takes over whatever is not yet committed */
+        if (pmaker->get_proposer() == get_id())
+        {
+            cmd_pending = std::queue<uint256_t>();
+            for (auto cmd_id: waiting)
+                queue_cmd(cluster.get_cmd_hash(cmd_id));
+        }
+        reg_view_change();
+    });
+}
+
+void SimReplica::check_progress() {
+    if (crashed) return;
+    /* blame the proposer if it sits on the commands */
+    if (!progressed && !waiting.empty())
+        on_blame_timeout();
+    progressed = false;
+    cluster.sim.add(opts.imp_timeout, [this]() { check_progress(); });
+}
+
+void SimReplica::on_cmd(uint64_t cmd_id) {
+    if (crashed) return;
+    waiting.insert(cmd_id);
+    if (pmaker->get_proposer() == get_id())
+        queue_cmd(cluster.get_cmd_hash(cmd_id));
+}
+
+void SimReplica::queue_cmd(const uint256_t &cmd_hash) {
+    cmd_pending.push(cmd_hash);
+    if (cmd_pending.size() >= opts.blk_size)
+    {
+        cut_blk();
+        return;
+    }
+    if (cmd_pending.size() == 1 && opts.blk_linger >= 0)
+    {
+        cluster.sim.cancel(linger_timer);
+        linger_timer = cluster.sim.add(opts.blk_linger, [this]() {
+            linger_timer = Simulator::null_id;
+            cut_blk();
+        });
+    }
+}
+
+void SimReplica::cut_blk() {
+    cluster.sim.cancel(linger_timer);
+    linger_timer = Simulator::null_id;
+    std::vector<uint256_t> cmds;
+    while (!cmd_pending.empty() && cmds.size() < opts.blk_size)
+    {
+        cmds.push_back(cmd_pending.front());
+        cmd_pending.pop();
+    }
+    if (!cmd_pending.empty() && opts.blk_linger >= 0)
+        linger_timer = cluster.sim.add(opts.blk_linger, [this]() {
+            linger_timer = Simulator::null_id;
+            cut_blk();
+        });
+    if (cmds.empty()) return;
+    /* the commands of a beat that never comes are proposed again after the
+     * view change, as they are still waiting */
+    pmaker->beat().then([this, cmds = std::move(cmds)](ReplicaID proposer) {
+        if (crashed || proposer != get_id()) return;
+        on_propose(cmds, pmaker->get_parents(), pmaker->get_extra());
+    });
+}
+
+void SimReplica::do_decide_batch(const block_t &blk) {
+    progressed = true;
+    cluster.on_decide(*this, blk);
+    for (const auto &cmd_hash: blk->get_cmds())
+    {
+        uint64_t cmd_id = Block::get_short_id(cmd_hash);
+        /* the same command may be committed twice after a view change */
+        if (waiting.erase(cmd_id))
+            cluster.on_commit(cmd_id);
+    }
+}
+
+void SimReplica::broadcast(MsgType type, const Serializable &msg) {
+    DataStream s;
+    s << msg;
+    auto bytes = std::make_shared<bytearray_t>(std::move(s));
+    for (size_t i = 0; i < opts.nreplicas; i++)
+        if (i != get_id())
+            cluster.send(get_id(), i, type, bytes);
+}
+
+void SimReplica::send_side(MsgType type, const Serializable &msg, bool twin) {
+    DataStream s;
+    s << msg;
+    auto bytes = std::make_shared<bytearray_t>(std::move(s));
+    for (size_t i = 0; i < opts.nreplicas; i++)
+        if (i != get_id() && cluster.on_side(i, twin))
+            cluster.send(get_id(), i, type, bytes);
+}
+
+void SimReplica::do_broadcast_proposal(const Proposal &prop) {
+    if (!is_byzantine())
+    {
+        broadcast(MSG_PROPOSE, prop);
+        return;
+    }
+    /* a twin at the same height, with the same parents and QC, for the
+     * other half of the honest replicas */
+    const block_t &blk = prop.blk;
+    bytearray_t extra = blk->get_extra();
+    extra.push_back(0);
+    block_t twin = storage->add_blk(
+        new Block(blk->get_parents(), blk->get_cmds(),
+            blk->get_qc()->clone(), std::move(extra),
+            blk->get_height(), blk->get_qc_ref(), nullptr));
+    on_deliver_blk(twin);
+    cluster.twins.insert(twin->get_hash());
+    HOTSTUFF_LOG_INFO("replica %d equivocates at height %u",
+                    get_id(), blk->get_height());
+    send_side(MSG_PROPOSE, prop, false);
+    send_side(MSG_PROPOSE, Proposal(get_id(), twin, nullptr), true);
+    vote_any(twin);
+}
+
+void SimReplica::do_broadcast_vote(const Vote &vote) {
+    if (is_byzantine())
+        send_side(MSG_VOTE, vote, cluster.twins.count(vote.blk_hash));
+    else
+        broadcast(MSG_VOTE, vote);
+}
+
+void SimReplica::vote_any(const block_t &blk) {
+    const auto &blk_hash = blk->get_hash();
+    do_broadcast_vote(Vote(get_id(), blk_hash,
+        create_part_cert(PrivKeyDummy(), Vote::proof_obj_hash(blk_hash)),
+        this));
+}
+
+void SimReplica::do_notify(const Notify &notify) {
+    ReplicaID next_proposer = pmaker->get_proposer();
+    if (next_proposer != get_id())
+    {
+        DataStream s;
+        s << notify;
+        cluster.send(get_id(), next_proposer, MSG_NOTIFY,
+                    std::make_shared<bytearray_t>(std::move(s)));
+    }
+    else
+        on_receive_notify(notify);
+}
+
+bool SimReplica::pull(const uint256_t &blk_hash, SimReplica &from) {
+    if (storage->is_blk_delivered(blk_hash)) return true;
+    block_t src = from.storage->find_blk(blk_hash);
+    if (src == nullptr || !src->is_delivered()) return false;
+    DataStream s;
+    s << *src;
+    return deliver(Block::parse(s, this), from);
+}
+
+bool SimReplica::deliver(block_t blk, SimReplica &from) {
+    for (const auto &phash: blk->get_parent_hashes())
+        if (!pull(phash, from)) return false;
+    if (blk->get_qc() && !pull(blk->get_qc_ref_hash(), from)) return false;
+    blk = storage->add_blk(blk);
+    if (!blk->is_delivered()) on_deliver_blk(blk);
+    return true;
+}
+
+void SimReplica::on_msg(MsgType type, SimReplica &from, const bytearray_t &msg) {
+    if (crashed) return;
+    DataStream s(msg);
+    try {
+        switch (type)
+        {
+            case MSG_PROPOSE:
+            {
+                Proposal prop;
+                prop.hsc = this;
+                s >> prop;
+                if (!deliver(prop.blk, from)) break;
+                block_t blk = storage->find_blk(prop.blk->get_hash());
+                on_receive_proposal(Proposal(prop.proposer, blk, nullptr));
+                if (is_byzantine()) vote_any(blk);
+                break;
+            }
+            case MSG_VOTE:
+            {
+                Vote vote;
+                vote.hsc = this;
+                s >> vote;
+                if (!pull(vote.blk_hash, from)) break;
+                on_receive_vote(vote);
+                break;
+            }
+            case MSG_NOTIFY:
+            {
+                Notify notify;
+                notify.hsc = this;
+                s >> notify;
+                if (!pull(notify.blk_hash, from)) break;
+                on_receive_notify(notify);
+                break;
+            }
+            case MSG_BLAME:
+            {
+                Blame blame;
+                blame.hsc = this;
+                s >> blame;
+                on_receive_blame(blame);
+                break;
+            }
+            case MSG_BLAMENOTIFY:
+            {
+                BlameNotify bn;
+                bn.hsc = this;
+                s >> bn;
+                if (!pull(bn.hqc_hash, from)) break;
+                on_receive_notify(Notify(bn.hqc_hash, bn.hqc_qc->clone(), this));
+                on_receive_blamenotify(bn);
+                break;
+            }
+        }
+    } catch (std::exception &err) {
+        HOTSTUFF_LOG_WARN("replica %d: %s", get_id(), err.what());
+    }
+}
+
+void SimReplica::set_commit_timer(const block_t &blk, double t_sec) {
+    auto height = blk->get_height();
+    auto &id = commit_timers[height];
+    cluster.sim.cancel(id);
+    id = cluster.sim.add(t_sec, [this, blk, height]() {
+        commit_timers.erase(height);
+        on_commit_timeout(blk);
+    });
+}
+
+void SimReplica::stop_commit_timer(uint32_t height) {
+    auto it = commit_timers.find(height);
+    if (it == commit_timers.end()) return;
+    cluster.sim.cancel(it->second);
+    commit_timers.erase(it);
+}
+
+void SimReplica::stop_commit_timer_all() {
+    for (auto &p: commit_timers)
+        cluster.sim.cancel(p.second);
+    commit_timers.clear();
+}
+
+void SimReplica::set_blame_timer(double t_sec) {
+    cluster.sim.cancel(blame_timer);
+    blame_timer = cluster.sim.add(t_sec, [this]() {
+        blame_timer = Simulator::null_id;
+        on_blame_timeout();
+    });
+}
+
+void SimReplica::stop_blame_timer() {
+    cluster.sim.cancel(blame_timer);
+    blame_timer = Simulator::null_id;
+}
+
+void SimReplica::set_viewtrans_timer(double t_sec) {
+    cluster.sim.cancel(viewtrans_timer);
+    viewtrans_timer = cluster.sim.add(t_sec, [this]() {
+        viewtrans_timer = Simulator::null_id;
+        on_viewtrans_timeout();
+    });
+}
+
+void SimReplica::stop_viewtrans_timer() {
+    cluster.sim.cancel(viewtrans_timer);
+    viewtrans_timer = Simulator::null_id;
+}
+
+Cluster::Cluster(const SimOptions &opts, double load, uint64_t seed,
+                const std::function<pacemaker_bt(ReplicaID)> &create_pmaker):
+        rng(seed), opts(opts),
+        links(opts.nreplicas * opts.nreplicas, Link{0, 0, 0, 0, 0}),
+        nfaulty(opts.nfaulty), load(load),
+        nmsgs(0), nbytes(0), ndropped(0), ncommitted(0), nconflicts(0),
+        lat(MetricHistogram::default_bounds()) {
+    for (size_t i = 0; i < opts.nreplicas; i++)
+        replicas.emplace_back(new SimReplica(i, *this, create_pmaker(i), opts));
+}
+
+void Cluster::start() {
+    for (auto &r: replicas) r->start();
+    if (load > 0) issue_cmd();
+}
+
+uint256_t Cluster::get_cmd_hash(uint64_t cmd_id) const {
+    /* the ID goes into the first 8 bytes, which Block::get_short_id() reads
+     * back */
+    bytearray_t h(32, 0);
+    for (int i = 0; i < 8; i++) h[i] = (cmd_id >> (i * 8)) & 0xff;
+    return uint256_t(h);
+}
+
+void Cluster::issue_cmd() {
+    uint64_t cmd_id = cmd_arrival.size();
+    cmd_arrival.push_back(sim.get_time());
+    cmd_ncommit.push_back(0);
+    /* the client sends the command to all replicas */
+    for (auto &r: replicas) r->on_cmd(cmd_id);
+    std::exponential_distribution<double> gap(load);
+    sim.add(gap(rng), [this]() { issue_cmd(); });
+}
+
+void Cluster::on_commit(uint64_t cmd_id) {
+    if (++cmd_ncommit[cmd_id] != nfaulty + 1) return;
+    ncommitted++;
+    lat.observe(sim.get_time() - cmd_arrival[cmd_id]);
+}
+
+void Cluster::on_decide(const SimReplica &r, const block_t &blk) {
+    if (r.is_byzantine()) return;
+    auto it = decided.insert(std::make_pair(blk->get_height(),
+                                            blk->get_hash())).first;
+    if (it->second == blk->get_hash()) return;
+    nconflicts++;
+    HOTSTUFF_LOG_WARN("replica %d commits %s at height %u, which conflicts "
+                    "with %s", r.get_id(), get_hex10(blk->get_hash()).c_str(),
+                    blk->get_height(), get_hex10(it->second).c_str());
+}
+
+void Cluster::send(ReplicaID from, ReplicaID to, MsgType type,
+                const std::shared_ptr<bytearray_t> &msg) {
+    auto &l = get_link(from, to);
+    double now = sim.get_time();
+    /* the message header of the real wire format */
+    size_t size = msg->size() + 16;
+    nmsgs++;
+    nbytes += size;
+    double start = std::max(now, l.busy_until);
+    l.busy_until = start + (l.bandwidth > 0 ? size / l.bandwidth : 0);
+    double arrival = l.busy_until + l.latency;
+    if (opts.jitter > 0)
+        arrival += std::uniform_real_distribution<double>(0, opts.jitter)(rng);
+    /* no overtaking on the same connection */
+    arrival = std::max(arrival, l.last_arrival);
+    l.last_arrival = arrival;
+    if (l.drop > 0 && std::uniform_real_distribution<double>(0, 1)(rng) < l.drop)
+    {
+        ndropped++;
+        return;
+    }
+    sim.add(arrival - now, [this, from, to, type, msg]() {
+        replicas[to]->on_msg(type, *replicas[from], *msg);
+    });
+}
+
+/** Estimate the q-quantile by the upper bound of the bucket it falls in. */
+static double get_quantile(const MetricHistogram &h, double q) {
+    uint64_t target = h.get_count() * q;
+    uint64_t acc = 0;
+    const auto &bounds = h.get_bounds();
+    for (size_t i = 0; i < bounds.size(); i++)
+    {
+        acc += h.get_bucket(i);
+        if (acc > target) return bounds[i];
+    }
+    return bounds.empty() ? 0 : bounds.back();
+}
+
+int main(int argc, char **argv) {
+    Config config("sim.conf");
+
+    auto opt_nreplicas = Config::OptValInt::create(4);
+    auto opt_blk_size = Config::OptValInt::create(100);
+    auto opt_blk_linger = Config::OptValDouble::create(0.01);
+    auto opt_delta = Config::OptValDouble::create(0.1);
+    auto opt_latency = Config::OptValDouble::create(0.01);
+    auto opt_jitter = Config::OptValDouble::create(0);
+    auto opt_bandwidth = Config::OptValDouble::create(0);
+    auto opt_drop = Config::OptValDouble::create(0);
+    auto opt_links = Config::OptValStrVec::create();
+    auto opt_load = Config::OptValDouble::create(1000);
+    auto opt_duration = Config::OptValDouble::create(60);
+    auto opt_crashes = Config::OptValStrVec::create();
+    auto opt_pace_maker = Config::OptValStr::create("rr");
+    auto opt_fixed_proposer = Config::OptValInt::create(0);
+    auto opt_parent_limit = Config::OptValInt::create(-1);
+    auto opt_imp_timeout = Config::OptValDouble::create(1);
+    auto opt_staleness = Config::OptValInt::create(1000);
+    auto opt_stat_period = Config::OptValDouble::create(10);
+    auto opt_seed = Config::OptValInt::create(1);
+    auto opt_nfaulty = Config::OptValInt::create(-1);
+    auto opt_responsive = Config::OptValFlag::create(false);
+    auto opt_nbyzantine = Config::OptValInt::create(0);
+    auto opt_help = Config::OptValFlag::create(false);
+
+    config.add_opt("replicas", opt_nreplicas, Config::SET_VAL, 'n', "number of replicas");
+    config.add_opt("block-size", opt_blk_size, Config::SET_VAL, 'b', "maximum number of commands in a block");
+    config.add_opt("block-linger", opt_blk_linger, Config::SET_VAL, 'L', "cut a block once a command has waited this long (disabled if negative)");
+    config.add_opt("delta", opt_delta, Config::SET_VAL, 'd', "the maximum network delay the protocol assumes (in seconds)");
+    config.add_opt("latency", opt_latency, Config::SET_VAL, 'l', "one-way latency of every link (in seconds)");
+    config.add_opt("jitter", opt_jitter, Config::SET_VAL, 'j', "extra latency drawn uniformly up to this for every message");
+    config.add_opt("bandwidth", opt_bandwidth, Config::SET_VAL, 'w', "bandwidth of every link in bytes per second (unlimited if zero)");
+    config.add_opt("drop", opt_drop, Config::SET_VAL, 'x', "probability that a message is lost on every link");
+    config.add_opt("link", opt_links, Config::APPEND, 'k', "override the link from one replica to another: from,to,latency[,bandwidth[,drop]]");
+    config.add_opt("load", opt_load, Config::SET_VAL, 'r', "client commands per second (Poisson arrivals)");
+    config.add_opt("duration", opt_duration, Config::SET_VAL, 't', "simulated seconds to run");
+    config.add_opt("crash", opt_crashes, Config::APPEND, 'c', "crash a replica at some time: rid@time");
+    config.add_opt("pace-maker", opt_pace_maker, Config::SET_VAL, 'p', "specify pace maker (dummy, rr)");
+    config.add_opt("proposer", opt_fixed_proposer, Config::SET_VAL, 'P', "set the fixed proposer (for dummy)");
+    config.add_opt("parent-limit", opt_parent_limit, Config::SET_VAL);
+    config.add_opt("imp-timeout", opt_imp_timeout, Config::SET_VAL, 'u', "blame if nothing is committed with commands waiting for this long (disabled if zero)");
+    config.add_opt("staleness", opt_staleness, Config::SET_VAL, 's', "number of committed blocks kept below the last one");
+    config.add_opt("stat-period", opt_stat_period, Config::SET_VAL);
+    config.add_opt("seed", opt_seed, Config::SET_VAL, 'S', "seed of the random number generator");
+    config.add_opt("faulty", opt_nfaulty, Config::SET_VAL, 'f', "number of faulty replicas tolerated (by default, the most the mode allows)");
+    config.add_opt("responsive", opt_responsive, Config::SWITCH_ON, 'Y', "commit a block once 3n/4 replicas have voted for it, without waiting for 2 delta");
+    config.add_opt("byzantine", opt_nbyzantine, Config::SET_VAL, 'B', "number of Byzantine replicas (the lowest IDs), which equivocate as the proposer and vote for everything");
+    config.add_opt("help", opt_help, Config::SWITCH_ON, 'h', "show this help info");
+
+    config.parse(argc, argv);
+    if (opt_help->get())
+    {
+        config.print_help();
+        exit(0);
+    }
+
+    SimOptions opts;
+    if (opt_nreplicas->get() < 1)
+        throw HotStuffError("at least one replica is needed");
+    if (opt_blk_size->get() < 1)
+        throw HotStuffError("block size should be positive");
+    opts.nreplicas = opt_nreplicas->get();
+    opts.blk_size = opt_blk_size->get();
+    opts.blk_linger = opt_blk_linger->get();
+    opts.delta = opt_delta->get();
+    opts.jitter = opt_jitter->get();
+    opts.imp_timeout = opt_imp_timeout->get();
+    opts.staleness = opt_staleness->get();
+    opts.responsive = opt_responsive->get();
+    /* fewer than n/2, or n/4 for the responsive mode */
+    opts.nfaulty = opt_nfaulty->get() >= 0 ? opt_nfaulty->get() :
+                    (opts.nreplicas - 1) / (opts.responsive ? 4 : 2);
+    if (opt_nbyzantine->get() < 0 || (size_t)opt_nbyzantine->get() > opts.nfaulty)
+        throw HotStuffError("more Byzantine replicas than tolerated");
+    opts.nbyzantine = opt_nbyzantine->get();
+
+    auto pace_maker = opt_pace_maker->get();
+    if (pace_maker != "dummy" && pace_maker != "rr")
+        throw HotStuffError("unknown pace maker %s", pace_maker.c_str());
+    int32_t parent_limit = opt_parent_limit->get();
+    ReplicaID fixed_proposer = opt_fixed_proposer->get() % opts.nreplicas;
+    Cluster cluster(opts, opt_load->get(), opt_seed->get(),
+        [&](ReplicaID) -> pacemaker_bt {
+            if (pace_maker == "dummy")
+                return new PaceMakerDummyFixed(fixed_proposer, parent_limit);
+            return new PaceMakerViewRR(parent_limit);
+        });
+
+    for (size_t i = 0; i < opts.nreplicas; i++)
+        for (size_t j = 0; j < opts.nreplicas; j++)
+            cluster.set_link(i, j, opt_latency->get(),
+                            opt_bandwidth->get(), opt_drop->get());
+    for (const auto &s: opt_links->get())
+    {
+        auto res = trim_all(split(s, ","));
+        if (res.size() < 3 || res.size() > 5)
+            throw HotStuffError("invalid link: %s", s.c_str());
+        size_t from = std::stoul(res[0]), to = std::stoul(res[1]);
+        if (from >= opts.nreplicas || to >= opts.nreplicas)
+            throw HotStuffError("invalid link: %s", s.c_str());
+        auto &l = cluster.get_link(from, to);
+        cluster.set_link(from, to, std::stod(res[2]),
+                        res.size() > 3 ? std::stod(res[3]) : l.bandwidth,
+                        res.size() > 4 ? std::stod(res[4]) : l.drop);
+    }
+    for (const auto &s: opt_crashes->get())
+    {
+        auto res = trim_all(split(s, "@"));
+        if (res.size() != 2)
+            throw HotStuffError("invalid crash: %s", s.c_str());
+        size_t rid = std::stoul(res[0]);
+        if (rid >= opts.nreplicas)
+            throw HotStuffError("invalid crash: %s", s.c_str());
+        auto &r = *cluster.replicas[rid];
+        cluster.sim.add(std::stod(res[1]), [&r]() { r.crash(); });
+    }
+
+    cluster.start();
+    double duration = opt_duration->get();
+    double period = opt_stat_period->get() > 0 ? opt_stat_period->get() : duration;
+    auto t0 = std::chrono::steady_clock::now();
+    uint64_t last_committed = 0;
+    for (double t = 0; t < duration;)
+    {
+        double next = std::min(t + period, duration);
+        cluster.sim.run(next);
+        uint32_t view = 0;
+        for (auto &r: cluster.replicas)
+            if (!r->is_crashed()) view = std::max(view, r->get_view());
+        printf("t=%.1f view=%u committed=%lu tput=%.1f\n", next, view,
+                cluster.ncommitted,
+                (cluster.ncommitted - last_committed) / (next - t));
+        last_committed = cluster.ncommitted;
+        t = next;
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    double wall = std::chrono::duration<double>(t1 - t0).count();
+
+    const auto &lat = cluster.lat;
+    printf("issued %lu commands, committed %lu (%.1f per second)\n",
+            cluster.get_nissued(), cluster.ncommitted,
+            cluster.ncommitted / duration);
+    printf("latency mean=%.4f p50<=%.4f p99<=%.4f\n",
+            lat.get_count() ? lat.get_sum() / lat.get_count() : 0,
+            get_quantile(lat, 0.5), get_quantile(lat, 0.99));
+    printf("messages %lu (%lu bytes), dropped %lu\n",
+            cluster.nmsgs, cluster.nbytes, cluster.ndropped);
+    printf("%.1f simulated seconds in %.3f wall seconds (%.1fx)\n",
+            duration, wall, wall > 0 ? duration / wall : 0);
+    if (cluster.nconflicts)
+    {
+        printf("safety violated: %lu conflicting commits\n",
+                cluster.nconflicts);
+        return 1;
+    }
+    return 0;
+}
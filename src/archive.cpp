@@ -0,0 +1,230 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hotstuff/util.h"
+#include "hotstuff/archive.h"
+
+namespace hotstuff {
+
+/* hash(32) + height(4) + length(4) */
+static const size_t rec_header_size = 40;
+
+static void put_u32(uint8_t *p, uint32_t x) {
+    for (int i = 0; i < 4; i++) p[i] = (x >> (i * 8)) & 0xff;
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+            ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* the slots of the hash index are kept at most half full */
+static const size_t min_hash_slots = 1 << 10;
+static const size_t min_height_slots = 1 << 10;
+
+void BlockArchive::MappedFile::open(const std::string &fname) {
+    fd = ::open(fname.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        throw HotStuffError("failed to open block archive %s: %s",
+                            fname.c_str(), strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        throw HotStuffError("failed to stat block archive: %s", strerror(errno));
+    len = st.st_size;
+}
+
+void BlockArchive::MappedFile::remap(size_t _len) {
+    if (base) munmap(base, len);
+    base = nullptr;
+    if (ftruncate(fd, _len) < 0)
+        throw HotStuffError("failed to grow block archive: %s", strerror(errno));
+    void *ptr = mmap(nullptr, _len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED)
+        throw HotStuffError("failed to map block archive: %s", strerror(errno));
+    base = static_cast<uint8_t *>(ptr);
+    len = _len;
+}
+
+void BlockArchive::MappedFile::reset(size_t _len) {
+    if (base) munmap(base, len);
+    base = nullptr;
+    if (ftruncate(fd, 0) < 0)
+        throw HotStuffError("failed to reset block archive index: %s",
+                            strerror(errno));
+    remap(_len);
+}
+
+void BlockArchive::MappedFile::close() {
+    if (base) munmap(base, len);
+    base = nullptr;
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+}
+
+BlockArchive::BlockArchive(const std::string &fname, size_t init_size):
+        fname(fname), tail(0), synced(0), nblks(0), base_height(0) {
+    seg.open(fname);
+    seg.remap(std::max(seg.len, init_size));
+    hash_idx.open(fname + ".hash");
+    height_idx.open(fname + ".height");
+    load();
+}
+
+BlockArchive::~BlockArchive() {
+    seg.close();
+    hash_idx.close();
+    height_idx.close();
+}
+
+size_t BlockArchive::find(const uint256_t &blk_hash) const {
+    const uint64_t *slots = reinterpret_cast<const uint64_t *>(hash_idx.base);
+    size_t mask = hash_idx.len / sizeof(uint64_t) - 1;
+    for (size_t i = std::hash<const uint256_t>()(blk_hash) & mask;; i = (i + 1) & mask)
+    {
+        if (slots[i] == 0) return 0;
+        if (uint256_t(seg.base + slots[i] - 1) == blk_hash) return slots[i];
+    }
+}
+
+void BlockArchive::index_hash(size_t rec) {
+    uint64_t *slots = reinterpret_cast<uint64_t *>(hash_idx.base);
+    size_t mask = hash_idx.len / sizeof(uint64_t) - 1;
+    size_t i = std::hash<const uint256_t>()(uint256_t(seg.base + rec)) & mask;
+    while (slots[i]) i = (i + 1) & mask;
+    slots[i] = rec + 1;
+}
+
+void BlockArchive::index_height(size_t rec) {
+    uint32_t height = get_u32(seg.base + rec + 32);
+    if (height < base_height) return;
+    size_t h = height - base_height;
+    size_t need = (h + 1) * sizeof(uint64_t);
+    if (need > height_idx.len)
+    {
+        size_t len = height_idx.len;
+        while (len < need) len <<= 1;
+        height_idx.remap(len);
+    }
+    uint64_t &slot = reinterpret_cast<uint64_t *>(height_idx.base)[h];
+    if (slot == 0) slot = rec + 1;
+}
+
+void BlockArchive::rebuild_hash_idx(size_t nslots) {
+    hash_idx.reset(nslots * sizeof(uint64_t));
+    for (size_t rec = 0; rec < tail;
+        rec += rec_header_size + get_u32(seg.base + rec + 36))
+        index_hash(rec);
+}
+
+void BlockArchive::load() {
+    /* the file is pre-extended with zeros, so the scan stops at the first
+     * record that is empty or does not match its hash */
+    while (tail + rec_header_size <= seg.len)
+    {
+        const uint8_t *p = seg.base + tail;
+        uint32_t size = get_u32(p + 36);
+        size_t offset = tail + rec_header_size;
+        if (size == 0 || offset + size > seg.len) break;
+        if (DataStream(seg.base + offset, seg.base + offset + size).get_hash() !=
+            uint256_t(p))
+            break;
+        if (nblks++ == 0) base_height = get_u32(p + 32);
+        tail = offset + size;
+    }
+    /* the indices only point into the segment, so they are rebuilt (rather
+     * than trusted) after a crash */
+    size_t nslots = min_hash_slots;
+    while (nslots < nblks * 2) nslots <<= 1;
+    rebuild_hash_idx(nslots);
+    height_idx.reset(min_height_slots * sizeof(uint64_t));
+    for (size_t rec = 0; rec < tail;
+        rec += rec_header_size + get_u32(seg.base + rec + 36))
+        index_height(rec);
+    synced = tail;
+    HOTSTUFF_LOG_INFO("block archive %s: loaded %lu blocks (%lu bytes)",
+                    fname.c_str(), nblks, tail);
+}
+
+void BlockArchive::append(const uint256_t &blk_hash, uint32_t height,
+                        const DataStream &blk) {
+    if (find(blk_hash)) return;
+    size_t nslots = hash_idx.len / sizeof(uint64_t);
+    if ((nblks + 1) * 2 > nslots)
+        rebuild_hash_idx(nslots << 1);
+    size_t size = blk.size();
+    size_t need = tail + rec_header_size + size;
+    if (need > seg.len)
+    {
+        size_t len = seg.len;
+        while (len < need) len <<= 1;
+        seg.remap(len);
+    }
+    uint8_t *p = seg.base + tail;
+    bytearray_t h = blk_hash.to_bytes();
+    memmove(p, &h[0], 32);
+    put_u32(p + 32, height);
+    put_u32(p + 36, size);
+    memmove(p + rec_header_size, blk.data(), size);
+    size_t rec = tail;
+    tail = need;
+    if (nblks++ == 0) base_height = height;
+    index_hash(rec);
+    index_height(rec);
+}
+
+void BlockArchive::sync() {
+    if (synced == tail) return;
+    /* the indices are rebuilt on load, so only the segment has to be on
+     * the disk (and its size, if it has grown) */
+    size_t start = synced & ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+    if (msync(seg.base + start, tail - start, MS_SYNC) < 0 || fsync(seg.fd) < 0)
+        throw HotStuffError("failed to sync block archive: %s", strerror(errno));
+    synced = tail;
+}
+
+bool BlockArchive::get(const uint256_t &blk_hash, const uint8_t *&data,
+                        size_t &size, uint32_t *height) const {
+    size_t rec = find(blk_hash);
+    if (rec-- == 0) return false;
+    data = seg.base + rec + rec_header_size;
+    size = get_u32(seg.base + rec + 36);
+    if (height) *height = get_u32(seg.base + rec + 32);
+    return true;
+}
+
+bool BlockArchive::get(uint32_t height, uint256_t &blk_hash,
+                        const uint8_t *&data, size_t &size) const {
+    if (height < base_height || nblks == 0) return false;
+    size_t h = height - base_height;
+    if ((h + 1) * sizeof(uint64_t) > height_idx.len) return false;
+    size_t rec = reinterpret_cast<const uint64_t *>(height_idx.base)[h];
+    if (rec-- == 0) return false;
+    blk_hash = uint256_t(seg.base + rec);
+    data = seg.base + rec + rec_header_size;
+    size = get_u32(seg.base + rec + 36);
+    return true;
+}
+
+}
@@ -14,14 +14,264 @@
  * limitations under the License.
  */
 
+#include <cstring>
+
+#include "hotstuff/util.h"
 #include "hotstuff/client.h"
+#include "hotstuff/hash.h"
+
+using salticidae::_1;
+using salticidae::_2;
 
 namespace hotstuff {
 
 const opcode_t MsgReqCmd::opcode;
 const opcode_t MsgRespCmd::opcode;
-#ifdef SYNCHS_AUTOCLI
+const opcode_t MsgRespCmdBatch::opcode;
 const opcode_t MsgDemandCmd::opcode;
+const opcode_t MsgReqCmdBatch::opcode;
+
+MsgRespCmdBatch::MsgRespCmdBatch(const std::vector<Finality> &fins) {
+    serialized << htole((uint32_t)fins.size());
+    for (const auto &fin: fins)
+    {
+        serialized << fin;
+#if HOTSTUFF_CMD_RESPSIZE > 0
+        uint8_t payload[HOTSTUFF_CMD_RESPSIZE];
+        serialized.put_data(payload, payload + sizeof(payload));
+#endif
+    }
+}
+
+MsgRespCmdBatch::MsgRespCmdBatch(DataStream &&s) {
+    uint32_t n;
+    s >> n;
+    n = letoh(n);
+    /* each entry takes more than one byte */
+    if (n > s.size())
+        throw std::runtime_error("invalid number of responses");
+    fins.resize(n);
+    for (auto &fin: fins)
+    {
+        s >> fin;
+#if HOTSTUFF_CMD_RESPSIZE > 0
+        s.get_data_inplace(HOTSTUFF_CMD_RESPSIZE);
+#endif
+    }
+}
+
+MsgReqCmdBatch::MsgReqCmdBatch(const std::vector<command_t> &cmds, bool full):
+        full(full), ncmd(cmds.size()) {
+    serialized << (uint8_t)full << htole(ncmd);
+    for (const auto &cmd: cmds)
+    {
+        if (full)
+            serialized << *cmd;
+        else
+            serialized << cmd->get_hash();
+    }
+}
+
+MsgReqCmdBatch::MsgReqCmdBatch(DataStream &&s) {
+    uint8_t _full;
+    s >> _full >> ncmd;
+    full = _full;
+    ncmd = letoh(ncmd);
+    if (!full)
+    {
+        if (ncmd > s.size() / uint256_nbytes)
+            throw std::runtime_error("invalid number of commands");
+        cmd_hashes.resize(ncmd);
+        for (auto &h: cmd_hashes) s >> h;
+    }
+    else serialized = std::move(s);
+}
+
+std::vector<command_t> CommandDummy::parse_batch(DataStream &s, size_t n) {
+    /* the serialized form is a plain copy of the fields, of fixed size:
+     * any `size` bytes read back and serialize to themselves, so hashing
+     * them gives the same as salticidae::get_hash() */
+    static const size_t size = sizeof(uint32_t) * 2
+#if HOTSTUFF_CMD_REQSIZE > 0
+        + HOTSTUFF_CMD_REQSIZE
 #endif
+        ;
+    if (n > s.size() / size)
+        throw std::runtime_error("invalid number of commands");
+    const uint8_t *base = s.get_data_inplace(n * size);
+    std::vector<const uint8_t *> msgs(n);
+    std::vector<size_t> lens(n, size);
+    std::vector<uint256_t> hashes(n);
+    for (size_t i = 0; i < n; i++)
+        msgs[i] = base + i * size;
+    hash_batch(msgs.data(), lens.data(), n, hashes.data());
+    std::vector<command_t> cmds(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        auto cmd = new CommandDummy();
+        /* as read by unserialize() */
+        memmove(&cmd->cid, msgs[i], sizeof(uint32_t));
+        memmove(&cmd->n, msgs[i] + sizeof(uint32_t), sizeof(uint32_t));
+#if HOTSTUFF_CMD_REQSIZE > 0
+        memmove(cmd->payload, msgs[i] + sizeof(uint32_t) * 2, HOTSTUFF_CMD_REQSIZE);
+#endif
+        cmd->hash = hashes[i];
+        cmds[i] = cmd;
+    }
+    return cmds;
+}
+
+HotStuffClient::HotStuffClient(const EventContext &ec,
+                            const Config &config,
+                            const Net::Config &netconfig):
+        ec(ec), config(config), mn(ec, netconfig),
+        nfaulty(0), proposer(0),
+        credit(config.window), window(config.window),
+        retry_delay(config.retry_delay), batch_cnt(0) {
+    mn.reg_handler(salticidae::generic_bind(&HotStuffClient::resp_cmd_handler, this, _1, _2));
+    mn.reg_handler(salticidae::generic_bind(&HotStuffClient::resp_cmd_batch_handler, this, _1, _2));
+    mn.reg_handler(salticidae::generic_bind(&HotStuffClient::demand_cmd_handler, this, _1, _2));
+    mn.start();
+    linger_timer = TimerEvent(ec, [this](TimerEvent &) { flush(); });
+    retry_timer = TimerEvent(ec, [this](TimerEvent &) { retry(); });
+}
+
+void HotStuffClient::connect(const std::vector<NetAddr> &replicas, ReplicaID _proposer) {
+    for (const auto &addr: replicas)
+        conns.push_back(mn.connect_sync(addr));
+    nfaulty = (replicas.size() - 1) / 2;
+    proposer = _proposer;
+}
+
+bool HotStuffClient::submit(const command_t &cmd, confirm_cb_t cb) {
+    if (!credit) return false;
+    credit--;
+    waiting.insert(std::make_pair(cmd->get_hash(), Request(cmd, std::move(cb))));
+    pending.push_back(cmd);
+    if (pending.size() >= config.batch_size)
+        flush();
+    else if (pending.size() == 1)
+        linger_timer.add(config.batch_linger);
+    return true;
+}
+
+void HotStuffClient::flush() {
+    linger_timer.del();
+    if (pending.empty()) return;
+    auto id = ++batch_cnt;
+    auto &batch = inflight[id];
+    batch.cmds = std::move(pending);
+    pending.clear();
+    batch.nwaiting = batch.cmds.size();
+    for (const auto &cmd: batch.cmds)
+        waiting.find(cmd->get_hash())->second.batch_id = id;
+    if (config.proposer_only)
+    {
+        batch.timeout = TimerEvent(ec, [this, id](TimerEvent &) {
+            /* the presumed proposer is faulty or no longer in charge */
+            proposer = (proposer + 1) % conns.size();
+            HOTSTUFF_LOG_WARN("batch %lu timed out, resending to all", id);
+            send_batch(inflight.find(id)->second, true);
+        });
+        batch.timeout.add(config.resend_timeout);
+    }
+    send_batch(batch, false);
+}
+
+void HotStuffClient::send_batch(Batch &batch, bool fallback) {
+    MsgReqCmdBatch msg(batch.cmds, true);
+    if (!config.proposer_only || fallback)
+    {
+        for (const auto &conn: conns) mn.send_msg(msg, conn);
+        return;
+    }
+    MsgReqCmdBatch hash_msg(batch.cmds, false);
+    for (size_t i = 0; i < conns.size(); i++)
+        mn.send_msg(i == proposer ? msg : hash_msg, conns[i]);
+}
+
+void HotStuffClient::add_credit(size_t ncmd) {
+    size_t outstanding = waiting.size();
+    size_t cap = window > outstanding ? window - outstanding : 0;
+    credit = std::min(credit + ncmd, cap);
+    if (credit && ready_cb) ready_cb();
+}
+
+void HotStuffClient::on_confirm(const Finality &fin) {
+    if (fin.decision == -1)
+    {
+        on_reject(fin);
+        return;
+    }
+    /* a replica answers a command it already has with decision 0 */
+    if (fin.decision != 1) return;
+    auto it = waiting.find(fin.cmd_hash);
+    if (it == waiting.end()) return;
+    auto &req = it->second;
+    req.et.stop();
+    if (fin.tentative)
+    {
+        /* the result is still subject to a rollback */
+        if (++req.ntentative == nfaulty + 1 && tentative_cb)
+            tentative_cb(fin, req.et.elapsed_sec);
+        return;
+    }
+    if (!req.confirmed) req.first_lat = req.et.elapsed_sec;
+    if (++req.confirmed <= nfaulty) return; // wait for f + 1 ack
+    auto bit = inflight.find(req.batch_id);
+    if (bit != inflight.end() && --bit->second.nwaiting == 0)
+        inflight.erase(bit);
+    auto cb = std::move(req.cb);
+    double first_lat = req.first_lat;
+    double lat = req.et.elapsed_sec;
+    waiting.erase(it);
+    if (cb) cb(fin, first_lat, lat);
+    retry_delay = config.retry_delay;
+    if (window < config.window) window++;
+    if (!config.demand_driven) add_credit(1);
+}
+
+void HotStuffClient::on_reject(const Finality &fin) {
+    auto it = waiting.find(fin.cmd_hash);
+    if (it == waiting.end() || it->second.rejected) return;
+    it->second.rejected = true;
+    if (rejected.empty()) retry_timer.add(retry_delay);
+    rejected.push_back(it->second.cmd);
+    /* the replicas are overloaded: back off multiplicatively, taking away
+     * the credit beyond the new window */
+    window = std::max(window / 2, (size_t)1);
+    size_t outstanding = waiting.size();
+    credit = window > outstanding ? std::min(credit, window - outstanding) : 0;
+}
+
+void HotStuffClient::retry() {
+    HOTSTUFF_LOG_WARN("resubmitting %lu rejected commands", rejected.size());
+    for (const auto &cmd: rejected)
+    {
+        auto it = waiting.find(cmd->get_hash());
+        if (it != waiting.end()) it->second.rejected = false;
+    }
+    /* to all replicas, as the proposer could be any of those turning it away */
+    MsgReqCmdBatch msg(rejected, true);
+    for (const auto &conn: conns) mn.send_msg(msg, conn);
+    rejected.clear();
+    retry_delay = std::min(retry_delay * 2, config.resend_timeout);
+}
+
+void HotStuffClient::resp_cmd_handler(MsgRespCmd &&msg, const Net::conn_t &) {
+    on_confirm(msg.fin);
+}
+
+void HotStuffClient::resp_cmd_batch_handler(MsgRespCmdBatch &&msg, const Net::conn_t &) {
+    for (const auto &fin: msg.fins)
+        on_confirm(fin);
+}
+
+void HotStuffClient::demand_cmd_handler(MsgDemandCmd &&msg, const Net::conn_t &conn) {
+    /* only the proposer demands commands */
+    for (size_t i = 0; i < conns.size(); i++)
+        if (conns[i] == conn) proposer = i;
+    add_credit(msg.ncmd);
+}
 
 }
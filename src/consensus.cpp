@@ -28,12 +28,44 @@
 
 namespace hotstuff {
 
+/* Skip heights as in Bitcoin's CBlockIndex::pskip: each block points to an
+ * ancestor chosen so that any ancestor can be reached in O(log n) steps. */
+static inline uint32_t invert_lowest_one(uint32_t n) { return n & (n - 1); }
+
+static inline uint32_t get_skip_height(uint32_t height) {
+    if (height < 2) return 0;
+    return (height & 1) ?
+        invert_lowest_one(invert_lowest_one(height - 1)) + 1 :
+        invert_lowest_one(height);
+}
+
+const Block *HotStuffCore::get_ancestor(const Block *blk, uint32_t height) const {
+    if (height > blk->height) return nullptr;
+    const Block *b = blk;
+    while (b->height > height)
+    {
+        uint32_t h = b->height;
+        uint32_t hskip = get_skip_height(h);
+        uint32_t hskip_prev = get_skip_height(h - 1);
+        if (b->skip != nullptr && hskip >= chain_floor &&
+            (hskip == height ||
+            (hskip > height && !(hskip_prev + 2 < hskip && hskip_prev >= height))))
+            b = b->skip;
+        else if (!b->parents.empty())
+            b = b->parents[0].get();
+        else
+            return nullptr; /* pruned */
+    }
+    return b;
+}
+
 /* The core logic of HotStuff, is fairly simple :). */
 /*** begin HotStuff protocol logic ***/
 HotStuffCore::HotStuffCore(ReplicaID id,
                             privkey_bt &&priv_key):
         b0(new Block(true, 1)),
         b_exec(b0),
+        b_spec(b0),
         vheight(0),
         view(0),
         view_trans(false),
@@ -41,8 +73,13 @@ HotStuffCore::HotStuffCore(ReplicaID id,
         priv_key(std::move(priv_key)),
         tails{b0},
         vote_disabled(false),
+        speculative(false),
+        responsive(false),
+        wal(nullptr),
+        recovering(false),
+        chain_floor(0),
         id(id),
-        storage(new EntityStorage()) {
+        storage(new EntityStorage(this)) {
     storage->add_blk(b0);
 }
 
@@ -68,11 +105,14 @@ bool HotStuffCore::on_deliver_blk(const block_t &blk) {
     for (const auto &hash: blk->parent_hashes)
         blk->parents.push_back(get_delivered_blk(hash));
     blk->height = blk->parents[0]->height + 1;
+    blk->skip = get_ancestor(blk->parents[0].get(), get_skip_height(blk->height));
 
     if (blk->qc)
     {
         block_t _blk = storage->find_blk(blk->qc_ref_hash);
-        if (_blk == nullptr)
+        /* a compacted log starts above the blocks pruned, which the lowest
+         * ones kept may still refer to */
+        if (_blk == nullptr && !recovering)
             throw std::runtime_error("block referred by qc not fetched");
         blk->qc_ref = std::move(_blk);
     } // otherwise blk->qc_ref remains null
@@ -82,6 +122,12 @@ bool HotStuffCore::on_deliver_blk(const block_t &blk) {
 
     blk->delivered = true;
     LOG_DEBUG("deliver %s", std::string(*blk).c_str());
+    if (wal != nullptr && !recovering)
+    {
+        DataStream s;
+        s << *blk;
+        wal->append(WAL_REC_BLOCK, s);
+    }
     return true;
 }
 
@@ -90,38 +136,94 @@ void HotStuffCore::update_hqc(const block_t &_hqc, const quorum_cert_bt &qc) {
     if (_hqc->height > hqc.first->height)
     {
         hqc = std::make_pair(_hqc, qc->clone());
+        if (wal != nullptr && !recovering)
+        {
+            DataStream s;
+            s << _hqc->get_hash() << *qc;
+            wal->append(WAL_REC_QC, s);
+        }
         on_hqc_update();
     }
 }
 
 void HotStuffCore::check_commit(const block_t &blk) {
+    if (!is_ancestor(b_exec, blk))
+        throw std::runtime_error("safety breached :( " +
+                                std::string(*blk) + " " +
+                                std::string(*b_exec));
+    /* the speculation off the committed chain is undone first, and the
+     * speculated block being committed are not executed again */
+    if (!is_ancestor(blk, b_spec))
+    {
+        rollback_to(blk);
+        b_spec = blk;
+    }
     std::vector<block_t> commit_queue;
-    block_t b;
-    for (b = blk; b->height > b_exec->height; b = b->parents[0])
+    for (block_t b = blk; b->height > b_exec->height; b = b->parents[0])
     { /* TODO: also commit the uncles/aunts */
         commit_queue.push_back(b);
     }
-    if (b != b_exec)
-        throw std::runtime_error("safety breached :( " +
-                                std::string(*blk) + " " +
-                                std::string(*b_exec));
     for (auto it = commit_queue.rbegin(); it != commit_queue.rend(); it++)
     {
         const block_t &blk = *it;
         blk->decision = 1;
         do_consensus(blk);
         LOG_PROTO("commit %s", std::string(*blk).c_str());
-        for (size_t i = 0; i < blk->cmds.size(); i++)
-            do_decide(Finality(id, 1, i, blk->height,
-                                blk->cmds[i], blk->get_hash()));
+        do_decide_batch(blk);
     }
     b_exec = blk;
+    DataStream s;
+    s << blk->get_hash();
+    wal_append(WAL_REC_EXEC, s);
+}
+
+void HotStuffCore::rollback_to(const block_t &blk) {
+    while (b_spec->height > b_exec->height && !is_ancestor(b_spec, blk))
+    {
+        LOG_PROTO("roll back %s", std::string(*b_spec).c_str());
+        do_rollback(b_spec);
+        b_spec = b_spec->parents[0];
+    }
+}
+
+void HotStuffCore::speculate(const block_t &blk) {
+    if (!speculative || recovering || is_ancestor(blk, b_spec)) return;
+    rollback_to(blk);
+    if (!is_ancestor(b_spec, blk)) return;
+    std::vector<block_t> spec_queue;
+    for (block_t b = blk; b->height > b_spec->height; b = b->parents[0])
+        spec_queue.push_back(b);
+    for (auto it = spec_queue.rbegin(); it != spec_queue.rend(); it++)
+    {
+        LOG_PROTO("speculate %s", std::string(**it).c_str());
+        do_speculate(*it);
+    }
+    b_spec = blk;
 }
 
 // 2. Vote
 void HotStuffCore::_vote(const block_t &blk) {
     const auto &blk_hash = blk->get_hash();
     LOG_PROTO("vote for %s", get_hex10(blk_hash).c_str());
+    if (wal != nullptr)
+    {
+        /* the vote must hit the disk before anyone can see it, but the
+         * sync is shared with other records appended in the same burst */
+        DataStream s;
+        s << htole(blk->height) << blk_hash;
+        wal->append(WAL_REC_VOTE, s);
+        uint32_t v = view;
+        wal->commit([this, blk, v]() {
+            if (view_trans || view != v) return;
+            _send_vote(blk);
+        });
+        return;
+    }
+    _send_vote(blk);
+}
+
+void HotStuffCore::_send_vote(const block_t &blk) {
+    const auto &blk_hash = blk->get_hash();
     Vote vote(id, blk_hash,
             create_part_cert(
                 *priv_key,
@@ -137,6 +239,9 @@ void HotStuffCore::_vote(const block_t &blk) {
 // 3. Blame
 void HotStuffCore::_blame() {
     stop_blame_timer();
+    DataStream s;
+    s << htole(view);
+    wal_append(WAL_REC_BLAME, s);
     Blame blame(id, view,
             create_part_cert(
                 *priv_key,
@@ -148,6 +253,8 @@ void HotStuffCore::_blame() {
 // i. New-view
 void HotStuffCore::_new_view() {
     LOG_INFO("preparing new-view");
+    /* nothing uncommitted survives the view change */
+    rollback_to(b_exec);
     blame_qc->compute();
     BlameNotify bn(view,
         hqc.first->get_hash(),
@@ -197,37 +304,36 @@ block_t HotStuffCore::on_propose(const std::vector<uint256_t> &cmds,
     return bnew;
 }
 
+/** Record the block as proposed at its height in this view, and blame on a
+ * conflicting one. Return false if the height has been equivocated. */
+bool HotStuffCore::_record_proposal(const block_t &blk) {
+    auto &pslot = proposals[blk->height];
+    if (pslot.size() > 1) return false;
+    pslot.insert(blk);
+    if (pslot.size() == 1) return true;
+    // TODO: put equivocating blocks in the Blame msg
+    LOG_INFO("conflicting proposal detected, start blaming");
+    _blame();
+    return false;
+}
+
 void HotStuffCore::on_receive_proposal(const Proposal &prop) {
     if (view_trans) return;
     LOG_PROTO("got %s", std::string(prop).c_str());
     block_t bnew = prop.blk;
     if (finished_propose[bnew]) return;
     sanity_check_delivered(bnew);
+    /* the chain below the floor is pruned and committed, nothing proposed
+     * there can be voted for (or kept track of) any more */
+    if (bnew->height <= chain_floor) return;
     if (bnew->qc_ref)
         update_hqc(bnew->qc_ref, bnew->qc);
-    bool opinion = false;
-    auto &pslot = proposals[bnew->height];
-    if (pslot.size() <= 1)
-    {
-        pslot.insert(bnew);
-        if (pslot.size() > 1)
-        {
-            // TODO: put equivocating blocks in the Blame msg
-            LOG_INFO("conflicting proposal detected, start blaming");
-            _blame();
-        }
-        else opinion = true;
-    }
     // opinion = false if equivocating
+    bool opinion = _record_proposal(bnew);
 
     if (opinion)
     {
-        block_t pref = hqc.first;
-        block_t b;
-        for (b = bnew;
-            b->height > pref->height;
-            b = b->parents[0]);
-        if (b == pref) /* on the same branch */
+        if (is_ancestor(hqc.first, bnew)) /* on the same branch */
             vheight = bnew->height;
         else
             opinion = false;
@@ -244,6 +350,9 @@ void HotStuffCore::on_receive_proposal(const Proposal &prop) {
 void HotStuffCore::on_receive_vote(const Vote &vote) {
     LOG_PROTO("got %s", std::string(vote).c_str());
     LOG_PROTO("now state: %s", std::string(*this).c_str());
+    /* a late vote for a pruned block: the copy read back from the archive
+     * is a new object each time, which would pass for a new proposal */
+    if (storage->is_blk_archived(vote.blk_hash)) return;
     block_t blk = get_delivered_blk(vote.blk_hash);
     assert(vote.cert);
     if (!finished_propose[blk])
@@ -253,25 +362,98 @@ void HotStuffCore::on_receive_vote(const Vote &vote) {
         //finished_propose[blk] = true;
         on_receive_proposal(Proposal(vote.voter, blk, nullptr));
     }
+    /* a block seen in an earlier view is proposed again by voting for it,
+     * which only matters to the responsive commit */
+    else if (!view_trans && config.nresponsive) _record_proposal(blk);
     size_t qsize = blk->voted.size();
-    if (qsize >= config.nmajority) return;
+    if (qsize >= std::max(config.nmajority, config.nresponsive)) return;
     if (!blk->voted.insert(vote.voter).second)
     {
         LOG_WARN("duplicate vote for %s from %d", get_hex10(vote.blk_hash).c_str(), vote.voter);
         return;
     }
+    /* the votes beyond the QC are only counted for the responsive commit */
+    if (qsize < config.nmajority)
+    {
+        auto &qc = blk->self_qc;
+        if (qc == nullptr)
+        {
+            qc = create_quorum_cert(Vote::proof_obj_hash(blk->get_hash()));
+        }
+        qc->add_part(vote.voter, *vote.cert);
+        if (qsize + 1 == config.nmajority)
+        {
+            qc->compute();
+            update_hqc(blk, qc);
+            on_qc_finish(blk);
+        }
+    }
+    on_vote_counted(blk, 1);
+}
+
+void HotStuffCore::on_vote_counted(const block_t &blk, size_t nvotes) {
+    if (!config.nresponsive || view_trans || !nvotes) return;
+    if (blk->decision == 1)
+    {
+        view_votes.erase(blk);
+        return;
+    }
+    /* a replica may vote for conflicting blocks in different views, so only
+     * the votes of the same view make a responsive quorum */
+    size_t &qsize = view_votes[blk];
+    if ((qsize += nvotes) < config.nresponsive) return;
+    if (!is_ancestor(b_exec, blk))
+    {
+        LOG_WARN("responsive quorum for a block off the committed chain");
+        return;
+    }
+    /* any equivocation seen on the branch leaves it to the commit timer */
+    for (uint32_t h = b_exec->height + 1; h <= blk->height; h++)
+    {
+        auto it = proposals.find(h);
+        if (it != proposals.end() && it->second.size() > 1) return;
+    }
+    LOG_PROTO("responsive commit %s", std::string(*blk).c_str());
+    view_votes.erase(blk);
+    stop_commit_timer(blk->height);
+    check_commit(blk);
+}
+
+void HotStuffCore::on_receive_agg_vote(const AggVote &av) {
+    LOG_PROTO("got %s", std::string(av).c_str());
+    if (storage->is_blk_archived(av.blk_hash)) return;
+    block_t blk = get_delivered_blk(av.blk_hash);
+    auto signers = av.qc->get_signers();
+    if (signers.empty()) return;
+    if (!finished_propose[blk])
+        on_receive_proposal(Proposal(av.root, blk, nullptr));
+    else if (!view_trans && config.nresponsive) _record_proposal(blk);
+    size_t qsize = blk->voted.size();
+    if (qsize >= std::max(config.nmajority, config.nresponsive)) return;
+    if (qsize >= config.nmajority)
+    {
+        /* the QC is done, only count the voters */
+        for (auto rid: signers) blk->voted.insert(rid);
+        on_vote_counted(blk, blk->voted.size() - qsize);
+        return;
+    }
     auto &qc = blk->self_qc;
     if (qc == nullptr)
-    {
         qc = create_quorum_cert(Vote::proof_obj_hash(blk->get_hash()));
+    if (!qc->merge(*av.qc))
+    {
+        LOG_WARN("no new votes for %s from the relay tree",
+                get_hex10(av.blk_hash).c_str());
+        return;
     }
-    qc->add_part(vote.voter, *vote.cert);
-    if (qsize + 1 == config.nmajority)
+    for (auto rid: signers) blk->voted.insert(rid);
+    if (blk->voted.size() >= config.nmajority)
     {
         qc->compute();
         update_hqc(blk, qc);
         on_qc_finish(blk);
     }
+    on_vote_counted(blk, blk->voted.size() - qsize);
 }
 
 void HotStuffCore::on_receive_notify(const Notify &notify) {
@@ -300,7 +482,11 @@ void HotStuffCore::on_receive_blamenotify(const BlameNotify &bn) {
     _new_view();
 }
 
-void HotStuffCore::on_commit_timeout(const block_t &blk) { check_commit(blk); }
+void HotStuffCore::on_commit_timeout(const block_t &blk) {
+    /* it may have been committed by a responsive quorum already */
+    if (is_ancestor(blk, b_exec)) return;
+    check_commit(blk);
+}
 
 void HotStuffCore::on_blame_timeout() {
     LOG_INFO("no progress, start blaming");
@@ -311,7 +497,11 @@ void HotStuffCore::on_viewtrans_timeout() {
     // view change
     view++;
     view_trans = false;
+    DataStream s;
+    s << htole(view);
+    wal_append(WAL_REC_VIEW, s);
     proposals.clear();
+    view_votes.clear();
     blame_qc = create_quorum_cert(Blame::proof_obj_hash(view));
     blamed.clear();
     set_blame_timer(3 * config.delta);
@@ -325,6 +515,15 @@ void HotStuffCore::on_viewtrans_timeout() {
 /*** end HotStuff protocol logic ***/
 void HotStuffCore::on_init(uint32_t nfaulty, double delta) {
     config.nmajority = config.nreplicas - nfaulty;
+    if (responsive)
+    {
+        /* the responsive commit assumes f < n/4 */
+        if (4 * nfaulty >= config.nreplicas)
+            throw std::runtime_error("the responsive mode needs fewer than "
+                                    "n/4 faulty replicas");
+        config.nresponsive = std::max(config.nmajority,
+                                    config.nreplicas * 3 / 4 + 1);
+    }
     config.delta = delta;
     blame_qc = create_quorum_cert(Blame::proof_obj_hash(view));
     b0->qc = create_quorum_cert(Vote::proof_obj_hash(b0->get_hash()));
@@ -334,11 +533,172 @@ void HotStuffCore::on_init(uint32_t nfaulty, double delta) {
     hqc = std::make_pair(b0, b0->qc->clone());
 }
 
+void HotStuffCore::on_recover_record(uint8_t type, DataStream &s) {
+    switch (type)
+    {
+        case WAL_REC_SNAPSHOT:
+        {
+            uint32_t v, vh, height;
+            s >> v >> vh >> height;
+            view = letoh(v);
+            vheight = letoh(vh);
+            height = letoh(height);
+            proposals.clear();
+            view_votes.clear();
+            blame_qc = create_quorum_cert(Blame::proof_obj_hash(view));
+            blamed.clear();
+            /* the anchor stands in for the pruned chain below it */
+            block_t blk = storage->parse_blk(s, this);
+            if (!blk->delivered)
+            {
+                blk->parents.clear();
+                blk->height = height;
+                blk->delivered = true;
+                tails.erase(b0);
+                tails.insert(blk);
+            }
+            if (blk->height > chain_floor) chain_floor = blk->height;
+            if (blk->height > b_exec->height) b_exec = blk;
+            break;
+        }
+        case WAL_REC_BLOCK:
+        {
+            block_t blk = storage->parse_blk(s, this);
+            if (!blk->delivered) on_deliver_blk(blk);
+            break;
+        }
+        case WAL_REC_VOTE:
+        {
+            uint32_t height;
+            uint256_t blk_hash;
+            s >> height >> blk_hash;
+            height = letoh(height);
+            if (height > vheight) vheight = height;
+            /* remember the vote so that no conflicting block at the same
+             * height gets voted in this view */
+            block_t blk = get_delivered_blk(blk_hash);
+            proposals[blk->height].insert(blk);
+            finished_propose[blk] = true;
+            break;
+        }
+        case WAL_REC_QC:
+        {
+            uint256_t blk_hash;
+            s >> blk_hash;
+            quorum_cert_bt qc = parse_quorum_cert(s);
+            block_t blk = get_delivered_blk(blk_hash);
+            if (blk->height > hqc.first->height)
+                hqc = std::make_pair(blk, std::move(qc));
+            break;
+        }
+        case WAL_REC_VIEW:
+        {
+            uint32_t v;
+            s >> v;
+            view = letoh(v);
+            proposals.clear();
+            view_votes.clear();
+            blame_qc = create_quorum_cert(Blame::proof_obj_hash(view));
+            blamed.clear();
+            break;
+        }
+        case WAL_REC_BLAME:
+        {
+            uint32_t v;
+            s >> v;
+            /* the blame will be resent upon the next blame timeout */
+            if (letoh(v) == view && blamed.insert(id).second)
+                blame_qc->add_part(id, *create_part_cert(
+                    *priv_key, Blame::proof_obj_hash(view)));
+            break;
+        }
+        case WAL_REC_EXEC:
+        {
+            uint256_t blk_hash;
+            s >> blk_hash;
+            block_t blk = get_delivered_blk(blk_hash);
+            if (blk->height > b_exec->height) b_exec = blk;
+            break;
+        }
+        default:
+            throw std::runtime_error("unknown wal record type");
+    }
+}
+
+void HotStuffCore::on_recover() {
+    if (wal == nullptr) return;
+    recovering = true;
+    try {
+        wal->replay([this](uint8_t type, DataStream &s) {
+            on_recover_record(type, s);
+        });
+    } catch (std::exception &err) {
+        recovering = false;
+        throw std::runtime_error(
+            std::string("failed to recover from wal: ") + err.what());
+    }
+    recovering = false;
+    b_spec = b_exec;
+    LOG_INFO("recovered state: %s", std::string(*this).c_str());
+}
+
+void HotStuffCore::compact_wal(const block_t &anchor) {
+    WriteAheadLog::records_t recs;
+    auto add = [&recs](uint8_t type, DataStream &&s) {
+        recs.push_back(std::make_pair(type, std::move(s)));
+    };
+    DataStream snap;
+    snap << htole(view) << htole(vheight) << htole(anchor->height) << *anchor;
+    add(WAL_REC_SNAPSHOT, std::move(snap));
+    /* only the blocks descending from the anchor can be delivered again
+     * (the others have parents below it) */
+    std::unordered_set<uint256_t> kept{anchor->get_hash()};
+    for (const auto &blk: storage->get_delivered_blks(anchor->height + 1))
+    {
+        bool linked = true;
+        for (const auto &h: blk->get_parent_hashes())
+            if (!kept.count(h)) linked = false;
+        if (!linked) continue;
+        kept.insert(blk->get_hash());
+        DataStream s;
+        s << *blk;
+        add(WAL_REC_BLOCK, std::move(s));
+    }
+    if (kept.count(hqc.first->get_hash()))
+    {
+        DataStream s;
+        s << hqc.first->get_hash() << *hqc.second;
+        add(WAL_REC_QC, std::move(s));
+    }
+    DataStream ex;
+    ex << b_exec->get_hash();
+    add(WAL_REC_EXEC, std::move(ex));
+    if (blamed.count(id))
+    {
+        DataStream s;
+        s << htole(view);
+        add(WAL_REC_BLAME, std::move(s));
+    }
+    /* the blocks seen in this view (a superset of those voted for), so
+     * that none conflicting with them gets voted after a restart */
+    for (const auto &p: proposals)
+        for (const auto &blk: p.second)
+        {
+            if (!kept.count(blk->get_hash())) continue;
+            DataStream s;
+            s << htole(blk->height) << blk->get_hash();
+            add(WAL_REC_VOTE, std::move(s));
+        }
+    wal->compact(recs);
+}
+
 void HotStuffCore::prune(uint32_t staleness) {
     block_t start;
     /* skip the blocks */
     for (start = b_exec; staleness; staleness--, start = start->parents[0])
         if (!start->parents.size()) return;
+    bool advanced = start->height > chain_floor;
+    if (advanced) chain_floor = start->height;
     std::stack<block_t> s;
     start->qc_ref = nullptr;
     s.push(start);
@@ -347,6 +707,8 @@ void HotStuffCore::prune(uint32_t staleness) {
         auto &blk = s.top();
         if (blk->parents.empty())
         {
+            finished_propose.erase(blk);
+            proposals.erase(blk->height);
             storage->try_release_blk(blk);
             s.pop();
             continue;
@@ -355,6 +717,13 @@ void HotStuffCore::prune(uint32_t staleness) {
         s.push(blk->parents.back());
         blk->parents.pop_back();
     }
+    /* the log no longer needs anything below the blocks kept, once they
+     * are in the archive for good */
+    if (wal != nullptr && advanced)
+    {
+        storage->sync_archive();
+        compact_wal(start);
+    }
 }
 
 void HotStuffCore::add_replica(ReplicaID rid, const NetAddr &addr,
@@ -376,6 +745,7 @@ promise_t HotStuffCore::async_qc_finish(const block_t &blk) {
 }
 
 void HotStuffCore::on_qc_finish(const block_t &blk) {
+    speculate(blk);
     auto it = qc_waiting.find(blk);
     if (it != qc_waiting.end())
     {
@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <cstring>
+
 #include "hotstuff/entity.h"
 #include "hotstuff/crypto.h"
 
@@ -22,14 +24,21 @@ namespace hotstuff {
 secp256k1_context_t secp256k1_default_sign_ctx = new Secp256k1Context(true);
 secp256k1_context_t secp256k1_default_verify_ctx = new Secp256k1Context(false);
 
-QuorumCertSecp256k1::QuorumCertSecp256k1(
+QuorumCertDummy::QuorumCertDummy(
         const ReplicaConfig &config, const uint256_t &obj_hash):
             QuorumCert(), obj_hash(obj_hash), rids(config.nreplicas) {
     rids.clear();
 }
+
+QuorumCertSecp256k1::QuorumCertSecp256k1(
+        const ReplicaConfig &config, const uint256_t &obj_hash):
+            QuorumCert(), obj_hash(obj_hash), rids(config.nreplicas),
+            sigs(config.nreplicas), nsigs(0) {
+    rids.clear();
+}
    
 bool QuorumCertSecp256k1::verify(const ReplicaConfig &config) {
-    if (sigs.size() < config.nmajority) return false;
+    if (nsigs < config.nmajority) return false;
     for (size_t i = 0; i < rids.size(); i++)
         if (rids.get(i))
         {
@@ -44,23 +53,212 @@ bool QuorumCertSecp256k1::verify(const ReplicaConfig &config) {
 }
 
 promise_t QuorumCertSecp256k1::verify(const ReplicaConfig &config, VeriPool &vpool) {
-    if (sigs.size() < config.nmajority)
+    if (nsigs < config.nmajority)
         return promise_t([](promise_t &pm) { pm.resolve(false); });
-    std::vector<promise_t> vpm;
+    auto task = new Secp256k1BatchVeriTask(obj_hash);
     for (size_t i = 0; i < rids.size(); i++)
         if (rids.get(i))
         {
             HOTSTUFF_LOG_DEBUG("checking cert(%d), obj_hash=%s",
                                 i, get_hex10(obj_hash).c_str());
-            vpm.push_back(vpool.verify(new Secp256k1VeriTask(obj_hash,
-                            static_cast<const PubKeySecp256k1 &>(config.get_pubkey(i)),
-                            sigs[i])));
+            task->add(static_cast<const PubKeySecp256k1 &>(config.get_pubkey(i)),
+                    sigs[i]);
+        }
+    return vpool.verify(task);
+}
+
+promise_t QuorumCertSecp256k1::verify(const ReplicaConfig &config, VeriPool &vpool,
+                                    VeriCache &vcache) {
+    if (nsigs < config.nmajority)
+        return promise_t([](promise_t &pm) { pm.resolve(false); });
+    Secp256k1BatchVeriTask *task = nullptr;
+    std::vector<std::pair<ReplicaID, uint256_t>> missed;
+    for (size_t i = 0; i < rids.size(); i++)
+        if (rids.get(i))
+        {
+            auto sig_hash = salticidae::get_hash(sigs[i]);
+            if (vcache.check(obj_hash, i, sig_hash)) continue;
+            HOTSTUFF_LOG_DEBUG("checking cert(%d), obj_hash=%s",
+                                i, get_hex10(obj_hash).c_str());
+            if (task == nullptr)
+                task = new Secp256k1BatchVeriTask(obj_hash);
+            task->add(static_cast<const PubKeySecp256k1 &>(config.get_pubkey(i)),
+                    sigs[i]);
+            missed.push_back(std::make_pair(i, sig_hash));
         }
-    return promise::all(vpm).then([](const promise::values_t &values) {
-        for (const auto &v: values)
-            if (!promise::any_cast<bool>(v)) return false;
-        return true;
+    if (task == nullptr)
+        return promise_t([](promise_t &pm) { pm.resolve(true); });
+    return vpool.verify(task).then(
+            [obj_hash=obj_hash, missed=std::move(missed), &vcache](bool result) {
+        if (result)
+            for (const auto &p: missed)
+                vcache.add(obj_hash, p.first, p.second);
+        return result;
     });
 }
 
+promise_t QuorumCertSecp256k1::verify_parts(const ReplicaConfig &config,
+                                            VeriPool &vpool) {
+    if (nsigs == 0)
+        return promise_t([](promise_t &pm) { pm.resolve(false); });
+    auto task = new Secp256k1BatchVeriTask(obj_hash);
+    for (size_t i = 0; i < rids.size(); i++)
+        if (rids.get(i))
+            task->add(static_cast<const PubKeySecp256k1 &>(config.get_pubkey(i)),
+                    sigs[i]);
+    return vpool.verify(task);
+}
+
+size_t QuorumCertSecp256k1::merge(const QuorumCert &other) {
+    const auto &o = static_cast<const QuorumCertSecp256k1 &>(other);
+    if (o.obj_hash != obj_hash) return 0;
+    size_t added = 0;
+    for (size_t i = 0; i < o.rids.size() && i < sigs.size(); i++)
+        if (o.rids.get(i) && !rids.get(i))
+        {
+            sigs[i] = o.sigs[i];
+            rids.set(i);
+            added++;
+        }
+    nsigs += added;
+    return added;
+}
+
+void check_qc_nbits(DataStream &s, size_t nbits) {
+    /* Bits is serialized as its 32-bit size, then the words */
+    uint32_t n;
+    if (s.size() < sizeof(n))
+        throw std::invalid_argument("truncated QC");
+    memmove(&n, s.data(), sizeof(n));
+    if (letoh(n) != nbits)
+        throw std::invalid_argument("number of replicas in QC does not match");
+}
+
+void QuorumCertSecp256k1::unserialize(DataStream &s) {
+    s >> obj_hash;
+    check_qc_nbits(s, sigs.size());
+    s >> rids;
+    nsigs = 0;
+    for (size_t i = 0; i < rids.size(); i++)
+        if (rids.get(i))
+        {
+            s >> sigs[i];
+            nsigs++;
+        }
+}
+
+void QuorumCertSecp256k1::serialize_compact(DataStream &s) const {
+    /* the bitmap is packed into (nbits + 7) / 8 bytes after a varint size */
+    uint32_t n = rids.size();
+    put_varint(s, n);
+    for (uint32_t i = 0; i < n; i += 8)
+    {
+        uint8_t b = 0;
+        for (uint32_t j = 0; j < 8 && i + j < n; j++)
+            if (rids.get(i + j)) b |= 1 << j;
+        s << b;
+    }
+    for (uint32_t i = 0; i < n; i++)
+        if (rids.get(i)) s << sigs[i];
+}
+
+void QuorumCertSecp256k1::unserialize_compact(DataStream &s, const uint256_t &_obj_hash) {
+    obj_hash = _obj_hash;
+    uint64_t n = get_varint(s);
+    if (n != sigs.size())
+        throw std::invalid_argument("number of replicas in QC does not match");
+    rids.clear();
+    nsigs = 0;
+    const uint8_t *bits = s.get_data_inplace((n + 7) / 8);
+    for (uint32_t i = 0; i < n; i++)
+        if (bits[i >> 3] & (1 << (i & 7)))
+        {
+            rids.set(i);
+            s >> sigs[i];
+            nsigs++;
+        }
+}
+
+#ifdef HOTSTUFF_ENABLE_BLS
+BLSContext::BLSContext() {
+    if (blsInit(MCL_BLS12_381, MCLBN_COMPILED_TIME_VAR))
+        throw std::runtime_error("failed to initialize bls library");
+}
+
+BLSContext bls_default_ctx;
+
+QuorumCertBLS::QuorumCertBLS(
+        const ReplicaConfig &config, const uint256_t &obj_hash):
+            QuorumCert(), obj_hash(obj_hash), rids(config.nreplicas),
+            aggregated(false) {
+    rids.clear();
+    memset(&sig.data, 0, sizeof(sig.data));
+}
+
+void QuorumCertBLS::compute() {
+    if (parts.empty()) return;
+    /* fold the parts added since into the aggregate so far, if any */
+    auto it = parts.begin();
+    if (!aggregated) sig = *it++;
+    for (; it != parts.end(); it++)
+        blsSignatureAdd(&sig.data, &it->data);
+    parts.clear();
+    aggregated = true;
+}
+
+size_t QuorumCertBLS::merge(const QuorumCert &other) {
+    const auto &o = static_cast<const QuorumCertBLS &>(other);
+    if (o.obj_hash != obj_hash || o.rids.size() != rids.size()) return 0;
+    /* an aggregated signature cannot be split, so the signers of both
+     * certs have to be disjoint */
+    size_t added = 0;
+    for (size_t i = 0; i < o.rids.size(); i++)
+        if (o.rids.get(i))
+        {
+            if (rids.get(i)) return 0;
+            added++;
+        }
+    if (o.aggregated) parts.push_back(o.sig);
+    parts.insert(parts.end(), o.parts.begin(), o.parts.end());
+    for (size_t i = 0; i < o.rids.size(); i++)
+        if (o.rids.get(i)) rids.set(i);
+    return added;
+}
+
+size_t QuorumCertBLS::get_agg_pubkey(const ReplicaConfig &config,
+                                    PubKeyBLS &agg) const {
+    size_t n = 0;
+    for (size_t i = 0; i < rids.size(); i++)
+        if (rids.get(i))
+        {
+            const auto &pub = static_cast<const PubKeyBLS &>(config.get_pubkey(i));
+            if (n++) blsPublicKeyAdd(&agg.data, &pub.data);
+            else agg = pub;
+        }
+    return n;
+}
+
+bool QuorumCertBLS::verify(const ReplicaConfig &config) {
+    PubKeyBLS agg;
+    if (get_agg_pubkey(config, agg) < config.nmajority) return false;
+    HOTSTUFF_LOG_DEBUG("checking aggregated cert, obj_hash=%s",
+                        get_hex10(obj_hash).c_str());
+    return sig.verify(obj_hash, agg);
+}
+
+promise_t QuorumCertBLS::verify(const ReplicaConfig &config, VeriPool &vpool) {
+    PubKeyBLS agg;
+    if (get_agg_pubkey(config, agg) < config.nmajority)
+        return promise_t([](promise_t &pm) { pm.resolve(false); });
+    return vpool.verify(new QuorumCertBLSVeriTask(obj_hash, agg, sig));
+}
+
+promise_t QuorumCertBLS::verify_parts(const ReplicaConfig &config, VeriPool &vpool) {
+    PubKeyBLS agg;
+    if (!aggregated || !parts.empty() || get_agg_pubkey(config, agg) == 0)
+        return promise_t([](promise_t &pm) { pm.resolve(false); });
+    return vpool.verify(new QuorumCertBLSVeriTask(obj_hash, agg, sig));
+}
+#endif
+
 }
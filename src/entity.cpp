@@ -17,54 +17,268 @@
 #include "hotstuff/entity.h"
 #include "hotstuff/consensus.h"
 #include "hotstuff/hotstuff.h"
+#include "hotstuff/hash.h"
 
 namespace hotstuff {
 
 void Block::serialize(DataStream &s) const {
+    s.put_data(raw.data(), raw.data() + raw.size());
+}
+
+void Block::encode(const std::vector<uint256_t> &cmds, const bytearray_t &extra) {
+    DataStream s;
     s << htole((uint32_t)parent_hashes.size());
     for (const auto &hash: parent_hashes)
         s << hash;
     s << htole((uint32_t)cmds.size());
-    for (auto cmd: cmds)
+    cmds_off = s.size();
+    for (const auto &cmd: cmds)
         s << cmd;
     if (qc)
         s << (uint8_t)1 << *qc << qc_ref_hash;
     else
         s << (uint8_t)0;
-    s << htole((uint32_t)extra.size()) << extra;
+    s << htole((uint32_t)extra.size());
+    extra_off = s.size();
+    s << extra;
+    ncmds = cmds.size();
+    extra_len = extra.size();
+    raw = bytearray_t(std::move(s));
+}
+
+void Block::hash_raw() {
+    SHA256 d;
+    d.update(raw.data(), raw.size());
+    hash = uint256_t(d.digest());
 }
 
 void Block::unserialize(DataStream &s, HotStuffCore *hsc) {
+    unserialize_unhashed(s, hsc);
+    hash_raw();
+}
+
+void Block::unserialize_unhashed(DataStream &s, HotStuffCore *hsc) {
+    static const auto _exc = std::runtime_error("invalid block encoding");
+    const uint8_t *begin = s.data();
     uint32_t n;
     uint8_t flag;
     s >> n;
     n = letoh(n);
+    if (n > s.size() / uint256_nbytes) throw _exc;
     parent_hashes.resize(n);
     for (auto &hash: parent_hashes)
         s >> hash;
     s >> n;
     n = letoh(n);
-    cmds.resize(n);
-    for (auto &cmd: cmds)
-        s >> cmd;
-//    for (auto &cmd: cmds)
-//        cmd = hsc->parse_cmd(s);
+    if (n > s.size() / uint256_nbytes) throw _exc;
+    /* the command hashes stay where they are */
+    cmds_off = s.data() - begin;
+    ncmds = n;
+    s.get_data_inplace(n * uint256_nbytes);
     s >> flag;
+    if (flag > 1) throw _exc;
     if (flag)
     {
+        /* the other fields can only be read back from the way they are
+         * written, but a QC type may take in more than one encoding */
+        const uint8_t *qc_begin = s.data();
         qc = hsc->parse_quorum_cert(s);
+        size_t qc_len = s.data() - qc_begin;
+        DataStream q;
+        q << *qc;
+        if (q.size() != qc_len || memcmp(q.data(), qc_begin, qc_len))
+            throw std::runtime_error("non-canonical block encoding");
         s >> qc_ref_hash;
-    } else qc = nullptr;
+    }
+    else
+    {
+        qc = nullptr;
+        qc_ref_hash = uint256_t();
+    }
     s >> n;
     n = letoh(n);
-    if (n == 0)
-        extra.clear();
-    else
+    extra_off = s.data() - begin;
+    extra_len = n;
+    const uint8_t *end = s.get_data_inplace(n) + n;
+    /* the one copy, from the message into the block */
+    raw = bytearray_t(begin, end);
+}
+
+/* flags of the compact encoding */
+static const uint8_t compact_blk_version = 1;
+static const uint8_t compact_has_qc = 1;
+static const uint8_t compact_qc_ref = 2;
+static const uint8_t compact_short_ids = 4;
+
+uint64_t Block::get_short_id(const uint256_t &cmd_hash) {
+    bytearray_t h = cmd_hash.to_bytes();
+    uint64_t x = 0;
+    for (int i = 7; i >= 0; i--) x = (x << 8) | h[i];
+    return x;
+}
+
+void Block::serialize_compact(DataStream &s,
+                const std::function<bool(const uint256_t &)> &use_short) const {
+    auto cmds = get_cmds();
+    std::vector<bool> is_short(cmds.size(), false);
+    bool any_short = false;
+    if (use_short)
+        for (size_t i = 0; i < cmds.size(); i++)
+            if ((is_short[i] = use_short(cmds[i]))) any_short = true;
+    bool implied_ref = qc && !parent_hashes.empty() &&
+                        qc_ref_hash == parent_hashes[0];
+    uint8_t flags = (qc ? compact_has_qc : 0) |
+                    (qc && !implied_ref ? compact_qc_ref : 0) |
+                    (any_short ? compact_short_ids : 0);
+    s << compact_blk_version << flags;
+    put_varint(s, parent_hashes.size());
+    for (const auto &hash: parent_hashes)
+        s << hash;
+    put_varint(s, cmds.size());
+    if (any_short)
+    {
+        for (size_t i = 0; i < cmds.size(); i += 8)
+        {
+            uint8_t b = 0;
+            for (size_t j = 0; j < 8 && i + j < cmds.size(); j++)
+                if (is_short[i + j]) b |= 1 << j;
+            s << b;
+        }
+    }
+    for (size_t i = 0; i < cmds.size(); i++)
+    {
+        if (is_short[i])
+            s << htole(get_short_id(cmds[i]));
+        else
+            s << cmds[i];
+    }
+    if (qc)
     {
-        auto base = s.get_data_inplace(n);
-        extra = bytearray_t(base, base + n);
+        if (!implied_ref) s << qc_ref_hash;
+        qc->serialize_compact(s);
     }
-    this->hash = salticidae::get_hash(*this);
+    put_varint(s, extra_len);
+    s.put_data(raw.data() + extra_off, raw.data() + extra_off + extra_len);
+}
+
+void Block::unserialize_compact(DataStream &s, HotStuffCore *hsc) {
+    uint8_t version, flags;
+    s >> version >> flags;
+    if (version != compact_blk_version ||
+        (flags & ~(compact_has_qc | compact_qc_ref | compact_short_ids)) ||
+        (flags & compact_qc_ref && !(flags & compact_has_qc)))
+        throw std::runtime_error("invalid compact block encoding");
+    /* each entry takes at least a byte, which bounds the sizes */
+    uint64_t n = get_varint(s);
+    if (n > s.size())
+        throw std::runtime_error("invalid compact block encoding");
+    parent_hashes.resize(n);
+    for (auto &hash: parent_hashes)
+        s >> hash;
+    n = get_varint(s);
+    if (n > s.size())
+        throw std::runtime_error("invalid compact block encoding");
+    std::vector<uint256_t> cmds(n);
+    short_cmds.clear();
+    std::vector<bool> is_short(n, false);
+    if (flags & compact_short_ids)
+    {
+        const uint8_t *bits = s.get_data_inplace((n + 7) / 8);
+        for (uint32_t i = 0; i < n; i++)
+            is_short[i] = bits[i >> 3] & (1 << (i & 7));
+    }
+    for (uint32_t i = 0; i < n; i++)
+    {
+        if (is_short[i])
+        {
+            uint64_t sid;
+            s >> sid;
+            short_cmds.push_back(std::make_pair(i, letoh(sid)));
+        }
+        else
+            s >> cmds[i];
+    }
+    qc = nullptr;
+    qc_ref_hash = uint256_t();
+    if (flags & compact_has_qc)
+    {
+        if (flags & compact_qc_ref)
+            s >> qc_ref_hash;
+        else if (!parent_hashes.empty())
+            qc_ref_hash = parent_hashes[0];
+        else
+            throw std::runtime_error("invalid compact block encoding");
+        qc = hsc->parse_quorum_cert_compact(s, Vote::proof_obj_hash(qc_ref_hash));
+    }
+    n = get_varint(s);
+    if (n > s.size())
+        throw std::runtime_error("invalid compact block encoding");
+    auto base = s.get_data_inplace(n);
+    /* the short IDs are left as zeros, to be filled in place */
+    encode(cmds, bytearray_t(base, base + n));
+}
+
+bool Block::finish_compact(const std::function<bool(uint64_t, uint256_t &)> &lookup) {
+    for (const auto &p: short_cmds)
+    {
+        uint256_t cmd_hash;
+        if (!lookup(p.second, cmd_hash)) return false;
+        bytearray_t h = cmd_hash.to_bytes();
+        memmove(&raw[cmds_off + p.first * uint256_nbytes], &h[0], uint256_nbytes);
+    }
+    short_cmds.clear();
+    hash_raw();
+    return true;
+}
+
+block_t Block::parse(DataStream &s, HotStuffCore *hsc) {
+    block_t blk = new Block();
+    blk->unserialize(s, hsc);
+    return blk;
+}
+
+std::vector<block_t> Block::parse_batch(DataStream &s, size_t n, HotStuffCore *hsc) {
+    std::vector<block_t> blks(n);
+    std::vector<const uint8_t *> begins(n);
+    std::vector<size_t> lens(n);
+    std::vector<uint256_t> hashes(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        blks[i] = new Block();
+        blks[i]->unserialize_unhashed(s, hsc);
+        begins[i] = blks[i]->raw.data();
+        lens[i] = blks[i]->raw.size();
+    }
+    hash_batch(begins.data(), lens.data(), n, hashes.data());
+    for (size_t i = 0; i < n; i++)
+        blks[i]->hash = hashes[i];
+    return blks;
+}
+
+block_t Block::parse_archived(DataStream &s, const uint256_t &blk_hash,
+                            uint32_t height, HotStuffCore *hsc) {
+    block_t blk = new Block();
+    blk->unserialize_unhashed(s, hsc);
+    /* the archive has checked the hash when it was loaded */
+    blk->hash = blk_hash;
+    blk->height = height;
+    blk->delivered = true;
+    blk->decision = 1;
+    return blk;
+}
+
+block_t EntityStorage::parse_blk(DataStream &s, HotStuffCore *hsc) {
+    return add_blk(Block::parse(s, hsc));
+}
+
+block_t EntityStorage::find_archived_blk(const uint256_t &blk_hash) const {
+    const uint8_t *data;
+    size_t size;
+    uint32_t height;
+    if (archive == nullptr || !archive->get(blk_hash, data, size, &height))
+        return nullptr;
+    DataStream s(data, data + size);
+    return Block::parse_archived(s, blk_hash, height, hsc);
 }
 
 bool Block::verify(const ReplicaConfig &config) const {
@@ -81,4 +295,12 @@ promise_t Block::verify(const ReplicaConfig &config, VeriPool &vpool) const {
     promise_t([](promise_t &pm) { pm.resolve(true); }));
 }
 
+promise_t Block::verify(const ReplicaConfig &config, VeriPool &vpool, VeriCache &vcache) const {
+    return (qc ?
+        (qc->get_obj_hash() != Vote::proof_obj_hash(qc_ref_hash) ?
+            promise_t([](promise_t &pm) { pm.resolve(false); }) :
+            qc->verify(config, vpool, vcache)) :
+    promise_t([](promise_t &pm) { pm.resolve(true); }));
+}
+
 }
@@ -0,0 +1,208 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+#include "hotstuff/util.h"
+#include "hotstuff/erasure.h"
+
+namespace hotstuff {
+
+/* GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1 (0x11d) */
+static struct GF256 {
+    uint8_t exp[512];
+    uint8_t log[256];
+    GF256() {
+        unsigned x = 1;
+        for (int i = 0; i < 255; i++)
+        {
+            exp[i] = x;
+            log[x] = i;
+            x <<= 1;
+            if (x & 0x100) x ^= 0x11d;
+        }
+        for (int i = 255; i < 512; i++) exp[i] = exp[i - 255];
+        log[0] = 0;
+    }
+    uint8_t mul(uint8_t a, uint8_t b) const {
+        if (a == 0 || b == 0) return 0;
+        return exp[log[a] + log[b]];
+    }
+    uint8_t inv(uint8_t a) const { return exp[255 - log[a]]; }
+} gf;
+
+/* dst ^= c * src */
+static void mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    if (c == 0) return;
+    if (c == 1)
+    {
+        for (size_t i = 0; i < len; i++) dst[i] ^= src[i];
+        return;
+    }
+    const uint8_t *ec = gf.exp + gf.log[c];
+    for (size_t i = 0; i < len; i++)
+        if (src[i]) dst[i] ^= ec[gf.log[src[i]]];
+}
+
+ReedSolomon::ReedSolomon(size_t ndata, size_t nshard):
+        ndata(ndata), nshard(nshard), gen(ndata * nshard, 0) {
+    if (ndata == 0 || ndata > nshard || nshard > 256)
+        throw std::invalid_argument("invalid reed-solomon parameters");
+    for (size_t i = 0; i < ndata; i++)
+        gen[i * ndata + i] = 1;
+    /* rows x_i = i and columns y_j = j never meet, so x_i + y_j != 0 */
+    for (size_t i = ndata; i < nshard; i++)
+        for (size_t j = 0; j < ndata; j++)
+            gen[i * ndata + j] = gf.inv(i ^ j);
+}
+
+std::vector<bytearray_t> ReedSolomon::encode(const uint8_t *data, size_t len) const {
+    size_t ssize = get_shard_size(len);
+    std::vector<bytearray_t> shards(nshard, bytearray_t(ssize, 0));
+    for (size_t j = 0; j < ndata; j++)
+    {
+        size_t off = j * ssize;
+        if (off < len)
+            memmove(&shards[j][0], data + off, std::min(ssize, len - off));
+    }
+    for (size_t i = ndata; i < nshard; i++)
+        for (size_t j = 0; j < ndata; j++)
+            mul_add(&shards[i][0], &shards[j][0], gen[i * ndata + j], ssize);
+    return shards;
+}
+
+/* invert the k x k matrix in place by Gauss-Jordan elimination */
+static bool invert(std::vector<uint8_t> &m, size_t k) {
+    std::vector<uint8_t> res(k * k, 0);
+    for (size_t i = 0; i < k; i++) res[i * k + i] = 1;
+    for (size_t c = 0; c < k; c++)
+    {
+        size_t p = c;
+        while (p < k && m[p * k + c] == 0) p++;
+        if (p == k) return false;
+        if (p != c)
+            for (size_t j = 0; j < k; j++)
+            {
+                std::swap(m[p * k + j], m[c * k + j]);
+                std::swap(res[p * k + j], res[c * k + j]);
+            }
+        uint8_t f = gf.inv(m[c * k + c]);
+        for (size_t j = 0; j < k; j++)
+        {
+            m[c * k + j] = gf.mul(m[c * k + j], f);
+            res[c * k + j] = gf.mul(res[c * k + j], f);
+        }
+        for (size_t r = 0; r < k; r++)
+        {
+            uint8_t g = m[r * k + c];
+            if (r == c || g == 0) continue;
+            for (size_t j = 0; j < k; j++)
+            {
+                m[r * k + j] ^= gf.mul(g, m[c * k + j]);
+                res[r * k + j] ^= gf.mul(g, res[c * k + j]);
+            }
+        }
+    }
+    m = std::move(res);
+    return true;
+}
+
+bool ReedSolomon::decode(const std::unordered_map<uint32_t, bytearray_t> &shards,
+                        size_t len, bytearray_t &data) const {
+    size_t ssize = get_shard_size(len);
+    /* prefer the data shards, which need no arithmetic */
+    std::vector<uint32_t> idx;
+    for (const auto &p: shards)
+        if (p.first < nshard && p.second.size() == ssize)
+            idx.push_back(p.first);
+    if (idx.size() < ndata) return false;
+    std::sort(idx.begin(), idx.end());
+    idx.resize(ndata);
+    auto has = [&](size_t j) {
+        auto it = shards.find(j);
+        return it != shards.end() && it->second.size() == ssize;
+    };
+    data.assign(ndata * ssize, 0);
+    if (idx.back() >= ndata)
+    {
+        std::vector<uint8_t> m(ndata * ndata);
+        for (size_t r = 0; r < ndata; r++)
+            memmove(&m[r * ndata], &gen[idx[r] * ndata], ndata);
+        if (!invert(m, ndata)) return false;
+        for (size_t j = 0; j < ndata; j++)
+        {
+            if (has(j)) continue;
+            for (size_t r = 0; r < ndata; r++)
+                mul_add(&data[j * ssize], &shards.at(idx[r])[0],
+                        m[j * ndata + r], ssize);
+        }
+    }
+    for (size_t j = 0; j < ndata; j++)
+        if (has(j)) memmove(&data[j * ssize], &shards.at(j)[0], ssize);
+    data.resize(len);
+    return true;
+}
+
+static uint256_t merkle_hash(const uint256_t &a, const uint256_t &b) {
+    DataStream s;
+    s << a << b;
+    return s.get_hash();
+}
+
+static void merkle_up(std::vector<uint256_t> &level) {
+    std::vector<uint256_t> next;
+    for (size_t i = 0; i + 1 < level.size(); i += 2)
+        next.push_back(merkle_hash(level[i], level[i + 1]));
+    if (level.size() & 1) next.push_back(level.back());
+    level = std::move(next);
+}
+
+uint256_t merkle_root(std::vector<uint256_t> level) {
+    if (level.empty()) return uint256_t();
+    while (level.size() > 1) merkle_up(level);
+    return level[0];
+}
+
+std::vector<uint256_t> merkle_proof(std::vector<uint256_t> level, size_t idx) {
+    std::vector<uint256_t> proof;
+    while (level.size() > 1)
+    {
+        if ((idx ^ 1) < level.size())
+            proof.push_back(level[idx ^ 1]);
+        merkle_up(level);
+        idx >>= 1;
+    }
+    return proof;
+}
+
+bool merkle_verify(const uint256_t &root, uint256_t leaf, size_t idx,
+                    size_t nleaves, const std::vector<uint256_t> &proof) {
+    if (idx >= nleaves) return false;
+    size_t p = 0;
+    for (size_t size = nleaves; size > 1; size = (size + 1) >> 1, idx >>= 1)
+    {
+        if ((idx ^ 1) >= size) continue;
+        if (p == proof.size()) return false;
+        const auto &sib = proof[p++];
+        leaf = (idx & 1) ? merkle_hash(sib, leaf) : merkle_hash(leaf, sib);
+    }
+    return p == proof.size() && leaf == root;
+}
+
+}
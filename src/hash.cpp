@@ -0,0 +1,265 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+#include "hotstuff/util.h"
+#include "hotstuff/crypto.h"
+#include "hotstuff/hash.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HOTSTUFF_HASH_X8
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+namespace hotstuff {
+
+#ifdef HOTSTUFF_HASH_X8
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t sha256_init[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const size_t nlane = 8;
+
+/* a message of `len` bytes takes this many 64-byte blocks after padding */
+static size_t get_nblk(size_t len) { return (len + 9 + 63) / 64; }
+
+static uint32_t load_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+            ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+#define HASH_X8 __attribute__((target("avx2")))
+
+HASH_X8 static inline __m256i rotr(__m256i x, int n) {
+    return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+HASH_X8 static inline __m256i add(__m256i a, __m256i b) {
+    return _mm256_add_epi32(a, b);
+}
+
+/* one 64-byte block of each lane, lane i lying at blks[i] */
+HASH_X8 static void transform_x8(__m256i *state, const uint8_t *const *blks) {
+    __m256i w[16];
+    for (int t = 0; t < 16; t++)
+        w[t] = _mm256_setr_epi32(
+            load_be32(blks[0] + t * 4), load_be32(blks[1] + t * 4),
+            load_be32(blks[2] + t * 4), load_be32(blks[3] + t * 4),
+            load_be32(blks[4] + t * 4), load_be32(blks[5] + t * 4),
+            load_be32(blks[6] + t * 4), load_be32(blks[7] + t * 4));
+    __m256i a = state[0], b = state[1], c = state[2], d = state[3];
+    __m256i e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int t = 0; t < 64; t++)
+    {
+        __m256i wt;
+        if (t < 16)
+            wt = w[t];
+        else
+        {
+            __m256i w15 = w[(t - 15) & 15], w2 = w[(t - 2) & 15];
+            __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(rotr(w15, 7), rotr(w15, 18)),
+                                        _mm256_srli_epi32(w15, 3));
+            __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(rotr(w2, 17), rotr(w2, 19)),
+                                        _mm256_srli_epi32(w2, 10));
+            wt = w[t & 15] = add(add(w[t & 15], s0), add(w[(t - 7) & 15], s1));
+        }
+        __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(rotr(e, 6), rotr(e, 11)), rotr(e, 25));
+        __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+        __m256i t1 = add(add(add(h, s1), add(ch, _mm256_set1_epi32(sha256_k[t]))), wt);
+        __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(rotr(a, 2), rotr(a, 13)), rotr(a, 22));
+        __m256i maj = _mm256_or_si256(_mm256_and_si256(a, b),
+                                    _mm256_and_si256(c, _mm256_or_si256(a, b)));
+        __m256i t2 = add(s0, maj);
+        h = g; g = f; f = e;
+        e = add(d, t1);
+        d = c; c = b; b = a;
+        a = add(t1, t2);
+    }
+    state[0] = add(state[0], a); state[1] = add(state[1], b);
+    state[2] = add(state[2], c); state[3] = add(state[3], d);
+    state[4] = add(state[4], e); state[5] = add(state[5], f);
+    state[6] = add(state[6], g); state[7] = add(state[7], h);
+}
+
+/* Hash up to eight messages, one per lane. Each lane runs through its full
+ * blocks in place and then through the padded tail; a lane that is done
+ * keeps its state while the longer ones go on. */
+HASH_X8 static void hash_x8(const uint8_t *const *msgs, const size_t *lens,
+                            size_t n, uint256_t *hashes) {
+    static const uint8_t idle[64] = {0};
+    uint8_t tails[nlane][128];
+    size_t nfull[nlane], nblk[nlane], max_nblk = 0;
+    for (size_t i = 0; i < nlane; i++)
+    {
+        nfull[i] = nblk[i] = 0;
+        if (i >= n) continue;
+        size_t len = lens[i];
+        size_t rem = len & 63;
+        nfull[i] = len >> 6;
+        nblk[i] = get_nblk(len);
+        size_t tlen = (nblk[i] - nfull[i]) * 64;
+        memset(tails[i], 0, tlen);
+        if (rem) memmove(tails[i], msgs[i] + nfull[i] * 64, rem);
+        tails[i][rem] = 0x80;
+        uint64_t bits = (uint64_t)len << 3;
+        for (int j = 0; j < 8; j++)
+            tails[i][tlen - 1 - j] = (bits >> (j * 8)) & 0xff;
+        max_nblk = std::max(max_nblk, nblk[i]);
+    }
+    __m256i state[8];
+    for (int j = 0; j < 8; j++)
+        state[j] = _mm256_set1_epi32(sha256_init[j]);
+    for (size_t k = 0; k < max_nblk; k++)
+    {
+        const uint8_t *blks[nlane];
+        alignas(32) int32_t active[nlane];
+        for (size_t i = 0; i < nlane; i++)
+        {
+            active[i] = k < nblk[i] ? -1 : 0;
+            if (k < nfull[i])
+                blks[i] = msgs[i] + k * 64;
+            else if (k < nblk[i])
+                blks[i] = tails[i] + (k - nfull[i]) * 64;
+            else
+                blks[i] = idle;
+        }
+        __m256i mask = _mm256_load_si256((const __m256i *)active);
+        __m256i next[8];
+        memmove(next, state, sizeof(state));
+        transform_x8(next, blks);
+        for (int j = 0; j < 8; j++)
+            state[j] = _mm256_blendv_epi8(state[j], next[j], mask);
+    }
+    alignas(32) uint32_t words[8][nlane];
+    for (int j = 0; j < 8; j++)
+        _mm256_store_si256((__m256i *)words[j], state[j]);
+    for (size_t i = 0; i < n; i++)
+    {
+        uint8_t md[32];
+        for (int j = 0; j < 8; j++)
+        {
+            uint32_t x = words[j][i];
+            md[j * 4] = x >> 24;
+            md[j * 4 + 1] = x >> 16;
+            md[j * 4 + 2] = x >> 8;
+            md[j * 4 + 3] = x;
+        }
+        hashes[i] = uint256_t(md);
+    }
+}
+
+/* AVX2 is only usable if the OS saves the ymm registers as well: OSXSAVE
+ * is set and XCR0 covers both the SSE and the AVX state */
+static bool can_x8() {
+    static const bool f = []() {
+        unsigned eax, ebx, ecx, edx;
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+        if (!(ecx & (1u << 27)) || !(ecx & (1u << 28))) return false;
+        unsigned xcr0_lo, xcr0_hi;
+        __asm__ volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+        if ((xcr0_lo & 6) != 6) return false;
+        if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return false;
+        return (ebx & (1u << 5)) != 0;
+    }();
+    return f;
+}
+
+/* the SHA extensions beat eight AVX2 lanes, and OpenSSL uses them */
+static bool use_x8() {
+    static const bool f = []() {
+        unsigned eax, ebx, ecx, edx;
+        if (!can_x8()) return false;
+        if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return false;
+        return !(ebx & (1u << 29));
+    }();
+    return f;
+}
+
+static void batch_x8(const uint8_t *const *msgs, const size_t *lens, size_t n,
+                    uint256_t *hashes) {
+    /* group the messages of similar lengths, so that few lanes idle */
+    std::vector<uint32_t> idx(n);
+    for (size_t i = 0; i < n; i++) idx[i] = i;
+    std::stable_sort(idx.begin(), idx.end(), [lens](uint32_t a, uint32_t b) {
+        return get_nblk(lens[a]) < get_nblk(lens[b]);
+    });
+    for (size_t i = 0; i < n; i += nlane)
+    {
+        size_t m = std::min(nlane, n - i);
+        const uint8_t *lmsgs[nlane];
+        size_t llens[nlane];
+        uint256_t lhashes[nlane];
+        for (size_t j = 0; j < m; j++)
+        {
+            lmsgs[j] = msgs[idx[i + j]];
+            llens[j] = lens[idx[i + j]];
+        }
+        hash_x8(lmsgs, llens, m, lhashes);
+        for (size_t j = 0; j < m; j++)
+            hashes[idx[i + j]] = lhashes[j];
+    }
+}
+
+#endif
+
+void hash_batch(const uint8_t *const *msgs, const size_t *lens, size_t n,
+                uint256_t *hashes) {
+#ifdef HOTSTUFF_HASH_X8
+    /* a lane only pays off with others to share the rounds */
+    if (n >= nlane / 2 && use_x8())
+    {
+        batch_x8(msgs, lens, n, hashes);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < n; i++)
+    {
+        SHA256 d;
+        d.update(msgs[i], lens[i]);
+        hashes[i] = uint256_t(d.digest());
+    }
+}
+
+bool hash_batch_x8(const uint8_t *const *msgs, const size_t *lens, size_t n,
+                uint256_t *hashes) {
+#ifdef HOTSTUFF_HASH_X8
+    if (!can_x8()) return false;
+    batch_x8(msgs, lens, n, hashes);
+    return true;
+#else
+    return false;
+#endif
+}
+
+}
@@ -34,6 +34,21 @@ void MsgPropose::postponed_parse(HotStuffCore *hsc) {
     serialized >> proposal;
 }
 
+const opcode_t MsgProposeCompact::opcode;
+MsgProposeCompact::MsgProposeCompact(const Proposal &proposal,
+                const std::function<bool(const uint256_t &)> &use_short) {
+    serialized << proposal.proposer << proposal.blk->get_hash();
+    proposal.blk->serialize_compact(serialized, use_short);
+}
+
+void MsgProposeCompact::postponed_parse(HotStuffCore *hsc) {
+    proposal.hsc = hsc;
+    serialized >> proposal.proposer >> blk_hash;
+    block_t blk = new Block();
+    blk->unserialize_compact(serialized, hsc);
+    proposal.blk = blk;
+}
+
 const opcode_t MsgVote::opcode;
 MsgVote::MsgVote(const Vote &vote) { serialized << vote; }
 void MsgVote::postponed_parse(HotStuffCore *hsc) {
@@ -42,10 +57,31 @@ void MsgVote::postponed_parse(HotStuffCore *hsc) {
 }
 
 const opcode_t MsgNotify::opcode;
-MsgNotify::MsgNotify(const Notify &notify) { serialized << notify; }
+MsgNotify::MsgNotify(const Notify &notify, const std::vector<block_t> &blks) {
+    serialized << notify << htole((uint32_t)blks.size());
+    for (const auto &blk: blks) serialized << *blk;
+}
+
+/* only the first few blocks are taken, the rest is ignored */
+static void parse_inline_blks(DataStream &s, HotStuffCore *hsc,
+                            std::vector<block_t> &blks) {
+    uint32_t size;
+    s >> size;
+    size = std::min(letoh(size), view_change_suffix_max);
+    blks = Block::parse_batch(s, size, hsc);
+}
+
 void MsgNotify::postponed_parse(HotStuffCore *hsc) {
     notify.hsc = hsc;
     serialized >> notify;
+    parse_inline_blks(serialized, hsc, blks);
+}
+
+const opcode_t MsgAggVote::opcode;
+MsgAggVote::MsgAggVote(const AggVote &av) { serialized << av; }
+void MsgAggVote::postponed_parse(HotStuffCore *hsc) {
+    av.hsc = hsc;
+    serialized >> av;
 }
 
 const opcode_t MsgBlame::opcode;
@@ -56,10 +92,83 @@ void MsgBlame::postponed_parse(HotStuffCore *hsc) {
 }
 
 const opcode_t MsgBlameNotify::opcode;
-MsgBlameNotify::MsgBlameNotify(const BlameNotify &bn) { serialized << bn; }
+MsgBlameNotify::MsgBlameNotify(const BlameNotify &bn,
+                            const std::vector<block_t> &blks) {
+    serialized << bn << htole((uint32_t)blks.size());
+    for (const auto &blk: blks) serialized << *blk;
+}
+
 void MsgBlameNotify::postponed_parse(HotStuffCore *hsc) {
     bn.hsc = hsc;
     serialized >> bn;
+    parse_inline_blks(serialized, hsc, blks);
+}
+
+const opcode_t MsgProposeChunk::opcode;
+MsgProposeChunk::MsgProposeChunk(ReplicaID proposer, const uint256_t &blk_hash,
+                                const uint256_t &root, uint32_t len,
+                                uint16_t ndata, uint16_t nchunk, uint16_t idx,
+                                const bytearray_t &chunk,
+                                const std::vector<uint256_t> &proof) {
+    serialized << proposer << blk_hash << root
+               << htole(len) << htole(ndata) << htole(nchunk) << htole(idx)
+               << htole((uint32_t)chunk.size());
+    serialized.put_data(chunk.data(), chunk.data() + chunk.size());
+    serialized << htole((uint32_t)proof.size());
+    for (const auto &h: proof) serialized << h;
+}
+
+MsgProposeChunk::MsgProposeChunk(DataStream &&s) {
+    uint32_t size;
+    s >> proposer >> blk_hash >> root >> len >> ndata >> nchunk >> idx >> size;
+    len = letoh(len);
+    ndata = letoh(ndata);
+    nchunk = letoh(nchunk);
+    idx = letoh(idx);
+    size = letoh(size);
+    if (size > s.size())
+        throw std::runtime_error("invalid chunk size");
+    auto base = s.get_data_inplace(size);
+    chunk = bytearray_t(base, base + size);
+    s >> size;
+    size = letoh(size);
+    if (size > s.size() / uint256_nbytes)
+        throw std::runtime_error("invalid merkle proof length");
+    proof.resize(size);
+    for (auto &h: proof) s >> h;
+}
+
+const opcode_t MsgRespCmds::opcode;
+MsgRespCmds::MsgRespCmds(const std::vector<command_t> &cmds) {
+    serialized << htole((uint32_t)cmds.size());
+    for (const auto &cmd: cmds) serialized << *cmd;
+}
+
+void MsgRespCmds::postponed_parse(HotStuffCore *hsc) {
+    uint32_t size;
+    serialized >> size;
+    size = letoh(size);
+    /* each command takes more than one byte */
+    if (size > serialized.size())
+        throw std::runtime_error("invalid number of commands");
+    cmds = hsc->parse_cmds(serialized, size);
+}
+
+const opcode_t MsgReqCmds::opcode;
+MsgReqCmds::MsgReqCmds(const std::vector<uint256_t> &cmd_hashes) {
+    serialized << htole((uint32_t)cmd_hashes.size());
+    for (const auto &h: cmd_hashes)
+        serialized << h;
+}
+
+MsgReqCmds::MsgReqCmds(DataStream &&s) {
+    uint32_t size;
+    s >> size;
+    size = letoh(size);
+    if (size > s.size() / uint256_nbytes)
+        throw std::runtime_error("invalid number of command hashes");
+    cmd_hashes.resize(size);
+    for (auto &h: cmd_hashes) s >> h;
 }
 
 const opcode_t MsgReqBlock::opcode;
@@ -83,17 +192,76 @@ MsgRespBlock::MsgRespBlock(const std::vector<block_t> &blks) {
     for (auto blk: blks) serialized << *blk;
 }
 
+MsgRespBlock::MsgRespBlock(const BlockArchive &archive,
+                            const std::vector<uint256_t> &blk_hashes) {
+    serialized << htole((uint32_t)blk_hashes.size());
+    for (const auto &h: blk_hashes)
+    {
+        const uint8_t *data;
+        size_t size;
+        if (!archive.get(h, data, size))
+            throw HotStuffError("block %s not archived", get_hex10(h).c_str());
+        serialized.put_data(data, data + size);
+    }
+}
+
 void MsgRespBlock::postponed_parse(HotStuffCore *hsc) {
     uint32_t size;
     serialized >> size;
     size = letoh(size);
-    blks.resize(size);
-    for (auto &blk: blks)
-    {
-        Block _blk;
-        _blk.unserialize(serialized, hsc);
-        blk = hsc->storage->add_blk(std::move(_blk), hsc->get_config());
-    }
+    /* each block takes more than one byte */
+    if (size > serialized.size())
+        throw std::runtime_error("invalid number of blocks");
+    blks = Block::parse_batch(serialized, size, hsc);
+}
+
+const opcode_t MsgReqBlockRange::opcode;
+MsgReqBlockRange::MsgReqBlockRange(const uint256_t &end_hash,
+                                    uint32_t start_height,
+                                    uint32_t chunk_size,
+                                    uint32_t stripe,
+                                    uint32_t nstripe) {
+    serialized << end_hash
+               << htole(start_height) << htole(chunk_size)
+               << htole(stripe) << htole(nstripe);
+}
+
+MsgReqBlockRange::MsgReqBlockRange(DataStream &&s) {
+    s >> end_hash >> start_height >> chunk_size >> stripe >> nstripe;
+    start_height = letoh(start_height);
+    chunk_size = letoh(chunk_size);
+    stripe = letoh(stripe);
+    nstripe = letoh(nstripe);
+}
+
+const opcode_t MsgRespBlockRange::opcode;
+MsgRespBlockRange::MsgRespBlockRange(const uint256_t &end_hash,
+                                    uint32_t start_height,
+                                    uint32_t chunk_idx,
+                                    uint32_t nchunk,
+                                    std::vector<block_t>::const_iterator begin,
+                                    std::vector<block_t>::const_iterator end) {
+    serialized << end_hash
+               << htole(start_height) << htole(chunk_idx) << htole(nchunk)
+               << htole((uint32_t)(end - begin));
+    for (auto it = begin; it != end; it++) serialized << **it;
+}
+
+MsgRespBlockRange::MsgRespBlockRange(DataStream &&s): serialized(std::move(s)) {
+    serialized >> end_hash >> start_height >> chunk_idx >> nchunk;
+    start_height = letoh(start_height);
+    chunk_idx = letoh(chunk_idx);
+    nchunk = letoh(nchunk);
+}
+
+void MsgRespBlockRange::postponed_parse(HotStuffCore *hsc) {
+    uint32_t size;
+    serialized >> size;
+    size = letoh(size);
+    /* each block takes more than one byte */
+    if (size > serialized.size())
+        throw std::runtime_error("invalid number of blocks");
+    blks = Block::parse_batch(serialized, size, hsc);
 }
 
 // TODO: improve this function
@@ -101,6 +269,100 @@ void HotStuffBase::exec_command(uint256_t cmd_hash, commit_cb_t callback) {
     cmd_pending.enqueue(std::make_pair(cmd_hash, callback));
 }
 
+void HotStuffBase::add_cmd(const command_t &cmd) {
+    if (mempool_enabled) cmd_arrived.enqueue(cmd);
+}
+
+void HotStuffBase::on_fetch_cmd(const command_t &cmd) {
+    const uint256_t &cmd_hash = cmd->get_hash();
+    auto it = cmd_fetch_waiting.find(cmd_hash);
+    if (it != cmd_fetch_waiting.end())
+    {
+        it->second.resolve(cmd);
+        cmd_fetch_waiting.erase(it);
+    }
+    if (cmd_awaiting_payload.erase(cmd_hash))
+        queue_proposal_cmd(cmd_hash);
+}
+
+void HotStuffBase::on_client_cmd(const command_t &cmd) {
+    const uint256_t &cmd_hash = cmd->get_hash();
+    bool fresh = !storage->is_cmd_fetched(cmd_hash);
+    storage->add_cmd(cmd);
+    mempool.mark_known(cmd_hash, get_id());
+    if (!fresh) return;
+    on_fetch_cmd(cmd);
+    mempool.queue_gossip(cmd_hash);
+    if (mempool.get_outbox_size() >= gossip_batch)
+        gossip_flush();
+    else if (mempool.get_outbox_size() == 1)
+        gossip_timer.add(gossip_linger);
+}
+
+void HotStuffBase::gossip_flush() {
+    gossip_timer.del();
+    auto cmd_hashes = mempool.take_outbox();
+    if (cmd_hashes.empty()) return;
+    /* most peers have none of them, so share one message among those */
+    std::vector<NetAddr> full;
+    for (const auto &replica: peers)
+    {
+        auto unknown = mempool.pick_unknown(peer_rids[replica], cmd_hashes);
+        if (unknown.size() == cmd_hashes.size())
+        {
+            full.push_back(replica);
+            continue;
+        }
+        std::vector<command_t> cmds;
+        for (const auto &h: unknown)
+            if (auto cmd = storage->find_cmd(h)) cmds.push_back(cmd);
+        if (!cmds.empty()) send_msg(MsgRespCmds(cmds), replica);
+    }
+    if (full.empty()) return;
+    std::vector<command_t> cmds;
+    for (const auto &h: cmd_hashes)
+        if (auto cmd = storage->find_cmd(h)) cmds.push_back(cmd);
+    MsgRespCmds m(cmds);
+    if (metrics.is_enabled())
+        for (const auto &replica: full)
+            count_msg(replica, m.serialized.size(), true);
+    pn.multicast_msg(std::move(m), full);
+}
+
+promise_t HotStuffBase::async_fetch_cmd(const uint256_t &cmd_hash,
+                                        const NetAddr *replica_id,
+                                        bool fetch_now) {
+    if (storage->is_cmd_fetched(cmd_hash))
+        return promise_t([this, &cmd_hash](promise_t pm){
+            pm.resolve(storage->find_cmd(cmd_hash));
+        });
+    auto it = cmd_fetch_waiting.find(cmd_hash);
+    if (it == cmd_fetch_waiting.end())
+        it = cmd_fetch_waiting.insert(
+            std::make_pair(
+                cmd_hash,
+                CmdFetchContext(cmd_hash, this))).first;
+    if (replica_id != nullptr)
+        it->second.add_replica(*replica_id, fetch_now);
+    return static_cast<promise_t &>(it->second);
+}
+
+promise_t HotStuffBase::async_fetch_cmds(const block_t &blk, const NetAddr &replica) {
+    std::vector<promise_t> pms;
+    std::vector<uint256_t> missing;
+    for (const auto &cmd_hash: blk->get_cmds())
+    {
+        if (storage->is_cmd_fetched(cmd_hash)) continue;
+        if (!cmd_fetch_waiting.count(cmd_hash))
+            missing.push_back(cmd_hash);
+        /* the requests are sent below in one message */
+        pms.push_back(async_fetch_cmd(cmd_hash, &replica, false));
+    }
+    if (!missing.empty())
+        send_msg(MsgReqCmds(missing), replica);
+    return promise::all(pms);
+}
+
 void HotStuffBase::on_fetch_blk(const block_t &blk) {
 #ifdef HOTSTUFF_BLK_PROFILE
     blk_profiler.get_tx(blk->get_hash());
@@ -108,14 +370,21 @@ void HotStuffBase::on_fetch_blk(const block_t &blk) {
     LOG_DEBUG("fetched %.10s", get_hex(blk->get_hash()).c_str());
     part_fetched++;
     fetched++;
+    if (metrics.is_enabled()) m_fetched->inc();
     //for (auto cmd: blk->get_cmds()) on_fetch_cmd(cmd);
     const uint256_t &blk_hash = blk->get_hash();
     auto it = blk_fetch_waiting.find(blk_hash);
     if (it != blk_fetch_waiting.end())
     {
+        if (metrics.is_enabled())
+        {
+            it->second.elapsed.stop(false);
+            m_fetch_time->observe(it->second.elapsed.elapsed_sec);
+        }
         it->second.resolve(blk);
         blk_fetch_waiting.erase(it);
     }
+    dsched.on_fetch(blk);
 }
 
 void HotStuffBase::on_deliver_blk(const block_t &blk) {
@@ -131,33 +400,191 @@ void HotStuffBase::on_deliver_blk(const block_t &blk) {
         part_parent_size += blk->get_parent_hashes().size();
         part_delivered++;
         delivered++;
+        if (metrics.is_enabled()) m_delivered->inc();
     }
     else
     {
         LOG_WARN("dropping invalid block");
     }
+    dsched.on_deliver(blk_hash, blk, valid);
+}
 
-    auto it = blk_delivery_waiting.find(blk_hash);
-    if (it != blk_delivery_waiting.end())
+DeliveryEntry &DeliveryScheduler::get_entry(const uint256_t &blk_hash) {
+    auto it = pending.find(blk_hash);
+    if (it == pending.end())
+        it = pending.insert(std::make_pair(blk_hash,
+                                        DeliveryEntry(next_id++))).first;
+    return it->second;
+}
+
+DeliveryEntry *DeliveryScheduler::find_entry(const dep_t &dep) {
+    auto it = pending.find(dep.first);
+    if (it == pending.end() || it->second.id != dep.second) return nullptr;
+    return &it->second;
+}
+
+promise_t DeliveryScheduler::schedule(const uint256_t &blk_hash,
+                                    const NetAddr &replica) {
+    auto &storage = hs->storage;
+    if (storage->is_blk_delivered(blk_hash))
+        return promise_t([&storage, &blk_hash](promise_t pm) {
+            pm.resolve(storage->find_blk(blk_hash));
+        });
+    auto &e = get_entry(blk_hash);
+    /* hold the promise, as the entry may be gone once the block is
+     * delivered below */
+    promise_t pm = static_cast<promise_t &>(e.pm);
+    if (!e.blk)
     {
-        auto &pm = it->second;
-        if (valid)
-        {
-            pm.elapsed.stop(false);
-            auto sec = pm.elapsed.elapsed_sec;
-            part_delivery_time += sec;
-            part_delivery_time_min = std::min(part_delivery_time_min, sec);
-            part_delivery_time_max = std::max(part_delivery_time_max, sec);
+        bool first = !e.scheduled;
+        e.scheduled = true;
+        if (first) e.replica = replica;
+        /* the block may have come with a proposal instead of a fetch */
+        if (storage->is_blk_fetched(blk_hash))
+            resolve_deps(blk_hash, storage->find_blk(blk_hash));
+        else if (first)
+            hs->async_fetch_blk(blk_hash, &replica);
+    }
+    return pm;
+}
 
-            pm.resolve(blk);
-        }
+promise_t DeliveryScheduler::reserve(const uint256_t &blk_hash) {
+    return static_cast<promise_t &>(get_entry(blk_hash).pm);
+}
+
+void DeliveryScheduler::resolve_deps(const uint256_t &blk_hash, const block_t &blk) {
+    auto &storage = hs->storage;
+    auto &e = pending.at(blk_hash);
+    const dep_t self{blk_hash, e.id};
+    const NetAddr replica = e.replica;
+    e.blk = blk;
+    /* hold the entry back until all its dependencies are counted */
+    e.nmissing = 1;
+    /* the signatures do not depend on the ancestors, so check them now */
+    if (blk != hs->get_genesis())
+    {
+        e.nmissing++;
+        blk->verify(hs->get_config(), hs->vpool, hs->vcache).then(
+                [this, self](bool valid) {
+            auto e = find_entry(self);
+            if (e == nullptr) return;
+            if (valid)
+                satisfy(self);
+            else
+            {
+                HOTSTUFF_LOG_WARN("invalid block %.10s",
+                                get_hex(self.first).c_str());
+                on_deliver(self.first, e->blk, false);
+            }
+            release();
+        });
+    }
+    if (blk->get_qc() && !storage->is_blk_fetched(blk->get_qc_ref_hash()))
+    {
+        const auto &qc_ref_hash = blk->get_qc_ref_hash();
+        fetch_dependents[qc_ref_hash].push_back(self);
+        pending.at(blk_hash).nmissing++;
+        hs->async_fetch_blk(qc_ref_hash, &replica);
+    }
+    /* a missing main parent means the replica is lagging behind, so catch
+     * up in ranges */
+    const auto &phashes = blk->get_parent_hashes();
+    for (size_t i = 0; i < phashes.size(); i++)
+    {
+        const auto &phash = phashes[i];
+        if (storage->is_blk_delivered(phash)) continue;
+        if (i == 0)
+            hs->async_sync_blk(phash, replica);
         else
+            schedule(phash, replica);
+        /* the parent may have been delivered (or rejected) on the spot,
+         * which may in turn have rejected this block */
+        if (find_entry(self) == nullptr) return;
+        if (storage->is_blk_delivered(phash)) continue;
+        auto pit = pending.find(phash);
+        if (pit == pending.end())
         {
-            pm.reject(blk);
-            // TODO: do we need to also free it from storage?
+            on_deliver(blk_hash, blk, false);
+            return;
         }
-        blk_delivery_waiting.erase(it);
+        pit->second.dependents.push_back(self);
+        pending.at(blk_hash).nmissing++;
     }
+    satisfy(self);
+    release();
+}
+
+void DeliveryScheduler::satisfy(const dep_t &dep) {
+    auto e = find_entry(dep);
+    if (e && --e->nmissing == 0) ready.push_back(dep.first);
+}
+
+void DeliveryScheduler::release() {
+    if (releasing) return;
+    releasing = true;
+    /* delivering a block appends its dependents that become ready to the
+     * batch, so the whole batch goes out in topological order */
+    for (size_t i = 0; i < ready.size(); i++)
+    {
+        auto it = pending.find(ready[i]);
+        if (it == pending.end() || it->second.nmissing) continue;
+        block_t blk = it->second.blk;
+        hs->on_deliver_blk(blk);
+    }
+    ready.clear();
+    releasing = false;
+}
+
+void DeliveryScheduler::on_fetch(const block_t &blk) {
+    const uint256_t &blk_hash = blk->get_hash();
+    auto it = pending.find(blk_hash);
+    if (it != pending.end() && it->second.scheduled && !it->second.blk)
+        resolve_deps(blk_hash, blk);
+    auto fit = fetch_dependents.find(blk_hash);
+    if (fit == fetch_dependents.end()) return;
+    auto deps = std::move(fit->second);
+    fetch_dependents.erase(fit);
+    for (const auto &dep: deps) satisfy(dep);
+    release();
+}
+
+void DeliveryScheduler::on_deliver(const uint256_t &blk_hash,
+                                    const block_t &blk, bool valid) {
+    auto it = pending.find(blk_hash);
+    if (it == pending.end()) return;
+    if (valid)
+    {
+        DeliveryEntry e = std::move(it->second);
+        pending.erase(it);
+        e.pm.elapsed.stop(false);
+        auto sec = e.pm.elapsed.elapsed_sec;
+        hs->part_delivery_time += sec;
+        hs->part_delivery_time_min = std::min(hs->part_delivery_time_min, sec);
+        hs->part_delivery_time_max = std::max(hs->part_delivery_time_max, sec);
+        if (hs->metrics.is_enabled()) hs->m_delivery_time->observe(sec);
+        for (const auto &dep: e.dependents) satisfy(dep);
+        e.pm.resolve(blk);
+        release();
+        return;
+    }
+    /* nothing that depends on an invalid block can be delivered */
+    std::vector<std::pair<DeliveryEntry, block_t>> rejected;
+    rejected.push_back(std::make_pair(std::move(it->second), blk));
+    pending.erase(it);
+    for (size_t i = 0; i < rejected.size(); i++)
+    {
+        auto deps = rejected[i].first.dependents;
+        for (const auto &dep: deps)
+        {
+            auto e = find_entry(dep);
+            if (e == nullptr) continue;
+            block_t dblk = e->blk;
+            rejected.push_back(std::make_pair(std::move(*e), dblk));
+            pending.erase(dep.first);
+        }
+    }
+    // TODO: do we need to also free them from storage?
+    for (auto &r: rejected) r.first.pm.reject(r.second);
 }
 
 promise_t HotStuffBase::async_fetch_blk(const uint256_t &blk_hash,
@@ -178,6 +605,8 @@ promise_t HotStuffBase::async_fetch_blk(const uint256_t &blk_hash,
                 blk_hash,
                 BlockFetchContext(blk_hash, this))).first;
     }
+    /* the block is being recovered from the chunks of its proposal */
+    if (chunk_waiting.count(blk_hash)) fetch_now = false;
     if (replica_id != nullptr)
         it->second.add_replica(*replica_id, fetch_now);
     return static_cast<promise_t &>(it->second);
@@ -185,108 +614,646 @@ promise_t HotStuffBase::async_fetch_blk(const uint256_t &blk_hash,
 
 promise_t HotStuffBase::async_deliver_blk(const uint256_t &blk_hash,
                                         const NetAddr &replica_id) {
-    if (storage->is_blk_delivered(blk_hash))
-        return promise_t([this, &blk_hash](promise_t pm) {
-            pm.resolve(storage->find_blk(blk_hash));
-        });
-    auto it = blk_delivery_waiting.find(blk_hash);
-    if (it != blk_delivery_waiting.end())
-        return static_cast<promise_t &>(it->second);
-    BlockDeliveryContext pm{[](promise_t){}};
-    it = blk_delivery_waiting.insert(std::make_pair(blk_hash, pm)).first;
-    /* otherwise the on_deliver_batch will resolve */
-    async_fetch_blk(blk_hash, &replica_id).then([this, replica_id](block_t blk) {
-        /* qc_ref should be fetched */
-        std::vector<promise_t> pms;
-        const auto &qc = blk->get_qc();
-        if (qc)
-            pms.push_back(async_fetch_blk(blk->get_qc_ref_hash(), &replica_id));
-        /* the parents should be delivered */
-        for (const auto &phash: blk->get_parent_hashes())
-            pms.push_back(async_deliver_blk(phash, replica_id));
-        if (blk != get_genesis())
-            pms.push_back(blk->verify(get_config(), vpool));
-        promise::all(pms).then([this, blk]() {
-            on_deliver_blk(blk);
-        });
+    return dsched.schedule(blk_hash, replica_id);
+}
+
+promise_t HotStuffBase::async_sync_blk(const uint256_t &blk_hash,
+                                    const NetAddr &replica_id) {
+    if (storage->is_blk_fetched(blk_hash) || dsched.is_pending(blk_hash))
+        return async_deliver_blk(blk_hash, replica_id);
+    promise_t pm = dsched.reserve(blk_hash);
+    /* the range starts right above the highest block delivered so far */
+    uint32_t start_height = (*get_tails().rbegin())->get_height() + 1;
+    auto &ctx = range_sync_waiting.insert(std::make_pair(blk_hash,
+        new RangeSyncContext(blk_hash, start_height))).first->second;
+    ctx->replicas.push_back(replica_id);
+    for (const auto &peer: peers)
+    {
+        if (ctx->replicas.size() >= range_sync_nstripe) break;
+        if (peer != replica_id) ctx->replicas.push_back(peer);
+    }
+    ctx->timeout = TimerEvent(ec, [this, blk_hash](TimerEvent &) {
+        auto it = range_sync_waiting.find(blk_hash);
+        auto &ctx = *it->second;
+        if (!ctx.delivering)
+        {
+            HOTSTUFF_LOG_WARN("range sync %.10s timeout",
+                            get_hex(blk_hash).c_str());
+            /* restart from where the delivery is, with the peer that is
+             * known to have the block */
+            ctx.start_height += ctx.next_chunk * range_sync_chunk_size;
+            ctx.nchunk = 0;
+            ctx.next_chunk = 0;
+            ctx.linked = 0;
+            ctx.link_hash = blk_hash;
+            ctx.chunks.clear();
+            ctx.replicas.resize(1);
+            range_sync_send(ctx, 0, 1);
+        }
+        ctx.timeout.add(salticidae::gen_rand_timeout(ent_waiting_timeout));
+    });
+    /* only ask the other peers once the range is known to be long enough */
+    range_sync_send(*ctx, 0, 1);
+    ctx->timeout.add(salticidae::gen_rand_timeout(ent_waiting_timeout));
+    LOG_INFO("range sync %.10s from height %u",
+            get_hex(blk_hash).c_str(), start_height);
+    return pm;
+}
+
+void HotStuffBase::range_sync_send(RangeSyncContext &ctx,
+                                    uint32_t first, uint32_t last) {
+    uint32_t nstripe = ctx.replicas.size();
+    for (uint32_t i = first; i < last; i++)
+    {
+        part_fetched_replica[ctx.replicas[i]]++;
+        send_msg(MsgReqBlockRange(ctx.end_hash, ctx.start_height,
+                                    range_sync_chunk_size, i, nstripe),
+                    ctx.replicas[i]);
+    }
+}
+
+void HotStuffBase::range_sync_link(RangeSyncContext &ctx) {
+    while (ctx.linked > ctx.next_chunk)
+    {
+        uint32_t idx = ctx.linked - 1;
+        auto cit = ctx.chunks.find(idx);
+        if (cit == ctx.chunks.end()) return;
+        auto &blks = cit->second;
+        /* all chunks but the top one are full, and each block is the
+         * main parent of the one above */
+        bool valid = !blks.empty() && blks.size() <= range_sync_chunk_size &&
+                    (idx + 1 == ctx.nchunk || blks.size() == range_sync_chunk_size) &&
+                    blks.back()->get_hash() == ctx.link_hash;
+        for (size_t i = 0; valid && i < blks.size(); i++)
+            valid = !blks[i]->get_parent_hashes().empty() &&
+                    (i == 0 || blks[i]->get_parent_hashes()[0] == blks[i - 1]->get_hash());
+        if (!valid)
+        {
+            /* wait for the timeout to fetch it again */
+            LOG_WARN("chunk %u of range sync %.10s does not link up",
+                    idx, get_hex(ctx.end_hash).c_str());
+            ctx.chunks.erase(cit);
+            return;
+        }
+        for (auto &blk: blks)
+        {
+            blk = storage->add_blk(blk);
+            on_fetch_blk(blk);
+        }
+        ctx.link_hash = blks[0]->get_parent_hashes()[0];
+        ctx.linked = idx;
+    }
+}
+
+void HotStuffBase::range_sync_finish(const uint256_t &end_hash) {
+    auto it = range_sync_waiting.find(end_hash);
+    if (it == range_sync_waiting.end()) return;
+    it->second->timeout.del();
+    range_sync_waiting.erase(it);
+}
+
+void HotStuffBase::range_sync_deliver(const uint256_t &end_hash) {
+    auto it = range_sync_waiting.find(end_hash);
+    if (it == range_sync_waiting.end()) return;
+    auto &ctx = *it->second;
+    if (ctx.delivering) return;
+    if (storage->is_blk_delivered(end_hash) ||
+        (ctx.nchunk && ctx.next_chunk >= ctx.nchunk))
+    {
+        range_sync_finish(end_hash);
+        return;
+    }
+    /* a chunk can only be trusted once the ones above it are */
+    if (ctx.next_chunk < ctx.linked) return;
+    auto cit = ctx.chunks.find(ctx.next_chunk);
+    if (cit == ctx.chunks.end()) return;
+    std::vector<block_t> blks = std::move(cit->second);
+    ctx.chunks.erase(cit);
+    ctx.delivering = true;
+    /* verify the whole chunk at once, then deliver it bottom-up */
+    std::vector<promise_t> pms;
+    for (const auto &blk: blks)
+        pms.push_back(blk->verify(get_config(), vpool, vcache));
+    NetAddr replica_id = ctx.replicas[0];
+    promise::all(pms).then([this, end_hash, blks, replica_id](
+                                    const promise::values_t values) {
+        auto it = range_sync_waiting.find(end_hash);
+        if (it == range_sync_waiting.end()) return;
+        auto &ctx = *it->second;
+        for (size_t i = 0; i < blks.size(); i++)
+        {
+            const auto &blk = blks[i];
+            if (blk->is_delivered()) continue;
+            if (!promise::any_cast<bool>(values[i]))
+            {
+                LOG_WARN("invalid block %.10s in range sync",
+                        get_hex(blk->get_hash()).c_str());
+                dsched.on_deliver(end_hash, blk, false);
+                range_sync_finish(end_hash);
+                return;
+            }
+            bool ready = !blk->get_qc() ||
+                        storage->is_blk_fetched(blk->get_qc_ref_hash());
+            for (const auto &phash: blk->get_parent_hashes())
+                ready = ready && storage->is_blk_delivered(phash);
+            if (ready)
+                on_deliver_blk(blk);
+            else /* the block also refers to blocks out of the range */
+                async_deliver_blk(blk->get_hash(), replica_id);
+        }
+        ctx.delivering = false;
+        ctx.next_chunk++;
+        ctx.timeout.del();
+        ctx.timeout.add(salticidae::gen_rand_timeout(ent_waiting_timeout));
+        range_sync_deliver(end_hash);
+    });
+}
+
+void HotStuffBase::req_cmds_handler(MsgReqCmds &&msg, const Net::conn_t &conn) {
+    count_recv(msg, conn);
+    const NetAddr replica = conn->get_peer_addr();
+    if (replica.is_null()) return;
+    auto it = peer_rids.find(replica);
+    if (it == peer_rids.end()) return;
+    std::vector<command_t> cmds;
+    for (const auto &h: msg.cmd_hashes)
+        if (auto cmd = storage->find_cmd(h))
+        {
+            cmds.push_back(cmd);
+            mempool.mark_known(h, it->second);
+        }
+    if (!cmds.empty())
+        send_msg(MsgRespCmds(cmds), replica);
+}
+
+void HotStuffBase::resp_cmds_handler(MsgRespCmds &&msg, const Net::conn_t &conn) {
+    count_recv(msg, conn);
+    const NetAddr replica = conn->get_peer_addr();
+    if (replica.is_null()) return;
+    auto it = peer_rids.find(replica);
+    if (it == peer_rids.end()) return;
+    ReplicaID rid = it->second;
+    parse_msg(std::move(msg), [this, rid](MsgRespCmds &msg) {
+        for (const auto &cmd: msg.cmds)
+        {
+            if (!cmd->verify()) continue;
+            const auto &cmd_hash = cmd->get_hash();
+            mempool.mark_known(cmd_hash, rid);
+            if (storage->is_cmd_fetched(cmd_hash)) continue;
+            storage->add_cmd(cmd);
+            mempool.mark_known(cmd_hash, get_id());
+            on_fetch_cmd(cmd);
+        }
+    });
+}
+
+void HotStuffBase::req_blk_range_handler(MsgReqBlockRange &&msg, const Net::conn_t &conn) {
+    count_recv(msg, conn);
+    const NetAddr replica = conn->get_peer_addr();
+    if (replica.is_null()) return;
+    if (msg.chunk_size == 0 || msg.nstripe == 0) return;
+    block_t blk = storage->find_blk(msg.end_hash);
+    if (blk == nullptr || !blk->is_delivered() ||
+        blk->get_height() < msg.start_height)
+    {
+        std::vector<block_t> none;
+        send_msg(MsgRespBlockRange(msg.end_hash, msg.start_height, 0, 0,
+                                    none.begin(), none.end()), replica);
+        return;
+    }
+    uint32_t end_height = blk->get_height();
+    uint32_t nchunk = (end_height - msg.start_height) / msg.chunk_size + 1;
+    /* walk down the main chain (past the pruned blocks via the archive),
+     * stop early where the chain is no longer kept */
+    std::vector<block_t> blks;
+    for (;;)
+    {
+        blks.push_back(blk);
+        if (end_height - (blks.size() - 1) <= msg.start_height) break;
+        if (!blk->get_parents().empty())
+            blk = blk->get_parents()[0];
+        else if (blk->get_parent_hashes().empty() ||
+                !(blk = storage->find_blk(blk->get_parent_hashes()[0])))
+            break;
+    }
+    std::reverse(blks.begin(), blks.end());
+    uint32_t low_height = end_height - (blks.size() - 1);
+    for (uint32_t i = msg.stripe; i < nchunk; i += msg.nstripe)
+    {
+        /* chunk i starts at an absolute height, so that peers with
+         * different chains kept agree on it */
+        uint32_t begin = msg.start_height + i * msg.chunk_size;
+        uint32_t end = std::min(begin + msg.chunk_size, end_height + 1);
+        if (begin < low_height) continue;
+        send_msg(MsgRespBlockRange(msg.end_hash, msg.start_height,
+                                    i, nchunk,
+                                    blks.begin() + (begin - low_height),
+                                    blks.begin() + (end - low_height)), replica);
+    }
+}
+
+void HotStuffBase::resp_blk_range_handler(MsgRespBlockRange &&msg, const Net::conn_t &conn) {
+    count_recv(msg, conn);
+    parse_msg(std::move(msg), [this](MsgRespBlockRange &msg) {
+        auto it = range_sync_waiting.find(msg.end_hash);
+        if (it == range_sync_waiting.end()) return;
+        auto &ctx = *it->second;
+        /* drop the responses to a request that has been restarted */
+        if (msg.start_height != ctx.start_height ||
+            msg.nchunk == 0 || msg.chunk_idx < ctx.next_chunk) return;
+        if (ctx.nchunk == 0)
+        {
+            /* the size of the range is fixed by the first response, and
+             * the other peers are asked for their stripes now */
+            ctx.nchunk = ctx.linked = msg.nchunk;
+            uint32_t nstripe = std::min((uint32_t)ctx.replicas.size(), ctx.nchunk);
+            if (nstripe > 1) range_sync_send(ctx, 1, nstripe);
+        }
+        if (msg.nchunk != ctx.nchunk || msg.chunk_idx >= ctx.nchunk) return;
+        ctx.chunks[msg.chunk_idx] = std::move(msg.blks);
+        range_sync_link(ctx);
+        range_sync_deliver(msg.end_hash);
     });
-    return static_cast<promise_t &>(pm);
 }
 
 void HotStuffBase::propose_handler(MsgPropose &&msg, const Net::conn_t &conn) {
-    const NetAddr &peer = conn->get_peer_addr();
+    count_recv(msg, conn);
+    const NetAddr peer = conn->get_peer_addr();
     if (peer.is_null()) return;
-    msg.postponed_parse(this);
-    auto &prop = msg.proposal;
-    block_t blk = prop.blk;
-    if (!blk) return;
-    promise::all(std::vector<promise_t>{
-        async_deliver_blk(blk->get_hash(), peer)
-    }).then([this, prop = std::move(prop)]() {
+    parse_msg(std::move(msg), [this, peer](MsgPropose &msg) {
+        if (!msg.proposal.blk) return;
+        on_proposal_parsed(msg.proposal, peer);
+    });
+}
+
+void HotStuffBase::on_proposal_parsed(Proposal &prop, const NetAddr &peer) {
+    /* already committed and pruned, do not bring it back into memory */
+    if (storage->is_blk_archived(prop.blk->get_hash())) return;
+    block_t blk = prop.blk = storage->add_blk(prop.blk);
+    if (vote_fanout && !coded_proposal && prop.proposer != get_id() &&
+        prop.proposer < get_config().nreplicas)
+    {
+        /* pass it down the tree before waiting for the delivery */
+        auto &ctx = get_vote_relay(blk->get_hash(), prop.proposer);
+        if (!ctx.prop_relayed)
+        {
+            ctx.prop_relayed = true;
+            relay_proposal(prop, ctx.root);
+        }
+    }
+    std::vector<promise_t> pms{async_deliver_blk(blk->get_hash(), peer)};
+    /* only vote for the block once the payloads are known to be here */
+    if (mempool_enabled) pms.push_back(async_fetch_cmds(blk, peer));
+    promise::all(pms).then([this, prop = std::move(prop)]() {
         on_receive_proposal(prop);
     });
 }
 
+void HotStuffBase::broadcast_compact_proposal(const Proposal &prop) {
+    MsgProposeCompact m(prop, mempool_enabled ?
+        std::function<bool(const uint256_t &)>([this](const uint256_t &cmd_hash) {
+            return mempool.is_short_safe(cmd_hash);
+        }) : nullptr);
+    if (metrics.is_enabled())
+        for (const auto &replica: peers)
+            count_msg(replica, m.serialized.size(), true);
+    pn.multicast_msg(std::move(m), peers);
+}
+
+void HotStuffBase::propose_compact_handler(MsgProposeCompact &&msg, const Net::conn_t &conn) {
+    count_recv(msg, conn);
+    const NetAddr peer = conn->get_peer_addr();
+    if (peer.is_null()) return;
+    parse_msg(std::move(msg), [this, peer](MsgProposeCompact &msg) {
+        auto &prop = msg.proposal;
+        if (!prop.blk) return;
+        if (prop.blk->finish_compact([this](uint64_t sid, uint256_t &cmd_hash) {
+                return mempool.lookup_short(sid, cmd_hash);
+            }) && prop.blk->get_hash() == msg.blk_hash)
+        {
+            on_proposal_parsed(prop, peer);
+            return;
+        }
+        /* some command is unknown here (or the hash is off), so take the
+         * block in full */
+        HOTSTUFF_LOG_DEBUG("fetching compact proposal %s in full",
+                            get_hex10(msg.blk_hash).c_str());
+        async_fetch_blk(msg.blk_hash, &peer).then(
+                [this, proposer=prop.proposer, peer](const block_t &blk) {
+            Proposal p(proposer, blk, this);
+            on_proposal_parsed(p, peer);
+        });
+    });
+}
+
+void HotStuffBase::broadcast_coded_proposal(const Proposal &prop) {
+    auto &config = get_config();
+    size_t n = config.nreplicas;
+    size_t ndata = n - config.nmajority;
+    if (ndata == 0 || n > 256)
+    {
+        _do_broadcast<Proposal, MsgPropose>(prop);
+        return;
+    }
+    DataStream s;
+    s << prop;
+    ReedSolomon rs(ndata, n);
+    auto chunks = rs.encode(s.data(), s.size());
+    std::vector<uint256_t> leaves;
+    for (const auto &c: chunks)
+        leaves.push_back(DataStream(c).get_hash());
+    uint256_t root = merkle_root(leaves);
+    const auto &blk_hash = prop.blk->get_hash();
+    for (size_t i = 0; i < n; i++)
+    {
+        if (i == get_id()) continue;
+        send_msg(MsgProposeChunk(get_id(), blk_hash, root, s.size(),
+                                ndata, n, i, chunks[i],
+                                merkle_proof(leaves, i)),
+                config.get_addr(i));
+    }
+}
+
+void HotStuffBase::propose_chunk_handler(MsgProposeChunk &&msg, const Net::conn_t &conn) {
+    count_recv(msg, conn);
+    const NetAddr peer = conn->get_peer_addr();
+    if (peer.is_null()) return;
+    auto &config = get_config();
+    size_t n = config.nreplicas;
+    if (msg.nchunk != n || msg.ndata == 0 || msg.ndata > n ||
+        msg.idx >= n || msg.proposer >= n || msg.proposer == get_id() ||
+        msg.len == 0 || msg.chunk.size() != (msg.len + msg.ndata - 1) / msg.ndata)
+        return;
+    /* a chunk only comes from the proposer (to its owner) or its owner */
+    bool from_proposer = peer == config.get_addr(msg.proposer);
+    if (!from_proposer && peer != config.get_addr(msg.idx)) return;
+    if (!merkle_verify(msg.root, DataStream(msg.chunk).get_hash(),
+                        msg.idx, msg.nchunk, msg.proof))
+    {
+        LOG_WARN("invalid proposal chunk from %s", std::string(peer).c_str());
+        return;
+    }
+    auto it = chunk_waiting.find(msg.blk_hash);
+    if (it == chunk_waiting.end())
+    {
+        if (storage->is_blk_fetched(msg.blk_hash) && !from_proposer) return;
+        it = chunk_waiting.insert(std::make_pair(msg.blk_hash,
+                                    ProposalChunkContext())).first;
+        timers.add(config.delta,
+                [this, blk_hash=msg.blk_hash]() {
+            chunk_waiting_expire(blk_hash);
+        });
+    }
+    auto &ctx = it->second;
+    if (from_proposer && msg.idx == get_id() && !ctx.forwarded)
+    {
+        ctx.forwarded = true;
+        std::vector<NetAddr> others;
+        for (const auto &replica: peers)
+            if (replica != peer) others.push_back(replica);
+        MsgProposeChunk m(msg.proposer, msg.blk_hash, msg.root, msg.len,
+                        msg.ndata, msg.nchunk, msg.idx, msg.chunk, msg.proof);
+        if (metrics.is_enabled())
+            for (const auto &replica: others)
+                count_msg(replica, m.serialized.size(), true);
+        pn.multicast_msg(std::move(m), others);
+    }
+    if (ctx.decoded || storage->is_blk_fetched(msg.blk_hash)) return;
+    ctx.chunks[msg.root][msg.idx] = std::move(msg.chunk);
+    try_decode_proposal(msg);
+}
+
+void HotStuffBase::try_decode_proposal(const MsgProposeChunk &msg) {
+    auto &ctx = chunk_waiting.find(msg.blk_hash)->second;
+    if (ctx.decoded || ctx.bad_roots.count(msg.root)) return;
+    auto &chunks = ctx.chunks[msg.root];
+    if (chunks.size() < msg.ndata) return;
+    ReedSolomon rs(msg.ndata, msg.nchunk);
+    bytearray_t data;
+    if (!rs.decode(chunks, msg.len, data)) return;
+    const NetAddr proposer = get_config().get_addr(msg.proposer);
+    /* each chunk is checked against the root on its own, but only the
+     * chunks of a codeword decode to the same data whichever of them are
+     * used: encode it again to see that the proposer sent one */
+    std::vector<uint256_t> leaves;
+    for (const auto &c: rs.encode(data.data(), msg.len))
+        leaves.push_back(DataStream(c).get_hash());
+    if (merkle_root(leaves) != msg.root)
+    {
+        LOG_WARN("chunks of %.10s are not a codeword",
+                get_hex(msg.blk_hash).c_str());
+        on_decode_proposal_failed(msg.blk_hash, msg.root, proposer);
+        return;
+    }
+    /* keep the context (and the forwarded flag) until it expires, but drop
+     * the chunks */
+    ctx.decoded = true;
+    ctx.chunks.clear();
+    parse_msg(MsgPropose(DataStream(std::move(data))),
+            [this, proposer, blk_hash=msg.blk_hash, root=msg.root](MsgPropose &m) {
+        auto &prop = m.proposal;
+        if (!prop.blk || prop.blk->get_hash() != blk_hash)
+        {
+            LOG_WARN("coded proposal does not match %s",
+                    get_hex10(blk_hash).c_str());
+            on_decode_proposal_failed(blk_hash, root, proposer);
+            return;
+        }
+        on_proposal_parsed(prop, proposer);
+    });
+}
+
+void HotStuffBase::on_decode_proposal_failed(const uint256_t &blk_hash,
+                                            const uint256_t &root,
+                                            const NetAddr &proposer) {
+    auto it = chunk_waiting.find(blk_hash);
+    if (it != chunk_waiting.end())
+    {
+        /* the chunks of other roots may still decode */
+        it->second.bad_roots.insert(root);
+        it->second.decoded = false;
+    }
+    /* fetch the whole block right away rather than when the chunks expire */
+    async_fetch_blk(blk_hash, &proposer);
+    auto fit = blk_fetch_waiting.find(blk_hash);
+    if (fit != blk_fetch_waiting.end())
+        fit->second.send_all();
+}
+
+void HotStuffBase::chunk_waiting_expire(const uint256_t &blk_hash) {
+    chunk_waiting.erase(blk_hash);
+    /* fall back to fetching the whole block if it could not be recovered */
+    auto it = blk_fetch_waiting.find(blk_hash);
+    if (it != blk_fetch_waiting.end())
+        it->second.send_all();
+}
+
+void HotStuffBase::set_coded_proposal(bool enabled) {
+    coded_proposal = enabled;
+}
+
+void HotStuffBase::set_compact_proposal(bool enabled) {
+    compact_proposal = enabled;
+}
+
+void HotStuffBase::set_fast_view_change(bool enabled) {
+    fast_view_change = enabled;
+}
+
+std::vector<block_t> HotStuffBase::get_chain_suffix(const block_t &blk) {
+    std::vector<block_t> blks;
+    for (block_t b = blk;
+        b && b != get_genesis() && b->get_decision() != 1 &&
+        blks.size() < view_change_suffix_max;
+        b = b->get_parents().empty() ? nullptr : b->get_parents()[0])
+        blks.push_back(b);
+    std::reverse(blks.begin(), blks.end());
+    return blks;
+}
+
+void HotStuffBase::add_inline_blks(std::vector<block_t> &blks) {
+    for (auto &blk: blks)
+    {
+        if (storage->is_blk_fetched(blk->get_hash())) continue;
+        blk = storage->add_blk(blk);
+        on_fetch_blk(blk);
+    }
+}
+
+void HotStuffBase::set_mempool(size_t batch, double linger) {
+    mempool_enabled = true;
+    gossip_batch = std::max(batch, (size_t)1);
+    gossip_linger = linger;
+}
+
 void HotStuffBase::vote_handler(MsgVote &&msg, const Net::conn_t &conn) {
-    const NetAddr &peer = conn->get_peer_addr();
+    count_recv(msg, conn);
+    const NetAddr peer = conn->get_peer_addr();
     if (peer.is_null()) return;
-    msg.postponed_parse(this);
-    //auto &vote = msg.vote;
-    RcObj<Vote> v(new Vote(std::move(msg.vote)));
-    promise::all(std::vector<promise_t>{
-        async_deliver_blk(v->blk_hash, peer),
-        v->verify(vpool),
-    }).then([this, v=std::move(v)](const promise::values_t values) {
-        if (!promise::any_cast<bool>(values[1]))
-            LOG_WARN("invalid vote from %d", v->voter);
-        else
-            on_receive_vote(*v);
+    parse_msg(std::move(msg), [this, peer](MsgVote &msg) {
+        //auto &vote = msg.vote;
+        RcObj<Vote> v(new Vote(std::move(msg.vote)));
+        promise::all(std::vector<promise_t>{
+            async_deliver_blk(v->blk_hash, peer),
+            v->verify(vpool, vcache),
+        }).then([this, v=std::move(v)](const promise::values_t values) {
+            if (!promise::any_cast<bool>(values[1]))
+                LOG_WARN("invalid vote from %d", v->voter);
+            else
+                on_receive_vote(*v);
+        });
     });
 }
 
 void HotStuffBase::notify_handler(MsgNotify &&msg, const Net::conn_t &conn) {
-    const NetAddr &peer = conn->get_peer_addr();
+    count_recv(msg, conn);
+    const NetAddr peer = conn->get_peer_addr();
     if (peer.is_null()) return;
-    msg.postponed_parse(this);
-    RcObj<Notify> n(new Notify(std::move(msg.notify)));
-    promise::all(std::vector<promise_t>{
-        async_deliver_blk(n->blk_hash, peer),
-        n->verify(vpool)
-    }).then([this, n, peer](const promise::values_t values) {
-        if (!promise::any_cast<bool>(values[1]))
-            LOG_WARN("invalid notify message from %s", std::string(peer).c_str());
-        else
-            on_receive_notify(*n);
+    parse_msg(std::move(msg), [this, peer](MsgNotify &msg) {
+        RcObj<Notify> n(new Notify(std::move(msg.notify)));
+        add_inline_blks(msg.blks);
+        promise::all(std::vector<promise_t>{
+            async_deliver_blk(n->blk_hash, peer),
+            n->verify(vpool, vcache)
+        }).then([this, n, peer](const promise::values_t values) {
+            if (!promise::any_cast<bool>(values[1]))
+                LOG_WARN("invalid notify message from %s", std::string(peer).c_str());
+            else
+                on_receive_notify(*n);
+        });
+    });
+}
+
+void HotStuffBase::agg_vote_handler(MsgAggVote &&msg, const Net::conn_t &conn) {
+    count_recv(msg, conn);
+    const NetAddr peer = conn->get_peer_addr();
+    if (peer.is_null()) return;
+    parse_msg(std::move(msg), [this, peer](MsgAggVote &msg) {
+        RcObj<AggVote> av(new AggVote(std::move(msg.av)));
+        if (av->root >= get_config().nreplicas) return;
+        if (av->root == get_id())
+        {
+            promise::all(std::vector<promise_t>{
+                async_deliver_blk(av->blk_hash, peer),
+                av->verify(vpool)
+            }).then([this, av, peer](const promise::values_t values) {
+                if (!promise::any_cast<bool>(values[1]))
+                    LOG_WARN("invalid aggregated votes from %s", std::string(peer).c_str());
+                else
+                    on_receive_agg_vote(*av);
+            });
+            return;
+        }
+        /* an interior node of the tree: the block is not needed to pass
+         * the votes on, but they are checked so that a faulty child cannot
+         * spoil the aggregate */
+        av->verify(vpool).then([this, av, peer](bool result) {
+            if (!result)
+            {
+                LOG_WARN("invalid aggregated votes from %s", std::string(peer).c_str());
+                return;
+            }
+            auto &ctx = get_vote_relay(av->blk_hash, av->root);
+            auto signers = av->qc->get_signers();
+            for (auto rid: signers)
+                if (ctx.voters.count(rid)) return;
+            if (!ctx.pending->merge(*av->qc)) return;
+            ctx.voters.insert(signers.begin(), signers.end());
+            if (ctx.flushed || ctx.voters.size() >= ctx.nsubtree)
+                vote_relay_flush(av->blk_hash, ctx);
+        });
     });
 }
 
 void HotStuffBase::blame_handler(MsgBlame &&msg, const Net::conn_t &conn) {
-    const NetAddr &peer = conn->get_peer_addr();
+    count_recv(msg, conn);
+    const NetAddr peer = conn->get_peer_addr();
     if (peer.is_null()) return;
-    msg.postponed_parse(this);
-    RcObj<Blame> b(new Blame(std::move(msg.blame)));
-    b->verify(vpool).then([this, b, peer](bool result) {
-        if (!result)
-            LOG_WARN("invalid blame message from %s", std::string(peer).c_str());
-        else
-            on_receive_blame(*b);
+    parse_msg(std::move(msg), [this, peer](MsgBlame &msg) {
+        RcObj<Blame> b(new Blame(std::move(msg.blame)));
+        b->verify(vpool, vcache).then([this, b, peer](bool result) {
+            if (!result)
+                LOG_WARN("invalid blame message from %s", std::string(peer).c_str());
+            else
+                on_receive_blame(*b);
+        });
     });
 }
 
 void HotStuffBase::blamenotify_handler(MsgBlameNotify &&msg, const Net::conn_t &conn) {
-    const NetAddr &peer = conn->get_peer_addr();
+    count_recv(msg, conn);
+    const NetAddr peer = conn->get_peer_addr();
     if (peer.is_null()) return;
-    msg.postponed_parse(this);
-    RcObj<BlameNotify> bn(new BlameNotify(std::move(msg.bn)));
-    promise::all(std::vector<promise_t>{
-        async_deliver_blk(bn->hqc_hash, peer),
-        bn->verify(vpool)
-    }).then([this, bn, peer](promise::values_t values) {
-        auto result = promise::any_cast<bool>(values[1]);
-        if (!result)
-            LOG_WARN("invalid blamenotify message from %s", std::string(peer).c_str());
-        else
-            on_receive_blamenotify(*bn);
+    parse_msg(std::move(msg), [this, peer](MsgBlameNotify &msg) {
+        RcObj<BlameNotify> bn(new BlameNotify(std::move(msg.bn)));
+        if (fast_view_change)
+        {
+            add_inline_blks(msg.blks);
+            /* the blame does not depend on the hqc block, so the hqc is
+             * delivered while waiting out the view transition */
+            bn->verify(vpool, vcache).then([this, bn, peer](bool result) {
+                if (!result)
+                {
+                    LOG_WARN("invalid blamenotify message from %s", std::string(peer).c_str());
+                    return;
+                }
+                on_receive_blamenotify(*bn);
+                async_deliver_blk(bn->hqc_hash, peer).then([this, bn]() {
+                    on_receive_notify(Notify(bn->hqc_hash, bn->hqc_qc->clone(), this));
+                });
+            });
+            return;
+        }
+        promise::all(std::vector<promise_t>{
+            async_deliver_blk(bn->hqc_hash, peer),
+            bn->verify(vpool, vcache)
+        }).then([this, bn, peer](promise::values_t values) {
+            auto result = promise::any_cast<bool>(values[1]);
+            if (!result)
+                LOG_WARN("invalid blamenotify message from %s", std::string(peer).c_str());
+            else
+                on_receive_blamenotify(*bn);
+        });
     });
 }
 
@@ -295,54 +1262,72 @@ void HotStuffBase::set_commit_timer(const block_t &blk, double t_sec) {
     on_commit_timeout(blk);
 #else
     auto height = blk->get_height();
-    auto &timer = commit_timers[height] =
-        TimerEvent(ec, [this, blk=std::move(blk), height](TimerEvent &) {
-            on_commit_timeout(blk);
-            stop_commit_timer(height);
-        });
-    timer.add(t_sec);
+    auto &id = commit_timers[height];
+    timers.cancel(id);
+    id = timers.add(t_sec, [this, blk, height]() {
+        commit_timers.erase(height);
+        on_commit_timeout(blk);
+    });
 #endif
 }
 
 void HotStuffBase::stop_commit_timer(uint32_t height) {
-    commit_timers.erase(height);
+    auto it = commit_timers.find(height);
+    if (it == commit_timers.end()) return;
+    timers.cancel(it->second);
+    commit_timers.erase(it);
 }
 
 void HotStuffBase::stop_commit_timer_all() {
+    for (auto &p: commit_timers)
+        timers.cancel(p.second);
     commit_timers.clear();
 }
 
 void HotStuffBase::set_blame_timer(double t_sec) {
-    blame_timer = TimerEvent(ec, [this](TimerEvent &) {
+    timers.cancel(blame_timer);
+    blame_timer = timers.add(t_sec, [this]() {
+        blame_timer = TimerQueue::null_id;
         on_blame_timeout();
-        stop_blame_timer();
     });
-    blame_timer.add(t_sec);
 }
 
 void HotStuffBase::stop_blame_timer() {
-    blame_timer.clear();
+    timers.cancel(blame_timer);
+    blame_timer = TimerQueue::null_id;
 }
 
 void HotStuffBase::set_viewtrans_timer(double t_sec) {
-    viewtrans_timer = TimerEvent(ec, [this](TimerEvent &) {
+    timers.cancel(viewtrans_timer);
+    viewtrans_timer = timers.add(t_sec, [this]() {
+        viewtrans_timer = TimerQueue::null_id;
         on_viewtrans_timeout();
-        stop_viewtrans_timer();
     });
-    viewtrans_timer.add(t_sec);
 }
 
 void HotStuffBase::stop_viewtrans_timer() {
-    viewtrans_timer.clear();
+    timers.cancel(viewtrans_timer);
+    viewtrans_timer = TimerQueue::null_id;
 }
 
 void HotStuffBase::req_blk_handler(MsgReqBlock &&msg, const Net::conn_t &conn) {
+    count_recv(msg, conn);
     const NetAddr replica = conn->get_peer_addr();
     if (replica.is_null()) return;
     auto &blk_hashes = msg.blk_hashes;
     std::vector<promise_t> pms;
+    std::vector<uint256_t> archived;
     for (const auto &h: blk_hashes)
-        pms.push_back(async_fetch_blk(h, nullptr));
+    {
+        if (storage->is_blk_archived(h))
+            archived.push_back(h);
+        else
+            pms.push_back(async_fetch_blk(h, nullptr));
+    }
+    /* old blocks are copied straight from the archive without parsing */
+    if (!archived.empty())
+        send_msg(MsgRespBlock(*storage->get_archive(), archived), replica);
+    if (pms.empty()) return;
     promise::all(pms).then([replica, this](const promise::values_t values) {
         std::vector<block_t> blks;
         for (auto &v: values)
@@ -350,14 +1335,19 @@ void HotStuffBase::req_blk_handler(MsgReqBlock &&msg, const Net::conn_t &conn) {
             auto blk = promise::any_cast<block_t>(v);
             blks.push_back(blk);
         }
-        pn.send_msg(MsgRespBlock(blks), replica);
+        send_msg(MsgRespBlock(blks), replica);
     });
 }
 
-void HotStuffBase::resp_blk_handler(MsgRespBlock &&msg, const Net::conn_t &) {
-    msg.postponed_parse(this);
-    for (const auto &blk: msg.blks)
-        if (blk) on_fetch_blk(blk);
+void HotStuffBase::resp_blk_handler(MsgRespBlock &&msg, const Net::conn_t &conn) {
+    count_recv(msg, conn);
+    parse_msg(std::move(msg), [this](MsgRespBlock &msg) {
+        for (auto &blk: msg.blks)
+        {
+            blk = storage->add_blk(blk);
+            on_fetch_blk(blk);
+        }
+    });
 }
 
 bool HotStuffBase::conn_handler(const salticidae::ConnPool::conn_t &conn, bool connected) {
@@ -374,9 +1364,10 @@ void HotStuffBase::print_stat() const {
     LOG_INFO("===== begin stats =====");
     LOG_INFO("-------- queues -------");
     LOG_INFO("blk_fetch_waiting: %lu", blk_fetch_waiting.size());
-    LOG_INFO("blk_delivery_waiting: %lu", blk_delivery_waiting.size());
+    LOG_INFO("blk_delivery_waiting: %lu", dsched.size());
     LOG_INFO("decision_waiting: %lu", decision_waiting.size());
     LOG_INFO("commit_timers: %lu", commit_timers.size());
+    LOG_INFO("timers: %lu", timers.size());
     LOG_INFO("-------- misc ---------");
     LOG_INFO("fetched: %lu", fetched);
     LOG_INFO("delivered: %lu", delivered);
@@ -387,7 +1378,14 @@ void HotStuffBase::print_stat() const {
             part_decided ? part_lat_committed / part_decided * 1e3 : 0);
 #endif
     LOG_INFO("cmd_cache: %lu", storage->get_cmd_cache_size());
+    LOG_INFO("mempool: %lu", mempool.size());
     LOG_INFO("blk_cache: %lu", storage->get_blk_cache_size());
+    LOG_INFO("blk_archive: %lu", storage->get_blk_archive_size());
+    LOG_INFO("vcache: %lu hit, %lu miss", vcache.nhit, vcache.nmiss);
+    LOG_INFO("blk_target: %lu", blk_target);
+    LOG_INFO("commit latency: %.3f ms avg, %.3f ms min",
+            commit_lat_avg * 1e3,
+            commit_lat_min == double_inf ? 0 : commit_lat_min * 1e3);
     LOG_INFO("------ misc (10s) -----");
     LOG_INFO("fetched: %lu", part_fetched);
     LOG_INFO("delivered: %lu", part_delivered);
@@ -449,15 +1447,40 @@ HotStuffBase::HotStuffBase(uint32_t blk_size,
                     pacemaker_bt pmaker,
                     EventContext ec,
                     size_t nworker,
-                    const Net::Config &netconfig):
+                    const Net::Config &netconfig,
+                    VeriPool *shared_vpool):
         HotStuffCore(rid, std::move(priv_key)),
         listen_addr(listen_addr),
         blk_size(blk_size),
+        blk_max_bytes(SIZE_MAX),
+        blk_linger(-1),
+        blk_adaptive(false),
+        blk_target(blk_size),
         ec(ec),
         tcall(ec),
-        vpool(ec, nworker),
+        pipelined(false),
+        own_vpool(shared_vpool ? nullptr : new VeriPool(ec, nworker)),
+        vpool(shared_vpool ? *shared_vpool : *own_vpool),
+        timers(ec),
+        blame_timer(TimerQueue::null_id),
+        viewtrans_timer(TimerQueue::null_id),
+        vote_fanout(0),
+        vote_relay_timeout(0),
+        coded_proposal(false),
+        compact_proposal(false),
+        mempool_enabled(false),
+        gossip_batch(1),
+        gossip_linger(0),
+        fast_view_change(false),
+        vc_awaiting_commit(false),
         pn(ec, netconfig),
         pmaker(std::move(pmaker)),
+        dsched(this),
+        max_waiting(0),
+        commit_lat_avg(0),
+        commit_lat_min(double_inf),
+        commit_lat_min_cur(double_inf),
+        commit_lat_nsamples(0),
 
         fetched(0), delivered(0),
         nsent(0), nrecv(0),
@@ -481,37 +1504,486 @@ HotStuffBase::HotStuffBase(uint32_t blk_size,
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::notify_handler, this, _1, _2));
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::blame_handler, this, _1, _2));
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::blamenotify_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::agg_vote_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::propose_chunk_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::propose_compact_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::req_cmds_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::resp_cmds_handler, this, _1, _2));
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::req_blk_handler, this, _1, _2));
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::resp_blk_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::req_blk_range_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::resp_blk_range_handler, this, _1, _2));
     pn.reg_conn_handler(salticidae::generic_bind(&HotStuffBase::conn_handler, this, _1, _2));
     pn.start();
     pn.listen(listen_addr);
 }
+void HotStuffBase::init_metrics() {
+    m_fetched = &metrics.add_counter("hotstuff_blocks_fetched_total",
+                                    "Blocks fetched from the peers.");
+    m_delivered = &metrics.add_counter("hotstuff_blocks_delivered_total",
+                                    "Blocks delivered to the protocol.");
+    m_decided = &metrics.add_counter("hotstuff_commands_decided_total",
+                                    "Commands committed.");
+    m_rejected = &metrics.add_counter("hotstuff_commands_rejected_total",
+                                    "Commands turned away for the lack of room.");
+    m_view_changes = &metrics.add_counter("hotstuff_view_changes_total",
+                                    "View changes.");
+    m_view_change_time = &metrics.add_histogram("hotstuff_view_change_seconds",
+                                    "Time from the start of a view transition to entering the new view.");
+    m_view_change_commit_time = &metrics.add_histogram("hotstuff_view_change_commit_seconds",
+                                    "Time from the start of a view transition to the first commit after it.");
+    m_fetch_time = &metrics.add_histogram("hotstuff_block_fetch_seconds",
+                                    "Time to fetch a block from the peers.");
+    m_delivery_time = &metrics.add_histogram("hotstuff_block_delivery_seconds",
+                                    "Time from the arrival to the delivery of a block.");
+    m_commit_lat = &metrics.add_histogram("hotstuff_commit_latency_seconds",
+                                    "Time from proposing a block to committing it.");
+    metrics.add_gauge("hotstuff_veripool_queue_depth",
+                    "Verification tasks not yet finished.",
+                    [this]() { return vpool.get_queue_depth(); });
+    metrics.add_gauge("hotstuff_decision_waiting",
+                    "Commands waiting to be decided.",
+                    [this]() { return decision_waiting.size(); });
+    metrics.add_gauge("hotstuff_cmd_pending",
+                    "Commands waiting to be proposed.",
+                    [this]() { return cmd_pending_buffer.size(); });
+    metrics.add_gauge("hotstuff_blk_cache",
+                    "Blocks kept in memory.",
+                    [this]() { return storage->get_blk_cache_size(); });
+    metrics.add_gauge("hotstuff_view", "The current view.",
+                    [this]() { return get_view(); });
+    metrics.add_gauge("hotstuff_hqc_height", "The height of the highest QC block.",
+                    [this]() { return get_hqc()->get_height(); });
+    metrics.add_gauge("hotstuff_blk_target", "The number of commands to cut a block at.",
+                    [this]() { return blk_target; });
+    for (const auto &replica: peers)
+    {
+        auto labels = "peer=\"" + std::string(replica) + "\"";
+        auto &pm = peer_metrics[replica];
+        pm.nsent = &metrics.add_counter("hotstuff_peer_msgs_sent_total",
+                                    "Messages sent to a peer.", labels);
+        pm.nrecv = &metrics.add_counter("hotstuff_peer_msgs_recv_total",
+                                    "Messages received from a peer.", labels);
+        pm.nsentb = &metrics.add_counter("hotstuff_peer_bytes_sent_total",
+                                    "Payload bytes sent to a peer.", labels);
+        pm.nrecvb = &metrics.add_counter("hotstuff_peer_bytes_recv_total",
+                                    "Payload bytes received from a peer.", labels);
+    }
+    reg_view_change_metric();
+    reg_view_trans_metric();
+}
+
+void HotStuffBase::reg_view_change_metric() {
+    async_wait_view_change().then([this](uint32_t view) {
+        vc_elapsed.stop(false);
+        LOG_INFO("view %u entered %.3f sec after the view transition started",
+                view, vc_elapsed.elapsed_sec);
+        if (metrics.is_enabled())
+        {
+            m_view_changes->inc();
+            m_view_change_time->observe(vc_elapsed.elapsed_sec);
+        }
+        vc_awaiting_commit = true;
+        reg_view_change_metric();
+    });
+}
+
+void HotStuffBase::reg_view_trans_metric() {
+    async_wait_view_trans().then([this]() {
+        vc_elapsed.start();
+        vc_awaiting_commit = false;
+        reg_view_trans_metric();
+    });
+}
+
+void HotStuffBase::count_msg(const NetAddr &addr, size_t nbytes, bool sent) {
+    auto it = peer_metrics.find(addr);
+    if (it == peer_metrics.end()) return;
+    auto &pm = it->second;
+    if (sent)
+    {
+        pm.nsent->inc();
+        pm.nsentb->inc(nbytes);
+    }
+    else
+    {
+        pm.nrecv->inc();
+        pm.nrecvb->inc(nbytes);
+    }
+}
+
+void HotStuffBase::start_metrics_server(const NetAddr &addr,
+                                        const std::string &token) {
+    metrics_server = new MetricsServer(ec, metrics, addr, token);
+    LOG_INFO("serving metrics at %s", std::string(addr).c_str());
+}
+
 void HotStuffBase::do_consensus(const block_t &blk) {
+    on_blk_committed(blk);
     pmaker->on_consensus(blk);
 }
 
-void HotStuffBase::do_decide(Finality &&fin) {
-    part_decided++;
-    state_machine_execute(fin);
-    auto it = decision_waiting.find(fin.cmd_hash);
-    if (it != decision_waiting.end())
+void HotStuffBase::set_batching(size_t max_bytes, double linger, bool adaptive) {
+    blk_max_bytes = max_bytes;
+    blk_linger = linger;
+    blk_adaptive = adaptive;
+    /* start small and grow with the load */
+    blk_target = adaptive ? 1 : blk_size;
+}
+
+void HotStuffBase::set_admission(size_t _max_waiting, size_t nrecent) {
+    max_waiting = _max_waiting;
+    recent_decided.init(nrecent);
+}
+
+bool HotStuffBase::queue_proposal_cmd(const uint256_t &cmd_hash) {
+    cmd_queued.insert(cmd_hash);
+    cmd_pending_buffer.push(cmd_hash);
+    if (cmd_pending_buffer.size() >= blk_target ||
+        cmd_pending_buffer.size() * uint256_nbytes >= blk_max_bytes)
     {
-        it->second(std::move(fin));
+        cut_blk();
+        return true;
+    }
+    if (cmd_pending_buffer.size() == 1 && blk_linger >= 0)
+        linger_timer.add(blk_linger);
+    return false;
+}
+
+void HotStuffBase::cut_blk() {
+    linger_timer.del();
+    size_t n = std::min(blk_target, cmd_pending_buffer.size());
+    /* each command is referred to by its hash in the block */
+    n = std::min(n, std::max(blk_max_bytes / uint256_nbytes, (size_t)1));
+    std::vector<uint256_t> cmds;
+    for (size_t i = 0; i < n; i++)
+    {
+        cmds.push_back(cmd_pending_buffer.front());
+        cmd_pending_buffer.pop();
+    }
+    if (!cmd_pending_buffer.empty() && blk_linger >= 0)
+        linger_timer.add(blk_linger);
+    pmaker->beat().then([this, cmds = std::move(cmds)](ReplicaID proposer) {
+        if (proposer == get_id())
+        {
+            block_t blk = on_propose(cmds, pmaker->get_parents(),
+                                    pmaker->get_extra());
+            if (blk && (blk_adaptive || metrics.is_enabled()))
+                blk_proposed[blk->get_hash()].start();
+#ifdef SYNCHS_LATBREAKDOWN
+            for (auto &ch: cmds)
+                cmd_lats[ch].on_propose();
+#endif
+#ifdef SYNCHS_AUTOCLI
+            for (size_t i = pmaker->get_pending_size(); i < 1; i++)
+                do_demand_commands(blk_target);
+#endif
+        }
+    });
+}
+
+std::vector<uint256_t> HotStuffBase::requeue_waiting() {
+    std::queue<uint256_t>().swap(cmd_pending_buffer);
+    cmd_queued.clear();
+    std::vector<uint256_t> cmds;
+    size_t n = std::min(blk_target, std::max(blk_max_bytes / uint256_nbytes, (size_t)1));
+    for (const auto &p: decision_waiting)
+    {
+        if (mempool_enabled && !storage->is_cmd_fetched(p.first))
+        {
+            cmd_awaiting_payload.insert(p.first);
+            continue;
+        }
+        cmd_queued.insert(p.first);
+        if (cmds.size() < n)
+            cmds.push_back(p.first);
+        else
+            cmd_pending_buffer.push(p.first);
+    }
+    linger_timer.del();
+    if (cmd_pending_buffer.empty()) return cmds;
+    /* cut the rest only after the first block is proposed, or they would
+     * go ahead of it on the same parents */
+    tcall.async_call([this](ThreadCall::Handle &) {
+        while (cmd_pending_buffer.size() >= blk_target) cut_blk();
+        if (cmd_pending_buffer.empty()) return;
+        if (blk_linger >= 0)
+            linger_timer.add(blk_linger);
+        else
+            cut_blk();
+    });
+    return cmds;
+}
+
+void HotStuffBase::on_blk_committed(const block_t &blk) {
+    auto it = blk_proposed.find(blk->get_hash());
+    if (it == blk_proposed.end()) return;
+    it->second.stop(false);
+    double lat = it->second.elapsed_sec;
+    blk_proposed.erase(it);
+    if (metrics.is_enabled()) m_commit_lat->observe(lat);
+    if (!blk_adaptive) return;
+    commit_lat_avg = commit_lat_avg ? 0.9 * commit_lat_avg + 0.1 * lat : lat;
+    commit_lat_min = std::min(commit_lat_min, lat);
+    commit_lat_min_cur = std::min(commit_lat_min_cur, lat);
+    if (++commit_lat_nsamples == commit_lat_window)
+    {
+        commit_lat_min = commit_lat_min_cur;
+        commit_lat_min_cur = double_inf;
+        commit_lat_nsamples = 0;
+    }
+    /* commands pile up while the latency is still close to the best seen:
+     * grow the blocks for throughput; once the latency inflates, back off */
+    if (commit_lat_avg > 2 * commit_lat_min)
+        blk_target = std::max(blk_target - blk_target / 4, (size_t)1);
+    else if (cmd_pending_buffer.size() >= blk_target)
+        blk_target = std::min(blk_target * 2, blk_size);
+}
+
+void HotStuffBase::do_decide_batch(const block_t &blk) {
+    const auto &cmds = blk->get_cmds();
+    part_decided += cmds.size();
+    if (vc_awaiting_commit && !cmds.empty())
+    {
+        vc_awaiting_commit = false;
+        vc_elapsed.stop(false);
+        LOG_INFO("first commit %.3f sec after the view transition started",
+                vc_elapsed.elapsed_sec);
+        if (metrics.is_enabled())
+            m_view_change_commit_time->observe(vc_elapsed.elapsed_sec);
+    }
+    if (metrics.is_enabled()) m_decided->inc(cmds.size());
+    std::vector<Finality> fins;
+    std::vector<std::pair<uint32_t, commit_cb_t>> cbs;
+    fins.reserve(cmds.size());
+    for (uint32_t i = 0; i < cmds.size(); i++)
+    {
+        fins.emplace_back(id, 1, i, blk->get_height(), cmds[i], blk->get_hash());
+        if (mempool_enabled) mempool.remove(cmds[i]);
+        recent_decided.insert(cmds[i]);
+        cmd_queued.erase(cmds[i]);
+        auto it = decision_waiting.find(cmds[i]);
+        if (it == decision_waiting.end()) continue;
+        cbs.push_back(std::make_pair(i, std::move(it->second)));
         decision_waiting.erase(it);
     }
+    if (!spec_log.empty() && spec_log.front().first == blk)
+        spec_log.pop_front();
+    run_exec([this, fins=std::move(fins), cbs=std::move(cbs)]() {
+        state_machine_execute_batch(fins);
+        for (const auto &p: cbs) p.second(fins[p.first]);
+        state_machine_respond_batch();
+    });
+}
+
+void HotStuffBase::run_exec(std::function<void()> &&exec) {
+    /* execution is ordered by the queue and never holds up voting */
+    if (pipelined)
+        exec_queue.enqueue(std::move(exec));
+    else
+        exec();
+}
+
+void HotStuffBase::do_speculate(const block_t &blk) {
+    const auto &cmds = blk->get_cmds();
+    std::vector<Finality> fins;
+    std::vector<std::pair<uint32_t, commit_cb_t>> cbs;
+    fins.reserve(cmds.size());
+    for (uint32_t i = 0; i < cmds.size(); i++)
+    {
+        fins.emplace_back(id, 1, i, blk->get_height(), cmds[i], blk->get_hash(), true);
+        /* the callback stays for the commit */
+        auto it = decision_waiting.find(cmds[i]);
+        if (it != decision_waiting.end())
+            cbs.push_back(std::make_pair(i, it->second));
+    }
+    spec_log.push_back(std::make_pair(blk, fins));
+    run_exec([this, fins=std::move(fins), cbs=std::move(cbs)]() {
+        state_machine_speculate_batch(fins);
+        for (const auto &p: cbs) p.second(fins[p.first]);
+        state_machine_respond_batch();
+    });
+}
+
+void HotStuffBase::do_rollback(const block_t &blk) {
+    if (spec_log.empty() || spec_log.back().first != blk) return;
+    auto fins = std::move(spec_log.back().second);
+    spec_log.pop_back();
+    run_exec([this, fins=std::move(fins)]() {
+        state_machine_rollback_batch(fins);
+    });
+}
+
+size_t HotStuffBase::tree_pos(ReplicaID rid, ReplicaID root) {
+    size_t n = get_config().nreplicas;
+    return (rid + n - root) % n;
+}
+
+ReplicaID HotStuffBase::tree_rid(size_t pos, ReplicaID root) {
+    return (pos + root) % get_config().nreplicas;
+}
+
+size_t HotStuffBase::tree_subtree_size(size_t pos) {
+    size_t n = get_config().nreplicas;
+    size_t total = 0;
+    /* count the positions of the subtree level by level */
+    for (size_t lo = pos, hi = pos; lo < n;
+            lo = lo * vote_fanout + 1, hi = hi * vote_fanout + vote_fanout)
+        total += std::min(hi, n - 1) - lo + 1;
+    return total;
+}
+
+void HotStuffBase::relay_proposal(const Proposal &prop, ReplicaID root) {
+    size_t n = get_config().nreplicas;
+    size_t first = tree_pos(get_id(), root) * vote_fanout + 1;
+    std::vector<NetAddr> children;
+    for (size_t c = first; c < first + vote_fanout && c < n; c++)
+        children.push_back(get_config().get_addr(tree_rid(c, root)));
+    if (children.empty()) return;
+    MsgPropose m(prop);
+    if (metrics.is_enabled())
+        for (const auto &replica: children)
+            count_msg(replica, m.serialized.size(), true);
+    pn.multicast_msg(std::move(m), children);
+}
+
+VoteRelayContext &HotStuffBase::get_vote_relay(const uint256_t &blk_hash, ReplicaID root) {
+    auto it = vote_relay.find(blk_hash);
+    if (it != vote_relay.end()) return *it->second;
+    auto &ctx = vote_relay.insert(std::make_pair(blk_hash,
+        new VoteRelayContext(root, tree_subtree_size(tree_pos(get_id(), root)))))
+        .first->second;
+    ctx->pending = create_quorum_cert(Vote::proof_obj_hash(blk_hash));
+    ctx->flush_timer = timers.add(vote_relay_timeout, [this, blk_hash]() {
+        auto it = vote_relay.find(blk_hash);
+        if (it == vote_relay.end()) return;
+        auto &ctx = *it->second;
+        ctx.flush_timer = TimerQueue::null_id;
+        ctx.flushed = true;
+        vote_relay_flush(blk_hash, ctx);
+    });
+    ctx->expire_timer = timers.add(vote_relay_timeout * vote_relay_expiry,
+                                    [this, blk_hash]() {
+        vote_relay_expire(blk_hash);
+    });
+    return *ctx;
+}
+
+void HotStuffBase::relay_vote(const Vote &vote) {
+    auto it = vote_relay.find(vote.blk_hash);
+    ReplicaID root = it != vote_relay.end() ?
+                        it->second->root : pmaker->get_proposer();
+    if (root == get_id())
+    {
+        /* the votes of the root go to the core directly */
+#ifdef SYNCHS_NOVOTEBROADCAST
+        on_receive_vote(vote);
+#endif
+        return;
+    }
+    auto &ctx = get_vote_relay(vote.blk_hash, root);
+    if (!ctx.voters.insert(vote.voter).second) return;
+    ctx.pending->add_part(vote.voter, *vote.cert);
+    ctx.own_vote = new Vote(vote);
+    if (ctx.flushed || ctx.voters.size() >= ctx.nsubtree)
+        vote_relay_flush(vote.blk_hash, ctx);
+}
+
+void HotStuffBase::vote_relay_flush(const uint256_t &blk_hash, VoteRelayContext &ctx) {
+    if (ctx.pending->get_signers().empty()) return;
+    ctx.pending->compute();
+    ReplicaID parent = tree_rid(
+        (tree_pos(get_id(), ctx.root) - 1) / vote_fanout, ctx.root);
+    send_msg(MsgAggVote(AggVote(ctx.root, blk_hash, std::move(ctx.pending), this)),
+            get_config().get_addr(parent));
+    ctx.pending = create_quorum_cert(Vote::proof_obj_hash(blk_hash));
+}
+
+void HotStuffBase::vote_relay_expire(const uint256_t &blk_hash) {
+    auto it = vote_relay.find(blk_hash);
+    if (it == vote_relay.end()) return;
+    auto &ctx = *it->second;
+    timers.cancel(ctx.flush_timer);
+    if (ctx.own_vote != nullptr)
+    {
+        /* the path to the root may be broken, so fall back to sending the
+         * vote directly if the block is still not certified */
+        block_t blk = storage->find_blk(blk_hash);
+        if (blk == nullptr || get_hqc()->get_height() < blk->get_height())
+            send_msg(MsgVote(*ctx.own_vote), get_config().get_addr(ctx.root));
+    }
+    vote_relay.erase(it);
+}
+
+void HotStuffBase::set_vote_relay(size_t fanout, double timeout) {
+    vote_fanout = fanout;
+    vote_relay_timeout = timeout;
+}
+
+void HotStuffBase::do_broadcast_blamenotify(const BlameNotify &bn) {
+    if (!fast_view_change)
+    {
+        _do_broadcast<BlameNotify, MsgBlameNotify>(bn);
+        return;
+    }
+    MsgBlameNotify m(bn, get_chain_suffix(get_hqc()));
+    if (metrics.is_enabled())
+        for (const auto &replica: peers)
+            count_msg(replica, m.serialized.size(), true);
+    pn.multicast_msg(std::move(m), peers);
 }
 
 void HotStuffBase::do_notify(const Notify &notify) {
-    MsgNotify m(notify);
+    MsgNotify m = fast_view_change ?
+        MsgNotify(notify, get_chain_suffix(storage->find_blk(notify.blk_hash))) :
+        MsgNotify(notify);
     ReplicaID next_proposer = pmaker->get_proposer();
     if (next_proposer != get_id())
-        pn.send_msg(m, get_config().get_addr(next_proposer));
+        send_msg(m, get_config().get_addr(next_proposer));
     else
         on_receive_notify(notify);
 }
 
-HotStuffBase::~HotStuffBase() {}
+HotStuffBase::~HotStuffBase() { stop_pipeline(); }
+
+static void reg_stage_handler(stage_queue_t &q, const EventContext &ec) {
+    q.reg_handler(ec, [](stage_queue_t &q) {
+        size_t cnt = stage_burst_size;
+        std::function<void()> task;
+        while (q.try_dequeue(task))
+        {
+            try {
+                task();
+            } catch (std::exception &err) {
+                HOTSTUFF_LOG_WARN("pipeline stage: %s", err.what());
+            }
+            if (!--cnt) return true;
+        }
+        return false;
+    });
+}
+
+void HotStuffBase::set_pipelined(bool enabled) {
+    pipelined = enabled;
+}
+
+void HotStuffBase::start_pipeline() {
+    reg_stage_handler(parse_queue, parse_ec);
+    reg_stage_handler(core_queue, ec);
+    reg_stage_handler(exec_queue, exec_ec);
+    parse_tcall = new ThreadCall(parse_ec);
+    exec_tcall = new ThreadCall(exec_ec);
+    parse_thread = std::thread([ec=parse_ec]() { ec.dispatch(); });
+    exec_thread = std::thread([ec=exec_ec]() { ec.dispatch(); });
+}
+
+void HotStuffBase::stop_pipeline() {
+    if (!parse_thread.joinable()) return;
+    parse_tcall->async_call([ec=parse_ec](ThreadCall::Handle &) { ec.stop(); });
+    exec_tcall->async_call([ec=exec_ec](ThreadCall::Handle &) { ec.stop(); });
+    parse_thread.join();
+    exec_thread.join();
+}
 
 void HotStuffBase::start(
         std::vector<std::tuple<NetAddr, pubkey_bt, uint256_t>> &&replicas,
@@ -523,20 +1995,41 @@ void HotStuffBase::start(
         valid_tls_certs.insert(std::move(std::get<2>(replicas[i])));
         if (addr != listen_addr)
         {
+            peer_rids[addr] = i;
             peers.push_back(addr);
             pn.add_peer(addr);
         }
     }
 
-    /* ((n - 1) + 1 - 1) / 2 */
-    uint32_t nfaulty = peers.size() / 2;
+    /* ((n - 1) + 1 - 1) / 2, or below n/4 for the responsive mode */
+    uint32_t nfaulty = is_responsive() ? peers.size() / 4 : peers.size() / 2;
     if (nfaulty == 0)
         LOG_WARN("too few replicas in the system to tolerate any failure");
     on_init(nfaulty, delta);
+    mempool.init(get_config().nreplicas);
+    on_recover();
+    init_metrics();
     pmaker->init(this);
+    if (pipelined) start_pipeline();
     if (ec_loop)
         ec.dispatch();
 
+    linger_timer = TimerEvent(ec, [this](TimerEvent &) {
+        if (cmd_pending_buffer.empty()) return;
+        /* the load is too low to fill the target in time */
+        if (blk_adaptive)
+            blk_target = std::max((blk_target + cmd_pending_buffer.size()) / 2,
+                                    (size_t)1);
+        cut_blk();
+    });
+
+    gossip_timer = TimerEvent(ec, [this](TimerEvent &) { gossip_flush(); });
+    cmd_arrived.reg_handler(ec, [this](cmd_arrival_queue_t &q) {
+        command_t cmd;
+        while (q.try_dequeue(cmd)) on_client_cmd(cmd);
+        return false;
+    });
+
     cmd_pending.reg_handler(ec, [this](cmd_queue_t &q) {
         std::pair<uint256_t, commit_cb_t> e;
         while (q.try_dequeue(e))
@@ -544,42 +2037,49 @@ void HotStuffBase::start(
             ReplicaID proposer = pmaker->get_proposer();
 
             const auto &cmd_hash = e.first;
+            /* respond in the execution context, like the decisions */
+            auto respond = [this, &e](int8_t decision) {
+                run_exec([this, cb=std::move(e.second), cmd_hash=e.first, decision]() {
+                    cb(Finality(id, decision, 0, 0, cmd_hash, uint256_t()));
+                    state_machine_respond_batch();
+                });
+            };
             auto it = decision_waiting.find(cmd_hash);
             if (it == decision_waiting.end())
             {
+                if (recent_decided.contains(cmd_hash))
+                {
+                    respond(0);
+                    continue;
+                }
+                if (proposer == get_id() && max_waiting &&
+                    decision_waiting.size() >= max_waiting)
+                {
+                    /* turn it away now rather than let the queue (and the
+                     * latency of every command) grow without bound */
+                    if (metrics.is_enabled()) m_rejected->inc();
+                    respond(-1);
+                    continue;
+                }
                 it = decision_waiting.insert(std::make_pair(cmd_hash, e.second)).first;
 #ifdef SYNCHS_LATBREAKDOWN
                 cmd_lats[cmd_hash].on_init();
 #endif
             }
             else
-                e.second(Finality(id, 0, 0, 0, cmd_hash, uint256_t()));
+            {
+                respond(0);
+                /* proposing it again would only commit it twice */
+                if (cmd_queued.count(cmd_hash)) continue;
+            }
             if (proposer != get_id()) continue;
-            cmd_pending_buffer.push(cmd_hash);
-            if (cmd_pending_buffer.size() >= blk_size)
+            if (mempool_enabled && !storage->is_cmd_fetched(cmd_hash))
             {
-                std::vector<uint256_t> cmds;
-                for (uint32_t i = 0; i < blk_size; i++)
-                {
-                    cmds.push_back(cmd_pending_buffer.front());
-                    cmd_pending_buffer.pop();
-                }
-                pmaker->beat().then([this, cmds = std::move(cmds)](ReplicaID proposer) {
-                    if (proposer == get_id())
-                    {
-                        on_propose(cmds, pmaker->get_parents());
-#ifdef SYNCHS_LATBREAKDOWN
-                        for (auto &ch: cmds)
-                            cmd_lats[ch].on_propose();
-#endif
-#ifdef SYNCHS_AUTOCLI
-                        for (size_t i = pmaker->get_pending_size(); i < 1; i++)
-                            do_demand_commands(blk_size);
-#endif
-                    }
-                });
-                return true;
+                /* only propose what the others can fetch from here */
+                cmd_awaiting_payload.insert(cmd_hash);
+                continue;
             }
+            if (queue_proposal_cmd(cmd_hash)) return true;
 #ifdef SYNCHS_LATBREAKDOWN
             auto orig_cb = std::move(it.second);
             it.second = [this](Finality &fin) {
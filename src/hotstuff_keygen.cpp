@@ -33,6 +33,10 @@ int main(int argc, char **argv) {
     auto &algo = opt_algo->get();
     if (algo == "secp256k1")
         priv_key = new hotstuff::PrivKeySecp256k1();
+#ifdef HOTSTUFF_ENABLE_BLS
+    else if (algo == "bls")
+        priv_key = new hotstuff::PrivKeyBLS();
+#endif
     else
         error(1, 0, "algo not supported");
     int n = opt_n->get();
@@ -41,6 +45,8 @@ int main(int argc, char **argv) {
     while (n--)
     {
         priv_key->from_rand();
+        /* a bls public key carries the proof of possession of its secret
+         * key, which the replicas check when loading the configuration */
         pubkey_bt pub_key = priv_key->get_pubkey();
         printf("pub:%s sec:%s\n", get_hex(*pub_key).c_str(),
                             get_hex(*priv_key).c_str());
@@ -0,0 +1,101 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+
+#include "hotstuff/util.h"
+#include "hotstuff/mempool.h"
+#include "hotstuff/entity.h"
+
+namespace hotstuff {
+
+bool Mempool::mark_known(const uint256_t &cmd_hash, ReplicaID rid) {
+    if (rid >= nreplicas) return false;
+    auto &k = known[cmd_hash];
+    if (k.empty())
+    {
+        k.resize(nreplicas, false);
+        auto it = short_ids.insert(std::make_pair(Block::get_short_id(cmd_hash), cmd_hash));
+        if (!it.second && it.first->second != cmd_hash)
+            it.first->second = uint256_t();
+    }
+    if (k[rid]) return false;
+    k[rid] = true;
+    return true;
+}
+
+bool Mempool::is_known(const uint256_t &cmd_hash, ReplicaID rid) const {
+    auto it = known.find(cmd_hash);
+    return it != known.end() && rid < it->second.size() && it->second[rid];
+}
+
+bool Mempool::is_short_safe(const uint256_t &cmd_hash) const {
+    auto it = known.find(cmd_hash);
+    if (it == known.end()) return false;
+    for (bool k: it->second)
+        if (!k) return false;
+    auto sit = short_ids.find(Block::get_short_id(cmd_hash));
+    return sit != short_ids.end() && sit->second == cmd_hash;
+}
+
+bool Mempool::lookup_short(uint64_t sid, uint256_t &cmd_hash) const {
+    auto it = short_ids.find(sid);
+    if (it == short_ids.end() || it->second.is_null()) return false;
+    cmd_hash = it->second;
+    return true;
+}
+
+void Mempool::remove(const uint256_t &cmd_hash) {
+    if (!known.erase(cmd_hash)) return;
+    /* a short ID once shared by several commands is left unusable, which
+     * only clients crafting colliding commands would cause */
+    auto it = short_ids.find(Block::get_short_id(cmd_hash));
+    if (it != short_ids.end() && it->second == cmd_hash)
+        short_ids.erase(it);
+}
+
+std::vector<uint256_t> Mempool::take_outbox() {
+    std::vector<uint256_t> res;
+    res.swap(outbox);
+    return res;
+}
+
+std::vector<uint256_t> Mempool::pick_unknown(ReplicaID rid,
+                                            const std::vector<uint256_t> &cmd_hashes) {
+    std::vector<uint256_t> res;
+    for (const auto &h: cmd_hashes)
+        if (mark_known(h, rid)) res.push_back(h);
+    return res;
+}
+
+void RecentFilter::init(size_t _capacity) {
+    capacity = _capacity;
+    cmds.clear();
+    order.clear();
+}
+
+void RecentFilter::insert(const uint256_t &cmd_hash) {
+    if (!capacity || !cmds.insert(cmd_hash).second) return;
+    order.push_back(cmd_hash);
+    if (order.size() > capacity)
+    {
+        cmds.erase(order.front());
+        order.pop_front();
+    }
+}
+
+}
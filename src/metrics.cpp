@@ -0,0 +1,319 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "hotstuff/util.h"
+#include "hotstuff/metrics.h"
+
+namespace hotstuff {
+
+size_t MetricCounter::get_stripe() {
+    static std::atomic<size_t> next(0);
+    thread_local size_t stripe = next.fetch_add(1) % nstripe;
+    return stripe;
+}
+
+MetricHistogram::MetricHistogram(const std::vector<double> &bounds):
+        bounds(bounds), counts(bounds.size() + 1), sum_ns(0) {
+    for (auto &c: counts) c.store(0);
+}
+
+void MetricHistogram::observe(double sec) {
+    size_t i = std::lower_bound(bounds.begin(), bounds.end(), sec) - bounds.begin();
+    counts[i].fetch_add(1, std::memory_order_relaxed);
+    sum_ns.fetch_add(sec > 0 ? (uint64_t)(sec * 1e9) : 0, std::memory_order_relaxed);
+    count.inc();
+}
+
+std::vector<double> MetricHistogram::default_bounds() {
+    std::vector<double> bounds;
+    for (double b = 1e-4; b < 200; b *= 2)
+        bounds.push_back(b);
+    return bounds;
+}
+
+Metrics::Family &Metrics::get_family(const std::string &name,
+                                    const std::string &help,
+                                    const std::string &type) {
+    auto &f = families[name];
+    if (f.type.empty())
+    {
+        f.help = help;
+        f.type = type;
+    }
+    else if (f.type != type)
+        throw HotStuffError("metric %s registered as %s and %s",
+                            name.c_str(), f.type.c_str(), type.c_str());
+    return f;
+}
+
+MetricCounter &Metrics::add_counter(const std::string &name,
+                                    const std::string &help,
+                                    const std::string &labels) {
+    counters.emplace_back();
+    get_family(name, help, "counter").series.push_back(
+        Series{labels, &counters.back(), nullptr, nullptr});
+    return counters.back();
+}
+
+MetricHistogram &Metrics::add_histogram(const std::string &name,
+                                        const std::string &help,
+                                        const std::vector<double> &bounds) {
+    histograms.emplace_back(bounds);
+    get_family(name, help, "histogram").series.push_back(
+        Series{"", nullptr, &histograms.back(), nullptr});
+    return histograms.back();
+}
+
+void Metrics::add_gauge(const std::string &name,
+                        const std::string &help,
+                        gauge_fn_t fn,
+                        const std::string &labels) {
+    get_family(name, help, "gauge").series.push_back(
+        Series{labels, nullptr, nullptr, std::move(fn)});
+}
+
+static std::string with_labels(const std::string &name, const std::string &labels) {
+    return labels.empty() ? name : name + "{" + labels + "}";
+}
+
+static std::string fmt_double(double x) {
+    char buff[64];
+    snprintf(buff, sizeof buff, "%.9g", x);
+    return buff;
+}
+
+std::string Metrics::to_prometheus() const {
+    std::string out;
+    out += "# HELP hotstuff_metrics_enabled Whether the metrics are being collected.\n";
+    out += "# TYPE hotstuff_metrics_enabled gauge\n";
+    out += "hotstuff_metrics_enabled " + std::to_string(is_enabled()) + "\n";
+    for (const auto &p: families)
+    {
+        const auto &name = p.first;
+        const auto &f = p.second;
+        out += "# HELP " + name + " " + f.help + "\n";
+        out += "# TYPE " + name + " " + f.type + "\n";
+        for (const auto &s: f.series)
+        {
+            if (s.counter)
+                out += with_labels(name, s.labels) + " " +
+                        std::to_string(s.counter->get()) + "\n";
+            else if (s.gauge)
+                out += with_labels(name, s.labels) + " " +
+                        fmt_double(s.gauge()) + "\n";
+            else
+            {
+                const auto &h = *s.histogram;
+                const auto &bounds = h.get_bounds();
+                uint64_t acc = 0;
+                for (size_t i = 0; i < bounds.size(); i++)
+                {
+                    acc += h.get_bucket(i);
+                    out += name + "_bucket{le=\"" + fmt_double(bounds[i]) +
+                            "\"} " + std::to_string(acc) + "\n";
+                }
+                acc += h.get_bucket(bounds.size());
+                out += name + "_bucket{le=\"+Inf\"} " + std::to_string(acc) + "\n";
+                out += name + "_sum " + fmt_double(h.get_sum()) + "\n";
+                out += name + "_count " + std::to_string(acc) + "\n";
+            }
+        }
+    }
+    return out;
+}
+
+const size_t MetricsServer::max_conns;
+const size_t MetricsServer::max_req_size;
+constexpr double MetricsServer::idle_timeout;
+
+MetricsServer::MetricsServer(const EventContext &ec, Metrics &metrics,
+                            const NetAddr &listen_addr, const std::string &token):
+        metrics(metrics), ec(ec), token(token) {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        throw HotStuffError("failed to create metrics socket: %s", strerror(errno));
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = listen_addr.ip;
+    addr.sin_port = listen_addr.port;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, 16) < 0 ||
+        fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+    {
+        close(fd);
+        throw HotStuffError("failed to listen for metrics: %s", strerror(errno));
+    }
+    ev_accept = FdEvent(ec, fd, [this](int, int) { on_accept(); });
+    ev_accept.add(FdEvent::READ);
+}
+
+MetricsServer::~MetricsServer() {
+    ev_accept.clear();
+    for (auto &p: conns)
+    {
+        p.second->ev.clear();
+        p.second->timeout.clear();
+        close(p.first);
+    }
+    close(fd);
+}
+
+void MetricsServer::on_accept() {
+    for (;;)
+    {
+        int cfd = accept(fd, nullptr, nullptr);
+        if (cfd < 0) return;
+        if (conns.size() >= max_conns ||
+            fcntl(cfd, F_SETFL, O_NONBLOCK) < 0)
+        {
+            close(cfd);
+            continue;
+        }
+        auto conn = new Conn();
+        conn->ev = FdEvent(ec, cfd, [this, cfd](int, int events) {
+            if (events & FdEvent::WRITE)
+                on_write(cfd);
+            else
+                on_read(cfd);
+        });
+        conn->ev.add(FdEvent::READ);
+        conn->timeout = TimerEvent(ec, [this, cfd](TimerEvent &) {
+            close_conn(cfd);
+        });
+        conn->timeout.add(idle_timeout);
+        conns[cfd] = conn;
+    }
+}
+
+void MetricsServer::close_conn(int cfd) {
+    auto it = conns.find(cfd);
+    if (it == conns.end()) return;
+    it->second->ev.clear();
+    it->second->timeout.clear();
+    close(cfd);
+    conns.erase(it);
+}
+
+void MetricsServer::on_read(int cfd) {
+    auto &conn = conns[cfd];
+    char buff[1024];
+    ssize_t ret = read(cfd, buff, sizeof buff);
+    if (ret < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    if (ret <= 0)
+    {
+        close_conn(cfd);
+        return;
+    }
+    conn->req.append(buff, ret);
+    /* the request has no body, so it ends with the headers */
+    auto end = conn->req.find("\r\n\r\n");
+    if (end == std::string::npos)
+    {
+        if (conn->req.size() >= max_req_size) close_conn(cfd);
+        return;
+    }
+    conn->timeout.del();
+    conn->timeout.add(idle_timeout);
+    handle(cfd, conn->req.substr(0, end + 2));
+}
+
+void MetricsServer::handle(int cfd, const std::string &req) {
+    /* the request line is "<method> <path> HTTP/1.x" */
+    auto eol = req.find("\r\n");
+    auto line = req.substr(0, eol);
+    auto method = line.substr(0, line.find(' '));
+    auto path = line.substr(std::min(line.find(' ') + 1, line.size()));
+    path = path.substr(0, path.find(' '));
+    if (path == "/metrics")
+    {
+        if (method == "GET")
+            respond(cfd, "200 OK", metrics.to_prometheus());
+        else
+            respond(cfd, "405 Method Not Allowed", "");
+    }
+    else if (path == "/enable" || path == "/disable")
+    {
+        static const std::string auth = "\r\nauthorization: bearer ";
+        std::string lower = req;
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        auto pos = lower.find(auth);
+        std::string given;
+        if (pos != std::string::npos)
+        {
+            pos += auth.size();
+            given = req.substr(pos, req.find("\r\n", pos) - pos);
+        }
+        if (method != "POST")
+            respond(cfd, "405 Method Not Allowed", "");
+        else if (token.empty() || given != token)
+            respond(cfd, "403 Forbidden", "");
+        else
+        {
+            metrics.set_enabled(path == "/enable");
+            HOTSTUFF_LOG_INFO("metrics %s", path == "/enable" ? "enabled" : "disabled");
+            respond(cfd, "200 OK", "ok\n");
+        }
+    }
+    else
+        respond(cfd, "404 Not Found", "");
+}
+
+void MetricsServer::respond(int cfd, const std::string &status, const std::string &body) {
+    auto &conn = conns[cfd];
+    conn->resp = "HTTP/1.0 " + status + "\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: " + std::to_string(body.size()) + "\r\n"
+        "Connection: close\r\n\r\n" + body;
+    conn->resp_off = 0;
+    /* nothing more is read, the rest is written as the socket drains */
+    conn->ev.del();
+    conn->ev.add(FdEvent::WRITE);
+    on_write(cfd);
+}
+
+void MetricsServer::on_write(int cfd) {
+    auto &conn = conns[cfd];
+    while (conn->resp_off < conn->resp.size())
+    {
+        /* a scraper that hangs up early must not take the replica down
+         * with SIGPIPE */
+        ssize_t ret = send(cfd, conn->resp.data() + conn->resp_off,
+                            conn->resp.size() - conn->resp_off, MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0 && errno == EAGAIN) return;
+        if (ret <= 0) break;
+        conn->resp_off += ret;
+        /* the peer is reading, so it is not idle */
+        conn->timeout.del();
+        conn->timeout.add(idle_timeout);
+    }
+    close_conn(cfd);
+}
+
+}
@@ -0,0 +1,64 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdexcept>
+
+#include "hotstuff/multi.h"
+
+namespace hotstuff {
+
+InstanceMerger::InstanceMerger(size_t ninst, output_t output):
+        pending(ninst), next(0), nmerged(0), output(std::move(output)) {
+    if (ninst == 0)
+        throw std::invalid_argument("at least one instance is needed");
+}
+
+uint64_t InstanceMerger::get_nmerged() const {
+    std::lock_guard<std::mutex> _(mlock);
+    return nmerged;
+}
+
+void InstanceMerger::on_commit(uint32_t inst, std::vector<Finality> &&fins) {
+    std::lock_guard<std::mutex> _(mlock);
+    pending.at(inst).push(std::move(fins));
+    while (!pending[next].empty())
+    {
+        output(next, pending[next].front());
+        pending[next].pop();
+        next = (next + 1) % pending.size();
+        nmerged++;
+    }
+}
+
+bool InstanceMerger::is_stalled_on(uint32_t inst) const {
+    std::lock_guard<std::mutex> _(mlock);
+    if (!pending.at(inst).empty()) return false;
+    for (const auto &q: pending)
+        if (!q.empty()) return true;
+    return false;
+}
+
+uint32_t InstanceMerger::partition(const uint256_t &cmd_hash, size_t ninst) {
+    /* the hash is uniform, so its leading bytes spread the load evenly */
+    bytearray_t h = cmd_hash.to_bytes();
+    const uint8_t *p = &h[0];
+    uint32_t x = (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+                ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    return x % ninst;
+}
+
+}
@@ -0,0 +1,108 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <chrono>
+#include <algorithm>
+
+#include "hotstuff/util.h"
+#include "hotstuff/timer.h"
+
+namespace hotstuff {
+
+const TimerQueue::timer_id_t TimerQueue::null_id;
+
+TimerQueue::TimerQueue(const EventContext &ec): armed(-1), next_id(null_id) {
+    tick = TimerEvent(ec, [this](TimerEvent &) { on_tick(); });
+}
+
+double TimerQueue::now() {
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+TimerQueue::timer_id_t TimerQueue::add(double t_sec, callback_t cb) {
+    auto id = ++next_id;
+    double deadline = now() + t_sec;
+    Lane *lane = nullptr;
+    for (auto &l: lanes)
+        if (l.duration == t_sec)
+        {
+            lane = &l;
+            break;
+        }
+    if (lane == nullptr)
+    {
+        lanes.push_back(Lane{t_sec, {}});
+        lane = &lanes.back();
+    }
+    lane->fifo.push_back(Entry{deadline, id});
+    pending.insert(std::make_pair(id, std::move(cb)));
+    if (armed < 0 || deadline < armed)
+        rearm();
+    return id;
+}
+
+void TimerQueue::clear() {
+    pending.clear();
+    for (auto &l: lanes) l.fifo.clear();
+    tick.del();
+    armed = -1;
+}
+
+void TimerQueue::rearm() {
+    double next = -1;
+    for (auto &l: lanes)
+    {
+        /* drop the cancelled timers at the head */
+        while (!l.fifo.empty() && !pending.count(l.fifo.front().id))
+            l.fifo.pop_front();
+        if (!l.fifo.empty() &&
+            (next < 0 || l.fifo.front().deadline < next))
+            next = l.fifo.front().deadline;
+    }
+    tick.del();
+    armed = next;
+    if (next >= 0)
+        tick.add(std::max(next - now(), 0.0));
+}
+
+void TimerQueue::on_tick() {
+    armed = -1;
+    double t = now();
+    for (;;)
+    {
+        /* the callbacks may add or cancel timers, so look up the earliest
+         * expired head afresh each time */
+        Lane *lane = nullptr;
+        for (auto &l: lanes)
+            if (!l.fifo.empty() && l.fifo.front().deadline <= t &&
+                (lane == nullptr ||
+                l.fifo.front().deadline < lane->fifo.front().deadline))
+                lane = &l;
+        if (lane == nullptr) break;
+        auto id = lane->fifo.front().id;
+        lane->fifo.pop_front();
+        auto it = pending.find(id);
+        if (it == pending.end()) continue;
+        auto cb = std::move(it->second);
+        pending.erase(it);
+        cb();
+    }
+    rearm();
+}
+
+}
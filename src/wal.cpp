@@ -0,0 +1,232 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <array>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "hotstuff/util.h"
+#include "hotstuff/wal.h"
+
+namespace hotstuff {
+
+static const size_t wal_header_size = 9; /* length(4) + type(1) + crc32(4) */
+
+static uint32_t crc32(const uint8_t *data, size_t len) {
+    /* built once, and thread-safe as a function-local static */
+    static const std::array<uint32_t, 256> table = []() {
+        std::array<uint32_t, 256> t;
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    uint32_t c = 0xffffffffu;
+    for (size_t i = 0; i < len; i++)
+        c = table[(c ^ data[i]) & 0xff] ^ (c >> 8);
+    return c ^ 0xffffffffu;
+}
+
+static void put_u32(bytearray_t &buff, uint32_t x) {
+    for (int i = 0; i < 4; i++)
+        buff.push_back((x >> (i * 8)) & 0xff);
+}
+
+static void put_record(bytearray_t &buff, uint8_t type, const DataStream &payload) {
+    const uint8_t *data = payload.data();
+    size_t len = payload.size();
+    put_u32(buff, len);
+    buff.push_back(type);
+    put_u32(buff, crc32(data, len));
+    buff.insert(buff.end(), data, data + len);
+}
+
+static bool write_all(int fd, const bytearray_t &buff) {
+    size_t off = 0;
+    while (off < buff.size())
+    {
+        ssize_t ret = write(fd, &buff[off], buff.size() - off);
+        if (ret < 0)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        off += ret;
+    }
+    return true;
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+            ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+WALFile::WALFile(const EventContext &ec, const std::string &fname):
+        fname(fname), scheduled(false), failed(false), nrecords(0), nsync(0) {
+    fd = open(fname.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+        throw HotStuffError("failed to open wal %s: %s",
+                            fname.c_str(), strerror(errno));
+    flush_timer = TimerEvent(ec, [this](TimerEvent &) { flush(); });
+}
+
+WALFile::~WALFile() {
+    /* the owner is being torn down, so do not call back into it */
+    waiting.clear();
+    flush();
+    fdatasync(fd);
+    close(fd);
+}
+
+void WALFile::schedule_flush() {
+    if (scheduled) return;
+    flush_timer.add(0);
+    scheduled = true;
+}
+
+void WALFile::append(uint8_t type, const DataStream &payload) {
+    if (failed) return;
+    put_record(buffer, type, payload);
+    nrecords++;
+    schedule_flush();
+}
+
+void WALFile::commit(durable_cb_t on_durable) {
+    if (failed) return;
+    waiting.push_back(std::move(on_durable));
+    schedule_flush();
+}
+
+void WALFile::fail(const char *what) {
+    /* called from the event loop, so do not throw: votes wait for the
+     * commits, and those are never notified from now on */
+    HOTSTUFF_LOG_ERROR("failed to %s wal %s: %s, no longer voting",
+                        what, fname.c_str(), strerror(errno));
+    failed = true;
+    buffer.clear();
+    waiting.clear();
+}
+
+void WALFile::flush() {
+    flush_timer.del();
+    scheduled = false;
+    if (failed) return;
+    if (!write_all(fd, buffer))
+    {
+        fail("write");
+        return;
+    }
+    buffer.clear();
+    if (waiting.empty()) return;
+    if (fdatasync(fd) < 0)
+    {
+        fail("sync");
+        return;
+    }
+    nsync++;
+    auto cbs = std::move(waiting);
+    waiting.clear();
+    for (auto &cb: cbs) cb();
+}
+
+void WALFile::replay(const replay_cb_t &cb) {
+    flush();
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        throw HotStuffError("failed to stat wal: %s", strerror(errno));
+    bytearray_t data(st.st_size);
+    size_t off = 0;
+    while (off < data.size())
+    {
+        ssize_t ret = pread(fd, &data[off], data.size() - off, off);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0)
+            throw HotStuffError("failed to read wal: %s", strerror(errno));
+        if (ret == 0)
+            throw HotStuffError("wal truncated while being read "
+                                "(%lu of %lu bytes)", off, data.size());
+        off += ret;
+    }
+    size_t pos = 0;
+    size_t nreplayed = 0;
+    while (pos + wal_header_size <= data.size())
+    {
+        const uint8_t *p = &data[pos];
+        uint32_t len = get_u32(p);
+        uint8_t type = p[4];
+        uint32_t crc = get_u32(p + 5);
+        if (pos + wal_header_size + len > data.size() ||
+            crc32(p + wal_header_size, len) != crc)
+            break;
+        DataStream s(p + wal_header_size, p + wal_header_size + len);
+        cb(type, s);
+        pos += wal_header_size + len;
+        nreplayed++;
+    }
+    if (pos < data.size())
+    {
+        HOTSTUFF_LOG_WARN("wal %s: dropping %lu bytes of torn records",
+                        fname.c_str(), data.size() - pos);
+        if (ftruncate(fd, pos) < 0)
+            throw HotStuffError("failed to truncate wal: %s", strerror(errno));
+    }
+    HOTSTUFF_LOG_INFO("wal %s: replayed %lu records", fname.c_str(), nreplayed);
+}
+
+void WALFile::compact(const records_t &records) {
+    flush();
+    if (failed) return;
+    bytearray_t buff;
+    for (const auto &r: records)
+        put_record(buff, r.first, r.second);
+    std::string tmp = fname + ".tmp";
+    int nfd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (nfd < 0 || !write_all(nfd, buff) || fdatasync(nfd) < 0 ||
+        rename(tmp.c_str(), fname.c_str()) < 0)
+    {
+        HOTSTUFF_LOG_WARN("failed to compact wal %s: %s, keeping it",
+                        fname.c_str(), strerror(errno));
+        if (nfd >= 0)
+        {
+            close(nfd);
+            unlink(tmp.c_str());
+        }
+        return;
+    }
+    /* make the rename durable */
+    auto pos = fname.rfind('/');
+    std::string dir = pos == std::string::npos ? "." : fname.substr(0, pos + 1);
+    int dfd = open(dir.c_str(), O_RDONLY);
+    if (dfd >= 0)
+    {
+        fsync(dfd);
+        close(dfd);
+    }
+    close(fd);
+    fd = nfd;
+    HOTSTUFF_LOG_INFO("wal %s: compacted into %lu records (%lu bytes)",
+                    fname.c_str(), records.size(), buff.size());
+}
+
+}
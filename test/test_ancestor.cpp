@@ -0,0 +1,110 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <vector>
+
+#include "hotstuff/util.h"
+#include "hotstuff/consensus.h"
+#include "hotstuff/archive.h"
+
+#include "test_core.h"
+
+using namespace hotstuff;
+
+/* long enough for skip pointers of many lengths */
+static const uint32_t nblks = 300;
+static const uint32_t fork_height = 101;
+static const uint32_t nforks = 50;
+
+static void run_checks() {
+    TempDir dir("ancestor");
+    TestCore hsc;
+    hsc.storage->set_archive(new BlockArchive(dir.path("archive"), 1 << 16));
+
+    /* chain[h] is at height h, and fork[i] at fork_height + 1 + i */
+    std::vector<block_t> chain{hsc.get_genesis()};
+    for (uint32_t h = 1; h <= nblks; h++)
+        chain.push_back(hsc.deliver(chain.back()));
+    std::vector<block_t> fork{hsc.deliver(chain[fork_height])};
+    for (uint32_t i = 1; i < nforks; i++)
+        fork.push_back(hsc.deliver(fork.back()));
+
+    for (uint32_t i = 0; i <= nblks; i++)
+        for (uint32_t j = 0; j <= nblks; j++)
+            CHECK(hsc.is_ancestor(chain[i], chain[j]) == (i <= j));
+    for (uint32_t h = 0; h <= nblks; h++)
+    {
+        CHECK(hsc.is_ancestor(chain[h], fork.back()) == (h <= fork_height));
+        for (const auto &b: fork)
+            CHECK(!hsc.is_ancestor(b, chain[h]));
+    }
+    for (uint32_t i = 0; i < nforks; i++)
+        CHECK(hsc.is_ancestor(fork[i], fork.back()));
+
+    /* prune below height 250, once nothing else holds the blocks to be
+     * released but the branch off the chain (and the storage) */
+    std::vector<uint256_t> hashes;
+    for (const auto &b: chain) hashes.push_back(b->get_hash());
+    fork.clear();
+    hsc.on_commit_timeout(chain[280]);
+    CHECK(hsc.decided.size() == 280 && hsc.decided.back() == chain[280]);
+    hsc.decided.clear();
+    const uint32_t floor = 250;
+    chain.erase(chain.begin(), chain.begin() + floor);
+    hsc.prune(280 - floor);
+
+    /* the released blocks are read back from the archive, one copy at a
+     * time, while the parent of the branch stays in memory */
+    for (uint32_t h = 1; h < floor; h++)
+    {
+        CHECK(hsc.storage->is_blk_archived(hashes[h]) == (h != fork_height));
+        CHECK(hsc.storage->is_blk_delivered(hashes[h]));
+        block_t b = hsc.storage->find_blk(hashes[h]);
+        CHECK(b != nullptr && b->get_hash() == hashes[h]);
+        CHECK(b->get_height() == h);
+    }
+    for (uint32_t h = floor; h <= nblks; h++)
+        CHECK(!hsc.storage->is_blk_archived(hashes[h]));
+
+    /* the skip pointers into the released range are not followed, so
+     * the ancestry is only answered from the floor up */
+    const block_t &tip = chain.back();
+    for (uint32_t i = 0; i < chain.size(); i++)
+    {
+        CHECK(hsc.is_ancestor(chain[i], tip));
+        CHECK(hsc.is_ancestor(tip, chain[i]) == (chain[i] == tip));
+    }
+    CHECK(!hsc.is_ancestor(hsc.get_genesis(), tip));
+
+    /* the chain grows on top as usual, and is pruned again */
+    for (uint32_t h = nblks + 1; h <= 2 * nblks; h++)
+        chain.push_back(hsc.deliver(chain.back()));
+    for (uint32_t i = 0; i < chain.size(); i++)
+        for (uint32_t j = i; j < chain.size(); j += 17)
+        {
+            CHECK(hsc.is_ancestor(chain[i], chain[j]));
+            CHECK(hsc.is_ancestor(chain[j], chain[i]) == (i == j));
+        }
+    hsc.on_commit_timeout(chain.back());
+    CHECK(hsc.decided.size() == 2 * nblks - 280);
+    hsc.decided.clear();
+    chain.erase(chain.begin(), chain.end() - 1);
+    hsc.prune(0);
+    CHECK(hsc.storage->is_blk_archived(hashes[nblks]));
+    CHECK(hsc.is_ancestor(chain[0], chain[0]));
+    CHECK(!hsc.is_ancestor(hsc.get_genesis(), chain[0]));
+}
@@ -0,0 +1,83 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+
+#include "hotstuff/util.h"
+#include "hotstuff/archive.h"
+
+#include "test_util.h"
+
+using namespace hotstuff;
+
+/* enough to grow both indices past their initial size */
+static const uint32_t nblks = 5000;
+static const uint32_t base_height = 10;
+
+static DataStream make_blk(uint32_t i) {
+    DataStream s;
+    s << std::string(i % 97 + 1, 'a' + i % 26) << i;
+    return s;
+}
+
+static void check_all(const BlockArchive &archive) {
+    CHECK(archive.size() == nblks);
+    for (uint32_t i = 0; i < nblks; i++)
+    {
+        DataStream blk = make_blk(i);
+        uint256_t blk_hash = blk.get_hash();
+        const uint8_t *data;
+        size_t size;
+        uint32_t height;
+        CHECK(archive.contains(blk_hash));
+        CHECK(archive.get(blk_hash, data, size, &height));
+        CHECK(height == base_height + i);
+        CHECK(size == blk.size() && !memcmp(data, blk.data(), size));
+        uint256_t h;
+        CHECK(archive.get(base_height + i, h, data, size));
+        CHECK(h == blk_hash);
+        CHECK(size == blk.size() && !memcmp(data, blk.data(), size));
+    }
+    const uint8_t *data;
+    size_t size;
+    uint256_t h;
+    CHECK(!archive.contains(make_blk(nblks).get_hash()));
+    CHECK(!archive.get(base_height - 1, h, data, size));
+    CHECK(!archive.get(base_height + nblks, h, data, size));
+}
+
+static void run_checks() {
+    TempDir dir("archive");
+    std::string fname = dir.path("archive");
+    {
+        BlockArchive archive(fname, 1 << 12);
+        for (uint32_t i = 0; i < nblks; i++)
+        {
+            archive.append(make_blk(i).get_hash(), base_height + i, make_blk(i));
+            /* flushing from the middle of a page */
+            if (i % 1000 == 7) archive.sync();
+        }
+        /* appending again is a no-op */
+        archive.append(make_blk(0).get_hash(), base_height, make_blk(0));
+        check_all(archive);
+    }
+    /* the indices are rebuilt from the segment */
+    {
+        BlockArchive archive(fname, 1 << 12);
+        check_all(archive);
+    }
+}
@@ -0,0 +1,172 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <unordered_map>
+#include <vector>
+
+#include "hotstuff/util.h"
+#include "hotstuff/consensus.h"
+#include "hotstuff/client.h"
+
+#include "test_core.h"
+
+using namespace hotstuff;
+
+static uint256_t cmd_hash(uint32_t i) {
+    DataStream s;
+    s << i;
+    return s.get_hash();
+}
+
+static block_t make_blk(const std::vector<block_t> &parents, uint32_t ncmds,
+                        quorum_cert_bt &&qc, const block_t &qc_ref) {
+    std::vector<uint256_t> cmds;
+    for (uint32_t i = 0; i < ncmds; i++)
+        cmds.push_back(cmd_hash(parents[0]->get_height() * 1000 + i));
+    return new Block(parents, cmds, std::move(qc), bytearray_t{1, 2, 3},
+                    parents[0]->get_height() + 1, qc_ref, nullptr);
+}
+
+static bytearray_t canonical(const Block &blk) {
+    DataStream s;
+    blk.serialize(s);
+    return std::move(s);
+}
+
+/** Encode compactly, decode and rebuild the canonical form, which must be
+ * the same block. Return the compact size. */
+static size_t round_trip(TestCore &hsc, const block_t &blk,
+        const std::function<bool(const uint256_t &)> &use_short = nullptr,
+        const std::unordered_map<uint64_t, uint256_t> &known = {}) {
+    DataStream s;
+    blk->serialize_compact(s, use_short);
+    size_t size = s.size();
+    Block b;
+    b.unserialize_compact(s, &hsc);
+    CHECK(s.size() == 0);
+    CHECK(b.finish_compact([&known](uint64_t sid, uint256_t &h) {
+        auto it = known.find(sid);
+        if (it == known.end()) return false;
+        h = it->second;
+        return true;
+    }));
+    CHECK(b.get_hash() == blk->get_hash());
+    CHECK(canonical(b) == canonical(*blk));
+    CHECK(b.get_cmds() == blk->get_cmds());
+    CHECK(b.get_qc_ref_hash() == blk->get_qc_ref_hash());
+    if (blk->get_qc())
+    {
+        CHECK(b.get_qc()->get_obj_hash() == blk->get_qc()->get_obj_hash());
+        CHECK(b.get_qc()->get_signers() == blk->get_qc()->get_signers());
+        CHECK(b.get_qc()->verify(hsc.get_config()));
+    }
+    return size;
+}
+
+static void run_checks() {
+    /* varints of every length, up to the full 64 bits */
+    std::vector<uint64_t> xs{0, 1, 127, 128, 300, 16383, 16384,
+                            (1ull << 32) - 1, 1ull << 32, ~0ull};
+    for (int i = 0; i < 64; i++) xs.push_back(1ull << i);
+    for (auto x: xs)
+    {
+        DataStream s;
+        put_varint(s, x);
+        size_t nbytes = 1;
+        for (uint64_t y = x; y >= 0x80; y >>= 7) nbytes++;
+        CHECK(s.size() == nbytes);
+        CHECK(get_varint(s) == x);
+        CHECK(s.size() == 0);
+    }
+    {
+        /* more than ten bytes cannot be a 64-bit varint */
+        DataStream s;
+        for (int i = 0; i < 11; i++) s << (uint8_t)0x80;
+        CHECK_THROWS(get_varint(s), std::runtime_error);
+    }
+
+    TestCore hsc;
+    const block_t &b0 = hsc.get_genesis();
+
+    /* no QC, no commands */
+    block_t b1 = make_blk({b0}, 0, nullptr, nullptr);
+    round_trip(hsc, b1);
+
+    /* the QC certifies the parent, so its reference is left out */
+    block_t b2 = make_blk({b1}, 20, hsc.make_qc(b1, 0x3f7), b1);
+    size_t compact = round_trip(hsc, b2);
+    CHECK(compact < canonical(*b2).size());
+
+    /* the QC certifies another block than the first parent */
+    block_t b3 = make_blk({b2, b1}, 3, hsc.make_qc(b1, 0x3ff), b1);
+    round_trip(hsc, b3);
+
+    /* every other command known to the receiver goes by its short ID */
+    block_t b4 = make_blk({b3}, 17, hsc.make_qc(b3, 0x2aa | 0x155), b3);
+    std::unordered_map<uint64_t, uint256_t> known;
+    const auto &cmds = b4->get_cmds();
+    for (size_t i = 0; i < cmds.size(); i += 2)
+        known[Block::get_short_id(cmds[i])] = cmds[i];
+    auto use_short = [&known](const uint256_t &h) {
+        return known.count(Block::get_short_id(h)) > 0;
+    };
+    size_t nshort = round_trip(hsc, b4, use_short, known);
+    CHECK(nshort + 9 * (32 - 8) - 3 == round_trip(hsc, b4));
+    {
+        /* an unknown short ID leaves the block to be fetched in full */
+        DataStream s;
+        b4->serialize_compact(s, use_short);
+        Block b;
+        b.unserialize_compact(s, &hsc);
+        CHECK(!b.finish_compact([](uint64_t, uint256_t &) { return false; }));
+    }
+
+    /* an unknown version or flag is refused */
+    for (int off = 0; off < 2; off++)
+    {
+        DataStream s;
+        b2->serialize_compact(s);
+        bytearray_t bytes(std::move(s));
+        bytes[off] ^= 0x80;
+        DataStream t(std::move(bytes));
+        Block b;
+        CHECK_THROWS(b.unserialize_compact(t, &hsc), std::runtime_error);
+    }
+
+    /* the full encoding is read back in place, and nothing else is taken */
+    {
+        bytearray_t bytes = canonical(*b3);
+        DataStream s(bytes);
+        block_t b = Block::parse(s, &hsc);
+        CHECK(s.size() == 0);
+        CHECK(b->get_hash() == b3->get_hash());
+        CHECK(canonical(*b) == bytes);
+        CHECK(b->get_cmds() == b3->get_cmds());
+        CHECK(b->get_extra() == b3->get_extra());
+        /* the QC flag follows the two parents and the three commands */
+        size_t flag_off = 4 + 2 * 32 + 4 + 3 * 32;
+        CHECK(bytes[flag_off] == 1);
+        for (auto edit: std::vector<std::pair<size_t, uint8_t>>{
+                {flag_off, 2}, {0, 0xff}, {4 + 2 * 32, 0xff}})
+        {
+            bytearray_t bad = bytes;
+            bad[edit.first] = edit.second;
+            DataStream t(std::move(bad));
+            CHECK_THROWS(Block::parse(t, &hsc), std::exception);
+        }
+    }
+}
@@ -0,0 +1,143 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HOTSTUFF_TEST_CORE_H
+#define _HOTSTUFF_TEST_CORE_H
+
+#include <vector>
+
+#include "hotstuff/consensus.h"
+#include "hotstuff/client.h"
+
+#include "test_util.h"
+
+/** A replica without a network or timers, which keeps the keys of all the
+ * replicas to sign for them, and records the blocks it executes. */
+class TestCore: public hotstuff::HotStuffCore {
+    uint32_t nblks_made;
+
+    protected:
+    void do_decide_batch(const hotstuff::block_t &blk) override {
+        decided.push_back(blk);
+    }
+    void do_consensus(const hotstuff::block_t &) override {}
+    void do_speculate(const hotstuff::block_t &blk) override {
+        speculated.push_back(blk);
+    }
+    void do_rollback(const hotstuff::block_t &blk) override {
+        rolled_back.push_back(blk);
+    }
+    void do_broadcast_proposal(const hotstuff::Proposal &) override {}
+    void do_broadcast_vote(const hotstuff::Vote &) override {}
+    void do_broadcast_blame(const hotstuff::Blame &) override {}
+    void do_broadcast_blamenotify(const hotstuff::BlameNotify &) override {}
+    void do_notify(const hotstuff::Notify &) override {}
+    void set_commit_timer(const hotstuff::block_t &, double) override {}
+    void set_blame_timer(double) override {}
+    void stop_commit_timer(uint32_t) override {}
+    void stop_commit_timer_all() override {}
+    void stop_blame_timer() override {}
+    void set_viewtrans_timer(double) override {}
+    void stop_viewtrans_timer() override {}
+
+    hotstuff::part_cert_bt create_part_cert(const hotstuff::PrivKey &priv_key,
+                                const hotstuff::uint256_t &obj_hash) override {
+        return new hotstuff::PartCertSecp256k1(
+            static_cast<const hotstuff::PrivKeySecp256k1 &>(priv_key), obj_hash);
+    }
+
+    hotstuff::part_cert_bt parse_part_cert(hotstuff::DataStream &s) override {
+        hotstuff::PartCert *pc = new hotstuff::PartCertSecp256k1();
+        s >> *pc;
+        return pc;
+    }
+
+    hotstuff::quorum_cert_bt create_quorum_cert(
+                                const hotstuff::uint256_t &obj_hash) override {
+        return new hotstuff::QuorumCertSecp256k1(get_config(), obj_hash);
+    }
+
+    hotstuff::quorum_cert_bt parse_quorum_cert(hotstuff::DataStream &s) override {
+        hotstuff::QuorumCert *qc =
+            new hotstuff::QuorumCertSecp256k1(get_config(), hotstuff::uint256_t());
+        s >> *qc;
+        return qc;
+    }
+
+    hotstuff::quorum_cert_bt parse_quorum_cert_compact(hotstuff::DataStream &s,
+                            const hotstuff::uint256_t &obj_hash) override {
+        hotstuff::QuorumCert *qc =
+            new hotstuff::QuorumCertSecp256k1(get_config(), hotstuff::uint256_t());
+        qc->unserialize_compact(s, obj_hash);
+        return qc;
+    }
+
+    hotstuff::command_t parse_cmd(hotstuff::DataStream &s) override {
+        auto cmd = new hotstuff::CommandDummy();
+        s >> *cmd;
+        return cmd;
+    }
+
+    public:
+    std::vector<hotstuff::PrivKeySecp256k1> privs;
+    /* the blocks passed to do_decide_batch(), do_speculate() and
+     * do_rollback() so far, in order */
+    std::vector<hotstuff::block_t> decided;
+    std::vector<hotstuff::block_t> speculated;
+    std::vector<hotstuff::block_t> rolled_back;
+
+    TestCore(hotstuff::ReplicaID nreplicas = 10):
+            HotStuffCore(0, new hotstuff::PrivKeySecp256k1()), nblks_made(0),
+            privs(nreplicas) {
+        for (hotstuff::ReplicaID i = 0; i < nreplicas; i++)
+        {
+            privs[i].from_rand();
+            add_replica(i, hotstuff::NetAddr(),
+                        new hotstuff::PubKeySecp256k1(privs[i]));
+        }
+    }
+
+    /** A QC for `blk` signed by the replicas set in `mask`. */
+    hotstuff::quorum_cert_bt make_qc(const hotstuff::block_t &blk, uint32_t mask) {
+        auto obj_hash = hotstuff::Vote::proof_obj_hash(blk->get_hash());
+        hotstuff::quorum_cert_bt qc = create_quorum_cert(obj_hash);
+        for (hotstuff::ReplicaID i = 0; i < privs.size(); i++)
+            if (mask & (1 << i))
+                qc->add_part(i, hotstuff::PartCertSecp256k1(privs[i], obj_hash));
+        qc->compute();
+        return qc;
+    }
+
+    /** Add a new block on top of `parent` to the storage and deliver it,
+     * carrying a QC for `qc_ref` (by all the replicas) unless it is null. */
+    hotstuff::block_t deliver(const hotstuff::block_t &parent,
+                            const hotstuff::block_t &qc_ref = nullptr) {
+        /* the serial number in the extra data tells the sibling blocks
+         * apart */
+        hotstuff::DataStream extra;
+        extra << nblks_made++;
+        hotstuff::block_t blk = new hotstuff::Block(
+            {parent}, {},
+            qc_ref ? make_qc(qc_ref, (1 << privs.size()) - 1) : nullptr,
+            hotstuff::bytearray_t(std::move(extra)), parent->get_height() + 1, qc_ref, nullptr);
+        blk = storage->add_blk(blk);
+        CHECK(on_deliver_blk(blk));
+        return blk;
+    }
+};
+
+#endif
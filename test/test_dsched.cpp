@@ -0,0 +1,116 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <vector>
+
+#include "hotstuff/util.h"
+#include "hotstuff/hotstuff.h"
+#include "hotstuff/liveness.h"
+#include "hotstuff/client.h"
+
+#include "test_util.h"
+
+using namespace hotstuff;
+
+/** A lone replica, whose blocks are all in its storage already so that
+ * nothing is fetched from the network. */
+class TestHotStuff: public HotStuffSecp256k1 {
+    command_t parse_cmd(DataStream &s) override {
+        auto cmd = new CommandDummy();
+        s >> *cmd;
+        return cmd;
+    }
+
+    void state_machine_execute(const Finality &) override {}
+
+    public:
+    TestHotStuff(const bytearray_t &raw_privkey, const NetAddr &addr,
+                const EventContext &ec):
+        HotStuffSecp256k1(1, 0, raw_privkey, addr,
+                        new PaceMakerDummyFixed(0, 1), ec, 1) {}
+};
+
+/** A fetched block of height 1 (the extra byte tells the siblings apart). */
+static block_t add_blk(TestHotStuff &hs, std::vector<block_t> &&uncles,
+                        quorum_cert_bt &&qc, const block_t &qc_ref,
+                        uint8_t tag) {
+    std::vector<block_t> parents{hs.get_genesis()};
+    for (auto &b: uncles) parents.push_back(std::move(b));
+    return hs.storage->add_blk(new Block(parents, {}, std::move(qc),
+                                bytearray_t{tag}, 1, qc_ref, nullptr));
+}
+
+static quorum_cert_bt make_qc(TestHotStuff &hs, const block_t &blk,
+                            const PrivKeySecp256k1 &priv) {
+    auto obj_hash = Vote::proof_obj_hash(blk->get_hash());
+    quorum_cert_bt qc = new QuorumCertSecp256k1(hs.get_config(), obj_hash);
+    qc->add_part(0, PartCertSecp256k1(priv, obj_hash));
+    qc->compute();
+    return qc;
+}
+
+static void run_checks() {
+    PrivKeySecp256k1 priv, other;
+    priv.from_rand();
+    other.from_rand();
+    NetAddr addr("127.0.0.1:32711");
+    EventContext ec;
+    TestHotStuff hs(priv.to_bytes(), addr, ec);
+    hs.start({std::make_tuple(addr, PubKeySecp256k1(priv).to_bytes(),
+                            bytearray_t(32))}, 1);
+    TimerEvent timeout(ec, [](TimerEvent &) { CHECK(!"timed out"); });
+    timeout.add(10);
+
+    /* c has the uncle b, which has the uncle a and carries a QC for it:
+     * scheduling b and then c delivers a on the spot, then b once its QC
+     * is verified, which releases c in the same batch */
+    block_t a = add_blk(hs, {}, nullptr, nullptr, 0);
+    block_t b = add_blk(hs, {a}, make_qc(hs, a, priv), a, 1);
+    block_t c = add_blk(hs, {b, a}, nullptr, nullptr, 2);
+    std::vector<block_t> delivered;
+    auto record = [&delivered](const block_t &blk) { delivered.push_back(blk); };
+    hs.async_deliver_blk(b->get_hash(), addr).then(record);
+    CHECK(hs.storage->is_blk_delivered(a->get_hash()));
+    CHECK(!hs.storage->is_blk_delivered(b->get_hash()));
+    hs.async_deliver_blk(c->get_hash(), addr).then(record).then([&ec]() {
+        ec.stop();
+    });
+    ec.dispatch();
+    CHECK((delivered == std::vector<block_t>{b, c}));
+    CHECK(hs.storage->is_blk_delivered(c->get_hash()));
+    /* a delivered block resolves right away */
+    bool resolved = false;
+    hs.async_deliver_blk(c->get_hash(), addr).then([&resolved]() {
+        resolved = true;
+    });
+    CHECK(resolved);
+
+    /* a QC signed with the wrong key makes d invalid, and e with it */
+    block_t d = add_blk(hs, {}, make_qc(hs, a, other), a, 3);
+    block_t e = add_blk(hs, {d}, nullptr, nullptr, 4);
+    bool rejected = false;
+    hs.async_deliver_blk(e->get_hash(), addr).then([]() {
+        CHECK(!"delivered an invalid block");
+    }, [&ec, &rejected]() {
+        rejected = true;
+        ec.stop();
+    });
+    ec.dispatch();
+    CHECK(rejected);
+    CHECK(!hs.storage->is_blk_delivered(d->get_hash()));
+    CHECK(!hs.storage->is_blk_delivered(e->get_hash()));
+}
@@ -0,0 +1,109 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <random>
+#include <algorithm>
+
+#include "hotstuff/util.h"
+#include "hotstuff/erasure.h"
+
+#include "test_util.h"
+
+using namespace hotstuff;
+
+static std::mt19937 rng(1);
+
+static std::vector<uint256_t> get_leaves(const std::vector<bytearray_t> &shards) {
+    std::vector<uint256_t> leaves;
+    for (const auto &s: shards)
+        leaves.push_back(DataStream(s).get_hash());
+    return leaves;
+}
+
+/* any ndata of the shards give the data back, fewer do not */
+static void check_code(size_t ndata, size_t nshard, size_t len) {
+    bytearray_t data(len);
+    for (auto &b: data) b = rng();
+    ReedSolomon rs(ndata, nshard);
+    auto shards = rs.encode(data.data(), len);
+    CHECK(shards.size() == nshard);
+    for (const auto &s: shards)
+        CHECK(s.size() == rs.get_shard_size(len));
+    std::vector<uint32_t> idx(nshard);
+    for (size_t i = 0; i < nshard; i++) idx[i] = i;
+    for (int round = 0; round < 8; round++)
+    {
+        std::shuffle(idx.begin(), idx.end(), rng);
+        std::unordered_map<uint32_t, bytearray_t> picked;
+        for (size_t i = 0; i + 1 < ndata; i++)
+            picked[idx[i]] = shards[idx[i]];
+        bytearray_t out;
+        CHECK(!rs.decode(picked, len, out));
+        picked[idx[ndata - 1]] = shards[idx[ndata - 1]];
+        CHECK(rs.decode(picked, len, out));
+        CHECK(out == data);
+    }
+}
+
+/* each leaf verifies at its own position only */
+static void check_merkle(size_t nleaves) {
+    std::vector<uint256_t> leaves;
+    for (size_t i = 0; i < nleaves; i++)
+        leaves.push_back(DataStream(bytearray_t{(uint8_t)i, (uint8_t)(i >> 8)}).get_hash());
+    auto root = merkle_root(leaves);
+    for (size_t i = 0; i < nleaves; i++)
+    {
+        auto proof = merkle_proof(leaves, i);
+        CHECK(merkle_verify(root, leaves[i], i, nleaves, proof));
+        if (nleaves > 1)
+        {
+            size_t j = (i + 1) % nleaves;
+            CHECK(!merkle_verify(root, leaves[j], i, nleaves, proof));
+            CHECK(!merkle_verify(root, leaves[i], j, nleaves, proof));
+        }
+    }
+}
+
+static void run_checks() {
+    for (size_t nshard: {1, 2, 4, 7, 10, 31, 64, 256})
+        for (size_t ndata: {(size_t)1, (nshard + 2) / 3, nshard - (nshard - 1) / 3, nshard})
+            for (size_t len: {1, 17, 1000})
+                check_code(ndata, nshard, len);
+    for (size_t n = 1; n <= 33; n++)
+        check_merkle(n);
+
+    /* shards that each match the root but are not a codeword decode to
+     * data that does not encode back to the root */
+    ReedSolomon rs(3, 7);
+    bytearray_t data(100, 0x5a);
+    auto shards = rs.encode(data.data(), data.size());
+    shards[5][0] ^= 1;
+    auto root = merkle_root(get_leaves(shards));
+    std::unordered_map<uint32_t, bytearray_t> picked{
+        {0, shards[0]}, {1, shards[1]}, {5, shards[5]}};
+    bytearray_t out;
+    CHECK(rs.decode(picked, data.size(), out));
+    CHECK(out != data);
+    CHECK(merkle_root(get_leaves(rs.encode(out.data(), out.size()))) != root);
+    /* while a codeword does */
+    shards[5][0] ^= 1;
+    root = merkle_root(get_leaves(shards));
+    picked[5] = shards[5];
+    CHECK(rs.decode(picked, data.size(), out));
+    CHECK(merkle_root(get_leaves(rs.encode(out.data(), out.size()))) == root);
+
+}
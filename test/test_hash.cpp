@@ -0,0 +1,116 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <random>
+#include <vector>
+
+#include "hotstuff/util.h"
+#include "hotstuff/hash.h"
+#include "hotstuff/client.h"
+
+#include "test_util.h"
+
+using namespace hotstuff;
+
+static uint256_t sha256(const bytearray_t &msg) {
+    SHA256 d;
+    d.update(msg.data(), msg.size());
+    return uint256_t(d.digest());
+}
+
+/** Hash the messages in one batch both ways, checking against SHA256. */
+static bool check_batch(const std::vector<bytearray_t> &msgs) {
+    size_t n = msgs.size();
+    std::vector<const uint8_t *> ptrs(n);
+    std::vector<size_t> lens(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        ptrs[i] = msgs[i].data();
+        lens[i] = msgs[i].size();
+    }
+    std::vector<uint256_t> hashes(n), hashes_x8(n);
+    hash_batch(ptrs.data(), lens.data(), n, hashes.data());
+    bool x8 = hash_batch_x8(ptrs.data(), lens.data(), n, hashes_x8.data());
+    for (size_t i = 0; i < n; i++)
+    {
+        uint256_t h = sha256(msgs[i]);
+        CHECK(hashes[i] == h);
+        CHECK(!x8 || hashes_x8[i] == h);
+    }
+    return x8;
+}
+
+static void run_checks() {
+    std::mt19937 rng(1);
+    auto random_msg = [&rng](size_t len) {
+        bytearray_t msg(len);
+        for (auto &b: msg) b = rng();
+        return msg;
+    };
+
+    /* a known digest */
+    bytearray_t abc{'a', 'b', 'c'};
+    const uint8_t *p = abc.data();
+    size_t len = abc.size();
+    uint256_t h;
+    hash_batch(&p, &len, 1, &h);
+    CHECK(get_hex(h) == "ba7816bf8f01cfea414140de5dae2223"
+                        "b00361a396177a9cb410ff61f20015ad");
+
+    /* every length across the block and padding boundaries, in batches of
+     * one length (filling all the lanes the same way) */
+    bool x8 = false;
+    for (size_t l = 0; l <= 300; l++)
+    {
+        std::vector<bytearray_t> msgs;
+        for (int i = 0; i < 8; i++) msgs.push_back(random_msg(l));
+        x8 = check_batch(msgs);
+    }
+
+    /* batches that are not multiples of eight, of mixed lengths */
+    for (size_t n = 1; n <= 41; n++)
+    {
+        std::vector<bytearray_t> msgs;
+        for (size_t i = 0; i < n; i++) msgs.push_back(random_msg(rng() % 301));
+        check_batch(msgs);
+    }
+    {
+        std::vector<bytearray_t> msgs;
+        for (size_t l = 0; l <= 300; l++) msgs.push_back(random_msg(l));
+        std::shuffle(msgs.begin(), msgs.end(), rng);
+        check_batch(msgs);
+    }
+
+    /* commands parsed in a batch hash as they are made */
+    for (size_t n: {1, 3, 8, 13, 100})
+    {
+        DataStream s;
+        std::vector<uint256_t> expected;
+        for (uint32_t i = 0; i < n; i++)
+        {
+            CommandDummy cmd(rng(), i);
+            s << cmd;
+            expected.push_back(cmd.get_hash());
+        }
+        auto cmds = CommandDummy::parse_batch(s, n);
+        CHECK(cmds.size() == n && s.size() == 0);
+        for (size_t i = 0; i < n; i++)
+            CHECK(cmds[i]->get_hash() == expected[i]);
+    }
+
+    if (!x8) printf("no AVX2, the eight lanes are not tested\n");
+}
@@ -0,0 +1,66 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "hotstuff/util.h"
+#include "hotstuff/mempool.h"
+
+#include "test_util.h"
+
+using namespace hotstuff;
+
+static uint256_t cmd_hash(uint32_t i) {
+    DataStream s;
+    s << i;
+    return s.get_hash();
+}
+
+static void run_checks() {
+    const uint32_t capacity = 1000;
+
+    /* disabled, it holds nothing */
+    RecentFilter f;
+    CHECK(!f.is_enabled());
+    f.insert(cmd_hash(0));
+    CHECK(!f.contains(cmd_hash(0)));
+
+    f.init(capacity);
+    CHECK(f.is_enabled());
+    for (uint32_t i = 0; i < capacity; i++)
+        f.insert(cmd_hash(i));
+    for (uint32_t i = 0; i < capacity; i++)
+        CHECK(f.contains(cmd_hash(i)));
+
+    /* the oldest commands go first, one for each new one */
+    for (uint32_t i = capacity; i < 3 * capacity; i++)
+    {
+        f.insert(cmd_hash(i));
+        CHECK(f.contains(cmd_hash(i)));
+        CHECK(!f.contains(cmd_hash(i - capacity)));
+        CHECK(f.contains(cmd_hash(i - capacity + 1)));
+    }
+
+    /* inserting a command again does not push out another one */
+    f.insert(cmd_hash(3 * capacity - 1));
+    CHECK(f.contains(cmd_hash(2 * capacity)));
+
+    /* a command never inserted is never mistaken for a recent one */
+    for (uint32_t i = 3 * capacity; i < 3 * capacity + 1000000; i++)
+        CHECK(!f.contains(cmd_hash(i)));
+
+    f.init(capacity);
+    CHECK(!f.contains(cmd_hash(3 * capacity - 1)));
+}
@@ -0,0 +1,88 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <vector>
+
+#include "hotstuff/util.h"
+#include "hotstuff/consensus.h"
+
+#include "test_core.h"
+
+using namespace hotstuff;
+
+using blks_t = std::vector<block_t>;
+
+/** Propose a block on top of `parent` carrying the QC for it, which makes
+ * the parent certified (and speculated). */
+static block_t propose(TestCore &hsc, const block_t &parent) {
+    block_t blk = hsc.deliver(parent, parent);
+    hsc.on_receive_proposal(Proposal(1, blk, &hsc));
+    return blk;
+}
+
+static void run_checks() {
+    TestCore hsc;
+    hsc.on_init(3, 1);
+    const block_t &b0 = hsc.get_genesis();
+
+    /* nothing is executed ahead of the commit unless speculative */
+    block_t a1 = hsc.deliver(b0);
+    block_t a2 = propose(hsc, a1);
+    CHECK(hsc.speculated.empty());
+
+    /* each certified block is speculated once, in the chain order */
+    hsc.set_speculative(true);
+    block_t a3 = propose(hsc, a2);
+    block_t a4 = propose(hsc, a3);
+    CHECK((hsc.speculated == blks_t{a1, a2, a3}));
+    propose(hsc, a1);
+    CHECK(hsc.speculated.size() == 3);
+
+    /* certifying a sibling branch undoes the speculation off it, from the
+     * top down, before speculating the branch */
+    block_t c2 = propose(hsc, a1);
+    block_t c3 = propose(hsc, c2);
+    CHECK((hsc.rolled_back == blks_t{a3, a2}));
+    CHECK((hsc.speculated == blks_t{a1, a2, a3, c2}));
+    CHECK(hsc.decided.empty());
+
+    /* committing the speculated branch does not execute it again */
+    hsc.on_commit_timeout(c2);
+    CHECK((hsc.decided == blks_t{a1, c2}));
+    CHECK(hsc.rolled_back.size() == 2 && hsc.speculated.size() == 4);
+
+    /* committing a sibling of the speculated block rolls that one back
+     * first, and the committed one is decided without a speculation */
+    propose(hsc, c3);
+    CHECK(hsc.speculated.back() == c3);
+    block_t d3 = hsc.deliver(c2);
+    hsc.on_commit_timeout(d3);
+    CHECK((hsc.rolled_back == blks_t{a3, a2, c3}));
+    CHECK((hsc.decided == blks_t{a1, c2, d3}));
+    CHECK(hsc.speculated.size() == 5);
+
+    /* the branch of the rolled back block is never speculated again */
+    propose(hsc, a4);
+    propose(hsc, c3);
+    CHECK(hsc.speculated.size() == 5 && hsc.rolled_back.size() == 3);
+
+    /* and the speculation carries on above the commit */
+    block_t d4 = propose(hsc, d3);
+    propose(hsc, d4);
+    CHECK(hsc.speculated.back() == d4 && hsc.speculated.size() == 6);
+    CHECK(hsc.rolled_back.size() == 3);
+}
@@ -0,0 +1,75 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <vector>
+
+#include "hotstuff/util.h"
+#include "hotstuff/timer.h"
+
+#include "test_util.h"
+
+using namespace hotstuff;
+
+static void run_checks() {
+    EventContext ec;
+    TimerQueue timers(ec);
+    std::vector<int> fired;
+    auto record = [&fired](int x) { return [&fired, x]() { fired.push_back(x); }; };
+
+    /* timers of several durations fire by deadline, those of the same
+     * duration in the order added */
+    timers.add(0.03, record(3));
+    timers.add(0.01, record(1));
+    timers.add(0.03, record(4));
+    timers.add(0.02, record(2));
+    auto cancelled = timers.add(0.01, record(-1));
+    /* cancelling the earliest head re-arms for the next one */
+    auto head = timers.add(0.005, record(-2));
+    CHECK(timers.size() == 6);
+    timers.cancel(cancelled);
+    timers.cancel(head);
+    timers.cancel(head);
+    timers.cancel(TimerQueue::null_id);
+    CHECK(!timers.is_pending(cancelled) && timers.size() == 4);
+    ec.dispatch();
+    CHECK((fired == std::vector<int>{1, 2, 3, 4}));
+    CHECK(timers.size() == 0);
+
+    /* a callback may add and cancel timers */
+    fired.clear();
+    TimerQueue::timer_id_t victim = TimerQueue::null_id;
+    timers.add(0.01, [&]() {
+        fired.push_back(1);
+        timers.cancel(victim);
+        timers.add(0.01, record(3));
+        timers.add(0, record(2));
+    });
+    victim = timers.add(0.015, record(-1));
+    ec.dispatch();
+    CHECK((fired == std::vector<int>{1, 2, 3}));
+
+    /* clear() drops all timers */
+    fired.clear();
+    auto id = timers.add(0.01, record(-1));
+    timers.add(0.02, record(-2));
+    timers.clear();
+    CHECK(!timers.is_pending(id) && timers.size() == 0);
+    timers.add(0.01, record(1));
+    ec.dispatch();
+    CHECK((fired == std::vector<int>{1}));
+
+}
@@ -0,0 +1,83 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HOTSTUFF_TEST_UTIL_H
+#define _HOTSTUFF_TEST_UTIL_H
+
+/* Each test is a plain program: it defines run_checks(), and fails (with a
+ * non-zero status) at the first CHECK that does not hold. */
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <dirent.h>
+#include <unistd.h>
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", \
+                __FILE__, __LINE__, #cond); \
+        exit(1); \
+    } } while (0)
+
+/** Check that evaluating `expr` throws an `E` (or a subclass of it). */
+#define CHECK_THROWS(expr, E) do { \
+    bool _thrown = false; \
+    try { expr; } catch (E &) { _thrown = true; } \
+    if (!_thrown) { \
+        fprintf(stderr, "%s:%d: no %s thrown by: %s\n", \
+                __FILE__, __LINE__, #E, #expr); \
+        exit(1); \
+    } } while (0)
+
+/** A fresh directory under /tmp, removed with its files when done. */
+class TempDir {
+    std::string dir;
+
+    public:
+    TempDir(const char *name) {
+        std::string tmpl = std::string("/tmp/hotstuff-") + name + "-XXXXXX";
+        CHECK(mkdtemp(&tmpl[0]) != nullptr);
+        dir = tmpl;
+    }
+
+    ~TempDir() {
+        DIR *d = opendir(dir.c_str());
+        if (d == nullptr) return;
+        while (struct dirent *e = readdir(d))
+            if (e->d_name[0] != '.') unlink((dir + "/" + e->d_name).c_str());
+        closedir(d);
+        rmdir(dir.c_str());
+    }
+
+    TempDir(const TempDir &) = delete;
+    TempDir &operator=(const TempDir &) = delete;
+
+    std::string path(const std::string &fname) const {
+        return dir + "/" + fname;
+    }
+};
+
+static void run_checks();
+
+int main() {
+    run_checks();
+    printf("ok\n");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,136 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "hotstuff/util.h"
+#include "hotstuff/wal.h"
+
+#include "test_util.h"
+
+using namespace hotstuff;
+
+using rec_t = std::pair<uint8_t, uint32_t>;
+
+static DataStream payload(uint32_t x) {
+    DataStream s;
+    s << x;
+    return s;
+}
+
+static std::vector<rec_t> read_all(const EventContext &ec,
+                                    const std::string &fname) {
+    std::vector<rec_t> recs;
+    WALFile wal(ec, fname);
+    wal.replay([&recs](uint8_t type, DataStream &s) {
+        uint32_t x;
+        s >> x;
+        recs.push_back(std::make_pair(type, x));
+    });
+    return recs;
+}
+
+static off_t file_size(const std::string &fname) {
+    struct stat st;
+    CHECK(stat(fname.c_str(), &st) == 0);
+    return st.st_size;
+}
+
+static void append_raw(const std::string &fname, const bytearray_t &bytes) {
+    int fd = open(fname.c_str(), O_WRONLY | O_APPEND);
+    CHECK(fd >= 0);
+    CHECK(write(fd, bytes.data(), bytes.size()) == (ssize_t)bytes.size());
+    close(fd);
+}
+
+static void corrupt_byte(const std::string &fname, off_t off) {
+    int fd = open(fname.c_str(), O_RDWR);
+    CHECK(fd >= 0);
+    uint8_t b;
+    CHECK(pread(fd, &b, 1, off) == 1);
+    b ^= 0xff;
+    CHECK(pwrite(fd, &b, 1, off) == 1);
+    close(fd);
+}
+
+static void run_checks() {
+    EventContext ec;
+    TempDir dir("wal");
+    std::string fname = dir.path("wal");
+
+    /* records survive a reopen, and commits are notified after the sync */
+    {
+        WALFile wal(ec, fname);
+        bool durable = false;
+        for (uint32_t i = 0; i < 10; i++)
+            wal.append(WAL_REC_VIEW, payload(i));
+        wal.commit([&durable]() { durable = true; });
+        CHECK(!durable);
+        wal.flush();
+        CHECK(durable);
+        CHECK(wal.nrecords == 10 && wal.nsync == 1);
+    }
+    auto recs = read_all(ec, fname);
+    CHECK(recs.size() == 10);
+    for (uint32_t i = 0; i < 10; i++)
+        CHECK(recs[i] == rec_t(WAL_REC_VIEW, i));
+
+    /* a torn record at the tail is dropped and truncated away */
+    off_t intact = file_size(fname);
+    append_raw(fname, bytearray_t{0x04, 0x00, 0x00, 0x00, WAL_REC_VOTE, 0x12});
+    recs = read_all(ec, fname);
+    CHECK(recs.size() == 10);
+    CHECK(file_size(fname) == intact);
+
+    /* new records follow the last intact one */
+    {
+        WALFile wal(ec, fname);
+        wal.append(WAL_REC_VOTE, payload(10));
+        wal.flush();
+    }
+    recs = read_all(ec, fname);
+    CHECK(recs.size() == 11 && recs.back() == rec_t(WAL_REC_VOTE, 10));
+
+    /* a record failing its checksum ends the replay */
+    corrupt_byte(fname, file_size(fname) - 1);
+    recs = read_all(ec, fname);
+    CHECK(recs.size() == 10);
+    CHECK(file_size(fname) == intact);
+
+    /* compaction replaces the whole log, and the log stays appendable */
+    {
+        WALFile wal(ec, fname);
+        wal.append(WAL_REC_VIEW, payload(11));
+        WriteAheadLog::records_t snap;
+        snap.push_back(std::make_pair((uint8_t)WAL_REC_SNAPSHOT, payload(100)));
+        snap.push_back(std::make_pair((uint8_t)WAL_REC_EXEC, payload(101)));
+        wal.compact(snap);
+        wal.append(WAL_REC_QC, payload(102));
+        bool durable = false;
+        wal.commit([&durable]() { durable = true; });
+        wal.flush();
+        CHECK(durable);
+    }
+    recs = read_all(ec, fname);
+    CHECK(recs.size() == 3);
+    CHECK(recs[0] == rec_t(WAL_REC_SNAPSHOT, 100));
+    CHECK(recs[1] == rec_t(WAL_REC_EXEC, 101));
+    CHECK(recs[2] == rec_t(WAL_REC_QC, 102));
+    CHECK(access((fname + ".tmp").c_str(), F_OK) != 0);
+}